@@ -0,0 +1,1043 @@
+//
+// IFChargeBench.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+// A headless benchmark of the charge message pipeline. It builds
+// against GNUstep on Linux as well as Foundation on OS X; see
+// GNUmakefile. Options are read as user defaults arguments:
+//
+//   -iterations N    operations timed per benchmark (default 20000)
+//   -filter S        only run benchmarks whose names contain S
+//   -json PATH       write the results as JSON
+//   -baseline PATH   compare with an earlier -json file, exiting 1 on
+//                    a regression
+//   -threshold F     the ops/sec drop counted as a regression (0.10)
+//   -stats PATH      write the pipeline's stage timings and rejection
+//                    counts (see IFChargeStats.h) as JSON
+//
+// This is where the pipeline's numbers come from: a change that's
+// meant to make something faster adds its benchmark here, next to one
+// of the implementation it replaces where that's worth keeping, so
+// the two can be compared and the gain held against later baselines.
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeRequest.h"
+#import "IFChargeResponse.h"
+#import "IFChargeBatch.h"
+#import "IFChargeCard.h"
+#import "IFChargeCharSet.h"
+#import "IFChargeEmail.h"
+#import "IFChargeJournal.h"
+#import "IFChargeNonce.h"
+#import "IFChargePattern.h"
+#import "IFChargeQuery.h"
+#import "IFChargeResponseHandler.h"
+#import "IFChargeSimulator.h"
+#import "IFChargeStats.h"
+#import "IFChargeWire.h"
+
+#include <dispatch/dispatch.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+@interface IFChargeResponse (Benchmark)
+- (void)validateFields;
+@end
+
+extern NSString* const emailRegEx;
+
+// Autorelease pools are drained, untimed, this often.
+#define IF_BENCH_POOL_BATCH 256
+
+// Journal lookups are timed against this many entries.
+#define IF_BENCH_JOURNAL_SIZE 2000000
+
+#pragma -
+#pragma Allocation Counting
+
+static volatile unsigned long _allocations;
+
+#if defined( __GLIBC__ )
+
+// Every malloc, calloc and realloc in the process, object allocation
+// included, comes through these.
+extern void* __libc_malloc( size_t size );
+extern void* __libc_calloc( size_t count, size_t size );
+extern void* __libc_realloc( void* p, size_t size );
+
+void* malloc( size_t size )
+{
+    __sync_fetch_and_add( &_allocations, 1 );
+    return __libc_malloc( size );
+}
+
+void* calloc( size_t count, size_t size )
+{
+    __sync_fetch_and_add( &_allocations, 1 );
+    return __libc_calloc( count, size );
+}
+
+void* realloc( void* p, size_t size )
+{
+    __sync_fetch_and_add( &_allocations, 1 );
+    return __libc_realloc( p, size );
+}
+
+#define IF_BENCH_COUNTS_ALLOCATIONS 1
+#else
+#define IF_BENCH_COUNTS_ALLOCATIONS 0
+#endif
+
+#pragma -
+#pragma Runner
+
+typedef struct IFBenchResult
+{
+    NSString*  name;
+    NSUInteger iterations;
+    double     opsPerSec;
+    double     p50;         // nanoseconds
+    double     p99;
+    double     allocations; // per operation
+} IFBenchResult;
+
+typedef void (^IFBenchBlock)( NSUInteger i );
+
+static uint64_t IFBenchNow( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int IFBenchCompareSamples( const void* a, const void* b )
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return ( x > y ) - ( x < y );
+}
+
+// Times each of iterations calls to op on its own, after a tenth as
+// many to warm up. setup, if not nil, runs untimed before each call.
+static IFBenchResult IFBenchRun( NSString* name, NSUInteger iterations, IFBenchBlock setup, IFBenchBlock op )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    for ( NSUInteger i = 0; i < iterations / 10; i++ )
+    {
+        if ( setup )
+        {
+            setup( i );
+        }
+        op( i );
+    }
+    [pool drain];
+
+    uint64_t* samples = malloc( iterations * sizeof( uint64_t ) );
+    uint64_t total = 0;
+    unsigned long allocations = 0;
+
+    pool = [[NSAutoreleasePool alloc] init];
+    for ( NSUInteger i = 0; i < iterations; i++ )
+    {
+        if ( setup )
+        {
+            setup( i );
+        }
+
+        unsigned long allocationsBefore = _allocations;
+        uint64_t start = IFBenchNow();
+        op( i );
+        samples[i] = IFBenchNow() - start;
+        allocations += _allocations - allocationsBefore;
+        total += samples[i];
+
+        if ( 0 == ( i + 1 ) % IF_BENCH_POOL_BATCH )
+        {
+            [pool drain];
+            pool = [[NSAutoreleasePool alloc] init];
+        }
+    }
+    [pool drain];
+
+    qsort( samples, iterations, sizeof( uint64_t ), IFBenchCompareSamples );
+
+    IFBenchResult result;
+    result.name        = name;
+    result.iterations  = iterations;
+    result.opsPerSec   = total ? iterations * 1e9 / total : 0;
+    result.p50         = samples[iterations / 2];
+    result.p99         = samples[iterations * 99 / 100];
+    result.allocations = IF_BENCH_COUNTS_ALLOCATIONS ? (double)allocations / iterations : -1;
+
+    free( samples );
+    return result;
+}
+
+#pragma -
+#pragma Fixtures
+
+// A request filled in the way a point-of-sale app would.
+static IFChargeRequest* IFBenchRequest( void )
+{
+    IFChargeRequest* request = [[[IFChargeRequest alloc] init] autorelease];
+    request.firstName     = @"Ben";
+    request.lastName      = @"Acland";
+    request.company       = @"Inner Fence";
+    request.address       = @"123 Main Street";
+    request.city          = @"Seattle";
+    request.state         = @"WA";
+    request.zip           = @"98101";
+    request.country       = @"US";
+    request.phone         = @"206-555-1212";
+    request.email         = @"ben@innerfence.com";
+    request.invoiceNumber = @"1029";
+    request.description   = @"Two tickets";
+    request.subtotal      = @"50.00";
+    request.tax           = @"5.00";
+    request.tip           = @"10.00";
+    request.shipping      = @"5.00";
+    request.discount      = @"3.00";
+    request.currency      = @"USD";
+    [request setReturnURL:@"com-innerfence-ChargeDemo://chargeResponse"
+          withExtraParams:[NSDictionary dictionaryWithObject:@"123" forKey:@"record_id"]];
+    return request;
+}
+
+// The shape of the URL Credit Card Terminal sends back, for a nonce.
+static NSURL* IFBenchResponseURL( NSString* nonce )
+{
+    return [NSURL URLWithString:[NSString stringWithFormat:
+        @"com-innerfence-ChargeDemo://chargeResponse?record_id=123"
+        @"&ifcc_request_nonce=%@"
+        @"&ifcc_responseType=approved&ifcc_amount=67.00&ifcc_currency=USD"
+        @"&ifcc_subtotal=50.00&ifcc_tip=10.00&ifcc_tax=5.00&ifcc_shipping=5.00&ifcc_discount=3.00"
+        @"&ifcc_redactedCardNumber=XXXXXXXXXXXX1111&ifcc_cardType=American%%20Express",
+        nonce
+    ]];
+}
+
+static NSURL* IFBenchIssueResponseURL( void )
+{
+    NSString* nonce = IFChargeNonceCreate( IFChargeNonceStoreShared(), nil );
+    NSURL* url = IFBenchResponseURL( nonce );
+    [nonce release];
+    return url;
+}
+
+// The ith of a run of journal entries, two per record id.
+static void IFBenchJournalEntry( IFChargeJournalEntry* entry, NSUInteger i )
+{
+    memset( entry, 0, sizeof( *entry ) );
+    entry->responseCode = kIFChargeResponseCodeApproved;
+    entry->amount       = 6700 + i % 100;
+    entry->timestamp    = 3e8 + i;
+    strcpy( entry->currency, "USD" );
+    strcpy( entry->redactedCardNumber, "XXXXXXXXXXXX1111" );
+    strcpy( entry->cardType, "American Express" );
+    snprintf( entry->recordId, sizeof( entry->recordId ), "%lu", (unsigned long)( i / 2 ) );
+    snprintf( entry->nonce, sizeof( entry->nonce ), "%027lu", (unsigned long)i );
+}
+
+// Reads a few fields of shared from threadCount threads at once, as a
+// checkout service sharing one request would.
+static void IFBenchConcurrentReads( IFChargeRequest* shared, size_t threadCount )
+{
+    dispatch_apply( threadCount, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t thread )
+    {
+        NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+        for ( NSUInteger i = 0; i < IF_BENCH_POOL_BATCH; i++ )
+        {
+            [shared firstName];
+            [shared amount];
+            [shared currency];
+            [shared returnURL];
+        }
+        [pool drain];
+    });
+}
+
+#pragma -
+#pragma Replaced Implementations
+
+// What the pipeline did before each optimization, kept so the two can
+// be timed side by side.
+
+// The regcomp per call that IFMatchesPattern made before patterns were
+// cached.
+static BOOL IFBenchLegacyMatchesPattern( NSString* string, NSString* pattern )
+{
+    regex_t re;
+    if ( regcomp( &re, [pattern UTF8String], REG_EXTENDED | REG_NOSUB ) )
+    {
+        return NO;
+    }
+    BOOL matches = 0 == regexec( &re, [string UTF8String], 0, NULL, 0 );
+    regfree( &re );
+    return matches;
+}
+
+// The componentsSeparatedByString: parse and knownFields loop that
+// initWithURL: used before IFChargeQueryParse.
+static NSMutableDictionary* IFBenchLegacyParseQuery( NSURL* url, NSArray* knownFields )
+{
+    NSMutableDictionary* dict = [NSMutableDictionary dictionary];
+    for ( NSString* queryPair in [[url query] componentsSeparatedByString:@"&"] )
+    {
+        NSArray* queryComps = [queryPair componentsSeparatedByString:@"="];
+        if ( 2 != [queryComps count] )
+        {
+            continue;
+        }
+        [dict setObject:[[queryComps objectAtIndex:1] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding]
+                 forKey:[[queryComps objectAtIndex:0] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding]];
+    }
+    for ( NSString* field in knownFields )
+    {
+        NSString* queryName = [IF_CHARGE_MESSAGE_FIELD_PREFIX stringByAppendingString:field];
+        if ( [[dict valueForKey:queryName] length] )
+        {
+            [dict removeObjectForKey:queryName];
+        }
+    }
+    return dict;
+}
+
+#if !defined( GNUSTEP )
+// The appendFormat: and valueForKey: loop that requestURL used before
+// IFChargeQueryCreateURLString, with CF doing the encoding. GNUstep
+// has no CFURL, so this is only timed against Foundation.
+static NSString* IFBenchLegacyRequestURLString( IFChargeMessage* message )
+{
+    NSMutableString* urlString = [[NSMutableString alloc] initWithString:message.baseURL];
+    BOOL first = NSNotFound == [urlString rangeOfString:@"?"].location;
+    for ( NSString* field in [[message class] knownFields] )
+    {
+        NSString* value = [message valueForKey:field];
+        if ( 0 == [value length] )
+        {
+            continue;
+        }
+        NSString* encoded = (NSString*)CFURLCreateStringByAddingPercentEscapes( kCFAllocatorDefault, (CFStringRef)value, NULL,
+                                                                                CFSTR( ":/?#[]@!$&'()*+,;=" ), kCFStringEncodingUTF8 );
+        [urlString appendFormat:@"%@%@%@=%@", first ? @"?" : @"&", IF_CHARGE_MESSAGE_FIELD_PREFIX, field, encoded];
+        [encoded release];
+        first = NO;
+    }
+    return [urlString autorelease];
+}
+#endif
+
+// The float sum and shared NSNumberFormatter that -amount used before
+// IFChargeMoney, under the lock it took on every read.
+static NSString* IFBenchLegacyAmount( IFChargeMessage* message, NSNumberFormatter* formatter )
+{
+    NSString* amount;
+    @synchronized( message )
+    {
+        float sum = [message.subtotal floatValue] + [message.tax floatValue] + [message.tip floatValue]
+                  + [message.shipping floatValue] - [message.discount floatValue];
+        NSNumber* number = [[NSNumber alloc] initWithFloat:sum];
+        amount = [[formatter stringFromNumber:number] retain];
+        [number release];
+    }
+    return [amount autorelease];
+}
+
+// The replaceCharactersInRange: loop that initWithChargeRequest: used
+// to redact card numbers, one call per masked character.
+static NSString* IFBenchLegacyRedact( NSString* cardNumber )
+{
+    NSMutableString* redacted = [NSMutableString stringWithString:cardNumber];
+    for ( NSUInteger index = 0; index + 4 < [redacted length]; index++ )
+    {
+        [redacted replaceCharactersInRange:NSMakeRange( index, 1 ) withString:IF_CHARGE_CARD_NUMBER_MASK];
+    }
+    return redacted;
+}
+
+#pragma -
+#pragma Results
+
+static NSDictionary* IFBenchResultDictionary( const IFBenchResult* result )
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+        result->name,                                          @"name",
+        [NSNumber numberWithUnsignedInteger:result->iterations], @"iterations",
+        [NSNumber numberWithDouble:result->opsPerSec],         @"ops_per_sec",
+        [NSNumber numberWithDouble:result->p50],               @"p50_ns",
+        [NSNumber numberWithDouble:result->p99],               @"p99_ns",
+        ( result->allocations < 0 ) ? (id)[NSNull null]
+            : [NSNumber numberWithDouble:result->allocations], @"allocs_per_op",
+        nil
+    ];
+}
+
+// Reports the results that ran slower than threshold allows, or
+// allocated more, than in the baseline. Returns the number found.
+static NSUInteger IFBenchCompare( NSArray* results, NSString* baselinePath, double threshold )
+{
+    NSData* data = [NSData dataWithContentsOfFile:baselinePath];
+    NSDictionary* baseline = data ? [NSJSONSerialization JSONObjectWithData:data options:0 error:NULL] : nil;
+    if ( ![baseline isKindOfClass:[NSDictionary class]] )
+    {
+        fprintf( stderr, "can't read baseline %s\n", [baselinePath fileSystemRepresentation] );
+        return 1;
+    }
+
+    NSMutableDictionary* before = [NSMutableDictionary dictionary];
+    for ( NSDictionary* result in [baseline objectForKey:@"results"] )
+    {
+        [before setObject:result forKey:[result objectForKey:@"name"]];
+    }
+
+    NSUInteger regressions = 0;
+    for ( NSDictionary* result in results )
+    {
+        NSDictionary* old = [before objectForKey:[result objectForKey:@"name"]];
+        if ( nil == old )
+        {
+            continue;
+        }
+
+        double rate    = [[result objectForKey:@"ops_per_sec"] doubleValue];
+        double oldRate = [[old objectForKey:@"ops_per_sec"] doubleValue];
+        if ( rate < oldRate * ( 1 - threshold ) )
+        {
+            printf( "REGRESSION %s: %.0f ops/sec, was %.0f\n", [[result objectForKey:@"name"] UTF8String], rate, oldRate );
+            regressions++;
+        }
+
+        id allocations    = [result objectForKey:@"allocs_per_op"];
+        id oldAllocations = [old objectForKey:@"allocs_per_op"];
+        if ( [allocations isKindOfClass:[NSNumber class]] && [oldAllocations isKindOfClass:[NSNumber class]] &&
+             [allocations doubleValue] > [oldAllocations doubleValue] + 0.5 )
+        {
+            printf( "REGRESSION %s: %.1f allocations/op, was %.1f\n", [[result objectForKey:@"name"] UTF8String],
+                    [allocations doubleValue], [oldAllocations doubleValue] );
+            regressions++;
+        }
+    }
+    return regressions;
+}
+
+static BOOL IFBenchSelected( NSString* filter, NSString* name )
+{
+    return nil == filter || NSNotFound != [name rangeOfString:filter].location;
+}
+
+// Runs a benchmark, unless filter excludes it, printing its row and
+// adding its result to results.
+static void IFBenchAdd( NSMutableArray* results, NSString* filter, NSString* name, NSUInteger iterations,
+                        IFBenchBlock setup, IFBenchBlock op )
+{
+    if ( !IFBenchSelected( filter, name ) )
+    {
+        return;
+    }
+
+    IFBenchResult result = IFBenchRun( name, iterations, setup, op );
+    printf( "%-36s %12.0f %10.0f %10.0f", [name UTF8String], result.opsPerSec, result.p50, result.p99 );
+    if ( result.allocations < 0 )
+    {
+        printf( " %10s\n", "-" );
+    }
+    else
+    {
+        printf( " %10.1f\n", result.allocations );
+    }
+    [results addObject:IFBenchResultDictionary( &result )];
+}
+
+#pragma -
+#pragma Benchmarks
+
+int main( int argc, const char* argv[] )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    NSUserDefaults* args = [NSUserDefaults standardUserDefaults];
+    NSUInteger iterations = [args integerForKey:@"iterations"] > 0 ? [args integerForKey:@"iterations"] : 20000;
+    NSString* filter = [args stringForKey:@"filter"];
+    NSString* jsonPath = [args stringForKey:@"json"];
+    NSString* baselinePath = [args stringForKey:@"baseline"];
+    NSString* statsPath = [args stringForKey:@"stats"];
+    double threshold = [args objectForKey:@"threshold"] ? [args doubleForKey:@"threshold"] : 0.10;
+
+    IFChargeRequest* request = IFBenchRequest();
+    NSDictionary* extras = [NSDictionary dictionaryWithObjectsAndKeys:
+                               @"123", @"record_id", @"front", @"register", @"Ben", @"clerk", nil];
+    IFChargeResponse* response = [[[IFChargeResponse alloc] initWithURL:IFBenchIssueResponseURL()] autorelease];
+    NSMutableArray* urls = [NSMutableArray array];
+    for ( NSUInteger i = 0; i < 256; i++ )
+    {
+        [urls addObject:IFBenchResponseURL( @"yRbRXvEGtHDcSQ6nP-cQ8lgsuyZ" )];
+    }
+    IFChargeVerifyResult* verifyResults = malloc( [urls count] * sizeof( IFChargeVerifyResult ) );
+    __block NSURL* url = nil;
+
+    printf( "%-36s %12s %10s %10s %10s\n", "benchmark", "ops/sec", "p50 ns", "p99 ns", "allocs/op" );
+    NSMutableArray* results = [NSMutableArray array];
+
+    // Micro-benchmarks: one call each.
+
+    IFBenchAdd( results, filter, @"initWithURL:", iterations,
+        ^( NSUInteger i ) { url = IFBenchIssueResponseURL(); },
+        ^( NSUInteger i ) { [[[IFChargeResponse alloc] initWithURL:url] release]; } );
+
+    IFBenchAdd( results, filter, @"requestURL", iterations, nil,
+        ^( NSUInteger i ) { [request requestURL]; } );
+
+    IFBenchAdd( results, filter, @"requestURL (one field changed)", iterations,
+        ^( NSUInteger i ) { request.invoiceNumber = ( i & 1 ) ? @"1001" : @"1002"; },
+        ^( NSUInteger i ) { [request requestURL]; } );
+
+    // A snapshot builds its URL from scratch every time.
+    IFChargeRequest* snapshot = [request freeze];
+    IFBenchAdd( results, filter, @"requestURL (from scratch)", iterations, nil,
+        ^( NSUInteger i ) { [snapshot requestURL]; } );
+
+    IFBenchAdd( results, filter, @"validateFields", iterations, nil,
+        ^( NSUInteger i ) { [response validateFields]; } );
+
+    IFBenchAdd( results, filter, @"amount", iterations, nil,
+        ^( NSUInteger i ) { [request amount]; } );
+
+    IFBenchAdd( results, filter, @"amount (recomputed)", iterations,
+        ^( NSUInteger i ) { request.tip = ( i & 1 ) ? @"10.00" : @"11.00"; },
+        ^( NSUInteger i ) { [request amount]; } );
+
+    IFBenchAdd( results, filter, @"setReturnURL:withExtraParams:", iterations, nil,
+        ^( NSUInteger i ) { [request setReturnURL:@"com-innerfence-ChargeDemo://chargeResponse" withExtraParams:extras]; } );
+
+    IFBenchAdd( results, filter, @"initWithChargeRequest:", iterations, nil,
+        ^( NSUInteger i ) {
+            [[[IFChargeResponse alloc] initWithChargeRequest:request
+                                                responseCode:kIFChargeResponseCodeApproved
+                                                  cardNumber:@"4111111111111111"
+                                                    cardType:@"Visa"] release];
+        } );
+
+    IFBenchAdd( results, filter, @"setDescription:", iterations, nil,
+        ^( NSUInteger i ) { request.description = @"Two tickets to the matinee, row F, seats 11 and 12"; } );
+
+    IFBenchAdd( results, filter, @"setPhone:", iterations, nil,
+        ^( NSUInteger i ) { request.phone = @"206-555-1212"; } );
+
+    IFBenchAdd( results, filter, @"IFChargeCardCreateRedacted", iterations, nil,
+        ^( NSUInteger i ) { [IFChargeCardCreateRedacted( @"4111111111111111", 'X' ) release]; } );
+
+    IFBenchAdd( results, filter, @"IFChargeCardLuhnValid", iterations, nil,
+        ^( NSUInteger i ) { IFChargeCardLuhnValid( "4111111111111111", 16 ); } );
+
+    IFBenchAdd( results, filter, @"IFChargeCardTypeForNumber", iterations, nil,
+        ^( NSUInteger i ) { IFChargeCardTypeForNumber( @"3782 822463 10005" ); } );
+
+    NSData* wireData = [response wireData];
+
+    IFBenchAdd( results, filter, @"wireData", iterations, nil,
+        ^( NSUInteger i ) { [response wireData]; } );
+
+    IFBenchAdd( results, filter, @"initWithWireData:", iterations, nil,
+        ^( NSUInteger i ) { [[[IFChargeResponse alloc] initWithWireData:wireData] release]; } );
+
+    IFChargeResponse* reused = [[[IFChargeResponse alloc] init] autorelease];
+    NSURL* readURL = IFBenchResponseURL( @"yRbRXvEGtHDcSQ6nP-cQ8lgsuyZ" );
+
+    IFBenchAdd( results, filter, @"tryReadURL:error: (reused)", iterations, nil,
+        ^( NSUInteger i ) { [reused tryReadURL:readURL error:NULL]; } );
+
+    __block IFChargeRequest* loose = nil;
+
+    IFBenchAdd( results, filter, @"compactFields", iterations,
+        ^( NSUInteger i ) { loose = IFBenchRequest(); },
+        ^( NSUInteger i ) { [loose compactFields]; } );
+
+    IFBenchAdd( results, filter, @"verifyURL:result:", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeVerifyResult verified;
+            [IFChargeResponse verifyURL:readURL result:&verified];
+            IFChargeVerifyResultsRelease( &verified, 1 );
+        } );
+
+    IFBenchAdd( results, filter, @"IFChargeWireReader amount", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeWireReader reader;
+            IFChargeWireField field;
+            IFChargeMoney amount;
+            IFChargeWireReaderInit( &reader, [wireData bytes], [wireData length] );
+            while ( IFChargeWireReaderNext( &reader, &field ) )
+            {
+                if ( 1 == field.tag )
+                {
+                    IFChargeWireFieldAmount( &field, &amount );
+                }
+            }
+        } );
+
+    // The same response with a currency and card type the intern table
+    // doesn't know, so they're decoded into strings of their own.
+    NSString* uninternedURL = [[[response requestURL] absoluteString] stringByReplacingOccurrencesOfString:@"=USD"
+                                                                                               withString:@"=XTQ"];
+    uninternedURL = [uninternedURL stringByReplacingOccurrencesOfString:@"American%20Express" withString:@"Store%20Card"];
+    IFChargeVerifyResult uninterned;
+    [IFChargeResponse verifyURL:[NSURL URLWithString:uninternedURL] result:&uninterned];
+    NSData* uninternedData = [uninterned.response wireData];
+    IFChargeVerifyResultsRelease( &uninterned, 1 );
+
+    IFBenchAdd( results, filter, @"initWithWireData: (uninterned values)", iterations, nil,
+        ^( NSUInteger i ) { [[[IFChargeResponse alloc] initWithWireData:uninternedData] release]; } );
+
+    IFBenchAdd( results, filter, @"IFChargeCardBrandForDigits", iterations, nil,
+        ^( NSUInteger i ) { IFChargeCardBrandForDigits( "6011111111111117", 16 ); } );
+
+    IFBenchAdd( results, filter, @"IFChargeQueryParse", iterations, nil,
+        ^( NSUInteger i ) {
+            NSString* values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+            IFChargeQueryParse( readURL, [IFChargeResponse queryFieldTable], values, [NSMutableDictionary dictionary] );
+        } );
+
+    IFBenchAdd( results, filter, @"field copy (schema)", iterations, nil,
+        ^( NSUInteger i ) {
+            const IFChargeFieldTable* table = [IFChargeResponse queryFieldTable];
+            NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+            for ( NSUInteger index = 0; index < table->count; index++ )
+            {
+                values[index] = *IFChargeFieldSlot( table, response, index );
+            }
+            IFChargeResponse* copy = [[IFChargeResponse alloc] init];
+            [copy trySetQueryValues:values extraParams:[NSMutableDictionary dictionary] error:NULL];
+            [copy release];
+        } );
+
+    NSString* description = @"Two tickets to the matinee, row F, seats 11 and 12";
+    IFChargeCharSet* symbols = IFChargeCharSetCreate( [NSCharacterSet symbolCharacterSet] );
+
+    IFBenchAdd( results, filter, @"IFChargeCharSetFind", iterations, nil,
+        ^( NSUInteger i ) { IFChargeCharSetFind( symbols, description ); } );
+
+    IFChargeCharSetFree( symbols );
+
+    IFBenchAdd( results, filter, @"validateTextArgument:", iterations, nil,
+        ^( NSUInteger i ) {
+            [request validateTextArgument:description withMaxLength:255
+                   forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], [NSCharacterSet controlCharacterSet], nil];
+        } );
+
+    NSArray* emails = [NSArray arrayWithObjects:@"ben@innerfence.com", @"first.last+tag@mail.example.co.uk",
+                          @"\"quoted local\"@example.com", @"admin@[192.168.0.1]", @"not an email", nil];
+
+    IFBenchAdd( results, filter, @"IFChargeEmailIsValid", iterations, nil,
+        ^( NSUInteger i ) { IFChargeEmailIsValid( [emails objectAtIndex:i % [emails count]] ); } );
+
+    // Issued and consumed with thousands outstanding, in a store of its
+    // own so the shared one isn't filled.
+    NSString* noncePath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeBench.nonces"];
+    [[NSFileManager defaultManager] removeItemAtPath:noncePath error:NULL];
+    IFChargeNonceStore* nonceStore = IFChargeNonceStoreOpen( noncePath, 60 );
+    for ( NSUInteger i = 0; i < 5000; i++ )
+    {
+        [IFChargeNonceCreate( nonceStore, nil ) release];
+    }
+
+    IFBenchAdd( results, filter, @"nonce issue+consume", iterations, nil,
+        ^( NSUInteger i ) {
+            NSString* nonce = IFChargeNonceCreate( nonceStore, nil );
+            IFChargeNonceConsume( nonceStore, nonce, NULL );
+            [nonce release];
+        } );
+
+    IFChargeNonceStoreClose( nonceStore );
+    [[NSFileManager defaultManager] removeItemAtPath:noncePath error:NULL];
+
+    // A replayed URL, the common burst, is rejected at the nonce check;
+    // a bad argument is rejected by the setter.
+
+    IFBenchAdd( results, filter, @"initWithURL: (replayed, raising)", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeResponse* replayed = nil;
+            @try
+            {
+                replayed = [[IFChargeResponse alloc] initWithURL:readURL];
+            }
+            @catch ( NSException* e )
+            {
+            }
+            [replayed release];
+        } );
+
+    IFBenchAdd( results, filter, @"tryInitWithURL:error: (replayed)", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeError error;
+            [[IFChargeResponse alloc] tryInitWithURL:readURL error:&error];
+        } );
+
+    IFChargeRequest* rejecting = [[[IFChargeRequest alloc] init] autorelease];
+
+    IFBenchAdd( results, filter, @"setFirstName: (rejected, raising)", iterations, nil,
+        ^( NSUInteger i ) {
+            @try
+            {
+                rejecting.firstName = @"B$n";
+            }
+            @catch ( NSException* e )
+            {
+            }
+        } );
+
+    IFBenchAdd( results, filter, @"trySetFirstName:error: (rejected)", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeError error;
+            [rejecting trySetFirstName:@"B$n" error:&error];
+        } );
+
+    IFBenchAdd( results, filter, @"stats stage timing", iterations, nil,
+        ^( NSUInteger i ) {
+            IF_CHARGE_STATS_START( start );
+            IF_CHARGE_STATS_STOP( kIFChargeStageEncode, start );
+        } );
+
+    // The implementations the ones above replaced, for comparison.
+
+    NSDictionary* patterns = [NSDictionary dictionaryWithObjectsAndKeys:
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"amount",
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"subtotal",
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"tip",
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"tax",
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"shipping",
+                                 @IF_CHARGE_AMOUNT_PATTERN,               @"discount",
+                                 @IF_CHARGE_CURRENCY_PATTERN,             @"currency",
+                                 @IF_CHARGE_REDACTED_CARD_NUMBER_PATTERN, @"redactedCardNumber",
+                                 @IF_CHARGE_CARD_TYPE_PATTERN,            @"cardType",
+                                 @IF_CHARGE_RESPONSE_TYPE_PATTERN,        @"responseType",
+                                 nil];
+
+    IFBenchAdd( results, filter, @"validateFields (regcomp per call)", MAX( iterations / 10, 10 ), nil,
+        ^( NSUInteger i ) {
+            for ( NSString* field in [IFChargeResponse knownFields] )
+            {
+                NSString* value = [response valueForKey:field];
+                if ( value )
+                {
+                    IFBenchLegacyMatchesPattern( value, [patterns objectForKey:field] );
+                }
+            }
+        } );
+
+    IFBenchAdd( results, filter, @"query parse (componentsSeparatedByString:)", iterations, nil,
+        ^( NSUInteger i ) { IFBenchLegacyParseQuery( readURL, [IFChargeResponse knownFields] ); } );
+
+#if !defined( GNUSTEP )
+    IFBenchAdd( results, filter, @"requestURL (appendFormat: and CF)", iterations, nil,
+        ^( NSUInteger i ) { [NSURL URLWithString:IFBenchLegacyRequestURLString( response )]; } );
+#endif
+
+    NSNumberFormatter* formatter = [[[NSNumberFormatter alloc] init] autorelease];
+    [formatter setNumberStyle:NSNumberFormatterCurrencyStyle];
+    [formatter setGeneratesDecimalNumbers:YES];
+    [formatter setCurrencySymbol:@""];
+    [formatter setPerMillSymbol:@""];
+
+    IFBenchAdd( results, filter, @"amount (float and NSNumberFormatter)", iterations, nil,
+        ^( NSUInteger i ) { IFBenchLegacyAmount( request, formatter ); } );
+
+    IFBenchAdd( results, filter, @"redact (replaceCharactersInRange:)", iterations, nil,
+        ^( NSUInteger i ) { IFBenchLegacyRedact( @"4111111111111111" ); } );
+
+    IFBenchAdd( results, filter, @"response code (responseCodeMapping)", iterations, nil,
+        ^( NSUInteger i ) { [[[IFChargeResponse responseCodeMapping] valueForKey:response.responseType] intValue]; } );
+
+    IFBenchAdd( results, filter, @"field copy (KVC)", iterations, nil,
+        ^( NSUInteger i ) {
+            IFChargeResponse* copy = [[IFChargeResponse alloc] init];
+            for ( NSString* field in [IFChargeResponse knownFields] )
+            {
+                NSString* value = [response valueForKey:field];
+                if ( value )
+                {
+                    [copy setValue:value forKey:field];
+                }
+            }
+            [copy release];
+        } );
+
+    IFBenchAdd( results, filter, @"rangeOfCharacterFromSet:", iterations, nil,
+        ^( NSUInteger i ) { [description rangeOfCharacterFromSet:[NSCharacterSet symbolCharacterSet]]; } );
+
+    IFBenchAdd( results, filter, @"validateTextArgument: (merged sets)", iterations, nil,
+        ^( NSUInteger i ) {
+            NSMutableCharacterSet* merged = [[[NSCharacterSet symbolCharacterSet] mutableCopy] autorelease];
+            [merged formUnionWithCharacterSet:[NSCharacterSet controlCharacterSet]];
+            [description rangeOfCharacterFromSet:merged];
+        } );
+
+    IFBenchAdd( results, filter, @"email (NSPredicate)", MAX( iterations / 10, 10 ), nil,
+        ^( NSUInteger i ) {
+            NSPredicate* predicate = [NSPredicate predicateWithFormat:@"SELF MATCHES %@", emailRegEx];
+            [predicate evaluateWithObject:[emails objectAtIndex:i % [emails count]]];
+        } );
+
+    // A write and a read of the user defaults each way, as nonces were
+    // kept before the store. Only this tool's own domain is touched.
+    NSUserDefaults* defaults = [NSUserDefaults standardUserDefaults];
+
+    IFBenchAdd( results, filter, @"nonce issue+consume (user defaults)", MAX( iterations / 10, 10 ), nil,
+        ^( NSUInteger i ) {
+            NSMutableString* nonce = [NSMutableString stringWithCapacity:IF_CHARGE_NONCE_LENGTH];
+            for ( NSUInteger c = 0; c < IF_CHARGE_NONCE_LENGTH; c++ )
+            {
+                [nonce appendFormat:@"%c", "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"[arc4random() & 0x3f]];
+            }
+            [defaults setObject:nonce forKey:@"IFChargeBenchNonce"];
+            [nonce isEqualToString:[defaults objectForKey:@"IFChargeBenchNonce"]];
+            [defaults removeObjectForKey:@"IFChargeBenchNonce"];
+        } );
+
+    // Reads of one request shared by several threads, locked and
+    // frozen.
+
+    IFBenchAdd( results, filter, @"shared reads x4 threads, locked", MAX( iterations / 100, 10 ), nil,
+        ^( NSUInteger i ) { IFBenchConcurrentReads( request, 4 ); } );
+
+    IFChargeRequest* frozen = [request freeze];
+    IFBenchAdd( results, filter, @"shared reads x4 threads, frozen", MAX( iterations / 100, 10 ), nil,
+        ^( NSUInteger i ) { IFBenchConcurrentReads( frozen, 4 ); } );
+
+    // Macro-benchmarks: a whole charge, and a reconciliation batch.
+
+    IFBenchAdd( results, filter, @"round trip", iterations,
+        nil,
+        ^( NSUInteger i ) {
+            IFChargeRequest* charge = IFBenchRequest();
+            [charge requestURL];
+            IFChargeResponse* result = [[IFChargeResponse alloc] initWithURL:IFBenchIssueResponseURL()];
+            [result amount];
+            [result release];
+        } );
+
+    IFBenchAdd( results, filter, @"verifyURLs:results: x256", MAX( iterations / 256, 10 ), nil,
+        ^( NSUInteger i ) {
+            [IFChargeResponse verifyURLs:urls results:verifyResults];
+            IFChargeVerifyResultsRelease( verifyResults, [urls count] );
+        } );
+
+    NSURL** urlArray = malloc( [urls count] * sizeof( NSURL* ) );
+    [urls getObjects:urlArray range:NSMakeRange( 0, [urls count] )];
+
+    IFBenchAdd( results, filter, @"verifyURLs x256, 1 thread", MAX( iterations / 256, 10 ), nil,
+        ^( NSUInteger i ) {
+            [IFChargeResponse verifyURLs:urlArray count:[urls count] results:verifyResults threadCount:1];
+            IFChargeVerifyResultsRelease( verifyResults, [urls count] );
+        } );
+
+    free( urlArray );
+
+    free( verifyResults );
+
+    // Invoice links: a request per row, and a batch of the same rows
+    // on one thread, so both are per core.
+
+    NSArray* invoiceColumns = [NSArray arrayWithObjects:
+                                  @"invoiceNumber", @"amount", @"firstName", @"lastName", @"email", @"record_id", nil];
+    NSUInteger invoiceCount = 1024;
+    NSString** invoiceCells = malloc( invoiceCount * [invoiceColumns count] * sizeof( NSString* ) );
+    for ( NSUInteger row = 0; row < invoiceCount; row++ )
+    {
+        NSString** cells = invoiceCells + row * [invoiceColumns count];
+        cells[0] = [[NSString alloc] initWithFormat:@"%u", (unsigned)( 5000 + row )];
+        cells[1] = [[NSString alloc] initWithFormat:@"%u.%02u", (unsigned)( row % 500 ), (unsigned)( row % 100 )];
+        cells[2] = [@"Ben" retain];
+        cells[3] = [@"Acland" retain];
+        cells[4] = [[NSString alloc] initWithFormat:@"customer%u@example.com", (unsigned)row];
+        cells[5] = [[NSString alloc] initWithFormat:@"r-%u", (unsigned)row];
+    }
+    IFChargeRequest* prototype = [[[IFChargeRequest alloc] init] autorelease];
+    prototype.returnAppName = @"Invoices";
+    prototype.returnURL = @"com-innerfence-ChargeDemo://chargeResponse";
+    prototype.currency = @"USD";
+    prototype.description = @"Invoice payment";
+    IFChargeBatch* batch = IFChargeBatchCreate( prototype, invoiceColumns, NULL );
+    IFChargeBatchResult* batchResults = malloc( invoiceCount * sizeof( IFChargeBatchResult ) );
+
+    IFBenchAdd( results, filter, @"invoice link, one request", iterations, nil,
+        ^( NSUInteger i ) {
+            NSString** cells = invoiceCells + ( i % invoiceCount ) * [invoiceColumns count];
+            IFChargeRequest* invoice = [prototype copy];
+            invoice.invoiceNumber = cells[0];
+            invoice.amount        = cells[1];
+            invoice.firstName     = cells[2];
+            invoice.lastName      = cells[3];
+            invoice.email         = cells[4];
+            [invoice setReturnURL:prototype.returnURL
+                  withExtraParams:[NSDictionary dictionaryWithObject:cells[5] forKey:@"record_id"]];
+            [invoice submitURL];
+            [invoice release];
+        } );
+
+    IFBenchAdd( results, filter, @"IFChargeBatchCreateURLs x1024, 1 thread", MAX( iterations / 1024, 10 ), nil,
+        ^( NSUInteger i ) {
+            IFChargeBatchCreateURLs( batch, invoiceCells, invoiceCount, batchResults, 1 );
+            IFChargeBatchResultsRelease( batchResults, invoiceCount );
+        } );
+
+    IFBenchAdd( results, filter, @"IFChargeBatchCreateURLs x1024", MAX( iterations / 1024, 10 ), nil,
+        ^( NSUInteger i ) {
+            IFChargeBatchCreateURLs( batch, invoiceCells, invoiceCount, batchResults, 0 );
+            IFChargeBatchResultsRelease( batchResults, invoiceCount );
+        } );
+
+    IFChargeBatchFree( batch );
+    free( batchResults );
+    IFChargeBatchCellsRelease( invoiceCells, invoiceCount * [invoiceColumns count] );
+
+    // A whole round trip: sent, answered by the simulated terminal and
+    // read back, nonce and all.
+
+    IFChargeSimulatorConfig simulatorConfig = { { 1, 1, 1, 1 }, nil, 0 };
+    IFChargeSimulator* simulator = IFChargeSimulatorCreate( &simulatorConfig );
+
+    IFBenchAdd( results, filter, @"round trip, simulated terminal", MAX( iterations / 10, 10 ), nil,
+        ^( NSUInteger i ) {
+            IFChargeRequest* sent = [request copy];
+            NSURL* answer = IFChargeSimulatorHandleRequestURL( simulator, [sent submitURL], NULL, NULL );
+            [[[IFChargeResponse alloc] tryInitWithURL:answer error:NULL] release];
+            [sent release];
+        } );
+
+    IFChargeSimulatorFree( simulator );
+
+    // How long -application:handleOpenURL: blocks the main thread: the
+    // whole of handling a response, as it used to be done there, and
+    // handing the URL to an IFChargeResponseHandler, as it is now. The
+    // handler's work is left to run on its own queue, untimed.
+
+    NSString* handlerJournalPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeBench.handler.journal"];
+    [[NSFileManager defaultManager] removeItemAtPath:handlerJournalPath error:NULL];
+    IFChargeJournal* handlerJournal = IFChargeJournalOpen( handlerJournalPath );
+    IFChargePattern* recordIdPattern = IFChargePatternGet( "^[0-9]+$" );
+
+    IFBenchAdd( results, filter, @"open URL, handled inline", MAX( iterations / 10, 10 ),
+        ^( NSUInteger i ) { url = IFBenchIssueResponseURL(); },
+        ^( NSUInteger i ) {
+            IFChargeResponse* handled = [[IFChargeResponse alloc] tryInitWithURL:url error:NULL];
+            if ( IFChargePatternMatches( recordIdPattern, [handled.extraParams objectForKey:@"record_id"] ) )
+            {
+                IFChargeJournalSync( handlerJournal, IFChargeJournalAppendResponse( handlerJournal, handled ) );
+            }
+            [handled release];
+        } );
+
+    dispatch_queue_t deliveryQueue = dispatch_queue_create( "IFChargeBench.delivery", NULL );
+    IFChargeResponseHandler* handler = IFChargeResponseHandlerCreate( handlerJournal, ^BOOL( IFChargeResponse* handled ) {
+        return IFChargePatternMatches( recordIdPattern, [handled.extraParams objectForKey:@"record_id"] );
+    }, deliveryQueue );
+
+    IFBenchAdd( results, filter, @"open URL, handed off", MAX( iterations / 10, 10 ),
+        ^( NSUInteger i ) { url = IFBenchIssueResponseURL(); },
+        ^( NSUInteger i ) {
+            IFChargeResponseHandlerSubmit( handler, url, ^( const IFChargeHandledResponse* handled ) {} );
+        } );
+
+    // Let everything handed off be delivered before moving on.
+    IFChargeResponseHandlerFree( handler );
+    dispatch_sync( deliveryQueue, ^{} );
+    dispatch_release( deliveryQueue );
+    IFChargeJournalClose( handlerJournal );
+    [[NSFileManager defaultManager] removeItemAtPath:handlerJournalPath error:NULL];
+
+    // The journal: appends, group-committed syncs, and lookups among
+    // millions of entries.
+
+    NSString* journalPath = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeBench.journal"];
+    [[NSFileManager defaultManager] removeItemAtPath:journalPath error:NULL];
+    IFChargeJournal* journal = IFChargeJournalOpen( journalPath );
+    __block IFChargeJournalEntry entry;
+    __block NSUInteger appended = 0;
+
+    IFBenchAdd( results, filter, @"journal append", iterations,
+        ^( NSUInteger i ) { IFBenchJournalEntry( &entry, appended++ ); },
+        ^( NSUInteger i ) { IFChargeJournalAppend( journal, &entry ); } );
+
+    IFBenchAdd( results, filter, @"journal append+sync", MAX( iterations / 100, 10 ), nil,
+        ^( NSUInteger i ) {
+            IFChargeJournalEntry synced;
+            IFBenchJournalEntry( &synced, 2 * IF_BENCH_JOURNAL_SIZE + i );
+            IFChargeJournalSync( journal, IFChargeJournalAppend( journal, &synced ) );
+        } );
+
+    IFBenchAdd( results, filter, @"journal append+sync x8 threads", MAX( iterations / 100, 10 ), nil,
+        ^( NSUInteger i ) {
+            dispatch_apply( 8, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t thread ) {
+                IFChargeJournalEntry synced;
+                IFBenchJournalEntry( &synced, IF_BENCH_JOURNAL_SIZE + i * 8 + thread );
+                IFChargeJournalSync( journal, IFChargeJournalAppend( journal, &synced ) );
+            });
+        } );
+
+    if ( IFBenchSelected( filter, @"journal lookup by nonce" ) || IFBenchSelected( filter, @"journal lookup by record_id" ) )
+    {
+        // Untimed: fill the journal to size. The keys looked up are
+        // scattered over it, so lookups miss the cache as they would
+        // in a real reconciliation.
+        for ( ; appended < IF_BENCH_JOURNAL_SIZE; appended++ )
+        {
+            IFBenchJournalEntry( &entry, appended );
+            IFChargeJournalAppend( journal, &entry );
+        }
+    }
+    __block NSString* key = nil;
+
+    IFBenchAdd( results, filter, @"journal lookup by nonce", iterations,
+        ^( NSUInteger i ) { key = [NSString stringWithFormat:@"%027u", arc4random_uniform( IF_BENCH_JOURNAL_SIZE )]; },
+        ^( NSUInteger i ) { IFChargeJournalFindNonce( journal, key, &entry ); } );
+
+    IFBenchAdd( results, filter, @"journal lookup by record_id", iterations,
+        ^( NSUInteger i ) { key = [NSString stringWithFormat:@"%u", arc4random_uniform( IF_BENCH_JOURNAL_SIZE / 2 )]; },
+        ^( NSUInteger i ) { IFChargeJournalFindRecordId( journal, key, &entry ); } );
+
+    IFChargeJournalClose( journal );
+    [[NSFileManager defaultManager] removeItemAtPath:journalPath error:NULL];
+
+    int status = 0;
+    if ( jsonPath )
+    {
+        NSDictionary* report = [NSDictionary dictionaryWithObjectsAndKeys:
+            [NSNumber numberWithInt:1],                                         @"version",
+            [[NSProcessInfo processInfo] operatingSystemVersionString],         @"platform",
+            [NSNumber numberWithDouble:[[NSDate date] timeIntervalSince1970]],  @"timestamp",
+            results,                                                            @"results",
+            nil
+        ];
+        NSData* data = [NSJSONSerialization dataWithJSONObject:report options:NSJSONWritingPrettyPrinted error:NULL];
+        if ( ![data writeToFile:jsonPath atomically:YES] )
+        {
+            fprintf( stderr, "can't write %s\n", [jsonPath fileSystemRepresentation] );
+            status = 2;
+        }
+    }
+    if ( statsPath )
+    {
+        IFChargeStatsSnapshot snapshot;
+        IFChargeStatsTakeSnapshot( &snapshot );
+        if ( ![IFChargeStatsSnapshotJSON( &snapshot ) writeToFile:statsPath atomically:YES encoding:NSUTF8StringEncoding error:NULL] )
+        {
+            fprintf( stderr, "can't write %s\n", [statsPath fileSystemRepresentation] );
+            status = 2;
+        }
+    }
+    if ( baselinePath && IFBenchCompare( results, baselinePath, threshold ) )
+    {
+        status = 1;
+    }
+
+    [pool drain];
+    return status;
+}
@@ -17,10 +17,19 @@
 // your iPhone project for calling into Credit Card Terminal.
 #import "IFChargeResponse.h"
 
-// This example uses <regex.h> to validate input. For a convenient
-// Objective-C wrapper to <regex.h>, see GTMRegex from
-// http://code.google.com/p/google-toolbox-for-mac/
-#import <regex.h>
+// Every handled response is recorded in an IFChargeJournal, so the
+// app can reconcile its records against Credit Card Terminal's later.
+#import "IFChargeJournal.h"
+
+// IFChargeResponseHandler does the work of handling a response on a
+// background queue, so the app isn't held up resuming while it's done.
+#import "IFChargeResponseHandler.h"
+
+// This example uses IFChargePattern to validate input. It wraps
+// <regex.h>, compiling each pattern once and caching it for the life
+// of the app. For a convenient Objective-C wrapper to <regex.h>, see
+// GTMRegex from http://code.google.com/p/google-toolbox-for-mac/
+#import "IFChargePattern.h"
 
 // kRecordIdPattern -- the regular expression for validating the
 // recordId extra param that ChargeDemo passes with its charge request
@@ -36,54 +45,15 @@ static const char* kRecordIdPattern = "^[0-9]+$";
 // IsValidRecordId -- matches kRecordIdPattern against nsRecordId
 BOOL IsValidRecordId( NSString* nsRecordId )
 {
-    const char* recordId = [nsRecordId cStringUsingEncoding:NSUTF8StringEncoding];
-    BOOL matches = NO;
-    BOOL compiled = NO;
-    int re_error;
-    regex_t re;
-
-    re_error = regcomp(
-        &re,
-        kRecordIdPattern,
-        REG_EXTENDED
-        | REG_NOSUB    // match only, no captures
-    );
-    if ( re_error )
+    static IFChargePattern* recordIdPattern = NULL;
+    if ( NULL == recordIdPattern )
     {
-        NSLog( @"regcomp error %d", re_error );
-        goto Cleanup;
+        // IFChargePatternGet is thread-safe and always hands back the
+        // same compiled pattern, so racing here is harmless.
+        recordIdPattern = IFChargePatternGet( kRecordIdPattern );
     }
-    compiled = YES;
-
-    re_error = regexec(
-        &re,
-        recordId,
-        0, NULL, // no captures
-        0        // no flags
-    );
-    if ( re_error )
-    {
-        if ( REG_NOMATCH == re_error )
-        {
-            NSLog( @"recordId does not match pattern %s", kRecordIdPattern );
-        }
-        else
-        {
-            NSLog( @"regexec error %d", re_error );
-        }
-        goto Cleanup;
-    }
-
-    // No error, regex matched, input is valid
-    matches = YES;
 
-Cleanup:
-    if ( compiled )
-    {
-        regfree( &re );
-    }
-
-    return matches;
+    return IFChargePatternMatches( recordIdPattern, nsRecordId );
 }
 
 void ReportError( NSString* message )
@@ -97,6 +67,24 @@ void ReportError( NSString* message )
     ] autorelease] show];
 }
 
+// ChargeResponseHandler -- the handler every response URL is given
+// to. It's made the first time one comes in; handleOpenURL: is only
+// called on the main thread, so there's no race.
+static IFChargeResponseHandler* ChargeResponseHandler( void )
+{
+    static IFChargeResponseHandler* handler = NULL;
+    if ( NULL == handler )
+    {
+        // The check runs on the handler's queue, along with the rest
+        // of the work. The URL is a public attack vector for the app,
+        // so it's important to validate any parameters.
+        handler = IFChargeResponseHandlerCreate( IFChargeJournalShared(), ^BOOL( IFChargeResponse* response ) {
+            return IsValidRecordId( [response.extraParams objectForKey:@"record_id"] );
+        }, NULL );
+    }
+    return handler;
+}
+
 @implementation ChargeDemoAppDelegate (HandleURL)
 
 - (BOOL)application:(UIApplication*)application handleOpenURL:(NSURL*)url
@@ -146,74 +134,78 @@ void ReportError( NSString* message )
         return NO;
     }
 
-    // initWithURL will throw an exception if there's a problem with
-    // the response URL parameters.
-    IFChargeResponse* chargeResponse = nil;
-    @try
-    {
-        chargeResponse = [[IFChargeResponse alloc] initWithURL:url];
-    }
-    @catch ( NSException* e )
-    {
-        ReportError( [NSString stringWithFormat:@"URL not valid charge response, abandoning the request! Exception: %@", [e reason] ]);
-        return NO;
-    }
-    @finally
-    {
-        [chargeResponse autorelease];
-    }
-
-    // Any extra params we included with the return URL can be
-    // queried from the extraParams dictionary.
-    NSString* recordId = [chargeResponse.extraParams objectForKey:@"record_id"];
+    // The handler parses and checks the response on a background
+    // queue and calls the block below on the main queue with the
+    // outcome, so this returns straight away. (tryInitWithURL:error:,
+    // which the handler uses, returns nil and fills in the error if
+    // there's a problem with the response URL parameters.)
+    IFChargeResponseHandlerSubmit( ChargeResponseHandler(), url, ^( const IFChargeHandledResponse* handled ) {
+        if ( kIFChargeResponseInvalid == handled->outcome )
+        {
+            ReportError( [NSString stringWithFormat:@"URL not valid charge response, abandoning the request! Error: %@",
+                             IFChargeErrorReason( &handled->error, [IFChargeResponse class], nil ) ]);
+            return;
+        }
+        if ( kIFChargeResponseRejected == handled->outcome )
+        {
+            ReportError( @"Bad record id, abandoning the request!" );
+            return;
+        }
 
-    // The URL is a public attack vector for the app, so it's
-    // important to validate any parameters.
-    if ( !IsValidRecordId( recordId ) )
-    {
-        ReportError( @"Bad record id, abandoning the request!" );
-        return NO;
-    }
+        // The handler recorded the outcome in the journal, and synced
+        // it, before delivering it.
+        if ( 0 == handled->journalSequence )
+        {
+            ReportError( @"Couldn't record the response in the journal!" );
+        }
 
-    NSString* title;
-    NSString* message;
+        // The response is frozen, so reading it takes no locks. Any
+        // extra params we included with the return URL can be queried
+        // from the extraParams dictionary.
+        IFChargeResponse* chargeResponse = handled->response;
+        NSString* recordId = [chargeResponse.extraParams objectForKey:@"record_id"];
 
-    // You may want to perform different actions based on the response
-    // code. This example shows an alert with the response data when
-    // the charge is approved.
-    if ( chargeResponse.responseCode == kIFChargeResponseCodeApproved )
-    {
-        title = @"Charged!";
-        message = [NSString stringWithFormat:@"Record: %@\n"
-                                             @"Amount: %@ %@\n"
-                                             @"Card Type: %@\n"
-                                             @"Redacted Number: %@",
-           recordId,
-           chargeResponse.amount,
-           chargeResponse.currency,
-           chargeResponse.cardType,
-           chargeResponse.redactedCardNumber
-        ];
-    }
-    else // other response code values are documented in IFChargeResponse.h
-    {
-        title = @"Not Charged!";
-        message = [NSString stringWithFormat:@"Record: %@", recordId];
-    }
+        NSString* title;
+        NSString* message;
 
-    // Generally you would do something app-specific here, like load
-    // the record specified by recordId, record the success or
-    // failure, etc. Since this sample doesn't actually do much, we'll
-    // just pop an alert.
-    UIAlertView* alert = [UIAlertView alloc];
-    [[alert initWithTitle:title
-            message:message
-            delegate:nil
-            cancelButtonTitle:@"OK"
-            otherButtonTitles:nil
-    ] show];
-    [alert release];
+        // You may want to perform different actions based on the response
+        // code. This example shows an alert with the response data when
+        // the charge is approved.
+        if ( chargeResponse.responseCode == kIFChargeResponseCodeApproved )
+        {
+            title = @"Charged!";
+            message = [NSString stringWithFormat:@"Record: %@\n"
+                                                 @"Amount: %@ %@\n"
+                                                 @"Card Type: %@\n"
+                                                 @"Redacted Number: %@",
+               recordId,
+               chargeResponse.amount,
+               chargeResponse.currency,
+               chargeResponse.cardType,
+               chargeResponse.redactedCardNumber
+            ];
+        }
+        else // other response code values are documented in IFChargeResponse.h
+        {
+            title = @"Not Charged!";
+            message = [NSString stringWithFormat:@"Record: %@", recordId];
+        }
 
+        // Generally you would do something app-specific here, like load
+        // the record specified by recordId and mark it paid. Since this
+        // sample doesn't actually do much, we'll just pop an alert.
+        UIAlertView* alert = [UIAlertView alloc];
+        [[alert initWithTitle:title
+                message:message
+                delegate:nil
+                cancelButtonTitle:@"OK"
+                otherButtonTitles:nil
+        ] show];
+        [alert release];
+    });
+
+    // The URL is ours; whether the response was any good is reported
+    // when the handler is done with it.
     return YES;
 }
 
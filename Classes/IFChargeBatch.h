@@ -0,0 +1,94 @@
+// -*- objc -*-
+//
+// IFChargeBatch.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeRequest.h"
+
+// IFChargeBatch - Makes request URLs for many invoices at once, such as
+// a batch of payment links, from a prototype request and a table of
+// rows. The prototype holds what every request shares (returnAppName,
+// returnURL, requestBaseURI, currency and so on). It's checked and
+// encoded once, when the batch is created. Each row gives the rest:
+//
+// - Columns named for a field in +[IFChargeRequest knownFields]
+//   ("amount", "invoiceNumber", "email", ...) set that field, checked
+//   as its setter would check it; amounts are checked against the
+//   row's currency. An empty cell leaves the field unset.
+//
+// - Any other column is an extra param, added to the returnURL as
+//   setReturnURL:withExtraParams: adds them, in column order. An empty
+//   cell leaves the param out.
+//
+// A row's URL is the submitURL of a copy of the prototype with the
+// row's fields set and the row's extra params passed to
+// setReturnURL:withExtraParams: with the prototype's returnURL. Each
+// row with a returnURL gets a nonce of its own from
+// IFChargeNonceStoreShared, with the prototype's stored extra params
+// and the row's own kept alongside, so the response to each row's
+// link is accepted once. A row for which no nonce can be issued is rejected
+// with kIFChargeErrorNonceUnavailable. No request is made per row.
+// Rows are spread across threads; a batch may be used from any
+// thread.
+typedef struct IFChargeBatch IFChargeBatch;
+
+// IFChargeBatchResult - The outcome of one row.
+typedef struct IFChargeBatchResult
+{
+    // Which field of the row was rejected, and why, or
+    // kIFChargeErrorNone.
+    IFChargeError error;
+
+    // The request URL, retained, or nil if the row was rejected.
+    NSString* url;
+} IFChargeBatchResult;
+
+// IFChargeBatchCreate - A batch of requests like prototype, whose rows
+// have the named columns. prototype is frozen (see -freeze) as it is
+// now, so changing it later doesn't change the batch. Returns NULL,
+// filling in *error, if a column name isn't a string
+// (kIFChargeErrorInvalidColumnName, with the column's index as its
+// detail), or if there are extra param columns but neither the
+// prototype nor a column has a returnURL. Free the batch with
+// IFChargeBatchFree.
+extern IFChargeBatch* IFChargeBatchCreate( IFChargeRequest* prototype, NSArray* columns, IFChargeError* error );
+
+extern void IFChargeBatchFree( IFChargeBatch* batch );
+
+// IFChargeBatchColumnCount - The number of cells in each of the
+// batch's rows.
+extern NSUInteger IFChargeBatchColumnCount( const IFChargeBatch* batch );
+
+// IFChargeBatchCreateURLs - Makes the URL for each of count rows, whose
+// cells are at cells, row after row, filling in one result per row. A
+// nil cell counts as empty. The rows are handed out in small batches
+// to threadCount threads, or one per core if threadCount is 0. Release
+// the results with IFChargeBatchResultsRelease.
+extern void IFChargeBatchCreateURLs( const IFChargeBatch* batch, NSString* const* cells, NSUInteger count,
+                                     IFChargeBatchResult* results, NSUInteger threadCount );
+
+// IFChargeBatchResultsRelease - Releases the URLs held by count
+// results.
+extern void IFChargeBatchResultsRelease( IFChargeBatchResult* results, NSUInteger count );
+
+// IFChargeBatchCreateCSVCells - Reads CSV (RFC 4180, in UTF-8): the
+// first record names the columns, and is returned in *header,
+// autoreleased. The cells of the rest are returned, row after row, in
+// an array the caller frees with IFChargeBatchCellsRelease, and
+// *rowCount is set to the number of rows. Quoted cells may hold commas,
+// line breaks and doubled quotes. Blank lines are skipped anywhere,
+// before the header too, so in a one-column table an empty cell has
+// to be quoted (""). Returns
+// NULL if a quote isn't closed, a row has the wrong number of cells,
+// or the data isn't UTF-8. The cells of an ASCII row share one
+// allocation (see IFChargeFieldArena.h).
+extern NSString** IFChargeBatchCreateCSVCells( NSData* csv, NSArray** header, NSUInteger* rowCount );
+
+// IFChargeBatchCellsRelease - Releases count cells and frees the array.
+extern void IFChargeBatchCellsRelease( NSString** cells, NSUInteger count );
@@ -0,0 +1,693 @@
+//
+// IFChargeBatch.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeBatch.h"
+#import "IFChargeFieldArena.h"
+#import "IFChargeNonce.h"
+#import "IFChargeStats.h"
+
+#include <dispatch/dispatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Threads claim this many rows at a time.
+#define IF_CHARGE_BATCH_ROWS 64
+
+// IFBatchPart - A run of the prepared bytes, then the pair of one row
+// field, if field isn't -1.
+typedef struct IFBatchPart
+{
+    size_t    offset;
+    size_t    length;
+    NSInteger field;
+} IFBatchPart;
+
+struct IFChargeBatch
+{
+    NSUInteger  columnCount;
+
+    // The base and the shared fields' pairs, encoded as requestURL
+    // encodes them, each pair starting with '&'. The first pair of a
+    // URL gets its real separator once the URL is complete.
+    char*       prepared;
+    size_t      baseLength;
+    BOOL        hasQuery;
+    IFBatchPart parts[IF_CHARGE_QUERY_MAX_FIELDS + 1];
+    NSUInteger  partCount;
+
+    // The column that sets each field, or -1 for a shared field.
+    NSInteger   fieldColumns[IF_CHARGE_QUERY_MAX_FIELDS];
+
+    // The prototype's snapshot, for the shared fields that a row's
+    // amounts are checked against, if a column sets an amount or the
+    // currency.
+    IFChargeRequest* snapshot;
+    BOOL        checkDecimals;
+    NSInteger   returnURLField;
+    const char* queryKeys[IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t      queryKeyLengths[IF_CHARGE_QUERY_MAX_FIELDS];
+
+    // The extra param columns, and the prototype's returnURL they and
+    // each row's nonce are added to, unless a column sets the
+    // returnURL.
+    NSUInteger  extraCount;
+    NSUInteger* extraColumns;
+    NSString**  extraNames;
+    char**      extraKeys;
+    size_t*     extraKeyLengths;
+    char*       returnURL;
+    size_t      returnURLLength;
+    BOOL        returnURLHasQuery;
+
+    // What's kept with each row's nonce: the prototype's stored extra
+    // params, to which the row's own are added.
+    NSDictionary* storedParams;
+    char*         nonceKey;
+    size_t        nonceKeyLength;
+};
+
+// IFBatchBuffer - Bytes that a thread reuses from row to row.
+typedef struct IFBatchBuffer
+{
+    char*  bytes;
+    size_t length;
+    size_t capacity;
+} IFBatchBuffer;
+
+#pragma -
+#pragma Buffers
+
+// Makes room for length more bytes and returns where they go.
+static char* IFBatchBufferAppend( IFBatchBuffer* buffer, size_t length )
+{
+    if ( buffer->length + length > buffer->capacity )
+    {
+        buffer->capacity = MAX( buffer->length + length, 2 * buffer->capacity );
+        buffer->bytes = realloc( buffer->bytes, buffer->capacity );
+    }
+    char* w = buffer->bytes + buffer->length;
+    buffer->length += length;
+    return w;
+}
+
+// Appends the UTF-8 bytes of s and returns how many there were.
+static size_t IFBatchBufferAppendUTF8( IFBatchBuffer* buffer, NSString* s )
+{
+    NSUInteger capacity = [s maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    char* w = IFBatchBufferAppend( buffer, capacity );
+    NSUInteger length = 0;
+    [s getBytes:w
+      maxLength:capacity
+     usedLength:&length
+       encoding:NSUTF8StringEncoding
+        options:0
+          range:NSMakeRange( 0, [s length] )
+ remainingRange:NULL];
+    buffer->length -= capacity - length;
+    return length;
+}
+
+// Appends the len bytes at s, percent-encoded.
+static void IFBatchBufferAppendEncoded( IFBatchBuffer* buffer, const char* s, size_t len )
+{
+    IFChargeEncode( IFBatchBufferAppend( buffer, IFChargeEncodedLength( s, len ) ), s, len );
+}
+
+// A malloc'd, NUL-terminated copy of the UTF-8 bytes of s.
+static char* IFBatchCreateUTF8( NSString* s, size_t* length )
+{
+    IFBatchBuffer buffer = { NULL, 0, 0 };
+    *length = IFBatchBufferAppendUTF8( &buffer, s );
+    *IFBatchBufferAppend( &buffer, 1 ) = '\0';
+    return buffer.bytes;
+}
+
+#pragma -
+#pragma Creating
+
+IFChargeBatch* IFChargeBatchCreate( IFChargeRequest* prototype, NSArray* columns, IFChargeError* error )
+{
+    const IFChargeFieldTable* fieldTable = [IFChargeRequest queryFieldTable];
+    NSInteger returnURLField = IFChargeFieldTableLookup( fieldTable, "returnURL", strlen( "returnURL" ) );
+    IFChargeRequest* snapshot = [prototype freeze];
+
+    IFChargeBatch* batch = calloc( 1, sizeof( IFChargeBatch ) );
+    batch->returnURLField  = returnURLField;
+    batch->columnCount     = [columns count];
+    batch->extraColumns    = malloc( MAX( batch->columnCount, 1 ) * sizeof( NSUInteger ) );
+    batch->extraNames      = calloc( MAX( batch->columnCount, 1 ), sizeof( NSString* ) );
+    batch->extraKeys       = calloc( MAX( batch->columnCount, 1 ), sizeof( char* ) );
+    batch->extraKeyLengths = malloc( MAX( batch->columnCount, 1 ) * sizeof( size_t ) );
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        batch->fieldColumns[index]    = -1;
+        batch->queryKeys[index]       = [fieldTable->queryKeys[index] UTF8String];
+        batch->queryKeyLengths[index] = strlen( batch->queryKeys[index] );
+    }
+
+    // A later column for the same field or param wins, as a later
+    // pair in a query does.
+    for ( NSUInteger column = 0; column < batch->columnCount; column++ )
+    {
+        NSString* name = [columns objectAtIndex:column];
+        if ( ![name isKindOfClass:[NSString class]] )
+        {
+            IFChargeBatchFree( batch );
+            IFChargeSetError( error, kIFChargeErrorInvalidColumnName, [IFChargeRequest class], NULL, column );
+            return NULL;
+        }
+
+        const char* utf8 = [name UTF8String];
+        NSInteger field = IFChargeFieldTableLookup( fieldTable, utf8, strlen( utf8 ) );
+        if ( field >= 0 )
+        {
+            IFChargeFieldKind kind = fieldTable->schema[field].kind;
+            batch->fieldColumns[field] = column;
+            batch->checkDecimals |= ( kIFChargeFieldAmount == kind || kIFChargeFieldCurrency == kind );
+            continue;
+        }
+
+        NSUInteger extra = 0;
+        while ( extra < batch->extraCount && ![name isEqualToString:[columns objectAtIndex:batch->extraColumns[extra]]] )
+        {
+            extra++;
+        }
+        if ( extra == batch->extraCount )
+        {
+            batch->extraNames[extra] = [name copy];
+            batch->extraKeys[extra] = IFBatchCreateUTF8( name, &batch->extraKeyLengths[extra] );
+            batch->extraCount++;
+        }
+        batch->extraColumns[extra] = column;
+    }
+
+    // The extra params and nonces go on the prototype's returnURL
+    // unless each row has its own.
+    NSString* returnURL = snapshot.returnURL;
+    if ( batch->extraCount && batch->fieldColumns[returnURLField] < 0 && nil == returnURL )
+    {
+        IFChargeBatchFree( batch );
+        IFChargeSetError( error, kIFChargeErrorNilURL, [IFChargeRequest class], "returnURL", 0 );
+        return NULL;
+    }
+    if ( [returnURL length] )
+    {
+        batch->returnURL = IFBatchCreateUTF8( returnURL, &batch->returnURLLength );
+        batch->returnURLHasQuery = 0 != [[[NSURL URLWithString:returnURL] query] length];
+    }
+    batch->storedParams = [snapshot.storedExtraParams retain];
+    batch->snapshot = [snapshot retain];
+    batch->nonceKey = IFBatchCreateUTF8( IF_CHARGE_NONCE_KEY, &batch->nonceKeyLength );
+
+    // Encode the base and every shared pair, splitting the bytes into
+    // parts at each field a row sets. Every row's returnURL carries a
+    // nonce of its own, so it's one of those whenever there is one.
+    IFBatchBuffer prepared = { NULL, 0, 0 };
+    NSString* baseURL = snapshot.baseURL;
+    batch->baseLength = IFBatchBufferAppendUTF8( &prepared, baseURL );
+    batch->hasQuery = NSNotFound != [baseURL rangeOfString:@"?"].location;
+
+    size_t partStart = 0;
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        BOOL rowField = batch->fieldColumns[index] >= 0 || ( index == returnURLField && batch->returnURL );
+        if ( rowField )
+        {
+            IFBatchPart* part = &batch->parts[batch->partCount++];
+            part->offset = partStart;
+            part->length = prepared.length - partStart;
+            part->field  = index;
+            partStart = prepared.length;
+            continue;
+        }
+
+        NSString* value = *IFChargeFieldSlot( fieldTable, snapshot, index );
+        if ( kIFChargeFieldCurrency == fieldTable->schema[index].kind && 0 == [value length] )
+        {
+            value = IF_CHARGE_DEFAULT_CURRENCY;
+        }
+        NSString* pair = IFChargeQueryCreateURLString( @"", YES, 1, &fieldTable->queryKeys[index], &value );
+        IFBatchBufferAppendUTF8( &prepared, pair );
+        [pair release];
+    }
+    IFBatchPart* last = &batch->parts[batch->partCount++];
+    last->offset = partStart;
+    last->length = prepared.length - partStart;
+    last->field  = -1;
+
+    batch->prepared = prepared.bytes;
+    return batch;
+}
+
+void IFChargeBatchFree( IFChargeBatch* batch )
+{
+    if ( NULL == batch )
+    {
+        return;
+    }
+    for ( NSUInteger extra = 0; extra < batch->extraCount; extra++ )
+    {
+        [batch->extraNames[extra] release];
+        free( batch->extraKeys[extra] );
+    }
+    [batch->storedParams release];
+    [batch->snapshot release];
+    free( batch->nonceKey );
+    free( batch->extraColumns );
+    free( batch->extraNames );
+    free( batch->extraKeys );
+    free( batch->extraKeyLengths );
+    free( batch->returnURL );
+    free( batch->prepared );
+    free( batch );
+}
+
+NSUInteger IFChargeBatchColumnCount( const IFChargeBatch* batch )
+{
+    return batch->columnCount;
+}
+
+#pragma -
+#pragma Rows
+
+// Appends "&key=value", with value encoded, unless it's empty.
+static void IFBatchAppendPair( IFBatchBuffer* url, IFBatchBuffer* scratch, const char* key, size_t keyLength, NSString* value )
+{
+    scratch->length = 0;
+    size_t valueLength = IFBatchBufferAppendUTF8( scratch, value );
+    if ( 0 == valueLength )
+    {
+        return;
+    }
+
+    char* w = IFBatchBufferAppend( url, 2 + keyLength );
+    *w++ = '&';
+    memcpy( w, key, keyLength );
+    w[keyLength] = '=';
+    IFBatchBufferAppendEncoded( url, scratch->bytes, valueLength );
+}
+
+// Appends the returnURL pair, with the row's extra params added to the
+// returnURL as IFChargeQueryCreateURLString adds them: keys as they
+// are, values encoded. Then a nonce is issued for the row, with its
+// extra params kept alongside, and added as submitURL adds it. Then
+// the whole returnURL is encoded again.
+static BOOL IFBatchAppendReturnURL( const IFChargeBatch* batch, NSString* const* row, NSInteger field,
+                                    IFBatchBuffer* url, IFBatchBuffer* returnURL, IFBatchBuffer* scratch,
+                                    IFChargeError* error )
+{
+    returnURL->length = 0;
+    BOOL hasQuery = batch->returnURLHasQuery;
+    NSInteger column = batch->fieldColumns[field];
+    if ( column >= 0 )
+    {
+        if ( 0 == [row[column] length] )
+        {
+            // Without extra params, an empty cell leaves the returnURL
+            // unset like any other field, and there's no nonce to add.
+            if ( 0 == batch->extraCount )
+            {
+                return YES;
+            }
+            return IFChargeSetError( error, kIFChargeErrorNilURL, [IFChargeRequest class], "returnURL", 0 );
+        }
+        IFBatchBufferAppendUTF8( returnURL, row[column] );
+        hasQuery = 0 != [[[NSURL URLWithString:row[column]] query] length];
+    }
+    else
+    {
+        memcpy( IFBatchBufferAppend( returnURL, batch->returnURLLength ), batch->returnURL, batch->returnURLLength );
+    }
+
+    BOOL first = !hasQuery;
+    NSMutableDictionary* params = nil;
+    for ( NSUInteger extra = 0; extra < batch->extraCount; extra++ )
+    {
+        scratch->length = 0;
+        NSString* value = row[batch->extraColumns[extra]];
+        size_t valueLength = IFBatchBufferAppendUTF8( scratch, value );
+        if ( 0 == valueLength )
+        {
+            continue;
+        }
+
+        if ( nil == params )
+        {
+            params = [NSMutableDictionary dictionaryWithDictionary:batch->storedParams];
+        }
+        [params setObject:value forKey:batch->extraNames[extra]];
+
+        char* w = IFBatchBufferAppend( returnURL, 2 + batch->extraKeyLengths[extra] );
+        *w++ = first ? '?' : '&';
+        memcpy( w, batch->extraKeys[extra], batch->extraKeyLengths[extra] );
+        w[batch->extraKeyLengths[extra]] = '=';
+        IFBatchBufferAppendEncoded( returnURL, scratch->bytes, valueLength );
+        first = NO;
+    }
+
+    // Nonces are web-safe base64, so they need no encoding.
+    NSString* nonce = IFChargeNonceCreate( IFChargeNonceStoreShared(), params ? params : batch->storedParams );
+    if ( nil == nonce )
+    {
+        return IFChargeSetError( error, kIFChargeErrorNonceUnavailable, [IFChargeRequest class], "returnURL", 0 );
+    }
+    char* w = IFBatchBufferAppend( returnURL, 2 + batch->nonceKeyLength );
+    *w++ = first ? '?' : '&';
+    memcpy( w, batch->nonceKey, batch->nonceKeyLength );
+    w[batch->nonceKeyLength] = '=';
+    IFBatchBufferAppendUTF8( returnURL, nonce );
+    [nonce release];
+
+    {
+        size_t keyLength = batch->queryKeyLengths[field];
+        char* w = IFBatchBufferAppend( url, 2 + keyLength );
+        *w++ = '&';
+        memcpy( w, batch->queryKeys[field], keyLength );
+        w[keyLength] = '=';
+        IFBatchBufferAppendEncoded( url, returnURL->bytes, returnURL->length );
+    }
+    return YES;
+}
+
+static void IFBatchCreateURL( const IFChargeBatch* batch, NSString* const* row, IFBatchBuffer* buffers, IFChargeBatchResult* result )
+{
+    const IFChargeFieldTable* fieldTable = [IFChargeRequest queryFieldTable];
+    IFChargeError* error = &result->error;
+    result->url = nil;
+    error->code = kIFChargeErrorNone;
+    error->field = -1;
+    error->detail = 0;
+
+    // Every field first, so a rejected row costs no encoding.
+    for ( NSUInteger part = 0; part < batch->partCount; part++ )
+    {
+        NSInteger field = batch->parts[part].field;
+        NSInteger column = ( field >= 0 ) ? batch->fieldColumns[field] : -1;
+        if ( column >= 0 && [row[column] length] && !IFChargeCheckField( fieldTable, field, row[column], error ) )
+        {
+            IF_CHARGE_STATS_REJECT( [IFChargeRequest class], error );
+            return;
+        }
+    }
+
+    // Then the row's amounts against the currency it ends up with, as
+    // the setters check them; an empty cell leaves its field unset.
+    if ( batch->checkDecimals )
+    {
+        NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+        for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+        {
+            NSInteger column = batch->fieldColumns[index];
+            values[index] = ( column >= 0 ) ? row[column] : *IFChargeFieldSlot( fieldTable, batch->snapshot, index );
+        }
+        if ( !IFChargeCheckAmountDecimals( fieldTable, values, error ) )
+        {
+            IF_CHARGE_STATS_REJECT( [IFChargeRequest class], error );
+            return;
+        }
+    }
+
+    IFBatchBuffer* url = &buffers[0];
+    url->length = 0;
+    for ( NSUInteger part = 0; part < batch->partCount; part++ )
+    {
+        const IFBatchPart* p = &batch->parts[part];
+        memcpy( IFBatchBufferAppend( url, p->length ), batch->prepared + p->offset, p->length );
+        if ( p->field < 0 )
+        {
+            continue;
+        }
+
+        NSInteger column = batch->fieldColumns[p->field];
+        if ( p->field == batch->returnURLField )
+        {
+            if ( !IFBatchAppendReturnURL( batch, row, p->field, url, &buffers[1], &buffers[2], error ) )
+            {
+                IF_CHARGE_STATS_REJECT( [IFChargeRequest class], error );
+                return;
+            }
+            continue;
+        }
+
+        NSString* value = row[column];
+        if ( kIFChargeFieldCurrency == fieldTable->schema[p->field].kind && 0 == [value length] )
+        {
+            value = IF_CHARGE_DEFAULT_CURRENCY;
+        }
+        IFBatchAppendPair( url, &buffers[2], batch->queryKeys[p->field], batch->queryKeyLengths[p->field], value );
+    }
+
+    if ( url->length > batch->baseLength )
+    {
+        url->bytes[batch->baseLength] = batch->hasQuery ? '&' : '?';
+    }
+    result->url = [[NSString alloc] initWithBytes:url->bytes length:url->length encoding:NSUTF8StringEncoding];
+}
+
+void IFChargeBatchCreateURLs( const IFChargeBatch* batch, NSString* const* cells, NSUInteger count,
+                              IFChargeBatchResult* results, NSUInteger threadCount )
+{
+    if ( 0 == threadCount )
+    {
+        threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+
+    // As in verifyURLs:, each thread claims the next rows as it
+    // finishes the last, and keeps its buffers from row to row.
+    volatile NSUInteger next = 0;
+    volatile NSUInteger* nextRows = &next;
+    dispatch_apply( threadCount, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t thread )
+    {
+        IFBatchBuffer buffers[3] = { { NULL, 0, 0 }, { NULL, 0, 0 }, { NULL, 0, 0 } };
+        for ( ;; )
+        {
+            NSUInteger start = __sync_fetch_and_add( nextRows, IF_CHARGE_BATCH_ROWS );
+            if ( start >= count )
+            {
+                break;
+            }
+
+            NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+            NSUInteger end = MIN( start + IF_CHARGE_BATCH_ROWS, count );
+            for ( NSUInteger index = start; index < end; index++ )
+            {
+                IFBatchCreateURL( batch, cells + index * batch->columnCount, buffers, &results[index] );
+            }
+            [pool drain];
+        }
+        for ( NSUInteger index = 0; index < 3; index++ )
+        {
+            free( buffers[index].bytes );
+        }
+    });
+}
+
+void IFChargeBatchResultsRelease( IFChargeBatchResult* results, NSUInteger count )
+{
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        [results[index].url release];
+        results[index].url = nil;
+    }
+}
+
+#pragma -
+#pragma CSV
+
+// IFCSVCell - Where a cell's unquoted bytes are.
+typedef struct IFCSVCell
+{
+    size_t offset;
+    size_t length;
+} IFCSVCell;
+
+// Splits the len bytes at csv into cells, unquoting them into text.
+// Returns the number of cells, each record having columnCount of them,
+// or NSNotFound if the CSV is malformed.
+static NSUInteger IFCSVSplit( const char* csv, size_t len, char* text, IFCSVCell** cells, NSUInteger* columnCount )
+{
+    NSUInteger count = 0;
+    NSUInteger capacity = 64;
+    *cells = malloc( capacity * sizeof( IFCSVCell ) );
+    *columnCount = 0;
+
+    size_t i = 0;
+    size_t textLength = 0;
+    NSUInteger recordStart = 0;
+    while ( i < len )
+    {
+        // One cell.
+        size_t start = textLength;
+        BOOL quoted = ( '"' == csv[i] );
+        if ( quoted )
+        {
+            for ( i++; ; i++ )
+            {
+                if ( i == len )
+                {
+                    return NSNotFound;
+                }
+                if ( '"' == csv[i] )
+                {
+                    if ( i + 1 < len && '"' == csv[i + 1] )
+                    {
+                        i++;
+                    }
+                    else
+                    {
+                        i++;
+                        break;
+                    }
+                }
+                text[textLength++] = csv[i];
+            }
+            if ( i < len && ',' != csv[i] && '\r' != csv[i] && '\n' != csv[i] )
+            {
+                return NSNotFound;
+            }
+        }
+        else
+        {
+            while ( i < len && ',' != csv[i] && '\r' != csv[i] && '\n' != csv[i] )
+            {
+                text[textLength++] = csv[i++];
+            }
+        }
+
+        if ( count == capacity )
+        {
+            capacity *= 2;
+            *cells = realloc( *cells, capacity * sizeof( IFCSVCell ) );
+        }
+        ( *cells )[count].offset = start;
+        ( *cells )[count].length = textLength - start;
+        count++;
+
+        // A comma at the very end leaves one more, empty, cell.
+        if ( i < len && ',' == csv[i] )
+        {
+            i++;
+            if ( i < len )
+            {
+                continue;
+            }
+            if ( count == capacity )
+            {
+                capacity *= 2;
+                *cells = realloc( *cells, capacity * sizeof( IFCSVCell ) );
+            }
+            ( *cells )[count].offset = textLength;
+            ( *cells )[count].length = 0;
+            count++;
+        }
+
+        // The end of a record.
+        if ( i < len && '\r' == csv[i] )
+        {
+            i++;
+        }
+        if ( i < len && '\n' == csv[i] )
+        {
+            i++;
+        }
+
+        // A blank line is skipped wherever it is, before the header
+        // too, and whatever the column count: a lone column's empty
+        // cell has to be quoted.
+        NSUInteger recordCells = count - recordStart;
+        if ( 1 == recordCells && 0 == ( *cells )[recordStart].length && !quoted )
+        {
+            count = recordStart;
+        }
+        else if ( 0 == *columnCount )
+        {
+            *columnCount = recordCells;
+        }
+        else if ( recordCells != *columnCount )
+        {
+            return NSNotFound;
+        }
+        recordStart = count;
+    }
+    return ( 0 == *columnCount ) ? NSNotFound : count;
+}
+
+NSString** IFChargeBatchCreateCSVCells( NSData* csv, NSArray** header, NSUInteger* rowCount )
+{
+    const char* bytes = [csv bytes];
+    size_t len = [csv length];
+    char* text = malloc( MAX( len, 1 ) );
+    IFCSVCell* cells = NULL;
+    NSUInteger columnCount = 0;
+    NSUInteger count = IFCSVSplit( bytes, len, text, &cells, &columnCount );
+    if ( NSNotFound == count )
+    {
+        free( text );
+        free( cells );
+        return NULL;
+    }
+
+    NSUInteger rows = count / columnCount - 1;
+    NSString** strings = malloc( MAX( count, 1 ) * sizeof( NSString* ) );
+    BOOL valid = YES;
+    const char* cellBytes[IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t cellLengths[IF_CHARGE_QUERY_MAX_FIELDS];
+    for ( NSUInteger record = 0; record <= rows; record++ )
+    {
+        NSUInteger first = record * columnCount;
+
+        // A row of ASCII cells is made in one arena.
+        BOOL ascii = record > 0 && columnCount <= IF_CHARGE_QUERY_MAX_FIELDS;
+        for ( NSUInteger column = 0; ascii && column < columnCount; column++ )
+        {
+            cellBytes[column]   = text + cells[first + column].offset;
+            cellLengths[column] = cells[first + column].length;
+            ascii = IFChargeFieldFitsArena( cellBytes[column], cellLengths[column] );
+        }
+        if ( ascii )
+        {
+            IFChargeFieldArenaCreateStrings( columnCount, cellBytes, cellLengths, strings + first );
+            continue;
+        }
+
+        for ( NSUInteger column = 0; column < columnCount; column++ )
+        {
+            NSString* cell = [[NSString alloc] initWithBytes:text + cells[first + column].offset
+                                                      length:cells[first + column].length
+                                                    encoding:NSUTF8StringEncoding];
+            valid = valid && nil != cell;
+            strings[first + column] = cell ? cell : [@"" retain];
+        }
+    }
+    free( text );
+    free( cells );
+
+    if ( !valid )
+    {
+        IFChargeBatchCellsRelease( strings, count );
+        return NULL;
+    }
+    *header = [NSArray arrayWithObjects:strings count:columnCount];
+    for ( NSUInteger column = 0; column < columnCount; column++ )
+    {
+        [strings[column] release];
+    }
+    memmove( strings, strings + columnCount, rows * columnCount * sizeof( NSString* ) );
+    *rowCount = rows;
+    return strings;
+}
+
+void IFChargeBatchCellsRelease( NSString** cells, NSUInteger count )
+{
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        [cells[index] release];
+    }
+    free( cells );
+}
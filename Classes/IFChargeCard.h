@@ -0,0 +1,68 @@
+// -*- objc -*-
+//
+// IFChargeCard.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// The longest card number, in digits (ISO/IEC 7812).
+#define IF_CHARGE_CARD_DIGITS_MAX 19
+
+// Card numbers are read by their first IF_CHARGE_CARD_BIN_DIGITS
+// digits, the issuer identification number or BIN.
+#define IF_CHARGE_CARD_BIN_DIGITS 6
+
+// IFChargeCardBrand - The card networks IFChargeCardBrandForDigits
+// knows.
+typedef enum {
+    kIFChargeCardUnknown,
+    kIFChargeCardVisa,
+    kIFChargeCardMasterCard,
+    kIFChargeCardAmericanExpress,
+    kIFChargeCardDiscover,
+    kIFChargeCardDinersClub,
+    kIFChargeCardJCB,
+    kIFChargeCardUnionPay,
+    kIFChargeCardMaestro
+} IFChargeCardBrand;
+
+// IFChargeCardDigits - Copies the digits of number into digits, which
+// needs room for IF_CHARGE_CARD_DIGITS_MAX bytes, skipping the spaces
+// and dashes people type between groups. Returns the number of digits,
+// or 0 if number is nil, has any other character or is too long.
+extern size_t IFChargeCardDigits( NSString* number, char* digits );
+
+// IFChargeCardLuhnValid - YES if the length ASCII digits at digits
+// pass the Luhn check. NO if there are none, or any isn't a digit.
+// Eight digits are checked at a time; allocates nothing.
+extern BOOL IFChargeCardLuhnValid( const char* digits, size_t length );
+
+// IFChargeCardBrandForDigits - The network that issued the card whose
+// number starts with the length ASCII digits at digits, looked up in a
+// table of BIN ranges. kIFChargeCardUnknown if there are fewer than
+// IF_CHARGE_CARD_BIN_DIGITS digits or no range holds them.
+extern IFChargeCardBrand IFChargeCardBrandForDigits( const char* digits, size_t length );
+
+// IFChargeCardBrandName - The name IFChargeResponse's cardType uses for
+// brand ("Visa", "American Express", ...), which always matches
+// IF_CHARGE_CARD_TYPE_PATTERN; nil for kIFChargeCardUnknown.
+extern NSString* IFChargeCardBrandName( IFChargeCardBrand brand );
+
+// IFChargeCardTypeForNumber - IFChargeCardBrandName of the brand of a
+// card number, as IFChargeCardDigits reads it. nil if it isn't known.
+extern NSString* IFChargeCardTypeForNumber( NSString* number );
+
+// IFChargeCardNumberIsValid - YES if number is 12 to 19 digits, as
+// IFChargeCardDigits reads it, and passes the Luhn check.
+extern BOOL IFChargeCardNumberIsValid( NSString* number );
+
+// IFChargeCardCreateRedacted - number with every character but the
+// last four replaced by mask, made in one pass. A number of four
+// characters or fewer is returned as it is. The caller must release
+// the result; nil for nil.
+extern NSString* IFChargeCardCreateRedacted( NSString* number, unichar mask );
@@ -0,0 +1,237 @@
+//
+// IFChargeCard.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeCard.h"
+
+// Card numbers up to this long are redacted on the stack.
+#define IF_CHARGE_CARD_STACK_MAX 64
+
+#pragma -
+#pragma Luhn
+
+// A digit's contribution to the sum: as it is at even places from the
+// right, doubled (and its digits summed) at odd places.
+static const uint8_t _luhn[2][10] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 },
+    { 0, 2, 4, 6, 8, 1, 3, 5, 7, 9 }
+};
+
+// Per-byte constants for checking eight digits in a word.
+#define IF_LANES( b )        ( 0x0101010101010101ULL * ( b ) )
+#define IF_LUHN_EVEN_LANES   0x00FF00FF00FF00FFULL
+
+// The Luhn sum of the eight digits in word, which sits at a multiple
+// of eight places from the right, or -1 if any byte isn't a digit.
+// Lanes 0, 2, 4 and 6 are then at odd places, and are doubled: 2d for
+// a digit below five, 2d - 9 otherwise.
+static int IFLuhnWord( uint64_t word )
+{
+    uint64_t d = word ^ IF_LANES( '0' );
+    if ( ( ( ( d & IF_LANES( 0x7F ) ) + IF_LANES( 0x76 ) ) | d ) & IF_LANES( 0x80 ) )
+    {
+        return -1;
+    }
+
+    uint64_t doubled = d & IF_LUHN_EVEN_LANES;
+    uint64_t fives   = ( ( doubled + IF_LANES( 0x7B ) ) & IF_LANES( 0x80 ) & IF_LUHN_EVEN_LANES ) >> 7;
+    uint64_t lanes   = ( d & ~IF_LUHN_EVEN_LANES ) + doubled + doubled - 9 * fives;
+
+    // Every lane is at most 9, so the sum of all eight fits the top one.
+    return (int)( ( lanes * IF_LANES( 1 ) ) >> 56 );
+}
+
+BOOL IFChargeCardLuhnValid( const char* digits, size_t length )
+{
+    if ( 0 == length )
+    {
+        return NO;
+    }
+
+    // Whole words from the right, where their places are known.
+    unsigned sum = 0;
+    size_t end = length;
+#if defined( __BYTE_ORDER__ ) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for ( ; end >= 8; end -= 8 )
+    {
+        uint64_t word;
+        memcpy( &word, digits + end - 8, sizeof( word ) );
+        int wordSum = IFLuhnWord( word );
+        if ( wordSum < 0 )
+        {
+            return NO;
+        }
+        sum += wordSum;
+    }
+#endif
+
+    // The rest one at a time; place is counted from the right.
+    for ( size_t index = 0; index < end; index++ )
+    {
+        unsigned digit = (unsigned char)digits[index] - '0';
+        if ( digit > 9 )
+        {
+            return NO;
+        }
+        sum += _luhn[( length - 1 - index ) & 1][digit];
+    }
+    return 0 == sum % 10;
+}
+
+#pragma -
+#pragma BIN Ranges
+
+// The BIN ranges of each brand, as the first six digits, sorted and
+// not overlapping. The bounds are kept apart from the brands so that
+// the search only touches the one array.
+static const uint32_t _binLow[] = {
+    222100, 300000, 309500, 340000, 352800, 360000, 370000, 380000,
+    400000, 500000, 510000, 560000, 601100, 620000, 622126, 622926,
+    639000, 644000, 670000
+};
+
+static const uint32_t _binHigh[] = {
+    272099, 305999, 309599, 349999, 358999, 369999, 379999, 399999,
+    499999, 509999, 559999, 589999, 601199, 622125, 622925, 629999,
+    639999, 659999, 679999
+};
+
+static const uint8_t _binBrand[] = {
+    kIFChargeCardMasterCard, kIFChargeCardDinersClub,      kIFChargeCardDinersClub, kIFChargeCardAmericanExpress,
+    kIFChargeCardJCB,        kIFChargeCardDinersClub,      kIFChargeCardAmericanExpress, kIFChargeCardDinersClub,
+    kIFChargeCardVisa,       kIFChargeCardMaestro,         kIFChargeCardMasterCard, kIFChargeCardMaestro,
+    kIFChargeCardDiscover,   kIFChargeCardUnionPay,        kIFChargeCardDiscover,   kIFChargeCardUnionPay,
+    kIFChargeCardMaestro,    kIFChargeCardDiscover,        kIFChargeCardMaestro
+};
+
+#define IF_BIN_COUNT ( sizeof( _binHigh ) / sizeof( _binHigh[0] ) )
+
+IFChargeCardBrand IFChargeCardBrandForDigits( const char* digits, size_t length )
+{
+    if ( length < IF_CHARGE_CARD_BIN_DIGITS )
+    {
+        return kIFChargeCardUnknown;
+    }
+
+    uint32_t bin = 0;
+    for ( size_t index = 0; index < IF_CHARGE_CARD_BIN_DIGITS; index++ )
+    {
+        unsigned digit = (unsigned char)digits[index] - '0';
+        if ( digit > 9 )
+        {
+            return kIFChargeCardUnknown;
+        }
+        bin = bin * 10 + digit;
+    }
+
+    // The first range ending at or after bin, found without branching
+    // on the comparisons.
+    const uint32_t* base = _binHigh;
+    size_t count = IF_BIN_COUNT;
+    while ( count > 1 )
+    {
+        size_t half = count / 2;
+        base = ( base[half] < bin ) ? base + half : base;
+        count -= half;
+    }
+    size_t index = ( base - _binHigh ) + ( *base < bin );
+    if ( IF_BIN_COUNT == index || _binLow[index] > bin )
+    {
+        return kIFChargeCardUnknown;
+    }
+    return _binBrand[index];
+}
+
+NSString* IFChargeCardBrandName( IFChargeCardBrand brand )
+{
+    switch ( brand )
+    {
+    case kIFChargeCardVisa:            return @"Visa";
+    case kIFChargeCardMasterCard:      return @"MasterCard";
+    case kIFChargeCardAmericanExpress: return @"American Express";
+    case kIFChargeCardDiscover:        return @"Discover";
+    case kIFChargeCardDinersClub:      return @"Diners Club";
+    case kIFChargeCardJCB:             return @"JCB";
+    case kIFChargeCardUnionPay:        return @"UnionPay";
+    case kIFChargeCardMaestro:         return @"Maestro";
+    case kIFChargeCardUnknown:
+    default:                           return nil;
+    }
+}
+
+#pragma -
+#pragma Card Numbers
+
+size_t IFChargeCardDigits( NSString* number, char* digits )
+{
+    // A card number typed with separators is still short.
+    unichar characters[IF_CHARGE_CARD_STACK_MAX];
+    NSUInteger length = [number length];
+    if ( 0 == length || length > IF_CHARGE_CARD_STACK_MAX )
+    {
+        return 0;
+    }
+    [number getCharacters:characters range:NSMakeRange( 0, length )];
+
+    size_t count = 0;
+    for ( NSUInteger index = 0; index < length; index++ )
+    {
+        unichar c = characters[index];
+        if ( c >= '0' && c <= '9' )
+        {
+            if ( IF_CHARGE_CARD_DIGITS_MAX == count )
+            {
+                return 0;
+            }
+            digits[count++] = (char)c;
+        }
+        else if ( ' ' != c && '-' != c )
+        {
+            return 0;
+        }
+    }
+    return count;
+}
+
+NSString* IFChargeCardTypeForNumber( NSString* number )
+{
+    char digits[IF_CHARGE_CARD_DIGITS_MAX];
+    size_t length = IFChargeCardDigits( number, digits );
+    return IFChargeCardBrandName( IFChargeCardBrandForDigits( digits, length ) );
+}
+
+BOOL IFChargeCardNumberIsValid( NSString* number )
+{
+    char digits[IF_CHARGE_CARD_DIGITS_MAX];
+    size_t length = IFChargeCardDigits( number, digits );
+    return length >= 12 && IFChargeCardLuhnValid( digits, length );
+}
+
+NSString* IFChargeCardCreateRedacted( NSString* number, unichar mask )
+{
+    NSUInteger length = [number length];
+    if ( length <= 4 )
+    {
+        return [number copy];
+    }
+
+    unichar stackBuffer[IF_CHARGE_CARD_STACK_MAX];
+    unichar* buffer = ( length <= IF_CHARGE_CARD_STACK_MAX ) ? stackBuffer : malloc( length * sizeof( unichar ) );
+    for ( NSUInteger index = 0; index < length - 4; index++ )
+    {
+        buffer[index] = mask;
+    }
+    [number getCharacters:buffer + length - 4 range:NSMakeRange( length - 4, 4 )];
+
+    NSString* redacted = [[NSString alloc] initWithCharacters:buffer length:length];
+    if ( buffer != stackBuffer )
+    {
+        free( buffer );
+    }
+    return redacted;
+}
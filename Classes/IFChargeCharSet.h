@@ -0,0 +1,39 @@
+// -*- objc -*-
+//
+// IFChargeCharSet.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargeCharSet - An NSCharacterSet compiled for finding its members
+// in short strings. Its ASCII members are kept as a bitmap, and as a
+// few ranges the scan tests 8 or 16 characters at a time with SSE2,
+// AVX2 or NEON where the CPU allows. Only a character outside ASCII is
+// looked up in the NSCharacterSet, so an ASCII string that holds no
+// member never reaches it. A compiled set never changes, and may be
+// used from any thread.
+typedef struct IFChargeCharSet IFChargeCharSet;
+
+// IFChargeCharSetCreate - Compiles characterSet as it is now. Free the
+// result with IFChargeCharSetFree.
+extern IFChargeCharSet* IFChargeCharSetCreate( NSCharacterSet* characterSet );
+
+extern void IFChargeCharSetFree( IFChargeCharSet* set );
+
+// IFChargeCharSetFind - The index of the first character of s in set,
+// or NSNotFound: the location -[NSString rangeOfCharacterFromSet:]
+// would give. A surrogate pair is looked up as the one character it
+// encodes.
+extern NSUInteger IFChargeCharSetFind( const IFChargeCharSet* set, NSString* s );
+
+// IFChargeCharSetFindInSets - IFChargeCharSetFind for the union of
+// count sets. The union is compiled once and cached by the sets'
+// identities, so calling again with the same immutable sets (such as
+// [NSCharacterSet symbolCharacterSet]) costs no more than
+// IFChargeCharSetFind. Mutable sets are compiled on every call.
+extern NSUInteger IFChargeCharSetFindInSets( NSString* s, NSCharacterSet* const* sets, NSUInteger count );
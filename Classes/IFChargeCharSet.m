@@ -0,0 +1,355 @@
+//
+// IFChargeCharSet.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeCharSet.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __AVX2__ )
+#include <immintrin.h>
+#elif defined( __SSE2__ )
+#include <emmintrin.h>
+#elif defined( __ARM_NEON__ ) || defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
+// The most ranges of ASCII members the vector scan tests. Sets with
+// more are scanned a character at a time.
+#define IF_CHARGE_CHAR_SET_MAX_RANGES 8
+
+// Characters copied out of a string at a time.
+#define IF_CHARGE_CHAR_SET_CHUNK 128
+
+// Unions cached by IFChargeCharSetFindInSets, and the most sets in one.
+#define IF_CHARGE_CHAR_SET_CACHE_SIZE 32
+#define IF_CHARGE_CHAR_SET_CACHE_SETS 4
+
+struct IFChargeCharSet
+{
+    // Bit c is set if ASCII character c is a member.
+    uint64_t        ascii[2];
+
+    // The ASCII members again, as the ranges lows[i] to
+    // lows[i] + spans[i]. vector is NO if there are too many.
+    BOOL            vector;
+    unsigned        rangeCount;
+    uint16_t        lows[IF_CHARGE_CHAR_SET_MAX_RANGES];
+    uint16_t        spans[IF_CHARGE_CHAR_SET_MAX_RANGES];
+
+    // For everything outside ASCII.
+    NSCharacterSet* characterSet;
+};
+
+#pragma -
+#pragma Compiling
+
+static BOOL IFCharSetHasASCII( const IFChargeCharSet* set, unsigned c )
+{
+    return ( set->ascii[c >> 6] >> ( c & 63 ) ) & 1;
+}
+
+IFChargeCharSet* IFChargeCharSetCreate( NSCharacterSet* characterSet )
+{
+    IFChargeCharSet* set = calloc( 1, sizeof( IFChargeCharSet ) );
+    set->characterSet = [characterSet copy];
+    for ( unichar c = 0; c < 128; c++ )
+    {
+        if ( [set->characterSet characterIsMember:c] )
+        {
+            set->ascii[c >> 6] |= 1ULL << ( c & 63 );
+        }
+    }
+
+    set->vector = YES;
+    for ( unsigned c = 0; c < 128 && set->vector; )
+    {
+        if ( !IFCharSetHasASCII( set, c ) )
+        {
+            c++;
+            continue;
+        }
+
+        unsigned low = c;
+        while ( c < 128 && IFCharSetHasASCII( set, c ) )
+        {
+            c++;
+        }
+        if ( set->rangeCount == IF_CHARGE_CHAR_SET_MAX_RANGES )
+        {
+            set->vector = NO;
+            break;
+        }
+        set->lows[set->rangeCount]  = (uint16_t)low;
+        set->spans[set->rangeCount] = (uint16_t)( c - 1 - low );
+        set->rangeCount++;
+    }
+    return set;
+}
+
+void IFChargeCharSetFree( IFChargeCharSet* set )
+{
+    if ( set )
+    {
+        [set->characterSet release];
+        free( set );
+    }
+}
+
+#pragma -
+#pragma Scanning
+
+// Returns the number of characters at the start of chars[0..count)
+// that are ASCII and not in set: where the scan must stop and look.
+static NSUInteger IFCharSetScan( const IFChargeCharSet* set, const unichar* chars, NSUInteger count )
+{
+    NSUInteger i = 0;
+
+    // A character is let through if it's at most 0x7F and outside
+    // every range. (c - low) <= span, unsigned, is a range test in one
+    // compare; the saturating subtract stands in for the unsigned
+    // compare SSE2 lacks.
+#if defined( __AVX2__ )
+    if ( set->vector )
+    {
+        const __m256i zero  = _mm256_setzero_si256();
+        const __m256i ascii = _mm256_set1_epi16( 0x7F );
+        for ( ; i + 16 <= count; i += 16 )
+        {
+            __m256i v  = _mm256_loadu_si256( (const __m256i*)( chars + i ) );
+            __m256i ok = _mm256_cmpeq_epi16( _mm256_subs_epu16( v, ascii ), zero );
+            for ( unsigned r = 0; r < set->rangeCount; r++ )
+            {
+                __m256i offset = _mm256_sub_epi16( v, _mm256_set1_epi16( (short)set->lows[r] ) );
+                __m256i hit    = _mm256_cmpeq_epi16( _mm256_subs_epu16( offset, _mm256_set1_epi16( (short)set->spans[r] ) ), zero );
+                ok = _mm256_andnot_si256( hit, ok );
+            }
+            unsigned mask = (unsigned)_mm256_movemask_epi8( ok );
+            if ( 0xffffffffu != mask )
+            {
+                return i + __builtin_ctz( ~mask ) / 2;
+            }
+        }
+    }
+#elif defined( __SSE2__ )
+    if ( set->vector )
+    {
+        const __m128i zero  = _mm_setzero_si128();
+        const __m128i ascii = _mm_set1_epi16( 0x7F );
+        for ( ; i + 8 <= count; i += 8 )
+        {
+            __m128i v  = _mm_loadu_si128( (const __m128i*)( chars + i ) );
+            __m128i ok = _mm_cmpeq_epi16( _mm_subs_epu16( v, ascii ), zero );
+            for ( unsigned r = 0; r < set->rangeCount; r++ )
+            {
+                __m128i offset = _mm_sub_epi16( v, _mm_set1_epi16( (short)set->lows[r] ) );
+                __m128i hit    = _mm_cmpeq_epi16( _mm_subs_epu16( offset, _mm_set1_epi16( (short)set->spans[r] ) ), zero );
+                ok = _mm_andnot_si128( hit, ok );
+            }
+            int mask = _mm_movemask_epi8( ok );
+            if ( 0xffff != mask )
+            {
+                return i + __builtin_ctz( ~mask ) / 2;
+            }
+        }
+    }
+#elif defined( __ARM_NEON__ ) || defined( __ARM_NEON )
+    if ( set->vector )
+    {
+        for ( ; i + 8 <= count; i += 8 )
+        {
+            uint16x8_t v    = vld1q_u16( chars + i );
+            uint16x8_t stop = vcgtq_u16( v, vdupq_n_u16( 0x7F ) );
+            for ( unsigned r = 0; r < set->rangeCount; r++ )
+            {
+                stop = vorrq_u16( stop, vcleq_u16( vsubq_u16( v, vdupq_n_u16( set->lows[r] ) ), vdupq_n_u16( set->spans[r] ) ) );
+            }
+            uint64_t lanes = vget_lane_u64( vreinterpret_u64_u8( vmovn_u16( stop ) ), 0 );
+            if ( lanes )
+            {
+                return i + __builtin_ctzll( lanes ) / 8;
+            }
+        }
+    }
+#endif
+
+    while ( i < count && chars[i] < 0x80 && !IFCharSetHasASCII( set, chars[i] ) )
+    {
+        i++;
+    }
+    return i;
+}
+
+NSUInteger IFChargeCharSetFind( const IFChargeCharSet* set, NSString* s )
+{
+    NSUInteger length = [s length];
+    unichar buffer[IF_CHARGE_CHAR_SET_CHUNK];
+    NSUInteger position = 0;
+    while ( position < length )
+    {
+        NSUInteger count = MIN( length - position, IF_CHARGE_CHAR_SET_CHUNK );
+        [s getCharacters:buffer range:NSMakeRange( position, count )];
+
+        NSUInteger i = 0;
+        while ( i < count )
+        {
+            i += IFCharSetScan( set, buffer + i, count - i );
+            if ( i >= count )
+            {
+                break;
+            }
+
+            unichar c = buffer[i];
+            if ( c < 0x80 )
+            {
+                return position + i;
+            }
+
+            // Outside ASCII: ask the NSCharacterSet, pairing surrogates
+            // as rangeOfCharacterFromSet: does. The low half may be in
+            // the next chunk.
+            NSUInteger width = 1;
+            BOOL member;
+            unichar low = 0;
+            if ( 0xD800 == ( c & 0xFC00 ) && position + i + 1 < length )
+            {
+                low = ( i + 1 < count ) ? buffer[i + 1] : [s characterAtIndex:position + i + 1];
+            }
+            if ( 0xDC00 == ( low & 0xFC00 ) )
+            {
+                UTF32Char character = 0x10000 + ( ( (UTF32Char)c - 0xD800 ) << 10 ) + ( low - 0xDC00 );
+                member = [set->characterSet longCharacterIsMember:character];
+                width = 2;
+            }
+            else
+            {
+                member = [set->characterSet characterIsMember:c];
+            }
+            if ( member )
+            {
+                return position + i;
+            }
+            i += width;
+        }
+        position += i;
+    }
+    return NSNotFound;
+}
+
+#pragma -
+#pragma Cached Unions
+
+typedef struct IFCharSetCacheEntry
+{
+    NSUInteger       count;
+    NSCharacterSet*  sets[IF_CHARGE_CHAR_SET_CACHE_SETS]; // retained, so never reused
+    IFChargeCharSet* compiled;
+} IFCharSetCacheEntry;
+
+// Entries are only ever added: each is filled in before the count
+// that covers it is published, so lookups take no lock.
+static IFCharSetCacheEntry _cache[IF_CHARGE_CHAR_SET_CACHE_SIZE];
+static volatile NSUInteger _cacheCount;
+static pthread_mutex_t     _cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static IFChargeCharSet* IFCharSetCreateUnion( NSCharacterSet* const* sets, NSUInteger count )
+{
+    if ( 1 == count )
+    {
+        return IFChargeCharSetCreate( sets[0] );
+    }
+
+    NSMutableCharacterSet* characterSet = [sets[0] mutableCopy];
+    for ( NSUInteger index = 1; index < count; index++ )
+    {
+        [characterSet formUnionWithCharacterSet:sets[index]];
+    }
+    IFChargeCharSet* set = IFChargeCharSetCreate( characterSet );
+    [characterSet release];
+    return set;
+}
+
+static const IFChargeCharSet* IFCharSetCacheLookup( NSCharacterSet* const* sets, NSUInteger count )
+{
+    NSUInteger cacheCount = _cacheCount;
+    __sync_synchronize();
+    for ( NSUInteger entry = 0; entry < cacheCount; entry++ )
+    {
+        if ( _cache[entry].count == count && 0 == memcmp( _cache[entry].sets, sets, count * sizeof( NSCharacterSet* ) ) )
+        {
+            return _cache[entry].compiled;
+        }
+    }
+    return NULL;
+}
+
+// A set whose copy is itself can't change, so it's safe to cache by
+// identity.
+static BOOL IFCharSetIsImmutable( NSCharacterSet* set )
+{
+    NSCharacterSet* copy = [set copy];
+    [copy release];
+    return copy == set;
+}
+
+// The cached union of sets, compiled and added if there's room and
+// every set is immutable; otherwise NULL.
+static const IFChargeCharSet* IFCharSetCacheGet( NSCharacterSet* const* sets, NSUInteger count )
+{
+    const IFChargeCharSet* set = IFCharSetCacheLookup( sets, count );
+    if ( set || count > IF_CHARGE_CHAR_SET_CACHE_SETS || _cacheCount == IF_CHARGE_CHAR_SET_CACHE_SIZE )
+    {
+        return set;
+    }
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        if ( !IFCharSetIsImmutable( sets[index] ) )
+        {
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock( &_cacheLock );
+    set = IFCharSetCacheLookup( sets, count );
+    if ( NULL == set && _cacheCount < IF_CHARGE_CHAR_SET_CACHE_SIZE )
+    {
+        IFCharSetCacheEntry* entry = &_cache[_cacheCount];
+        entry->count = count;
+        for ( NSUInteger index = 0; index < count; index++ )
+        {
+            entry->sets[index] = [sets[index] retain];
+        }
+        entry->compiled = IFCharSetCreateUnion( sets, count );
+        set = entry->compiled;
+        __sync_synchronize();
+        _cacheCount++;
+    }
+    pthread_mutex_unlock( &_cacheLock );
+    return set;
+}
+
+NSUInteger IFChargeCharSetFindInSets( NSString* s, NSCharacterSet* const* sets, NSUInteger count )
+{
+    if ( 0 == count || 0 == [s length] )
+    {
+        return NSNotFound;
+    }
+
+    const IFChargeCharSet* cached = IFCharSetCacheGet( sets, count );
+    if ( cached )
+    {
+        return IFChargeCharSetFind( cached, s );
+    }
+
+    IFChargeCharSet* set = IFCharSetCreateUnion( sets, count );
+    NSUInteger location = IFChargeCharSetFind( set, s );
+    IFChargeCharSetFree( set );
+    return location;
+}
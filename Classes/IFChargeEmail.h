@@ -0,0 +1,23 @@
+// -*- objc -*-
+//
+// IFChargeEmail.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargeEmailScan - Checks whether the len bytes at s are an email
+// address in the language of emailRegEx (see IFChargeMessage.m): a
+// dot-atom or quoted local part, '@', then either a dotted domain of
+// at least two labels or a bracketed IPv4 or tagged address literal.
+// Only ASCII is accepted, and the match is case-sensitive exactly
+// where the expression is. Allocates nothing.
+extern BOOL IFChargeEmailScan( const char* s, size_t len );
+
+// IFChargeEmailIsValid - IFChargeEmailScan for an NSString. nil, empty
+// and non-ASCII strings are never valid.
+extern BOOL IFChargeEmailIsValid( NSString* s );
@@ -0,0 +1,251 @@
+//
+// IFChargeEmail.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeEmail.h"
+
+// Addresses up to this long are converted on the stack.
+#define IF_CHARGE_EMAIL_STACK_MAX 256
+
+// Character classes of emailRegEx, one bit each.
+enum
+{
+    kIFEmailAtext   = 0x01, // [a-zA-Z0-9!#$%&'*+/=?^_`{|}~-]
+    kIFEmailQtext   = 0x02, // [\x01-\x08\x0b\x0c\x0e-\x1f\x21\x23-\x5b\x5d-\x7f]
+    kIFEmailQpair   = 0x04, // [\x01-\x09\x0b\x0c\x0e-\x7f], after a backslash
+    kIFEmailLtext   = 0x08, // [\x01-\x08\x0b\x0c\x0e-\x1f\x21-\x7f]
+    kIFEmailAlnum   = 0x10, // [a-zA-Z0-9]
+    kIFEmailLower   = 0x20, // [a-z0-9-], inside a label before the last
+    kIFEmailLabel   = 0x40  // [a-zA-Z0-9-]
+};
+
+// Bytes 0x80 and up are in no class.
+static const unsigned char _classes[256] = {
+//     0     1     2     3     4     5     6     7     8     9     A     B     C     D     E     F
+    0x00, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x04, 0x00, 0x0E, 0x0E, 0x00, 0x0E, 0x0E, // 0x00
+    0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, // 0x10
+    0x04, 0x0F, 0x0C, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0E, 0x0E, 0x0F, 0x0F, 0x0E, 0x6F, 0x0E, 0x0F, // 0x20
+    0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x0E, 0x0E, 0x0E, 0x0F, 0x0E, 0x0F, // 0x30
+    0x0E, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, // 0x40
+    0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x5F, 0x0E, 0x0C, 0x0E, 0x0F, 0x0F, // 0x50
+    0x0F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, // 0x60
+    0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0E, // 0x70
+};
+
+#define IF_EMAIL_IS( c, cls ) ( 0 != ( _classes[(unsigned char)( c )] & ( cls ) ) )
+#define IF_EMAIL_IS_DIGIT( c ) ( (unsigned char)( ( c ) - '0' ) < 10 )
+
+#pragma -
+#pragma Local Part
+
+// Scans a dot-atom or quoted local part, returning the byte after it,
+// or NULL if there isn't one.
+static const unsigned char* IFScanLocalPart( const unsigned char* p, const unsigned char* end )
+{
+    if ( p < end && '"' == *p )
+    {
+        for ( p++; p < end; p++ )
+        {
+            if ( '"' == *p )
+            {
+                return p + 1;
+            }
+            if ( '\\' == *p )
+            {
+                if ( ++p == end || !IF_EMAIL_IS( *p, kIFEmailQpair ) )
+                {
+                    return NULL;
+                }
+            }
+            else if ( !IF_EMAIL_IS( *p, kIFEmailQtext ) )
+            {
+                return NULL;
+            }
+        }
+        return NULL; // unterminated
+    }
+
+    for ( ;; )
+    {
+        const unsigned char* atom = p;
+        while ( p < end && IF_EMAIL_IS( *p, kIFEmailAtext ) )
+        {
+            p++;
+        }
+        if ( p == atom )
+        {
+            return NULL;
+        }
+        if ( p == end || '.' != *p )
+        {
+            return p;
+        }
+        p++;
+    }
+}
+
+#pragma -
+#pragma Domain
+
+// A dotted domain running to end. Every label starts and ends with a
+// letter or digit; the expression only allows capitals inside the
+// last one.
+static BOOL IFScanDomain( const unsigned char* p, const unsigned char* end )
+{
+    NSUInteger labelCount = 0;
+    for ( ;; )
+    {
+        const unsigned char* label = p;
+        while ( p < end && IF_EMAIL_IS( *p, kIFEmailLabel ) )
+        {
+            p++;
+        }
+        if ( p == label || !IF_EMAIL_IS( label[0], kIFEmailAlnum ) || !IF_EMAIL_IS( p[-1], kIFEmailAlnum ) )
+        {
+            return NO;
+        }
+        labelCount++;
+
+        if ( p == end || '.' != *p )
+        {
+            return ( p == end && labelCount >= 2 );
+        }
+        for ( const unsigned char* q = label + 1; q < p - 1; q++ )
+        {
+            if ( !IF_EMAIL_IS( *q, kIFEmailLower ) )
+            {
+                return NO;
+            }
+        }
+        p++;
+    }
+}
+
+// An octet is one or two digits, or three making at most 255.
+static BOOL IFIsOctet( const unsigned char* p, const unsigned char* end )
+{
+    size_t len = end - p;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( !IF_EMAIL_IS_DIGIT( p[i] ) )
+        {
+            return NO;
+        }
+    }
+    if ( 3 == len )
+    {
+        return ( ( p[0] - '0' ) * 100 + ( p[1] - '0' ) * 10 + ( p[2] - '0' ) ) <= 255;
+    }
+    return ( 1 == len || 2 == len );
+}
+
+// The inside of a bracketed literal: three octets and dots, then an
+// octet or a tag, ':' and content. A tab or space in the content must
+// be escaped by the backslash before it.
+static BOOL IFScanDomainLiteral( const unsigned char* p, const unsigned char* end )
+{
+    for ( int i = 0; i < 3; i++ )
+    {
+        const unsigned char* octet = p;
+        while ( p < end && '.' != *p )
+        {
+            p++;
+        }
+        if ( p == end || !IFIsOctet( octet, p ) )
+        {
+            return NO;
+        }
+        p++;
+    }
+
+    if ( p == end || ']' != end[-1] )
+    {
+        return NO;
+    }
+    end--;
+    if ( IFIsOctet( p, end ) )
+    {
+        return YES;
+    }
+
+    const unsigned char* tag = p;
+    while ( p < end && IF_EMAIL_IS( *p, kIFEmailLabel ) )
+    {
+        p++;
+    }
+    if ( p == tag || p == end || ':' != *p || !IF_EMAIL_IS( p[-1], kIFEmailAlnum ) )
+    {
+        return NO;
+    }
+
+    const unsigned char* content = ++p;
+    if ( p == end )
+    {
+        return NO;
+    }
+    for ( ; p < end; p++ )
+    {
+        if ( !IF_EMAIL_IS( *p, kIFEmailLtext ) &&
+             !( ( '\t' == *p || ' ' == *p ) && p > content && '\\' == p[-1] ) )
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+#pragma -
+#pragma Addresses
+
+BOOL IFChargeEmailScan( const char* s, size_t len )
+{
+    const unsigned char* p   = (const unsigned char*)s;
+    const unsigned char* end = p + len;
+
+    p = IFScanLocalPart( p, end );
+    if ( NULL == p || p == end || '@' != *p++ )
+    {
+        return NO;
+    }
+    if ( p < end && '[' == *p )
+    {
+        return IFScanDomainLiteral( p + 1, end );
+    }
+    return IFScanDomain( p, end );
+}
+
+BOOL IFChargeEmailIsValid( NSString* s )
+{
+    NSUInteger length = [s length];
+    if ( 0 == length )
+    {
+        return NO;
+    }
+
+    // Every accepted character is ASCII, so the conversion stops short
+    // (leaving a remaining range) exactly when the address can't match.
+    char stackBuffer[IF_CHARGE_EMAIL_STACK_MAX];
+    char* buffer = ( length <= sizeof( stackBuffer ) ) ? stackBuffer : malloc( length );
+    if ( NULL == buffer )
+    {
+        return NO;
+    }
+
+    NSUInteger usedLength = 0;
+    NSRange remaining = NSMakeRange( 0, 0 );
+    BOOL valid = [s getBytes:buffer maxLength:length usedLength:&usedLength encoding:NSASCIIStringEncoding
+                     options:0 range:NSMakeRange( 0, length ) remainingRange:&remaining]
+        && 0 == remaining.length
+        && IFChargeEmailScan( buffer, usedLength );
+
+    if ( buffer != stackBuffer )
+    {
+        free( buffer );
+    }
+    return valid;
+}
@@ -0,0 +1,35 @@
+// -*- objc -*-
+//
+// IFChargeFieldArena.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargeFieldArena - Immutable ASCII strings made in one allocation,
+// which holds the string objects as well as their bytes. They're
+// ordinary NSStrings to everyone else: retaining any one of them keeps
+// the whole arena, and it's freed when the last is released. Copying
+// one just retains it.
+//
+// IFChargeQueryParse puts every ASCII value of a URL in one arena,
+// rather than allocating a string per value, and -compactFields does
+// the same for the fields a message already has.
+
+// IFChargeFieldArenaCreateStrings - Makes count strings, the i'th from
+// the lengths[i] bytes at bytes[i], which must pass
+// IFChargeFieldFitsArena, and stores them in strings. The caller owns
+// each string.
+extern void IFChargeFieldArenaCreateStrings( NSUInteger count, const char* const* bytes, const size_t* lengths, NSString** strings );
+
+// IFChargeFieldArenaContains - YES if s is an arena string.
+extern BOOL IFChargeFieldArenaContains( NSString* s );
+
+// IFChargeFieldFitsArena - YES if the length bytes at bytes can make an
+// arena string: none has the high bit set, and none is NUL. An arena
+// string's -UTF8String is its bytes, so a NUL would cut it short.
+extern BOOL IFChargeFieldFitsArena( const char* bytes, size_t length );
@@ -0,0 +1,263 @@
+//
+// IFChargeFieldArena.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeFieldArena.h"
+#import <objc/runtime.h>
+
+// Strings are placed on this boundary within the arena.
+#define IF_ARENA_ALIGNMENT 16
+
+#define IF_ARENA_ALIGN( n ) ( ( (n) + IF_ARENA_ALIGNMENT - 1 ) & ~(size_t)( IF_ARENA_ALIGNMENT - 1 ) )
+
+// IFChargeFieldArena - The allocation. Its indexed ivars hold count
+// IFChargeArenaStrings, then their NUL-terminated bytes.
+@interface IFChargeFieldArena : NSObject
+{
+@public
+    NSUInteger _count;
+    char*      _strings;
+    size_t     _stringSize;
+}
+@end
+
+// IFChargeArenaString - A string living in an arena. It has no retain
+// count of its own: it's retained and released by retaining and
+// releasing its arena, which holds one reference for every reference
+// to any of its strings.
+@interface IFChargeArenaString : NSString
+{
+@public
+    IFChargeFieldArena* _arena;
+    const char*         _bytes;
+    NSUInteger          _length;
+}
+@end
+
+@implementation IFChargeFieldArena
+
+- (void)dealloc
+{
+#if !defined( GNUSTEP )
+    for ( NSUInteger index = 0; index < _count; index++ )
+    {
+        objc_destructInstance( (id)( _strings + index * _stringSize ) );
+    }
+#endif
+    [super dealloc];
+}
+
+@end
+
+@implementation IFChargeArenaString
+
+- (id)retain
+{
+    [_arena retain];
+    return self;
+}
+
+- (oneway void)release
+{
+    [_arena release];
+}
+
+- (NSUInteger)retainCount
+{
+    return [_arena retainCount];
+}
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    return [self retain];
+}
+
+- (NSUInteger)length
+{
+    return _length;
+}
+
+- (unichar)characterAtIndex:(NSUInteger)index
+{
+    if ( index >= _length )
+    {
+        [NSException raise:NSRangeException format:@"Index %lu out of bounds", (unsigned long)index];
+    }
+    return (unsigned char)_bytes[index];
+}
+
+- (void)getCharacters:(unichar*)buffer range:(NSRange)range
+{
+    if ( range.location > _length || range.length > _length - range.location )
+    {
+        [NSException raise:NSRangeException format:@"Range %@ out of bounds", NSStringFromRange( range )];
+    }
+    const unsigned char* bytes = (const unsigned char*)_bytes + range.location;
+    for ( NSUInteger index = 0; index < range.length; index++ )
+    {
+        buffer[index] = bytes[index];
+    }
+}
+
+// The bytes are ASCII, and so UTF-8 too, and NUL-terminated with no
+// NUL before the end, so the conversions the library makes are copies
+// or nothing at all.
+
+- (const char*)UTF8String
+{
+    return _bytes;
+}
+
+- (NSStringEncoding)fastestEncoding
+{
+    return NSASCIIStringEncoding;
+}
+
+- (NSStringEncoding)smallestEncoding
+{
+    return NSASCIIStringEncoding;
+}
+
+- (NSUInteger)lengthOfBytesUsingEncoding:(NSStringEncoding)encoding
+{
+    if ( NSASCIIStringEncoding == encoding || NSUTF8StringEncoding == encoding )
+    {
+        return _length;
+    }
+    return [super lengthOfBytesUsingEncoding:encoding];
+}
+
+- (BOOL)getCString:(char*)buffer maxLength:(NSUInteger)maxLength encoding:(NSStringEncoding)encoding
+{
+    if ( NSASCIIStringEncoding == encoding || NSUTF8StringEncoding == encoding )
+    {
+        if ( _length >= maxLength )
+        {
+            return NO;
+        }
+        memcpy( buffer, _bytes, _length + 1 );
+        return YES;
+    }
+    return [super getCString:buffer maxLength:maxLength encoding:encoding];
+}
+
+- (BOOL)getBytes:(void*)buffer
+       maxLength:(NSUInteger)maxLength
+      usedLength:(NSUInteger*)usedLength
+        encoding:(NSStringEncoding)encoding
+         options:(NSStringEncodingConversionOptions)options
+           range:(NSRange)range
+  remainingRange:(NSRangePointer)remainingRange
+{
+    if ( NSASCIIStringEncoding != encoding && NSUTF8StringEncoding != encoding )
+    {
+        return [super getBytes:buffer maxLength:maxLength usedLength:usedLength encoding:encoding
+                       options:options range:range remainingRange:remainingRange];
+    }
+    if ( range.location > _length || range.length > _length - range.location )
+    {
+        [NSException raise:NSRangeException format:@"Range %@ out of bounds", NSStringFromRange( range )];
+    }
+
+    // As with NSString, maxLength doesn't apply without a buffer.
+    NSUInteger length = buffer ? MIN( range.length, maxLength ) : range.length;
+    if ( buffer )
+    {
+        memcpy( buffer, _bytes + range.location, length );
+    }
+    if ( usedLength )
+    {
+        *usedLength = length;
+    }
+    if ( remainingRange )
+    {
+        *remainingRange = NSMakeRange( range.location + length, range.length - length );
+    }
+    return length > 0 || 0 == range.length;
+}
+
+@end
+
+void IFChargeFieldArenaCreateStrings( NSUInteger count, const char* const* bytes, const size_t* lengths, NSString** strings )
+{
+    if ( 0 == count )
+    {
+        return;
+    }
+
+    Class stringClass = [IFChargeArenaString class];
+    size_t stringSize = IF_ARENA_ALIGN( class_getInstanceSize( stringClass ) );
+    size_t size = IF_ARENA_ALIGNMENT + count * stringSize;
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        size += lengths[index] + 1;
+    }
+
+    // NSAllocateObject zeroes the memory, as placing an object needs.
+    IFChargeFieldArena* arena = NSAllocateObject( [IFChargeFieldArena class], size, NULL );
+    arena->_strings    = (char*)IF_ARENA_ALIGN( (uintptr_t)object_getIndexedIvars( arena ) );
+    arena->_stringSize = stringSize;
+
+    char* out = arena->_strings + count * stringSize;
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        void* place = arena->_strings + index * stringSize;
+#if defined( GNUSTEP )
+        // A libobjc2 object is just its isa and ivars.
+        object_setClass( (id)place, stringClass );
+        IFChargeArenaString* string = (IFChargeArenaString*)place;
+#else
+        IFChargeArenaString* string = objc_constructInstance( stringClass, place );
+#endif
+        memcpy( out, bytes[index], lengths[index] );
+        out[lengths[index]] = '\0';
+
+        string->_arena  = arena;
+        string->_bytes  = out;
+        string->_length = lengths[index];
+        strings[index]  = string;
+        out += lengths[index] + 1;
+
+        // The arena starts with the first string's reference.
+        arena->_count = index + 1;
+        if ( index > 0 )
+        {
+            [arena retain];
+        }
+    }
+}
+
+BOOL IFChargeFieldArenaContains( NSString* s )
+{
+    return [s isKindOfClass:[IFChargeArenaString class]];
+}
+
+BOOL IFChargeFieldFitsArena( const char* bytes, size_t length )
+{
+    // Eight bytes at a time; memcpy keeps the loads unaligned-safe.
+    // With no high bits set, a byte is 0 just when subtracting 1 from
+    // it borrows into its high bit.
+    size_t index = 0;
+    for ( ; index + 8 <= length; index += 8 )
+    {
+        uint64_t word;
+        memcpy( &word, bytes + index, sizeof( word ) );
+        if ( ( word | ( word - 0x0101010101010101ULL ) ) & 0x8080808080808080ULL )
+        {
+            return NO;
+        }
+    }
+    for ( ; index < length; index++ )
+    {
+        if ( ( bytes[index] & 0x80 ) || '\0' == bytes[index] )
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
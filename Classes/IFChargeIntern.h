@@ -0,0 +1,46 @@
+// -*- objc -*-
+//
+// IFChargeIntern.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargeIntern - One shared string for each value a field with a
+// small vocabulary takes: the response types, the common ISO 4217
+// currency codes and the card brand names. A field read from a URL or
+// from wire data whose value is in the table gets the shared instance
+// instead of a string of its own, so reading a known currency, card
+// type or response type allocates nothing. Shared strings are never
+// freed.
+//
+// The table only grows. Lookups take no lock and may be made from any
+// thread, as may additions.
+
+// The most bytes an interned string may have, and the most strings.
+#define IF_CHARGE_INTERN_MAX_LENGTH 31
+#define IF_CHARGE_INTERN_CAPACITY   128
+
+// IFChargeInternLookup - The shared string whose UTF-8 form is the
+// length bytes at bytes, or nil if there isn't one.
+extern NSString* IFChargeInternLookup( const char* bytes, size_t length );
+
+// IFChargeInternString - The shared string equal to s, or nil if there
+// isn't one.
+extern NSString* IFChargeInternString( NSString* s );
+
+// IFChargeInternAdd - Adds s to the table, if an equal string isn't
+// there already, and returns the shared string. Returns nil, adding
+// nothing, if s isn't ASCII, is longer than
+// IF_CHARGE_INTERN_MAX_LENGTH, or the table is full. An app that takes
+// payments in a currency the table doesn't know may add it once at
+// launch.
+extern NSString* IFChargeInternAdd( NSString* s );
+
+// IFChargeInternCopy - -copy, but returning the shared string equal to
+// s (retained) when there is one.
+extern NSString* IFChargeInternCopy( NSString* s );
@@ -0,0 +1,189 @@
+//
+// IFChargeIntern.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeIntern.h"
+#import "IFChargeCard.h"
+#import "IFChargeFieldArena.h"
+
+#include <pthread.h>
+#include <string.h>
+
+// Open addressing, kept at most half full so a probe ends quickly.
+#define IF_CHARGE_INTERN_BUCKETS ( 2 * IF_CHARGE_INTERN_CAPACITY )
+
+// The currencies seeded into the table: the ones Credit Card Terminal's
+// merchants most often charge in.
+static NSString* const _currencies[] = {
+    @"USD", @"CAD", @"EUR", @"GBP", @"AUD", @"NZD", @"JPY", @"CHF",
+    @"SEK", @"NOK", @"DKK", @"MXN", @"BRL", @"HKD", @"SGD", @"CNY",
+    @"INR", @"ZAR", @"PLN", @"CZK", @"HUF", @"ILS", @"KRW", @"TWD",
+    @"THB", @"MYR", @"PHP", @"IDR", @"AED", @"SAR", @"TRY", @"RUB",
+};
+
+typedef struct IFInternEntry
+{
+    size_t    length;
+    char      bytes[IF_CHARGE_INTERN_MAX_LENGTH];
+    NSString* string;
+} IFInternEntry;
+
+// Entries are only ever added: each is filled in, and its bucket set,
+// before the count that covers it is published, so lookups take no
+// lock. A bucket holds an entry index plus one, or 0 if empty.
+static IFInternEntry     _entries[IF_CHARGE_INTERN_CAPACITY];
+static volatile uint16_t _buckets[IF_CHARGE_INTERN_BUCKETS];
+static volatile NSUInteger _count;
+static pthread_mutex_t   _lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t    _seedOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t IFInternHash( const char* bytes, size_t length )
+{
+    // FNV-1a, as the field tables use.
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        h = ( h ^ (unsigned char)bytes[i] ) * 16777619u;
+    }
+    return h ^ ( h >> 16 );
+}
+
+static NSString* IFInternFind( const char* bytes, size_t length )
+{
+    NSUInteger count = _count;
+    __sync_synchronize();
+    for ( uint32_t bucket = IFInternHash( bytes, length ); ; bucket++ )
+    {
+        uint16_t slot = _buckets[bucket % IF_CHARGE_INTERN_BUCKETS];
+        if ( 0 == slot )
+        {
+            return nil;
+        }
+
+        // An entry added since count was read isn't looked at yet, but
+        // an older one may be further along.
+        const IFInternEntry* entry = &_entries[slot - 1];
+        if ( slot <= count && entry->length == length && 0 == memcmp( entry->bytes, bytes, length ) )
+        {
+            return entry->string;
+        }
+    }
+}
+
+// Adds string, whose bytes are given, unless an equal one is there
+// already; returns the shared one. string is retained if it's added.
+static NSString* IFInternInsert( const char* bytes, size_t length, NSString* string )
+{
+    pthread_mutex_lock( &_lock );
+    NSString* shared = IFInternFind( bytes, length );
+    if ( nil == shared && _count < IF_CHARGE_INTERN_CAPACITY )
+    {
+        IFInternEntry* entry = &_entries[_count];
+        entry->length = length;
+        memcpy( entry->bytes, bytes, length );
+        entry->string = [string retain];
+        shared = entry->string;
+
+        uint32_t bucket = IFInternHash( bytes, length );
+        while ( 0 != _buckets[bucket % IF_CHARGE_INTERN_BUCKETS] )
+        {
+            bucket++;
+        }
+        _buckets[bucket % IF_CHARGE_INTERN_BUCKETS] = (uint16_t)( _count + 1 );
+        __sync_synchronize();
+        _count++;
+    }
+    pthread_mutex_unlock( &_lock );
+    return shared;
+}
+
+// Copies the ASCII form of s, with no NULs, into buffer; the length,
+// or -1 if there isn't one that fits.
+static long IFInternGetBytes( NSString* s, char* buffer )
+{
+    NSUInteger length = [s length];
+    if ( 0 == length || length > IF_CHARGE_INTERN_MAX_LENGTH ||
+         ![s getCString:buffer maxLength:IF_CHARGE_INTERN_MAX_LENGTH + 1 encoding:NSASCIIStringEncoding] ||
+         strlen( buffer ) != length )
+    {
+        return -1;
+    }
+    return (long)length;
+}
+
+static NSString* IFInternAddUnseeded( NSString* s )
+{
+    char buffer[IF_CHARGE_INTERN_MAX_LENGTH + 1];
+    long length = IFInternGetBytes( s, buffer );
+    if ( length < 0 )
+    {
+        return nil;
+    }
+
+    NSString* shared = IFInternFind( buffer, length );
+    if ( shared )
+    {
+        return shared;
+    }
+
+    // A literal is its own copy, and already immortal. An arena string
+    // would keep its whole arena, so it gets a string of its own.
+    NSString* string = [s copy];
+    if ( IFChargeFieldArenaContains( string ) )
+    {
+        [string release];
+        string = [[NSString alloc] initWithBytes:buffer length:length encoding:NSASCIIStringEncoding];
+    }
+    shared = IFInternInsert( buffer, length, string );
+    [string release];
+    return shared;
+}
+
+static void IFInternSeed( void )
+{
+    for ( NSUInteger index = 0; index < sizeof( _currencies ) / sizeof( _currencies[0] ); index++ )
+    {
+        IFInternAddUnseeded( _currencies[index] );
+    }
+    for ( IFChargeCardBrand brand = kIFChargeCardVisa; brand <= kIFChargeCardMaestro; brand++ )
+    {
+        IFInternAddUnseeded( IFChargeCardBrandName( brand ) );
+    }
+}
+
+#pragma -
+#pragma Interning
+
+NSString* IFChargeInternLookup( const char* bytes, size_t length )
+{
+    pthread_once( &_seedOnce, IFInternSeed );
+    if ( 0 == length || length > IF_CHARGE_INTERN_MAX_LENGTH )
+    {
+        return nil;
+    }
+    return IFInternFind( bytes, length );
+}
+
+NSString* IFChargeInternString( NSString* s )
+{
+    char buffer[IF_CHARGE_INTERN_MAX_LENGTH + 1];
+    long length = IFInternGetBytes( s, buffer );
+    return ( length < 0 ) ? nil : IFChargeInternLookup( buffer, length );
+}
+
+NSString* IFChargeInternAdd( NSString* s )
+{
+    pthread_once( &_seedOnce, IFInternSeed );
+    return IFInternAddUnseeded( s );
+}
+
+NSString* IFChargeInternCopy( NSString* s )
+{
+    NSString* shared = IFChargeInternString( s );
+    return shared ? [shared retain] : [s copy];
+}
@@ -0,0 +1,101 @@
+// -*- objc -*-
+//
+// IFChargeJournal.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeNonce.h"
+#import "IFChargeResponse.h"
+
+// IFChargeJournal - A permanent record of every charge response an
+// app has handled, for reconciliation. Entries are fixed-size records
+// appended to a memory-mapped log and never rewritten. They're
+// indexed by record_id and by nonce, so either lookup is one hash
+// probe however long the journal grows.
+//
+// An appended entry survives the app being terminated at once, and
+// survives the device losing power once it's been synced. Syncs by
+// several threads at once share one fsync. Opening a journal replays
+// the log, dropping any record torn by a crash. A journal may be used
+// from any thread.
+typedef struct IFChargeJournal IFChargeJournal;
+
+// The shared journal's log, in the app's Library directory.
+#define IF_CHARGE_JOURNAL_FILE @"IFChargeJournal.log"
+
+// The longest strings, in UTF-8 bytes, an entry holds.
+#define IF_CHARGE_JOURNAL_CURRENCY_MAX    3
+#define IF_CHARGE_JOURNAL_CARD_NUMBER_MAX 23
+#define IF_CHARGE_JOURNAL_CARD_TYPE_MAX   23
+#define IF_CHARGE_JOURNAL_RECORD_ID_MAX   63
+
+// IFChargeJournalEntry - One handled response. The strings are
+// NUL-terminated and empty when the response didn't have the field.
+// This is also the layout of an entry in the log.
+typedef struct IFChargeJournalEntry
+{
+    int32_t        responseCode;  // an IFChargeResponseCode
+    int32_t        reserved;
+    int64_t        amount;        // in the currency's minor units
+    NSTimeInterval timestamp;     // since the reference date
+    char           currency[IF_CHARGE_JOURNAL_CURRENCY_MAX + 1];
+    char           redactedCardNumber[IF_CHARGE_JOURNAL_CARD_NUMBER_MAX + 1];
+    char           cardType[IF_CHARGE_JOURNAL_CARD_TYPE_MAX + 1];
+    char           recordId[IF_CHARGE_JOURNAL_RECORD_ID_MAX + 1];
+    char           nonce[IF_CHARGE_NONCE_LENGTH + 1];
+} IFChargeJournalEntry;
+
+// IFChargeJournalOpen - Opens (creating if need be) the journal logged
+// at path, replaying it to rebuild the indexes. If path is nil, or its
+// log can't be mapped, the journal is kept only in memory; the latter
+// is logged. Never returns NULL.
+extern IFChargeJournal* IFChargeJournalOpen( NSString* path );
+
+// IFChargeJournalClose - Syncs and unmaps the log and frees the
+// journal.
+extern void IFChargeJournalClose( IFChargeJournal* journal );
+
+// IFChargeJournalShared - The journal logged to IF_CHARGE_JOURNAL_FILE.
+extern IFChargeJournal* IFChargeJournalShared( void );
+
+// IFChargeJournalAppend - Adds a copy of entry to the journal and
+// returns its sequence number, counting from 1, to pass to
+// IFChargeJournalSync. Returns 0 if the log couldn't be grown.
+extern uint64_t IFChargeJournalAppend( IFChargeJournal* journal, const IFChargeJournalEntry* entry );
+
+// IFChargeJournalAppendResponse - Appends an entry for response, with
+// the amount converted to minor units of its currency (USD if unset),
+// its record_id extra param and the current time. Returns 0, appending
+// nothing, if a field is too long for an entry.
+extern uint64_t IFChargeJournalAppendResponse( IFChargeJournal* journal, IFChargeResponse* response );
+
+// IFChargeJournalSync - Waits until the entries up to and including
+// sequence are on disk. Threads syncing at the same time are covered
+// by a single fsync. Returns NO if the fsync failed.
+extern BOOL IFChargeJournalSync( IFChargeJournal* journal, uint64_t sequence );
+
+// IFChargeJournalCount - The number of entries in the journal.
+extern uint64_t IFChargeJournalCount( IFChargeJournal* journal );
+
+// IFChargeJournalEntryAt - Copies the entry with the given sequence
+// number into *entry. Returns NO if there isn't one.
+extern BOOL IFChargeJournalEntryAt( IFChargeJournal* journal, uint64_t sequence, IFChargeJournalEntry* entry );
+
+// IFChargeJournalFindRecordId - Copies the latest entry for recordId
+// into *entry. Returns NO if there isn't one.
+extern BOOL IFChargeJournalFindRecordId( IFChargeJournal* journal, NSString* recordId, IFChargeJournalEntry* entry );
+
+// IFChargeJournalFindNonce - Copies the latest entry for nonce into
+// *entry. Returns NO if there isn't one.
+extern BOOL IFChargeJournalFindNonce( IFChargeJournal* journal, NSString* nonce, IFChargeJournalEntry* entry );
+
+// IFChargeJournalHistory - Copies up to maxCount entries for recordId
+// into entries, newest first (a declined charge may be retried), and
+// returns how many there were.
+extern NSUInteger IFChargeJournalHistory( IFChargeJournal* journal, NSString* recordId,
+                                          IFChargeJournalEntry* entries, NSUInteger maxCount );
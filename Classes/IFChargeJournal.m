@@ -0,0 +1,606 @@
+//
+// IFChargeJournal.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeJournal.h"
+#import "IFChargeMoney.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IF_JOURNAL_LOG_MAGIC       0x4A434649 // "IFCJ"
+#define IF_JOURNAL_LOG_VERSION     1
+#define IF_JOURNAL_LOG_MIN_SIZE    ( 1024 * 1024 )
+#define IF_JOURNAL_LOG_MAX_GROWTH  ( 64 * 1024 * 1024 )
+#define IF_JOURNAL_INDEX_MIN       1024
+
+// The log is a header followed by fixed-size records, numbered from 1.
+// A record's type is written last, after a barrier, so a record torn
+// by the app being killed reads as the end of the log. The checksum
+// catches one torn by the device losing power, when pages may reach
+// the disk in any order.
+typedef struct IFChargeJournalHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+} IFChargeJournalHeader;
+
+enum
+{
+    kIFJournalRecordEnd   = 0,
+    kIFJournalRecordEntry = 1
+};
+
+typedef struct IFChargeJournalRecord
+{
+    uint32_t             type;
+    uint32_t             checksum; // of everything after it
+    uint32_t             previous; // the last record with the same recordId, or 0
+    uint32_t             reserved;
+    IFChargeJournalEntry entry;
+} IFChargeJournalRecord;
+
+// A slot in an open-addressed index. sequence is 0 for an empty slot;
+// tag is the high half of the key's hash, checked before the key.
+typedef struct IFChargeJournalSlot
+{
+    uint32_t tag;
+    uint32_t sequence;
+} IFChargeJournalSlot;
+
+// An index from one of an entry's strings to the latest record with
+// it. capacity is a power of two, kept at least twice count.
+typedef struct IFChargeJournalIndex
+{
+    size_t               keyOffset; // in IFChargeJournalEntry
+    IFChargeJournalSlot* slots;
+    NSUInteger           capacity;
+    NSUInteger           count;
+} IFChargeJournalIndex;
+
+struct IFChargeJournal
+{
+    // Held for reading by lookups and for writing by appends.
+    pthread_rwlock_t      lock;
+
+    // The log. fd is -1 for a journal kept only in memory.
+    char*                 path;
+    int                   fd;
+    unsigned char*        map;
+    size_t                mapSize;
+    volatile uint32_t     count;
+
+    IFChargeJournalIndex  recordIds;
+    IFChargeJournalIndex  nonces;
+
+    // Group commit: one thread at a time fsyncs, covering everything
+    // appended when it started; the rest wait for it.
+    pthread_mutex_t       syncLock;
+    pthread_cond_t        syncDone;
+    uint64_t              syncedCount;
+    BOOL                  syncing;
+};
+
+#define IF_JOURNAL_RECORD( journal, sequence ) \
+    ( (IFChargeJournalRecord*)( (journal)->map + sizeof( IFChargeJournalHeader ) + \
+                                ( (size_t)(sequence) - 1 ) * sizeof( IFChargeJournalRecord ) ) )
+
+#define IF_JOURNAL_KEY( journal, index, sequence ) \
+    ( (const char*)&IF_JOURNAL_RECORD( journal, sequence )->entry + (index)->keyOffset )
+
+static uint64_t IFJournalHash( const char* key, size_t length )
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( size_t i = 0; i < length; i++ )
+    {
+        h = ( h ^ (unsigned char)key[i] ) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t IFJournalChecksum( const IFChargeJournalRecord* record )
+{
+    const unsigned char* p   = (const unsigned char*)&record->previous;
+    const unsigned char* end = (const unsigned char*)( record + 1 );
+    uint32_t h = 0x811c9dc5;
+    for ( ; p < end; p++ )
+    {
+        h = ( h ^ *p ) * 0x01000193;
+    }
+    return h;
+}
+
+#pragma -
+#pragma Indexes
+
+static IFChargeJournalSlot* IFJournalIndexFind( IFChargeJournal* journal, IFChargeJournalIndex* index,
+                                                const char* key, size_t length, uint64_t hash )
+{
+    NSUInteger mask = index->capacity - 1;
+    uint32_t tag = (uint32_t)( hash >> 32 );
+    for ( NSUInteger i = (NSUInteger)hash & mask; ; i = ( i + 1 ) & mask )
+    {
+        IFChargeJournalSlot* slot = &index->slots[i];
+        if ( 0 == slot->sequence )
+        {
+            return NULL;
+        }
+        if ( tag == slot->tag )
+        {
+            const char* slotKey = IF_JOURNAL_KEY( journal, index, slot->sequence );
+            if ( 0 == memcmp( slotKey, key, length ) && '\0' == slotKey[length] )
+            {
+                return slot;
+            }
+        }
+    }
+}
+
+static IFChargeJournalSlot* IFJournalIndexEmptySlot( IFChargeJournalSlot* slots, NSUInteger capacity, uint64_t hash )
+{
+    NSUInteger mask = capacity - 1;
+    NSUInteger i = (NSUInteger)hash & mask;
+    while ( 0 != slots[i].sequence )
+    {
+        i = ( i + 1 ) & mask;
+    }
+    return &slots[i];
+}
+
+static void IFJournalIndexInit( IFChargeJournalIndex* index, size_t keyOffset )
+{
+    index->keyOffset = keyOffset;
+    index->capacity  = IF_JOURNAL_INDEX_MIN;
+    index->count     = 0;
+    index->slots     = calloc( index->capacity, sizeof( IFChargeJournalSlot ) );
+}
+
+// Doubles the index, rehashing each key from its record.
+static void IFJournalIndexGrow( IFChargeJournal* journal, IFChargeJournalIndex* index )
+{
+    NSUInteger capacity = index->capacity * 2;
+    IFChargeJournalSlot* slots = calloc( capacity, sizeof( IFChargeJournalSlot ) );
+    for ( NSUInteger i = 0; i < index->capacity; i++ )
+    {
+        uint32_t sequence = index->slots[i].sequence;
+        if ( sequence )
+        {
+            const char* key = IF_JOURNAL_KEY( journal, index, sequence );
+            uint64_t hash = IFJournalHash( key, strlen( key ) );
+            *IFJournalIndexEmptySlot( slots, capacity, hash ) = index->slots[i];
+        }
+    }
+    free( index->slots );
+    index->slots    = slots;
+    index->capacity = capacity;
+}
+
+// Points the record's key at it, returning the record it pointed at
+// before, or 0. Empty keys aren't indexed.
+static uint32_t IFJournalIndexSet( IFChargeJournal* journal, IFChargeJournalIndex* index, uint32_t sequence )
+{
+    const char* key = IF_JOURNAL_KEY( journal, index, sequence );
+    size_t length = strlen( key );
+    if ( 0 == length )
+    {
+        return 0;
+    }
+
+    uint64_t hash = IFJournalHash( key, length );
+    IFChargeJournalSlot* slot = IFJournalIndexFind( journal, index, key, length, hash );
+    if ( slot )
+    {
+        uint32_t previous = slot->sequence;
+        slot->sequence = sequence;
+        return previous;
+    }
+
+    if ( ( index->count + 1 ) * 2 > index->capacity )
+    {
+        IFJournalIndexGrow( journal, index );
+    }
+    slot = IFJournalIndexEmptySlot( index->slots, index->capacity, hash );
+    slot->tag      = (uint32_t)( hash >> 32 );
+    slot->sequence = sequence;
+    index->count++;
+    return 0;
+}
+
+// Looks up an NSString key, returning its latest record or 0. Called
+// with the lock held.
+static uint32_t IFJournalIndexGet( IFChargeJournal* journal, IFChargeJournalIndex* index, NSString* key, size_t maxLength )
+{
+    char bytes[IF_CHARGE_JOURNAL_RECORD_ID_MAX + 1];
+    NSUInteger length = 0;
+    NSRange remaining = NSMakeRange( 0, 0 );
+    if ( 0 == [key length] ||
+         ![key getBytes:bytes maxLength:maxLength usedLength:&length encoding:NSUTF8StringEncoding
+                options:0 range:NSMakeRange( 0, [key length] ) remainingRange:&remaining] ||
+         0 != remaining.length )
+    {
+        return 0;
+    }
+
+    IFChargeJournalSlot* slot = IFJournalIndexFind( journal, index, bytes, length, IFJournalHash( bytes, length ) );
+    return slot ? slot->sequence : 0;
+}
+
+#pragma -
+#pragma Log
+
+static void IFJournalResetLog( IFChargeJournal* journal )
+{
+    memset( journal->map, 0, journal->mapSize );
+    IFChargeJournalHeader* header = (IFChargeJournalHeader*)journal->map;
+    header->magic      = IF_JOURNAL_LOG_MAGIC;
+    header->version    = IF_JOURNAL_LOG_VERSION;
+    header->recordSize = sizeof( IFChargeJournalRecord );
+    journal->count = 0;
+}
+
+// Maps mapSize bytes of the log, growing the file to match. The
+// contents of a memory-only log are copied over.
+static BOOL IFJournalMap( IFChargeJournal* journal, size_t mapSize )
+{
+    if ( journal->fd >= 0 && 0 != ftruncate( journal->fd, mapSize ) )
+    {
+        return NO;
+    }
+    unsigned char* map = mmap( NULL, mapSize, PROT_READ | PROT_WRITE,
+                               journal->fd >= 0 ? MAP_SHARED : ( MAP_PRIVATE | MAP_ANON ), journal->fd, 0 );
+    if ( MAP_FAILED == map )
+    {
+        return NO;
+    }
+    if ( journal->map )
+    {
+        if ( journal->fd < 0 )
+        {
+            memcpy( map, journal->map, journal->mapSize );
+        }
+        munmap( journal->map, journal->mapSize );
+    }
+    journal->map     = map;
+    journal->mapSize = mapSize;
+    return YES;
+}
+
+static void IFJournalReplay( IFChargeJournal* journal )
+{
+    IFChargeJournalHeader* header = (IFChargeJournalHeader*)journal->map;
+    if ( IF_JOURNAL_LOG_MAGIC != header->magic || IF_JOURNAL_LOG_VERSION != header->version ||
+         sizeof( IFChargeJournalRecord ) != header->recordSize )
+    {
+        if ( 0 != header->magic )
+        {
+            NSLog( @"IFChargeJournal: discarding unreadable log %s", journal->path );
+        }
+        IFJournalResetLog( journal );
+        return;
+    }
+
+    uint32_t sequence = 1;
+    for ( ; sequence < UINT32_MAX; sequence++ )
+    {
+        if ( (size_t)( (unsigned char*)( IF_JOURNAL_RECORD( journal, sequence ) + 1 ) - journal->map ) > journal->mapSize )
+        {
+            break;
+        }
+        IFChargeJournalRecord* record = IF_JOURNAL_RECORD( journal, sequence );
+        if ( kIFJournalRecordEntry != record->type )
+        {
+            break;
+        }
+        if ( IFJournalChecksum( record ) != record->checksum )
+        {
+            NSLog( @"IFChargeJournal: dropping torn record %u of %s", sequence, journal->path );
+            break;
+        }
+
+        IFJournalIndexSet( journal, &journal->recordIds, sequence );
+        IFJournalIndexSet( journal, &journal->nonces, sequence );
+    }
+    journal->count = sequence - 1;
+
+    // Anything past the end is a torn record; clear it so it can't be
+    // mistaken for part of a later one.
+    unsigned char* end = (unsigned char*)IF_JOURNAL_RECORD( journal, sequence );
+    size_t offset = end - journal->map;
+    for ( size_t i = offset; i < journal->mapSize; i++ )
+    {
+        if ( journal->map[i] )
+        {
+            memset( journal->map + i, 0, journal->mapSize - i );
+            break;
+        }
+    }
+}
+
+// fsyncs the log. Its pages are the file's, so this writes out what
+// was stored through the map.
+static BOOL IFJournalFlush( IFChargeJournal* journal )
+{
+#ifdef F_FULLFSYNC
+    if ( 0 == fcntl( journal->fd, F_FULLFSYNC ) )
+    {
+        return YES;
+    }
+#endif
+    return 0 == fsync( journal->fd );
+}
+
+#pragma -
+#pragma Journal
+
+IFChargeJournal* IFChargeJournalOpen( NSString* path )
+{
+    IFChargeJournal* journal = calloc( 1, sizeof( IFChargeJournal ) );
+    pthread_rwlock_init( &journal->lock, NULL );
+    pthread_mutex_init( &journal->syncLock, NULL );
+    pthread_cond_init( &journal->syncDone, NULL );
+    journal->fd = -1;
+    IFJournalIndexInit( &journal->recordIds, offsetof( IFChargeJournalEntry, recordId ) );
+    IFJournalIndexInit( &journal->nonces, offsetof( IFChargeJournalEntry, nonce ) );
+
+    if ( path )
+    {
+        journal->path = strdup( [path fileSystemRepresentation] );
+        journal->fd = open( journal->path, O_RDWR | O_CREAT, 0600 );
+
+        struct stat st;
+        if ( journal->fd < 0 || 0 != fstat( journal->fd, &st ) ||
+             !IFJournalMap( journal, st.st_size > IF_JOURNAL_LOG_MIN_SIZE ? (size_t)st.st_size : IF_JOURNAL_LOG_MIN_SIZE ) )
+        {
+            NSLog( @"IFChargeJournal: can't map %s (%s); the journal won't persist", journal->path, strerror( errno ) );
+            if ( journal->fd >= 0 )
+            {
+                close( journal->fd );
+                journal->fd = -1;
+            }
+        }
+    }
+    if ( NULL == journal->map )
+    {
+        IFJournalMap( journal, IF_JOURNAL_LOG_MIN_SIZE );
+    }
+
+    IFJournalReplay( journal );
+    journal->syncedCount = journal->count;
+    return journal;
+}
+
+void IFChargeJournalClose( IFChargeJournal* journal )
+{
+    IFChargeJournalSync( journal, journal->count );
+    munmap( journal->map, journal->mapSize );
+    if ( journal->fd >= 0 )
+    {
+        close( journal->fd );
+    }
+    pthread_rwlock_destroy( &journal->lock );
+    pthread_mutex_destroy( &journal->syncLock );
+    pthread_cond_destroy( &journal->syncDone );
+    free( journal->recordIds.slots );
+    free( journal->nonces.slots );
+    free( journal->path );
+    free( journal );
+}
+
+uint64_t IFChargeJournalAppend( IFChargeJournal* journal, const IFChargeJournalEntry* entry )
+{
+    pthread_rwlock_wrlock( &journal->lock );
+
+    uint32_t sequence = journal->count + 1;
+    size_t end = sizeof( IFChargeJournalHeader ) + (size_t)sequence * sizeof( IFChargeJournalRecord );
+    if ( UINT32_MAX == journal->count )
+    {
+        sequence = 0;
+    }
+    else if ( end > journal->mapSize )
+    {
+        size_t mapSize = journal->mapSize;
+        while ( mapSize < end )
+        {
+            mapSize += MIN( mapSize, IF_JOURNAL_LOG_MAX_GROWTH );
+        }
+        if ( !IFJournalMap( journal, mapSize ) )
+        {
+            sequence = 0;
+        }
+    }
+    if ( 0 == sequence )
+    {
+        pthread_rwlock_unlock( &journal->lock );
+        NSLog( @"IFChargeJournal: can't grow the log; entry dropped" );
+        return 0;
+    }
+
+    IFChargeJournalRecord* record = IF_JOURNAL_RECORD( journal, sequence );
+    record->entry = *entry;
+    record->entry.currency[IF_CHARGE_JOURNAL_CURRENCY_MAX]              = '\0';
+    record->entry.redactedCardNumber[IF_CHARGE_JOURNAL_CARD_NUMBER_MAX] = '\0';
+    record->entry.cardType[IF_CHARGE_JOURNAL_CARD_TYPE_MAX]             = '\0';
+    record->entry.recordId[IF_CHARGE_JOURNAL_RECORD_ID_MAX]             = '\0';
+    record->entry.nonce[IF_CHARGE_NONCE_LENGTH]                         = '\0';
+    record->previous = IFJournalIndexSet( journal, &journal->recordIds, sequence );
+    record->checksum = IFJournalChecksum( record );
+    __sync_synchronize();
+    record->type = kIFJournalRecordEntry;
+
+    IFJournalIndexSet( journal, &journal->nonces, sequence );
+    journal->count = sequence;
+
+    pthread_rwlock_unlock( &journal->lock );
+    return sequence;
+}
+
+// Copies s into a field of max bytes plus a NUL; nil is empty. Returns
+// NO if it doesn't fit.
+static BOOL IFJournalCopyString( NSString* s, char* field, size_t max )
+{
+    NSUInteger length = 0;
+    NSRange remaining = NSMakeRange( 0, 0 );
+    if ( [s length] &&
+         ( ![s getBytes:field maxLength:max usedLength:&length encoding:NSUTF8StringEncoding
+                options:0 range:NSMakeRange( 0, [s length] ) remainingRange:&remaining] ||
+           0 != remaining.length ) )
+    {
+        return NO;
+    }
+    field[length] = '\0';
+    return YES;
+}
+
+uint64_t IFChargeJournalAppendResponse( IFChargeJournal* journal, IFChargeResponse* response )
+{
+    IFChargeJournalEntry entry;
+    memset( &entry, 0, sizeof( entry ) );
+
+    NSString* currency = response.currency ? response.currency : @"USD";
+    unsigned exponent = IFChargeCurrencyExponent( currency );
+    int64_t divisor = 1;
+    for ( unsigned i = exponent; i < IF_CHARGE_MONEY_SCALE; i++ )
+    {
+        divisor *= 10;
+    }
+
+    entry.responseCode = response.responseCode;
+    entry.amount       = IFChargeMoneyRound( IFChargeMoneyFromString( response.amount ), exponent ) / divisor;
+    entry.timestamp    = [NSDate timeIntervalSinceReferenceDate];
+    if ( !IFJournalCopyString( currency, entry.currency, IF_CHARGE_JOURNAL_CURRENCY_MAX ) ||
+         !IFJournalCopyString( response.redactedCardNumber, entry.redactedCardNumber, IF_CHARGE_JOURNAL_CARD_NUMBER_MAX ) ||
+         !IFJournalCopyString( response.cardType, entry.cardType, IF_CHARGE_JOURNAL_CARD_TYPE_MAX ) ||
+         !IFJournalCopyString( [response.extraParams objectForKey:@"record_id"], entry.recordId, IF_CHARGE_JOURNAL_RECORD_ID_MAX ) ||
+         !IFJournalCopyString( response.nonce, entry.nonce, IF_CHARGE_NONCE_LENGTH ) )
+    {
+        return 0;
+    }
+    return IFChargeJournalAppend( journal, &entry );
+}
+
+BOOL IFChargeJournalSync( IFChargeJournal* journal, uint64_t sequence )
+{
+    if ( journal->fd < 0 )
+    {
+        return YES;
+    }
+
+    BOOL ok = YES;
+    pthread_mutex_lock( &journal->syncLock );
+    while ( ok && journal->syncedCount < sequence )
+    {
+        if ( journal->syncing )
+        {
+            pthread_cond_wait( &journal->syncDone, &journal->syncLock );
+            continue;
+        }
+
+        // Whatever's been appended by now rides along with this fsync.
+        journal->syncing = YES;
+        uint64_t target = journal->count;
+        pthread_mutex_unlock( &journal->syncLock );
+        ok = IFJournalFlush( journal );
+        pthread_mutex_lock( &journal->syncLock );
+        journal->syncing = NO;
+        if ( ok && target > journal->syncedCount )
+        {
+            journal->syncedCount = target;
+        }
+        pthread_cond_broadcast( &journal->syncDone );
+    }
+    pthread_mutex_unlock( &journal->syncLock );
+
+    if ( !ok )
+    {
+        NSLog( @"IFChargeJournal: can't sync %s (%s)", journal->path, strerror( errno ) );
+    }
+    return ok;
+}
+
+uint64_t IFChargeJournalCount( IFChargeJournal* journal )
+{
+    return journal->count;
+}
+
+BOOL IFChargeJournalEntryAt( IFChargeJournal* journal, uint64_t sequence, IFChargeJournalEntry* entry )
+{
+    pthread_rwlock_rdlock( &journal->lock );
+    BOOL found = ( sequence > 0 && sequence <= journal->count );
+    if ( found )
+    {
+        *entry = IF_JOURNAL_RECORD( journal, sequence )->entry;
+    }
+    pthread_rwlock_unlock( &journal->lock );
+    return found;
+}
+
+BOOL IFChargeJournalFindRecordId( IFChargeJournal* journal, NSString* recordId, IFChargeJournalEntry* entry )
+{
+    return 1 == IFChargeJournalHistory( journal, recordId, entry, 1 );
+}
+
+BOOL IFChargeJournalFindNonce( IFChargeJournal* journal, NSString* nonce, IFChargeJournalEntry* entry )
+{
+    pthread_rwlock_rdlock( &journal->lock );
+    uint32_t sequence = IFJournalIndexGet( journal, &journal->nonces, nonce, IF_CHARGE_NONCE_LENGTH );
+    if ( sequence )
+    {
+        *entry = IF_JOURNAL_RECORD( journal, sequence )->entry;
+    }
+    pthread_rwlock_unlock( &journal->lock );
+    return 0 != sequence;
+}
+
+NSUInteger IFChargeJournalHistory( IFChargeJournal* journal, NSString* recordId,
+                                   IFChargeJournalEntry* entries, NSUInteger maxCount )
+{
+    NSUInteger count = 0;
+    pthread_rwlock_rdlock( &journal->lock );
+    uint32_t sequence = IFJournalIndexGet( journal, &journal->recordIds, recordId, IF_CHARGE_JOURNAL_RECORD_ID_MAX );
+    for ( ; sequence && count < maxCount; count++ )
+    {
+        IFChargeJournalRecord* record = IF_JOURNAL_RECORD( journal, sequence );
+        entries[count] = record->entry;
+        sequence = record->previous;
+    }
+    pthread_rwlock_unlock( &journal->lock );
+    return count;
+}
+
+static IFChargeJournal* _sharedJournal;
+static pthread_once_t   _sharedJournalOnce = PTHREAD_ONCE_INIT;
+
+static void IFJournalOpenShared( void )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    NSString* directory = [NSSearchPathForDirectoriesInDomains( NSLibraryDirectory, NSUserDomainMask, YES ) lastObject];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES
+                                               attributes:nil error:NULL];
+    _sharedJournal = IFChargeJournalOpen( [directory stringByAppendingPathComponent:IF_CHARGE_JOURNAL_FILE] );
+
+    [pool drain];
+}
+
+IFChargeJournal* IFChargeJournalShared( void )
+{
+    pthread_once( &_sharedJournalOnce, IFJournalOpenShared );
+    return _sharedJournal;
+}
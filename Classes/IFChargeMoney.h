@@ -0,0 +1,74 @@
+// -*- objc -*-
+//
+// IFChargeMoney.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargeMoney - An amount of money as a whole number of
+// ten-thousandths of the currency's major unit. Four decimal places is
+// the most any ISO 4217 currency uses, so decimal amount strings are
+// held exactly and sums of them never round.
+typedef int64_t IFChargeMoney;
+
+#define IF_CHARGE_MONEY_SCALE     4
+#define IF_CHARGE_MONEY_ONE       10000LL
+
+// The largest magnitude an amount field may hold, 9999999999999.99.
+#define IF_CHARGE_MONEY_MAX       99999999999999900LL
+
+// Amounts are always sent with two decimal places; see
+// IF_CHARGE_AMOUNT_PATTERN.
+#define IF_CHARGE_AMOUNT_DECIMALS 2
+
+// Room for the longest string IFChargeMoneyFormat writes.
+#define IF_CHARGE_MONEY_FORMAT_MAX 32
+
+// IFChargeMoneyParse - Parses the decimal number at the start of the
+// len bytes at s, the way strtod would: leading white space, an
+// optional sign, digits with an optional decimal point and an optional
+// exponent. Anything after the number is ignored. Digits beyond the
+// fourth decimal place are rounded half-to-even.
+//
+// Returns NO, setting *money to 0, if there's no decimal number at
+// all. That includes the hex numbers, infinities and NaNs strtod
+// accepts. A number too large for IFChargeMoney saturates to INT64_MAX
+// or INT64_MIN.
+extern BOOL IFChargeMoneyParse( const char* s, size_t len, IFChargeMoney* money );
+
+// IFChargeMoneyParseString - IFChargeMoneyParse for an NSString.
+// Returns NO for nil.
+extern BOOL IFChargeMoneyParseString( NSString* s, IFChargeMoney* money );
+
+// IFChargeMoneyDecimalPlaces - The decimal places the number at the
+// start of s needs, as IFChargeMoneyParseString reads it: its fraction
+// digits, less trailing zeros and its exponent, and never below 0.
+// "1.50" needs 1, "1.5e3" none and "1.00001" 5, though parsing rounds
+// that last to 1.0000. 0 if s isn't a decimal number.
+extern unsigned IFChargeMoneyDecimalPlaces( NSString* s );
+
+// IFChargeMoneyFromString - IFChargeMoneyParseString, for sums: nil
+// and non-numeric strings are 0.
+extern IFChargeMoney IFChargeMoneyFromString( NSString* s );
+
+// IFChargeMoneyRound - Rounds half-to-even to the given number of
+// decimal places (0 to IF_CHARGE_MONEY_SCALE).
+extern IFChargeMoney IFChargeMoneyRound( IFChargeMoney money, unsigned decimals );
+
+// IFChargeMoneyFormat - Writes money, rounded to the given number of
+// decimal places, as a plain decimal string ("-1234.50"; no grouping,
+// no currency symbol, whatever the locale). buffer needs room for
+// IF_CHARGE_MONEY_FORMAT_MAX bytes. Returns the length written; the
+// string is not NUL-terminated.
+extern size_t IFChargeMoneyFormat( IFChargeMoney money, unsigned decimals, char* buffer );
+
+// IFChargeCurrencyExponent - The ISO 4217 minor unit exponent of a
+// currency code: 2 for USD, 0 for JPY, 3 for KWD. Codes not in the
+// table, including nil, are taken to be 2. Never more than
+// IF_CHARGE_MONEY_SCALE, so an amount in minor units is exact.
+extern unsigned IFChargeCurrencyExponent( NSString* currency );
@@ -0,0 +1,367 @@
+//
+// IFChargeMoney.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeMoney.h"
+
+#include <string.h>
+
+#define IF_IS_DIGIT( c ) ( (unsigned char)( (c) - '0' ) <= 9 )
+#define IF_IS_SPACE( c ) ( ' ' == (c) || (unsigned char)( (c) - '\t' ) <= '\r' - '\t' )
+
+static const uint64_t _powersOfTen[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL,
+};
+
+#pragma -
+#pragma Parsing
+
+// Returns the index'th digit of the number, skipping over the decimal
+// point if there is one.
+static unsigned IFDigitAt( const char* digits, size_t pointIndex, size_t index )
+{
+    return digits[( index < pointIndex ) ? index : index + 1] - '0';
+}
+
+// IFChargeMoneyParse, also setting *places (if places isn't NULL) to
+// the decimal places the number needs; see IFChargeMoneyDecimalPlaces.
+static BOOL IFMoneyParse( const char* s, size_t len, IFChargeMoney* money, unsigned* places )
+{
+    const char* p   = s;
+    const char* end = s + len;
+    *money = 0;
+
+    while ( p < end && IF_IS_SPACE( *p ) )
+    {
+        p++;
+    }
+
+    BOOL negative = NO;
+    if ( p < end && ( '+' == *p || '-' == *p ) )
+    {
+        negative = ( '-' == *p++ );
+    }
+
+    // The mantissa: digits[0..digitCount) with the decimal point, if
+    // any, at pointIndex.
+    const char* digits = p;
+    size_t digitCount = 0;
+    size_t fractionCount = 0;
+    size_t pointIndex = SIZE_MAX;
+    for ( ; p < end; p++ )
+    {
+        if ( IF_IS_DIGIT( *p ) )
+        {
+            digitCount++;
+            if ( SIZE_MAX != pointIndex )
+            {
+                fractionCount++;
+            }
+        }
+        else if ( '.' == *p && SIZE_MAX == pointIndex )
+        {
+            pointIndex = p - digits;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if ( 0 == digitCount )
+    {
+        return NO;
+    }
+
+    // strtod would read "0x1A" as hex; it isn't a decimal amount, and
+    // reading it as 0 would hide that.
+    if ( 1 == digitCount && SIZE_MAX == pointIndex && '0' == *digits && p < end && ( 'x' == *p || 'X' == *p ) )
+    {
+        return NO;
+    }
+
+    // The exponent only counts if it has digits.
+    long exponent = 0;
+    if ( p + 1 < end && ( 'e' == *p || 'E' == *p ) )
+    {
+        const char* e = p + 1;
+        BOOL negativeExponent = NO;
+        if ( '+' == *e || '-' == *e )
+        {
+            negativeExponent = ( '-' == *e++ );
+        }
+        for ( ; e < end && IF_IS_DIGIT( *e ); e++ )
+        {
+            if ( exponent < 100000 )
+            {
+                exponent = exponent * 10 + ( *e - '0' );
+            }
+        }
+        if ( negativeExponent )
+        {
+            exponent = -exponent;
+        }
+    }
+
+    if ( places )
+    {
+        long trailingZeros = 0;
+        while ( trailingZeros < (long)digitCount && 0 == IFDigitAt( digits, pointIndex, digitCount - 1 - trailingZeros ) )
+        {
+            trailingZeros++;
+        }
+        long needed = (long)fractionCount - exponent - trailingZeros;
+        *places = ( trailingZeros == (long)digitCount || needed < 0 ) ? 0 : (unsigned)MIN( needed, 100000 );
+    }
+
+    // The value is the mantissa digits times 10^shift ten-thousandths.
+    // The first `kept` digits are whole units; the rest are rounded.
+    long shift = exponent - (long)fractionCount + IF_CHARGE_MONEY_SCALE;
+    long kept  = ( shift < 0 ) ? (long)digitCount + shift : (long)digitCount;
+
+    uint64_t units = 0;
+    BOOL overflow = NO;
+    for ( long i = 0; i < kept && !overflow; i++ )
+    {
+        unsigned d = IFDigitAt( digits, pointIndex, i );
+        overflow = ( units > ( INT64_MAX - d ) / 10 );
+        units = units * 10 + d;
+    }
+    for ( long i = 0; i < shift && 0 != units && !overflow; i++ )
+    {
+        overflow = ( units > INT64_MAX / 10 );
+        units *= 10;
+    }
+
+    if ( !overflow && 0 <= kept && kept < (long)digitCount )
+    {
+        unsigned roundDigit = IFDigitAt( digits, pointIndex, kept );
+        BOOL sticky = NO;
+        for ( size_t i = kept + 1; i < digitCount && !sticky; i++ )
+        {
+            sticky = ( 0 != IFDigitAt( digits, pointIndex, i ) );
+        }
+        if ( roundDigit > 5 || ( 5 == roundDigit && ( sticky || ( units & 1 ) ) ) )
+        {
+            units++;
+            overflow = ( units > INT64_MAX );
+        }
+    }
+
+    if ( overflow )
+    {
+        *money = negative ? INT64_MIN : INT64_MAX;
+    }
+    else
+    {
+        *money = negative ? -(IFChargeMoney)units : (IFChargeMoney)units;
+    }
+    return YES;
+}
+
+BOOL IFChargeMoneyParse( const char* s, size_t len, IFChargeMoney* money )
+{
+    return IFMoneyParse( s, len, money, NULL );
+}
+
+static BOOL IFMoneyParseString( NSString* s, IFChargeMoney* money, unsigned* places )
+{
+    *money = 0;
+    if ( places )
+    {
+        *places = 0;
+    }
+    if ( nil == s )
+    {
+        return NO;
+    }
+
+    // Amount strings are short; avoid the autoreleased UTF8String
+    // buffer whenever the string fits on the stack.
+    char buffer[64];
+    const char* string = buffer;
+    if ( ![s getCString:buffer maxLength:sizeof( buffer ) encoding:NSUTF8StringEncoding] )
+    {
+        string = [s UTF8String];
+        if ( NULL == string )
+        {
+            return NO;
+        }
+    }
+
+    return IFMoneyParse( string, strlen( string ), money, places );
+}
+
+BOOL IFChargeMoneyParseString( NSString* s, IFChargeMoney* money )
+{
+    return IFMoneyParseString( s, money, NULL );
+}
+
+unsigned IFChargeMoneyDecimalPlaces( NSString* s )
+{
+    IFChargeMoney money;
+    unsigned places;
+    return IFMoneyParseString( s, &money, &places ) ? places : 0;
+}
+
+IFChargeMoney IFChargeMoneyFromString( NSString* s )
+{
+    IFChargeMoney money;
+    IFChargeMoneyParseString( s, &money );
+    return money;
+}
+
+#pragma -
+#pragma Rounding and Formatting
+
+IFChargeMoney IFChargeMoneyRound( IFChargeMoney money, unsigned decimals )
+{
+    if ( decimals >= IF_CHARGE_MONEY_SCALE )
+    {
+        return money;
+    }
+
+    uint64_t divisor   = _powersOfTen[IF_CHARGE_MONEY_SCALE - decimals];
+    uint64_t magnitude = ( money < 0 ) ? -(uint64_t)money : (uint64_t)money;
+    uint64_t quotient  = magnitude / divisor;
+    uint64_t remainder = magnitude % divisor;
+    if ( remainder * 2 > divisor || ( remainder * 2 == divisor && ( quotient & 1 ) ) )
+    {
+        quotient++;
+    }
+    if ( quotient > INT64_MAX / divisor )
+    {
+        quotient--; // a saturated amount rounds toward zero
+    }
+
+    magnitude = quotient * divisor;
+    return ( money < 0 ) ? -(IFChargeMoney)magnitude : (IFChargeMoney)magnitude;
+}
+
+size_t IFChargeMoneyFormat( IFChargeMoney money, unsigned decimals, char* buffer )
+{
+    if ( decimals > IF_CHARGE_MONEY_SCALE )
+    {
+        decimals = IF_CHARGE_MONEY_SCALE;
+    }
+
+    money = IFChargeMoneyRound( money, decimals );
+    uint64_t magnitude = ( money < 0 ) ? -(uint64_t)money : (uint64_t)money;
+    uint64_t whole     = magnitude / IF_CHARGE_MONEY_ONE;
+    uint64_t fraction  = ( magnitude % IF_CHARGE_MONEY_ONE ) / _powersOfTen[IF_CHARGE_MONEY_SCALE - decimals];
+
+    char* w = buffer;
+    if ( 0 != magnitude && money < 0 )
+    {
+        *w++ = '-';
+    }
+
+    // Whole units, written backwards and then reversed into place.
+    char reversed[24];
+    size_t wholeLength = 0;
+    do
+    {
+        reversed[wholeLength++] = '0' + whole % 10;
+        whole /= 10;
+    }
+    while ( whole );
+    while ( wholeLength )
+    {
+        *w++ = reversed[--wholeLength];
+    }
+
+    if ( decimals )
+    {
+        *w++ = '.';
+        for ( unsigned i = decimals; i > 0; i-- )
+        {
+            w[i - 1] = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        w += decimals;
+    }
+
+    return w - buffer;
+}
+
+#pragma -
+#pragma ISO 4217 Exponents
+
+#define IF_CURRENCY_KEY( a, b, c ) ( ( (uint32_t)(a) << 16 ) | ( (uint32_t)(b) << 8 ) | (uint32_t)(c) )
+
+// Every ISO 4217 currency whose minor unit isn't hundredths, sorted by
+// code. Everything else is 2.
+static const struct
+{
+    uint32_t code;
+    unsigned exponent;
+} _currencyExponents[] = {
+    { IF_CURRENCY_KEY( 'B', 'H', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'B', 'I', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'C', 'L', 'F' ), 4 },
+    { IF_CURRENCY_KEY( 'C', 'L', 'P' ), 0 },
+    { IF_CURRENCY_KEY( 'D', 'J', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'G', 'N', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'I', 'Q', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'I', 'S', 'K' ), 0 },
+    { IF_CURRENCY_KEY( 'J', 'O', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'J', 'P', 'Y' ), 0 },
+    { IF_CURRENCY_KEY( 'K', 'M', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'K', 'R', 'W' ), 0 },
+    { IF_CURRENCY_KEY( 'K', 'W', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'L', 'Y', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'O', 'M', 'R' ), 3 },
+    { IF_CURRENCY_KEY( 'P', 'Y', 'G' ), 0 },
+    { IF_CURRENCY_KEY( 'R', 'W', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'T', 'N', 'D' ), 3 },
+    { IF_CURRENCY_KEY( 'U', 'G', 'X' ), 0 },
+    { IF_CURRENCY_KEY( 'U', 'Y', 'I' ), 0 },
+    { IF_CURRENCY_KEY( 'U', 'Y', 'W' ), 4 },
+    { IF_CURRENCY_KEY( 'V', 'N', 'D' ), 0 },
+    { IF_CURRENCY_KEY( 'V', 'U', 'V' ), 0 },
+    { IF_CURRENCY_KEY( 'X', 'A', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'X', 'O', 'F' ), 0 },
+    { IF_CURRENCY_KEY( 'X', 'P', 'F' ), 0 },
+};
+
+unsigned IFChargeCurrencyExponent( NSString* currency )
+{
+    if ( 3 != [currency length] )
+    {
+        return 2;
+    }
+
+    unichar c[3];
+    [currency getCharacters:c range:NSMakeRange( 0, 3 )];
+    if ( c[0] > 'Z' || c[1] > 'Z' || c[2] > 'Z' )
+    {
+        return 2;
+    }
+    uint32_t code = IF_CURRENCY_KEY( c[0], c[1], c[2] );
+
+    size_t low  = 0;
+    size_t high = sizeof( _currencyExponents ) / sizeof( _currencyExponents[0] );
+    while ( low < high )
+    {
+        size_t middle = ( low + high ) / 2;
+        if ( _currencyExponents[middle].code < code )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    size_t count = sizeof( _currencyExponents ) / sizeof( _currencyExponents[0] );
+    if ( low < count && _currencyExponents[low].code == code )
+    {
+        return _currencyExponents[low].exponent;
+    }
+    return 2;
+}
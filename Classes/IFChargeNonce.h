@@ -0,0 +1,76 @@
+// -*- objc -*-
+//
+// IFChargeNonce.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeMessage.h"
+
+// IFChargeNonceStore - The charge requests still waiting on a
+// response, keyed by the nonce each was sent with. Any number may be
+// outstanding at once. Each expires after the store's TTL and can be
+// consumed once. Lookup and consumption are a single hash probe.
+//
+// A store persists to a memory-mapped, append-only log. Issuing or
+// consuming a nonce writes one record in place, so nothing is
+// re-serialized. The log is replayed when the store is opened and
+// compacted when it's mostly dead records. A store may be used from
+// any thread.
+typedef struct IFChargeNonceStore IFChargeNonceStore;
+
+// Nonces are this many web-safe base64 characters, the length of a
+// base64-encoded SHA1.
+#define IF_CHARGE_NONCE_LENGTH 27
+
+// How long, in seconds, a nonce in the shared store stays valid.
+#ifndef IF_CHARGE_NONCE_TTL
+#define IF_CHARGE_NONCE_TTL ( 24 * 60 * 60 )
+#endif
+
+// The shared store's log, in the app's Library directory.
+#define IF_CHARGE_NONCE_FILE @"IFChargeNonces.log"
+
+// IFChargeNonceStoreOpen - Opens (creating if need be) the store
+// logged at path, with nonces issued from now on valid for ttl
+// seconds. Nonces in the log that have expired are dropped. If path
+// is nil, or its log can't be mapped, the store is kept only in
+// memory; the latter is logged. Never returns NULL.
+extern IFChargeNonceStore* IFChargeNonceStoreOpen( NSString* path, NSTimeInterval ttl );
+
+// IFChargeNonceStoreClose - Unmaps the log and frees the store.
+extern void IFChargeNonceStoreClose( IFChargeNonceStore* store );
+
+// IFChargeNonceStoreShared - The store IFChargeRequest issues nonces
+// from and IFChargeResponse checks them against, logged to
+// IF_CHARGE_NONCE_FILE. A nonce left in the user defaults by an
+// earlier version is carried over the first time it's opened.
+extern IFChargeNonceStore* IFChargeNonceStoreShared( void );
+
+// IFChargeNonceCreate - Issues a new, random nonce and returns it
+// retained. extraParams, if any, must have only NSString keys and
+// values; they're kept with the nonce and handed back when it's
+// consumed. Returns nil if the log couldn't be grown.
+extern NSString* IFChargeNonceCreate( IFChargeNonceStore* store, NSDictionary* extraParams );
+
+// IFChargeNonceConsume - Checks a response's nonce and, if it's
+// outstanding, consumes it so it can't be replayed. Returns
+// kIFChargeErrorNone, kIFChargeErrorNoOutstandingRequest,
+// kIFChargeErrorMissingNonce, kIFChargeErrorIncorrectNonce,
+// kIFChargeErrorExpiredNonce (an expired nonce is consumed too) or
+// kIFChargeErrorNonceUnavailable, if the log couldn't be grown to
+// record the consumption; the nonce is left outstanding then. On
+// success, *extraParams (if extraParams isn't NULL) is set to the
+// autoreleased parameters stored with the nonce, or nil.
+extern IFChargeErrorCode IFChargeNonceConsume( IFChargeNonceStore* store, NSString* nonce, NSDictionary** extraParams );
+
+// IFChargeNonceStoreCount - The number of nonces issued and not yet
+// consumed. Expired nonces count until the store is next compacted.
+extern NSUInteger IFChargeNonceStoreCount( IFChargeNonceStore* store );
+
+// IFChargeNonceStoreRemoveAll - Forgets every outstanding nonce.
+extern void IFChargeNonceStoreRemoveAll( IFChargeNonceStore* store );
@@ -0,0 +1,785 @@
+//
+// IFChargeNonce.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeNonce.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Base64 isn't provided in Cocoa Touch, and I don't want to depend on
+// an external Base64 library, so instead of base64 encoding a random
+// value, I'll instead choose (web safe) base64-characters at random.
+static const char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+#define IF_NONCE_ALPHABET_MASK 0x3f
+
+// Random bytes are drawn this many nonces' worth at a time.
+#define IF_NONCE_RANDOM_BATCH  32
+
+#define IF_NONCE_LOG_MAGIC     0x4E434649 // "IFCN"
+#define IF_NONCE_LOG_VERSION   1
+#define IF_NONCE_LOG_MIN_SIZE  ( 64 * 1024 )
+#define IF_NONCE_TABLE_MIN     64
+
+// The log is a header followed by records, each padded to 8 bytes.
+// A record's type is written last, after a barrier, so a record torn
+// by the process being killed reads as the end of the log.
+typedef struct IFChargeNonceHeader
+{
+    uint32_t magic;
+    uint32_t version;
+} IFChargeNonceHeader;
+
+enum
+{
+    kIFNonceRecordEnd      = 0,
+    kIFNonceRecordIssued   = 1,
+    kIFNonceRecordConsumed = 2
+};
+
+// An issued record is followed by paramsLength bytes of extraParams:
+// a uint32_t count, then each key and value as a uint32_t length and
+// that many bytes of UTF-8.
+typedef struct IFChargeNonceRecord
+{
+    uint32_t       type;
+    uint32_t       paramsLength;
+    NSTimeInterval expires;
+    char           nonce[IF_CHARGE_NONCE_LENGTH + 1];
+} IFChargeNonceRecord;
+
+enum
+{
+    kIFNonceSlotEmpty = 0,
+    kIFNonceSlotLive,
+    kIFNonceSlotDead
+};
+
+// A slot in the open-addressed nonce table. record is the offset of
+// the nonce's issued record in the log.
+typedef struct IFChargeNonceEntry
+{
+    char           nonce[IF_CHARGE_NONCE_LENGTH];
+    unsigned char  state;
+    NSTimeInterval expires;
+    size_t         record;
+} IFChargeNonceEntry;
+
+struct IFChargeNonceStore
+{
+    pthread_mutex_t     lock;
+    NSTimeInterval      ttl;
+
+    // The log. fd is -1 for a store kept only in memory.
+    char*               path;
+    int                 fd;
+    unsigned char*      map;
+    size_t              mapSize;
+    size_t              end;
+    size_t              liveBytes; // bytes of records for live entries
+
+    // capacity is a power of two; used counts live and dead slots and
+    // is kept under half of capacity.
+    IFChargeNonceEntry* entries;
+    NSUInteger          capacity;
+    NSUInteger          count;
+    NSUInteger          used;
+
+    unsigned char       random[IF_NONCE_RANDOM_BATCH * IF_CHARGE_NONCE_LENGTH];
+    size_t              randomUsed;
+};
+
+#define IF_NONCE_RECORD( store, offset ) ( (IFChargeNonceRecord*)( (store)->map + (offset) ) )
+
+static size_t IFNonceRecordSize( uint32_t paramsLength )
+{
+    return sizeof( IFChargeNonceRecord ) + ( ( (size_t)paramsLength + 7 ) & ~(size_t)7 );
+}
+
+static NSTimeInterval IFNonceNow( void )
+{
+    return [NSDate timeIntervalSinceReferenceDate];
+}
+
+#pragma -
+#pragma Nonce Table
+
+// Nonces are random, so their first bytes hash well enough.
+static NSUInteger IFNonceHash( const char* nonce )
+{
+    uint64_t h;
+    memcpy( &h, nonce, sizeof( h ) );
+    return (NSUInteger)( ( h * 0x9E3779B97F4A7C15ULL ) >> 32 );
+}
+
+// Compares every byte, so the time taken doesn't reveal how much of a
+// guessed nonce was right.
+static BOOL IFNonceEqual( const char* a, const char* b )
+{
+    unsigned char diff = 0;
+    for ( NSUInteger i = 0; i < IF_CHARGE_NONCE_LENGTH; i++ )
+    {
+        diff |= a[i] ^ b[i];
+    }
+    return 0 == diff;
+}
+
+static IFChargeNonceEntry* IFNonceFind( IFChargeNonceStore* store, const char* nonce )
+{
+    NSUInteger mask = store->capacity - 1;
+    for ( NSUInteger i = IFNonceHash( nonce ) & mask; ; i = ( i + 1 ) & mask )
+    {
+        IFChargeNonceEntry* entry = &store->entries[i];
+        if ( kIFNonceSlotEmpty == entry->state )
+        {
+            return NULL;
+        }
+        if ( kIFNonceSlotLive == entry->state && IFNonceEqual( entry->nonce, nonce ) )
+        {
+            return entry;
+        }
+    }
+}
+
+static void IFNonceRemove( IFChargeNonceStore* store, IFChargeNonceEntry* entry )
+{
+    store->liveBytes -= IFNonceRecordSize( IF_NONCE_RECORD( store, entry->record )->paramsLength );
+    entry->state = kIFNonceSlotDead;
+    store->count--;
+}
+
+static IFChargeNonceEntry* IFNonceSlot( IFChargeNonceEntry* entries, NSUInteger capacity, const char* nonce )
+{
+    NSUInteger mask = capacity - 1;
+    NSUInteger i = IFNonceHash( nonce ) & mask;
+    while ( kIFNonceSlotLive == entries[i].state )
+    {
+        i = ( i + 1 ) & mask;
+    }
+    return &entries[i];
+}
+
+// Rebuilds the table at a quarter full, leaving out dead slots and
+// expired nonces.
+static void IFNonceRehash( IFChargeNonceStore* store )
+{
+    NSTimeInterval now = IFNonceNow();
+    NSUInteger capacity = IF_NONCE_TABLE_MIN;
+    while ( ( store->count + 1 ) * 4 > capacity )
+    {
+        capacity *= 2;
+    }
+
+    IFChargeNonceEntry* entries = calloc( capacity, sizeof( IFChargeNonceEntry ) );
+    for ( NSUInteger i = 0; i < store->capacity; i++ )
+    {
+        IFChargeNonceEntry* entry = &store->entries[i];
+        if ( kIFNonceSlotLive != entry->state )
+        {
+            continue;
+        }
+        if ( entry->expires <= now )
+        {
+            IFNonceRemove( store, entry );
+            continue;
+        }
+        *IFNonceSlot( entries, capacity, entry->nonce ) = *entry;
+    }
+
+    free( store->entries );
+    store->entries  = entries;
+    store->capacity = capacity;
+    store->used     = store->count;
+}
+
+// Adds a nonce that isn't in the table.
+static void IFNonceInsert( IFChargeNonceStore* store, const char* nonce, NSTimeInterval expires, size_t record )
+{
+    if ( ( store->used + 1 ) * 2 > store->capacity )
+    {
+        IFNonceRehash( store );
+    }
+
+    IFChargeNonceEntry* entry = IFNonceSlot( store->entries, store->capacity, nonce );
+    if ( kIFNonceSlotEmpty == entry->state )
+    {
+        store->used++;
+    }
+    memcpy( entry->nonce, nonce, IF_CHARGE_NONCE_LENGTH );
+    entry->state   = kIFNonceSlotLive;
+    entry->expires = expires;
+    entry->record  = record;
+
+    store->count++;
+    store->liveBytes += IFNonceRecordSize( IF_NONCE_RECORD( store, record )->paramsLength );
+}
+
+#pragma -
+#pragma Log
+
+static void IFNonceResetLog( IFChargeNonceStore* store )
+{
+    memset( store->map, 0, store->end > sizeof( IFChargeNonceHeader ) ? store->end : store->mapSize );
+    IFChargeNonceHeader* header = (IFChargeNonceHeader*)store->map;
+    header->magic   = IF_NONCE_LOG_MAGIC;
+    header->version = IF_NONCE_LOG_VERSION;
+    store->end       = sizeof( IFChargeNonceHeader );
+    store->liveBytes = 0;
+}
+
+// Maps mapSize bytes of the log, growing the file to match. The
+// contents of a memory-only log are copied over.
+static BOOL IFNonceMap( IFChargeNonceStore* store, size_t mapSize )
+{
+    if ( store->fd >= 0 && 0 != ftruncate( store->fd, mapSize ) )
+    {
+        return NO;
+    }
+    unsigned char* map = mmap( NULL, mapSize, PROT_READ | PROT_WRITE,
+                               store->fd >= 0 ? MAP_SHARED : ( MAP_PRIVATE | MAP_ANON ), store->fd, 0 );
+    if ( MAP_FAILED == map )
+    {
+        return NO;
+    }
+    if ( store->map )
+    {
+        if ( store->fd < 0 )
+        {
+            memcpy( map, store->map, store->end );
+        }
+        munmap( store->map, store->mapSize );
+    }
+    store->map     = map;
+    store->mapSize = mapSize;
+    return YES;
+}
+
+static BOOL IFNonceWriteAll( int fd, const unsigned char* bytes, size_t length )
+{
+    while ( length > 0 )
+    {
+        ssize_t written = write( fd, bytes, length );
+        if ( written < 0 && EINTR != errno )
+        {
+            return NO;
+        }
+        if ( written > 0 )
+        {
+            bytes  += written;
+            length -= written;
+        }
+    }
+    return YES;
+}
+
+// Rewrites the log with only the live nonces' records. A file log is
+// written beside the old one and renamed over it, so a crash leaves
+// one or the other.
+static BOOL IFNonceCompact( IFChargeNonceStore* store )
+{
+    size_t end = sizeof( IFChargeNonceHeader ) + store->liveBytes;
+    unsigned char* log = malloc( end );
+    if ( NULL == log )
+    {
+        return NO;
+    }
+
+    memcpy( log, store->map, sizeof( IFChargeNonceHeader ) );
+    size_t offset = sizeof( IFChargeNonceHeader );
+    for ( NSUInteger i = 0; i < store->capacity; i++ )
+    {
+        if ( kIFNonceSlotLive == store->entries[i].state )
+        {
+            IFChargeNonceRecord* record = IF_NONCE_RECORD( store, store->entries[i].record );
+            size_t size = IFNonceRecordSize( record->paramsLength );
+            memcpy( log + offset, record, size );
+            offset += size;
+        }
+    }
+
+    if ( store->fd >= 0 )
+    {
+        size_t pathLength = strlen( store->path );
+        char* tmpPath = malloc( pathLength + sizeof( ".tmp" ) );
+        memcpy( tmpPath, store->path, pathLength );
+        memcpy( tmpPath + pathLength, ".tmp", sizeof( ".tmp" ) );
+
+        int fd = open( tmpPath, O_RDWR | O_CREAT | O_TRUNC, 0600 );
+        unsigned char* map = MAP_FAILED;
+        if ( fd >= 0 && IFNonceWriteAll( fd, log, end ) && 0 == ftruncate( fd, store->mapSize ) )
+        {
+            map = mmap( NULL, store->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+        }
+        if ( MAP_FAILED == map || 0 != rename( tmpPath, store->path ) )
+        {
+            if ( MAP_FAILED != map )
+            {
+                munmap( map, store->mapSize );
+            }
+            if ( fd >= 0 )
+            {
+                close( fd );
+            }
+            unlink( tmpPath );
+            free( tmpPath );
+            free( log );
+            return NO;
+        }
+        free( tmpPath );
+
+        munmap( store->map, store->mapSize );
+        close( store->fd );
+        store->fd  = fd;
+        store->map = map;
+    }
+    else
+    {
+        memcpy( store->map, log, end );
+        memset( store->map + end, 0, store->end - end );
+    }
+    free( log );
+
+    // Same order as the copy above.
+    offset = sizeof( IFChargeNonceHeader );
+    for ( NSUInteger i = 0; i < store->capacity; i++ )
+    {
+        if ( kIFNonceSlotLive == store->entries[i].state )
+        {
+            store->entries[i].record = offset;
+            offset += IFNonceRecordSize( IF_NONCE_RECORD( store, offset )->paramsLength );
+        }
+    }
+    store->end = end;
+    return YES;
+}
+
+// Returns the record at the end of the log, with room for paramsLength
+// bytes of parameters, compacting or growing the log if need be. It
+// isn't part of the log until IFNonceCommit. Returns NULL if there's
+// no room to be had.
+static IFChargeNonceRecord* IFNonceReserve( IFChargeNonceStore* store, uint32_t paramsLength )
+{
+    size_t size = IFNonceRecordSize( paramsLength );
+    if ( store->end + size > store->mapSize )
+    {
+        BOOL compacted = ( sizeof( IFChargeNonceHeader ) + store->liveBytes + size <= store->mapSize / 2 ) &&
+                         IFNonceCompact( store );
+        if ( !compacted )
+        {
+            size_t mapSize = store->mapSize;
+            while ( mapSize < store->end + size )
+            {
+                mapSize *= 2;
+            }
+            if ( !IFNonceMap( store, mapSize ) )
+            {
+                return NULL;
+            }
+        }
+    }
+
+    IFChargeNonceRecord* record = IF_NONCE_RECORD( store, store->end );
+    record->paramsLength = paramsLength;
+    return record;
+}
+
+// Adds a reserved record to the log and returns its offset. The pages
+// are shared with the file, so the record survives the app being
+// terminated as soon as this returns.
+static size_t IFNonceCommit( IFChargeNonceStore* store, IFChargeNonceRecord* record, uint32_t type )
+{
+    size_t offset = store->end;
+    __sync_synchronize();
+    record->type = type;
+    store->end += IFNonceRecordSize( record->paramsLength );
+    return offset;
+}
+
+static void IFNonceReplay( IFChargeNonceStore* store )
+{
+    IFChargeNonceHeader* header = (IFChargeNonceHeader*)store->map;
+    if ( IF_NONCE_LOG_MAGIC != header->magic || IF_NONCE_LOG_VERSION != header->version )
+    {
+        if ( 0 != header->magic )
+        {
+            NSLog( @"IFChargeNonceStore: discarding unreadable log %s", store->path );
+        }
+        store->end = 0;
+        IFNonceResetLog( store );
+        return;
+    }
+
+    NSTimeInterval now = IFNonceNow();
+    size_t offset = sizeof( IFChargeNonceHeader );
+    while ( offset + sizeof( IFChargeNonceRecord ) <= store->mapSize )
+    {
+        IFChargeNonceRecord* record = IF_NONCE_RECORD( store, offset );
+        if ( ( kIFNonceRecordIssued != record->type && kIFNonceRecordConsumed != record->type ) ||
+             record->paramsLength > store->mapSize ||
+             IFNonceRecordSize( record->paramsLength ) > store->mapSize - offset )
+        {
+            break;
+        }
+
+        IFChargeNonceEntry* entry = IFNonceFind( store, record->nonce );
+        if ( kIFNonceRecordIssued == record->type && !entry && record->expires > now )
+        {
+            IFNonceInsert( store, record->nonce, record->expires, offset );
+        }
+        else if ( kIFNonceRecordConsumed == record->type && entry )
+        {
+            IFNonceRemove( store, entry );
+        }
+        offset += IFNonceRecordSize( record->paramsLength );
+    }
+    store->end = offset;
+
+    // Anything past the end is a torn record; clear it so it can't be
+    // mistaken for part of a later one.
+    for ( size_t i = offset; i < store->mapSize; i++ )
+    {
+        if ( store->map[i] )
+        {
+            memset( store->map + i, 0, store->mapSize - i );
+            break;
+        }
+    }
+}
+
+#pragma -
+#pragma Extra Params
+
+static size_t IFNonceParamsLength( NSDictionary* params )
+{
+    size_t length = sizeof( uint32_t );
+    for ( NSString* key in params )
+    {
+        length += 2 * sizeof( uint32_t )
+            + [key lengthOfBytesUsingEncoding:NSUTF8StringEncoding]
+            + [[params objectForKey:key] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    }
+    return length;
+}
+
+static unsigned char* IFNonceWriteString( NSString* s, unsigned char* p )
+{
+    NSUInteger length = [s lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    uint32_t length32 = (uint32_t)length;
+    memcpy( p, &length32, sizeof( length32 ) );
+    [s getBytes:p + sizeof( length32 ) maxLength:length usedLength:NULL encoding:NSUTF8StringEncoding
+        options:0 range:NSMakeRange( 0, [s length] ) remainingRange:NULL];
+    return p + sizeof( length32 ) + length;
+}
+
+static void IFNonceWriteParams( NSDictionary* params, unsigned char* p )
+{
+    uint32_t count = (uint32_t)[params count];
+    memcpy( p, &count, sizeof( count ) );
+    p += sizeof( count );
+    for ( NSString* key in params )
+    {
+        p = IFNonceWriteString( key, p );
+        p = IFNonceWriteString( [params objectForKey:key], p );
+    }
+}
+
+static NSString* IFNonceReadString( const unsigned char** p, const unsigned char* end )
+{
+    uint32_t length;
+    if ( (size_t)( end - *p ) < sizeof( length ) )
+    {
+        return nil;
+    }
+    memcpy( &length, *p, sizeof( length ) );
+    *p += sizeof( length );
+    if ( (size_t)( end - *p ) < length )
+    {
+        return nil;
+    }
+    NSString* s = [[[NSString alloc] initWithBytes:*p length:length encoding:NSUTF8StringEncoding] autorelease];
+    *p += length;
+    return s;
+}
+
+static NSDictionary* IFNonceReadParams( const IFChargeNonceRecord* record )
+{
+    const unsigned char* p = (const unsigned char*)( record + 1 );
+    const unsigned char* end = p + record->paramsLength;
+    uint32_t count;
+    if ( record->paramsLength < sizeof( count ) )
+    {
+        return nil;
+    }
+    memcpy( &count, p, sizeof( count ) );
+    p += sizeof( count );
+
+    NSMutableDictionary* params = [NSMutableDictionary dictionaryWithCapacity:count];
+    for ( uint32_t i = 0; i < count; i++ )
+    {
+        NSString* key   = IFNonceReadString( &p, end );
+        NSString* value = IFNonceReadString( &p, end );
+        if ( nil == key || nil == value )
+        {
+            return nil;
+        }
+        [params setObject:value forKey:key];
+    }
+    return params;
+}
+
+#pragma -
+#pragma Nonce Store
+
+IFChargeNonceStore* IFChargeNonceStoreOpen( NSString* path, NSTimeInterval ttl )
+{
+    IFChargeNonceStore* store = calloc( 1, sizeof( IFChargeNonceStore ) );
+    pthread_mutex_init( &store->lock, NULL );
+    store->ttl        = ttl;
+    store->fd         = -1;
+    store->capacity   = IF_NONCE_TABLE_MIN;
+    store->entries    = calloc( store->capacity, sizeof( IFChargeNonceEntry ) );
+    store->randomUsed = sizeof( store->random );
+
+    if ( path )
+    {
+        store->path = strdup( [path fileSystemRepresentation] );
+        store->fd = open( store->path, O_RDWR | O_CREAT, 0600 );
+
+        struct stat st;
+        if ( store->fd < 0 || 0 != fstat( store->fd, &st ) ||
+             !IFNonceMap( store, st.st_size > IF_NONCE_LOG_MIN_SIZE ? (size_t)st.st_size : IF_NONCE_LOG_MIN_SIZE ) )
+        {
+            NSLog( @"IFChargeNonceStore: can't map %s (%s); nonces won't persist", store->path, strerror( errno ) );
+            if ( store->fd >= 0 )
+            {
+                close( store->fd );
+                store->fd = -1;
+            }
+        }
+    }
+    if ( NULL == store->map )
+    {
+        IFNonceMap( store, IF_NONCE_LOG_MIN_SIZE );
+    }
+
+    IFNonceReplay( store );
+    return store;
+}
+
+void IFChargeNonceStoreClose( IFChargeNonceStore* store )
+{
+    munmap( store->map, store->mapSize );
+    if ( store->fd >= 0 )
+    {
+        close( store->fd );
+    }
+    pthread_mutex_destroy( &store->lock );
+    free( store->entries );
+    free( store->path );
+    free( store );
+}
+
+// Records a nonce issued for params. Returns NO if there's no room in
+// the log. Called with the lock held.
+static BOOL IFNonceIssue( IFChargeNonceStore* store, const char* nonce, NSDictionary* params )
+{
+    uint32_t paramsLength = [params count] ? (uint32_t)IFNonceParamsLength( params ) : 0;
+    IFChargeNonceRecord* record = IFNonceReserve( store, paramsLength );
+    if ( NULL == record )
+    {
+        return NO;
+    }
+
+    record->expires = IFNonceNow() + store->ttl;
+    memcpy( record->nonce, nonce, IF_CHARGE_NONCE_LENGTH );
+    record->nonce[IF_CHARGE_NONCE_LENGTH] = '\0';
+    if ( paramsLength )
+    {
+        IFNonceWriteParams( params, (unsigned char*)( record + 1 ) );
+    }
+
+    NSTimeInterval expires = record->expires;
+    size_t offset = IFNonceCommit( store, record, kIFNonceRecordIssued );
+    IFNonceInsert( store, nonce, expires, offset );
+    return YES;
+}
+
+// Fills in nonce from the batch of random bytes, drawing another batch
+// when it runs out. Used bytes are cleared.
+static void IFNonceGenerate( IFChargeNonceStore* store, char* nonce )
+{
+    if ( store->randomUsed == sizeof( store->random ) )
+    {
+        arc4random_buf( store->random, sizeof( store->random ) );
+        store->randomUsed = 0;
+    }
+
+    unsigned char* random = store->random + store->randomUsed;
+    for ( NSUInteger i = 0; i < IF_CHARGE_NONCE_LENGTH; i++ )
+    {
+        nonce[i] = _nonceAlphabet[random[i] & IF_NONCE_ALPHABET_MASK];
+    }
+    memset( random, 0, IF_CHARGE_NONCE_LENGTH );
+    store->randomUsed += IF_CHARGE_NONCE_LENGTH;
+}
+
+// Copies nonce into bytes, if it's the right length and all ASCII.
+static BOOL IFNonceGetBytes( NSString* nonce, char* bytes )
+{
+    NSUInteger usedLength = 0;
+    return IF_CHARGE_NONCE_LENGTH == [nonce length] &&
+        [nonce getBytes:bytes maxLength:IF_CHARGE_NONCE_LENGTH usedLength:&usedLength encoding:NSASCIIStringEncoding
+                options:0 range:NSMakeRange( 0, IF_CHARGE_NONCE_LENGTH ) remainingRange:NULL] &&
+        IF_CHARGE_NONCE_LENGTH == usedLength;
+}
+
+NSString* IFChargeNonceCreate( IFChargeNonceStore* store, NSDictionary* extraParams )
+{
+    char nonce[IF_CHARGE_NONCE_LENGTH];
+
+    pthread_mutex_lock( &store->lock );
+    do
+    {
+        IFNonceGenerate( store, nonce );
+    }
+    while ( IFNonceFind( store, nonce ) );
+    BOOL issued = IFNonceIssue( store, nonce, extraParams );
+    pthread_mutex_unlock( &store->lock );
+
+    if ( !issued )
+    {
+        NSLog( @"IFChargeNonceStore: can't grow the log; no nonce issued" );
+        return nil;
+    }
+    return [[NSString alloc] initWithBytes:nonce length:IF_CHARGE_NONCE_LENGTH encoding:NSASCIIStringEncoding];
+}
+
+IFChargeErrorCode IFChargeNonceConsume( IFChargeNonceStore* store, NSString* nonce, NSDictionary** extraParams )
+{
+    if ( extraParams )
+    {
+        *extraParams = nil;
+    }
+
+    char bytes[IF_CHARGE_NONCE_LENGTH];
+    BOOL wellFormed = IFNonceGetBytes( nonce, bytes );
+
+    IFChargeErrorCode code = kIFChargeErrorNone;
+    pthread_mutex_lock( &store->lock );
+
+    IFChargeNonceEntry* entry = wellFormed ? IFNonceFind( store, bytes ) : NULL;
+    if ( 0 == store->count )
+    {
+        code = kIFChargeErrorNoOutstandingRequest;
+    }
+    else if ( 0 == [nonce length] )
+    {
+        code = kIFChargeErrorMissingNonce;
+    }
+    else if ( NULL == entry )
+    {
+        code = kIFChargeErrorIncorrectNonce;
+    }
+    else
+    {
+        // Log the consumption first: making room may move the issued
+        // record, and entry->record with it. A consumption that isn't
+        // logged would be forgotten on relaunch and the nonce accepted
+        // again, so if there's no room the nonce stays outstanding.
+        IFChargeNonceRecord* record = IFNonceReserve( store, 0 );
+        if ( NULL == record )
+        {
+            NSLog( @"IFChargeNonceStore: can't grow the log; nonce not consumed" );
+            code = kIFChargeErrorNonceUnavailable;
+        }
+        else
+        {
+            memcpy( record->nonce, bytes, IF_CHARGE_NONCE_LENGTH );
+            record->nonce[IF_CHARGE_NONCE_LENGTH] = '\0';
+            record->expires = 0;
+            IFNonceCommit( store, record, kIFNonceRecordConsumed );
+
+            if ( entry->expires <= IFNonceNow() )
+            {
+                code = kIFChargeErrorExpiredNonce;
+            }
+            else if ( extraParams && IF_NONCE_RECORD( store, entry->record )->paramsLength )
+            {
+                *extraParams = IFNonceReadParams( IF_NONCE_RECORD( store, entry->record ) );
+            }
+            IFNonceRemove( store, entry );
+        }
+    }
+
+    pthread_mutex_unlock( &store->lock );
+    return code;
+}
+
+NSUInteger IFChargeNonceStoreCount( IFChargeNonceStore* store )
+{
+    pthread_mutex_lock( &store->lock );
+    NSUInteger count = store->count;
+    pthread_mutex_unlock( &store->lock );
+    return count;
+}
+
+void IFChargeNonceStoreRemoveAll( IFChargeNonceStore* store )
+{
+    pthread_mutex_lock( &store->lock );
+    IFNonceResetLog( store );
+    memset( store->entries, 0, store->capacity * sizeof( IFChargeNonceEntry ) );
+    store->count = 0;
+    store->used  = 0;
+    pthread_mutex_unlock( &store->lock );
+}
+
+#pragma -
+#pragma Shared Store
+
+static IFChargeNonceStore* _sharedStore;
+static pthread_once_t      _sharedStoreOnce = PTHREAD_ONCE_INIT;
+
+static void IFNonceOpenSharedStore( void )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    NSString* directory = [NSSearchPathForDirectoriesInDomains( NSLibraryDirectory, NSUserDomainMask, YES ) lastObject];
+    [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES
+                                               attributes:nil error:NULL];
+    _sharedStore = IFChargeNonceStoreOpen( [directory stringByAppendingPathComponent:IF_CHARGE_NONCE_FILE],
+                                           IF_CHARGE_NONCE_TTL );
+
+    // Earlier versions kept the one outstanding nonce in the defaults.
+    NSUserDefaults* defaults = [NSUserDefaults standardUserDefaults];
+    NSString* legacyNonce = [defaults objectForKey:IF_CHARGE_NONCE_KEY];
+    char bytes[IF_CHARGE_NONCE_LENGTH];
+    if ( [legacyNonce isKindOfClass:[NSString class]] && IFNonceGetBytes( legacyNonce, bytes ) )
+    {
+        pthread_mutex_lock( &_sharedStore->lock );
+        if ( !IFNonceFind( _sharedStore, bytes ) )
+        {
+            IFNonceIssue( _sharedStore, bytes, nil );
+        }
+        pthread_mutex_unlock( &_sharedStore->lock );
+    }
+    [defaults removeObjectForKey:IF_CHARGE_NONCE_KEY];
+
+    [pool drain];
+}
+
+IFChargeNonceStore* IFChargeNonceStoreShared( void )
+{
+    pthread_once( &_sharedStoreOnce, IFNonceOpenSharedStore );
+    return _sharedStore;
+}
@@ -0,0 +1,42 @@
+// -*- objc -*-
+//
+// IFChargePattern.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+
+// IFChargePattern - A compiled <regex.h> extended regular expression.
+//
+// Patterns are compiled once per process and cached for its
+// lifetime, so the pointer returned by IFChargePatternGet may be kept
+// in a static and used from any thread. The fixed response field
+// patterns (amount, currency, redactedCardNumber, cardType and
+// responseType) are recognized and matched by hand-written scanners
+// instead of regexec.
+typedef struct IFChargePattern IFChargePattern;
+
+// IFChargePatternGet - Returns the cached pattern for the given
+// extended regular expression, compiling it on first use. Never
+// returns NULL; a pattern that fails to compile is logged once and
+// then never matches.
+extern IFChargePattern* IFChargePatternGet( const char* pattern );
+
+// IFChargePatternMatchesCString - Matches a NUL-terminated string of
+// length len (as returned by strlen) against the pattern.
+extern BOOL IFChargePatternMatchesCString( IFChargePattern* pattern, const char* s, size_t len );
+
+// IFChargePatternMatches - Matches the UTF-8 form of an NSString
+// against the pattern. A nil string never matches.
+extern BOOL IFChargePatternMatches( IFChargePattern* pattern, NSString* s );
+
+// The response field patterns which have hand-written matchers.
+#define IF_CHARGE_AMOUNT_PATTERN               "^(0|[1-9][0-9]*)[.][0-9][0-9]$"
+#define IF_CHARGE_CURRENCY_PATTERN             "^[A-Z]{3}$"
+#define IF_CHARGE_REDACTED_CARD_NUMBER_PATTERN "^X*[0-9]{4}$"
+#define IF_CHARGE_CARD_TYPE_PATTERN            "^[A-Za-z ]{0,20}$"
+#define IF_CHARGE_RESPONSE_TYPE_PATTERN        "^[a-z]*$"
@@ -0,0 +1,250 @@
+//
+// IFChargePattern.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargePattern.h"
+
+#include <pthread.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef BOOL (*IFChargePatternMatcher)( IFChargePattern* pattern, const char* s, size_t len );
+
+struct IFChargePattern
+{
+    char*                   source;
+    IFChargePatternMatcher  match;
+    regex_t                 re;
+    IFChargePattern*        next;
+};
+
+#pragma -
+#pragma Hand-written Matchers
+
+#define IF_IS_DIGIT( c ) ( (unsigned char)( (c) - '0' ) <= 9 )
+#define IF_IS_UPPER( c ) ( (unsigned char)( (c) - 'A' ) <= 'Z' - 'A' )
+#define IF_IS_LOWER( c ) ( (unsigned char)( (c) - 'a' ) <= 'z' - 'a' )
+
+// ^(0|[1-9][0-9]*)[.][0-9][0-9]$
+static BOOL IFMatchAmount( IFChargePattern* pattern, const char* s, size_t len )
+{
+    if ( len < 4 )
+    {
+        return NO;
+    }
+
+    size_t intLen = len - 3;
+    if ( s[intLen] != '.' || !IF_IS_DIGIT( s[intLen + 1] ) || !IF_IS_DIGIT( s[intLen + 2] ) )
+    {
+        return NO;
+    }
+    if ( s[0] == '0' )
+    {
+        return 1 == intLen;
+    }
+    for ( size_t i = 0; i < intLen; i++ )
+    {
+        if ( !IF_IS_DIGIT( s[i] ) )
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+// ^[A-Z]{3}$
+static BOOL IFMatchCurrency( IFChargePattern* pattern, const char* s, size_t len )
+{
+    return 3 == len && IF_IS_UPPER( s[0] ) && IF_IS_UPPER( s[1] ) && IF_IS_UPPER( s[2] );
+}
+
+// ^X*[0-9]{4}$
+static BOOL IFMatchRedactedCardNumber( IFChargePattern* pattern, const char* s, size_t len )
+{
+    if ( len < 4 )
+    {
+        return NO;
+    }
+
+    size_t maskLen = len - 4;
+    for ( size_t i = 0; i < maskLen; i++ )
+    {
+        if ( s[i] != 'X' )
+        {
+            return NO;
+        }
+    }
+    return IF_IS_DIGIT( s[maskLen] ) && IF_IS_DIGIT( s[maskLen + 1] )
+        && IF_IS_DIGIT( s[maskLen + 2] ) && IF_IS_DIGIT( s[maskLen + 3] );
+}
+
+// ^[A-Za-z ]{0,20}$
+static BOOL IFMatchCardType( IFChargePattern* pattern, const char* s, size_t len )
+{
+    if ( len > 20 )
+    {
+        return NO;
+    }
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( !IF_IS_UPPER( s[i] ) && !IF_IS_LOWER( s[i] ) && s[i] != ' ' )
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+// ^[a-z]*$
+static BOOL IFMatchResponseType( IFChargePattern* pattern, const char* s, size_t len )
+{
+    for ( size_t i = 0; i < len; i++ )
+    {
+        if ( !IF_IS_LOWER( s[i] ) )
+        {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+static BOOL IFMatchRegex( IFChargePattern* pattern, const char* s, size_t len )
+{
+    int re_error = regexec(
+        &pattern->re,
+        s,
+        0, NULL, // no captures
+        0        // no flags
+    );
+    if ( re_error && REG_NOMATCH != re_error )
+    {
+        NSLog( @"regexec error %d", re_error );
+    }
+    return 0 == re_error;
+}
+
+static BOOL IFMatchNothing( IFChargePattern* pattern, const char* s, size_t len )
+{
+    return NO;
+}
+
+static const struct
+{
+    const char*            source;
+    IFChargePatternMatcher match;
+} _handWrittenMatchers[] = {
+    { IF_CHARGE_AMOUNT_PATTERN,               IFMatchAmount },
+    { IF_CHARGE_CURRENCY_PATTERN,             IFMatchCurrency },
+    { IF_CHARGE_REDACTED_CARD_NUMBER_PATTERN, IFMatchRedactedCardNumber },
+    { IF_CHARGE_CARD_TYPE_PATTERN,            IFMatchCardType },
+    { IF_CHARGE_RESPONSE_TYPE_PATTERN,        IFMatchResponseType },
+};
+
+#pragma -
+#pragma Pattern Cache
+
+// Entries are only ever prepended, and never freed, so readers walk
+// the list without taking the lock. Writers serialize on the mutex
+// and publish the new head after a full barrier.
+static IFChargePattern* volatile _patternCache = NULL;
+static pthread_mutex_t           _patternCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static IFChargePattern* IFChargePatternFind( IFChargePattern* head, const char* source )
+{
+    for ( IFChargePattern* p = head; p; p = p->next )
+    {
+        if ( 0 == strcmp( p->source, source ) )
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static IFChargePattern* IFChargePatternCreate( const char* source )
+{
+    IFChargePattern* pattern = calloc( 1, sizeof( IFChargePattern ) );
+    pattern->source = strdup( source );
+
+    for ( size_t i = 0; i < sizeof( _handWrittenMatchers ) / sizeof( _handWrittenMatchers[0] ); i++ )
+    {
+        if ( 0 == strcmp( _handWrittenMatchers[i].source, source ) )
+        {
+            pattern->match = _handWrittenMatchers[i].match;
+            return pattern;
+        }
+    }
+
+    int re_error = regcomp(
+        &pattern->re,
+        source,
+        REG_EXTENDED
+        | REG_NOSUB    // match only, no captures
+    );
+    if ( re_error )
+    {
+        NSLog( @"regcomp error %d", re_error );
+        pattern->match = IFMatchNothing;
+    }
+    else
+    {
+        pattern->match = IFMatchRegex;
+    }
+    return pattern;
+}
+
+IFChargePattern* IFChargePatternGet( const char* source )
+{
+    IFChargePattern* pattern = IFChargePatternFind( _patternCache, source );
+    if ( pattern )
+    {
+        return pattern;
+    }
+
+    pthread_mutex_lock( &_patternCacheLock );
+    pattern = IFChargePatternFind( _patternCache, source );
+    if ( !pattern )
+    {
+        pattern = IFChargePatternCreate( source );
+        pattern->next = _patternCache;
+        __sync_synchronize();
+        _patternCache = pattern;
+    }
+    pthread_mutex_unlock( &_patternCacheLock );
+
+    return pattern;
+}
+
+BOOL IFChargePatternMatchesCString( IFChargePattern* pattern, const char* s, size_t len )
+{
+    return pattern->match( pattern, s, len );
+}
+
+BOOL IFChargePatternMatches( IFChargePattern* pattern, NSString* s )
+{
+    if ( nil == s )
+    {
+        return NO;
+    }
+
+    // Field values are short, so avoid the autoreleased buffer behind
+    // UTF8String whenever the string fits on the stack.
+    char buffer[256];
+    const char* string = buffer;
+    if ( ![s getCString:buffer maxLength:sizeof( buffer ) encoding:NSUTF8StringEncoding] )
+    {
+        string = [s UTF8String];
+        if ( NULL == string )
+        {
+            return NO;
+        }
+    }
+
+    return pattern->match( pattern, string, strlen( string ) );
+}
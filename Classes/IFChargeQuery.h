@@ -0,0 +1,166 @@
+// -*- objc -*-
+//
+// IFChargeQuery.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeCharSet.h"
+
+#define IF_CHARGE_QUERY_MAX_FIELDS 32
+
+// IFChargeFieldKind - What a field's setter checks.
+typedef enum {
+    kIFChargeFieldPlain,    // nothing
+    kIFChargeFieldToken,    // nothing, but known values are interned
+    kIFChargeFieldText,     // maxLength and forbidden characters
+    kIFChargeFieldEmail,    // maxLength and RFC 2822
+    kIFChargeFieldURL,      // NSURL accepts it
+    kIFChargeFieldAmount,   // within +/- IF_CHARGE_MONEY_MAX
+    kIFChargeFieldCurrency  // as Token, but sent as USD when unset
+} IFChargeFieldKind;
+
+// IFChargeCharClass - The characters a text field may not contain.
+typedef enum {
+    kIFChargeForbidNone,
+    kIFChargeForbidSymbols, // [NSCharacterSet symbolCharacterSet]
+    kIFChargeForbidPhone    // all but digits, '-' and ' '
+} IFChargeCharClass;
+
+// IFChargeFieldSchema - One field of a message class. Each class
+// declares its fields as a static array of these, built with
+// IF_CHARGE_FIELD, and everything else about a field (the query key,
+// where it's stored, how it's checked) comes from its row.
+typedef struct IFChargeFieldSchema
+{
+    const char*       name;      // e.g. "amount"
+    const char*       ivar;      // e.g. "_amount"
+    IFChargeFieldKind kind;
+    int               maxLength; // 0 for no limit
+    IFChargeCharClass forbidden;
+    const char*       pattern;   // what a response value must match, or NULL
+    unsigned          wireTag;   // the field's number in the wire format
+} IFChargeFieldSchema;
+
+#define IF_CHARGE_FIELD( name, kind, maxLength, forbidden, pattern, wireTag ) \
+    { #name, "_" #name, kIFChargeField##kind, maxLength, kIFChargeForbid##forbidden, pattern, wireTag },
+
+// Wire tags (see IFChargeWire.h) are below this. A field's tag is part
+// of the format, so it never changes once assigned, and is never
+// reused.
+#define IF_CHARGE_WIRE_TAG_LIMIT 64
+
+@class IFChargePattern;
+
+// IFChargeFieldTable - The known fields of a message class, indexed
+// by a perfect hash over their UTF-8 names so that a query key can be
+// resolved to a field slot without building any strings.
+typedef struct IFChargeFieldTable
+{
+    NSUInteger count;
+
+    // The schema, and the per-field data derived from it, in
+    // knownFields order.
+    const IFChargeFieldSchema* schema;
+    NSString*        names[IF_CHARGE_QUERY_MAX_FIELDS];     // e.g. @"amount"
+    NSString*        queryKeys[IF_CHARGE_QUERY_MAX_FIELDS]; // e.g. @"ifcc_amount"
+    ptrdiff_t        offsets[IF_CHARGE_QUERY_MAX_FIELDS];   // of the NSString* ivar
+    IFChargeCharSet* forbidden[IF_CHARGE_QUERY_MAX_FIELDS]; // NULL for kIFChargeForbidNone
+    IFChargePattern* patterns[IF_CHARGE_QUERY_MAX_FIELDS];  // NULL if no pattern
+    BOOL             interned[IF_CHARGE_QUERY_MAX_FIELDS];  // Token and Currency fields
+    const char*      utf8Names[IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t           utf8Lengths[IF_CHARGE_QUERY_MAX_FIELDS];
+
+    // wireIndexes[tag] is the index of the field with that wire tag,
+    // or -1.
+    int8_t           wireIndexes[IF_CHARGE_WIRE_TAG_LIMIT];
+
+    // Perfect hash: buckets[hash & mask] is a field index or -1.
+    uint32_t         seed;
+    uint32_t         mask;
+    int8_t*          buckets;
+} IFChargeFieldTable;
+
+// IFChargeFieldTableCreate - Builds the table for count rows of
+// schema, resolving each row's ivar in messageClass. The schema must
+// outlive the table, which is never freed; create one per class.
+extern IFChargeFieldTable* IFChargeFieldTableCreate( Class messageClass, const IFChargeFieldSchema* schema, NSUInteger count );
+
+// IFChargeFieldSlot - The ivar that holds field index of message.
+#define IFChargeFieldSlot( table, message, index ) \
+    ( (NSString**)( (char*)(message) + (table)->offsets[index] ) )
+
+// IFChargeFieldTableLookup - Returns the index of the field whose name
+// is the len bytes at name, or -1 if there isn't one.
+extern NSInteger IFChargeFieldTableLookup( const IFChargeFieldTable* table, const char* name, size_t len );
+
+// IFChargeQueryParse - Parses the query string of url in a single pass
+// over its UTF-8 bytes. The value of each ifcc_-prefixed known field
+// is stored at values[index] (which must have room for table->count
+// entries); every other field=value pair, including known fields with
+// an empty value, is added to extraParams. As with a dictionary, the
+// last of several pairs with the same key wins, and anything that
+// isn't a field=value pair is skipped. The strings are autoreleased;
+// all the ASCII ones share a single allocation (see
+// IFChargeFieldArena.h), except the values of interned fields that are
+// in the table (see IFChargeIntern.h), which are the shared strings.
+//
+// Returns NO, leaving values and extraParams untouched, if a key or
+// value has a malformed percent escape or isn't UTF-8.
+extern BOOL IFChargeQueryParse( NSURL* url, const IFChargeFieldTable* table, NSString** values, NSMutableDictionary* extraParams );
+
+// IFChargeQueryParseString - As IFChargeQueryParse, for a query string
+// that hasn't been through NSURL, which refuses some of what this
+// rejects.
+extern BOOL IFChargeQueryParseString( NSString* query, const IFChargeFieldTable* table, NSString** values, NSMutableDictionary* extraParams );
+
+// IFChargeEncodedLength - The length of the percent-encoded form of
+// the len UTF-8 bytes at s, as written by IFChargeEncode.
+extern size_t IFChargeEncodedLength( const char* s, size_t len );
+
+// IFChargeEncode - Percent-encodes the len UTF-8 bytes at s into out,
+// which must have room for IFChargeEncodedLength( s, len ) bytes, and
+// returns a pointer just past the last byte written. Everything but
+// the RFC 3986 unreserved characters (ALPHA, DIGIT and "-._~") is
+// encoded, with upper-case hex digits, so the output is the same as
+// IFEncodeURIComponent's.
+extern char* IFChargeEncode( char* out, const char* s, size_t len );
+
+// IFChargeQueryCreateURLString - Appends key=value pairs to base and
+// returns the result, which the caller must release. Pairs with an
+// empty value are skipped. Values are percent-encoded; keys are
+// written as they are. The first pair is introduced with '?' unless
+// hasQuery is set, in which case every pair is introduced with '&'.
+//
+// The length of the URL is worked out before anything is written, so
+// the string is built in a single allocation.
+extern NSString* IFChargeQueryCreateURLString( NSString* base, BOOL hasQuery, NSUInteger count, NSString* const* keys, NSString* const* values );
+
+// IFChargeQueryBuilder - Builds the same URL strings as
+// IFChargeQueryCreateURLString, one after another, for a message
+// whose fields change a few at a time. It keeps the URL it last built,
+// with the bytes of each encoded "&key=value" pair (its fragment) at a
+// known place in it, and the strings each fragment was encoded from.
+// A fragment is dirty when the string passed for its pair is no longer
+// the one it was encoded from; only dirty fragments are encoded again,
+// and each is spliced into the kept URL in place of the old one. The
+// values passed must be immutable, as message fields are.
+//
+// A builder isn't thread safe; a message uses its own under its lock.
+typedef struct IFChargeQueryBuilder IFChargeQueryBuilder;
+
+// IFChargeQueryBuilderCreate - A builder for URLs of count pairs, up
+// to IF_CHARGE_QUERY_MAX_FIELDS. Free it with IFChargeQueryBuilderFree.
+extern IFChargeQueryBuilder* IFChargeQueryBuilderCreate( NSUInteger count );
+
+extern void IFChargeQueryBuilderFree( IFChargeQueryBuilder* builder );
+
+// IFChargeQueryBuilderCreateURLString - IFChargeQueryCreateURLString
+// of the builder's count pairs, byte for byte, which the caller must
+// release. If nothing has changed since the last call, the string it
+// returned is returned again.
+extern NSString* IFChargeQueryBuilderCreateURLString( IFChargeQueryBuilder* builder, NSString* base, BOOL hasQuery, NSString* const* keys, NSString* const* values );
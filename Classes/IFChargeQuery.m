@@ -0,0 +1,835 @@
+//
+// IFChargeQuery.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeQuery.h"
+#import "IFChargeFieldArena.h"
+#import "IFChargeIntern.h"
+#import "IFChargeMessage.h"
+#import "IFChargePattern.h"
+#import "IFChargeStats.h"
+
+#include <objc/runtime.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined( __SSE2__ )
+#include <emmintrin.h>
+#elif defined( __ARM_NEON__ ) || defined( __ARM_NEON )
+#include <arm_neon.h>
+#endif
+
+#define IF_CHARGE_FIELD_PREFIX_CSTRING "ifcc_"
+#define IF_CHARGE_FIELD_PREFIX_LENGTH  ( sizeof( IF_CHARGE_FIELD_PREFIX_CSTRING ) - 1 )
+
+#pragma -
+#pragma Field Table
+
+static uint32_t IFChargeFieldHash( const char* s, size_t len, uint32_t seed )
+{
+    // FNV-1a, seeded, with a final avalanche so the low bits are usable.
+    uint32_t h = 2166136261u ^ seed;
+    for ( size_t i = 0; i < len; i++ )
+    {
+        h = ( h ^ (unsigned char)s[i] ) * 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    return h;
+}
+
+// The characters a kIFChargeForbidPhone field may contain.
+#define IF_CHARGE_PHONE_CHARACTERS @"0123456789- "
+
+static IFChargeCharSet* IFForbiddenCharSet( IFChargeCharClass forbidden )
+{
+    switch ( forbidden )
+    {
+        case kIFChargeForbidSymbols:
+            return IFChargeCharSetCreate( [NSCharacterSet symbolCharacterSet] );
+        case kIFChargeForbidPhone:
+            return IFChargeCharSetCreate( [[NSCharacterSet characterSetWithCharactersInString:IF_CHARGE_PHONE_CHARACTERS] invertedSet] );
+        case kIFChargeForbidNone:
+        default:
+            return NULL;
+    }
+}
+
+IFChargeFieldTable* IFChargeFieldTableCreate( Class messageClass, const IFChargeFieldSchema* schema, NSUInteger count )
+{
+    if ( count > IF_CHARGE_QUERY_MAX_FIELDS )
+    {
+        [NSException raise:NSInternalInconsistencyException
+                     format:@"At most %d fields are supported", IF_CHARGE_QUERY_MAX_FIELDS];
+    }
+
+    IFChargeFieldTable* table = calloc( 1, sizeof( IFChargeFieldTable ) );
+    table->count  = count;
+    table->schema = schema;
+
+    memset( table->wireIndexes, -1, sizeof( table->wireIndexes ) );
+
+    NSUInteger index;
+    for ( index = 0; index < count; index++ )
+    {
+        const IFChargeFieldSchema* field = &schema[index];
+
+        if ( 0 == field->wireTag || field->wireTag >= IF_CHARGE_WIRE_TAG_LIMIT || -1 != table->wireIndexes[field->wireTag] )
+        {
+            [NSException raise:NSInternalInconsistencyException
+                         format:@"%@ field %s has a bad or duplicate wire tag", NSStringFromClass( messageClass ), field->name];
+        }
+        table->wireIndexes[field->wireTag] = (int8_t)index;
+
+        Ivar ivar = class_getInstanceVariable( messageClass, field->ivar );
+        if ( NULL == ivar )
+        {
+            [NSException raise:NSInternalInconsistencyException
+                         format:@"%@ has no ivar %s", NSStringFromClass( messageClass ), field->ivar];
+        }
+
+        table->names[index]       = [[NSString alloc] initWithUTF8String:field->name];
+        table->queryKeys[index]   = [[IF_CHARGE_MESSAGE_FIELD_PREFIX stringByAppendingString:table->names[index]] retain];
+        table->offsets[index]     = ivar_getOffset( ivar );
+        table->forbidden[index]   = IFForbiddenCharSet( field->forbidden );
+        table->patterns[index]    = field->pattern ? IFChargePatternGet( field->pattern ) : NULL;
+        table->interned[index]    = ( kIFChargeFieldToken == field->kind || kIFChargeFieldCurrency == field->kind );
+        table->utf8Names[index]   = field->name;
+        table->utf8Lengths[index] = strlen( field->name );
+    }
+
+    // Search for a seed that puts every field in its own bucket. With a
+    // table at least twice the field count this takes a handful of
+    // tries; grow the table if it somehow doesn't.
+    uint32_t size = 4;
+    while ( size < 2 * count )
+    {
+        size <<= 1;
+    }
+    for ( ;; size <<= 1 )
+    {
+        table->buckets = realloc( table->buckets, size );
+        table->mask = size - 1;
+        for ( uint32_t seed = 0; seed < 4096; seed++ )
+        {
+            memset( table->buckets, -1, size );
+            BOOL collided = NO;
+            for ( index = 0; index < count && !collided; index++ )
+            {
+                uint32_t bucket = IFChargeFieldHash( table->utf8Names[index], table->utf8Lengths[index], seed ) & table->mask;
+                collided = ( -1 != table->buckets[bucket] );
+                table->buckets[bucket] = (int8_t)index;
+            }
+            if ( !collided )
+            {
+                table->seed = seed;
+                return table;
+            }
+        }
+    }
+}
+
+NSInteger IFChargeFieldTableLookup( const IFChargeFieldTable* table, const char* name, size_t len )
+{
+    int8_t index = table->buckets[IFChargeFieldHash( name, len, table->seed ) & table->mask];
+    if ( index < 0
+         || table->utf8Lengths[index] != len
+         || 0 != memcmp( table->utf8Names[index], name, len ) )
+    {
+        return -1;
+    }
+    return index;
+}
+
+#pragma -
+#pragma Query Parsing
+
+static int IFHexValue( char c )
+{
+    if ( c >= '0' && c <= '9' ) return c - '0';
+    if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes the percent escapes in s[0..len) in place and returns the
+// decoded length, or -1 if an escape is malformed.
+static long IFPercentDecodeInPlace( char* s, size_t len )
+{
+    char* end = s + len;
+    char* r = memchr( s, '%', len );
+    if ( NULL == r )
+    {
+        return len;
+    }
+
+    char* w = r;
+    while ( r < end )
+    {
+        if ( '%' == *r )
+        {
+            int hi, lo;
+            if ( end - r < 3 || ( hi = IFHexValue( r[1] ) ) < 0 || ( lo = IFHexValue( r[2] ) ) < 0 )
+            {
+                return -1;
+            }
+            *w++ = (char)( ( hi << 4 ) | lo );
+            r += 3;
+        }
+        else
+        {
+            *w++ = *r++;
+        }
+    }
+    return w - s;
+}
+
+static NSString* IFCreateString( const char* bytes, size_t len )
+{
+    return [[NSString alloc] initWithBytes:bytes length:len encoding:NSUTF8StringEncoding];
+}
+
+// A field=value pair, decoded in place.
+typedef struct IFQueryPair
+{
+    const char* key;
+    size_t      keyLength;
+    const char* value;
+    size_t      valueLength;
+    NSInteger   field;       // a field index, or one of the below
+    NSString*   keyString;
+    NSString*   valueString;
+} IFQueryPair;
+
+#define IF_QUERY_PAIR_EXTRA      -1
+#define IF_QUERY_PAIR_SUPERSEDED -2 // a known field set again later
+
+// Makes the string for len bytes at bytes: into the arena lists if
+// it fits an arena, or at once if not, as a value decoded from %00
+// doesn't.
+static BOOL IFQueueString( const char* bytes, size_t len, NSString** target,
+                           const char** arenaBytes, size_t* arenaLengths, NSString*** arenaTargets, NSUInteger* arenaCount )
+{
+    if ( IFChargeFieldFitsArena( bytes, len ) )
+    {
+        arenaBytes[*arenaCount]   = bytes;
+        arenaLengths[*arenaCount] = len;
+        arenaTargets[*arenaCount] = target;
+        ( *arenaCount )++;
+        return YES;
+    }
+    *target = IFCreateString( bytes, len );
+    return nil != *target;
+}
+
+BOOL IFChargeQueryParse( NSURL* url, const IFChargeFieldTable* table, NSString** values, NSMutableDictionary* extraParams )
+{
+    return IFChargeQueryParseString( [url query], table, values, extraParams );
+}
+
+BOOL IFChargeQueryParseString( NSString* query, const IFChargeFieldTable* table, NSString** values, NSMutableDictionary* extraParams )
+{
+    IF_CHARGE_STATS_START( parseStart );
+    NSUInteger queryLength = [query length];
+    if ( 0 == queryLength )
+    {
+        IF_CHARGE_STATS_STOP( kIFChargeStageQueryParse, parseStart );
+        return YES;
+    }
+
+    // The query is percent-encoded, so it's almost always ASCII and
+    // fits on the stack.
+    char stackBuffer[2048];
+    NSUInteger capacity = [query maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    char* buffer = ( capacity <= sizeof( stackBuffer ) ) ? stackBuffer : malloc( capacity );
+    NSUInteger length = 0;
+    [query getBytes:buffer
+          maxLength:capacity
+         usedLength:&length
+           encoding:NSUTF8StringEncoding
+            options:0
+              range:NSMakeRange( 0, queryLength )
+     remainingRange:NULL];
+    char* end = buffer + length;
+
+    // Every pair is decoded in place and noted first; the strings are
+    // made afterwards, the ASCII ones (nearly all) in a single arena.
+    NSUInteger pairCapacity = 1;
+    for ( const char* amp = buffer; ( amp = memchr( amp, '&', end - amp ) ); amp++ )
+    {
+        pairCapacity++;
+    }
+    IFQueryPair  stackPairs[IF_CHARGE_QUERY_MAX_FIELDS];
+    const char*  stackArenaBytes[2 * IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t       stackArenaLengths[2 * IF_CHARGE_QUERY_MAX_FIELDS];
+    NSString**   stackArenaTargets[2 * IF_CHARGE_QUERY_MAX_FIELDS];
+    NSString*    stackArenaStrings[2 * IF_CHARGE_QUERY_MAX_FIELDS];
+    IFQueryPair* pairs         = stackPairs;
+    const char** arenaBytes    = stackArenaBytes;
+    size_t*      arenaLengths  = stackArenaLengths;
+    NSString***  arenaTargets  = stackArenaTargets;
+    NSString**   arenaStrings  = stackArenaStrings;
+    if ( pairCapacity > IF_CHARGE_QUERY_MAX_FIELDS )
+    {
+        pairs        = malloc( pairCapacity * sizeof( IFQueryPair ) );
+        arenaBytes   = malloc( 2 * pairCapacity * sizeof( const char* ) );
+        arenaLengths = malloc( 2 * pairCapacity * sizeof( size_t ) );
+        arenaTargets = malloc( 2 * pairCapacity * sizeof( NSString** ) );
+        arenaStrings = malloc( 2 * pairCapacity * sizeof( NSString* ) );
+    }
+    NSUInteger pairCount = 0;
+
+    // The pair that set each field. Only the last occurrence counts.
+    NSInteger fieldPairs[IF_CHARGE_QUERY_MAX_FIELDS];
+    for ( NSUInteger index = 0; index < table->count; index++ )
+    {
+        fieldPairs[index] = -1;
+    }
+
+    IF_CHARGE_STATS_START( decodeStart );
+    BOOL valid = YES;
+    for ( char* pair = buffer; pair <= end && valid; )
+    {
+        char* pairEnd = memchr( pair, '&', end - pair );
+        if ( NULL == pairEnd )
+        {
+            pairEnd = end;
+        }
+
+        // Only interested in field=value pairs
+        char* equals = memchr( pair, '=', pairEnd - pair );
+        if ( equals && NULL == memchr( equals + 1, '=', pairEnd - equals - 1 ) )
+        {
+            long keyLength   = IFPercentDecodeInPlace( pair, equals - pair );
+            long valueLength = IFPercentDecodeInPlace( equals + 1, pairEnd - equals - 1 );
+            if ( keyLength < 0 || valueLength < 0 )
+            {
+                valid = NO;
+                break;
+            }
+
+            NSInteger index = -1;
+            if ( (size_t)keyLength > IF_CHARGE_FIELD_PREFIX_LENGTH
+                 && 0 == memcmp( pair, IF_CHARGE_FIELD_PREFIX_CSTRING, IF_CHARGE_FIELD_PREFIX_LENGTH ) )
+            {
+                index = IFChargeFieldTableLookup(
+                    table,
+                    pair + IF_CHARGE_FIELD_PREFIX_LENGTH,
+                    keyLength - IF_CHARGE_FIELD_PREFIX_LENGTH
+                );
+            }
+
+            IFQueryPair* noted = &pairs[pairCount];
+            noted->key         = pair;
+            noted->keyLength   = keyLength;
+            noted->value       = equals + 1;
+            noted->valueLength = valueLength;
+            noted->field       = IF_QUERY_PAIR_EXTRA;
+            noted->keyString   = nil;
+            noted->valueString = nil;
+            if ( index >= 0 )
+            {
+                if ( fieldPairs[index] >= 0 )
+                {
+                    pairs[fieldPairs[index]].field = IF_QUERY_PAIR_SUPERSEDED;
+                }
+                fieldPairs[index] = pairCount;
+                noted->field = index;
+            }
+            pairCount++;
+        }
+
+        pair = pairEnd + 1;
+    }
+    IF_CHARGE_STATS_STOP( kIFChargeStagePercentDecode, decodeStart );
+
+    // Extra params need their key and value; known fields, their
+    // value unless it's empty, in which case it's left for the caller
+    // in extraParams.
+    NSUInteger arenaCount = 0;
+    for ( NSUInteger index = 0; index < pairCount && valid; index++ )
+    {
+        IFQueryPair* pair = &pairs[index];
+        if ( IF_QUERY_PAIR_EXTRA == pair->field )
+        {
+            valid = IFQueueString( pair->key, pair->keyLength, &pair->keyString,
+                                   arenaBytes, arenaLengths, arenaTargets, &arenaCount )
+                 && IFQueueString( pair->value, pair->valueLength, &pair->valueString,
+                                   arenaBytes, arenaLengths, arenaTargets, &arenaCount );
+        }
+        else if ( pair->field >= 0 && pair->valueLength > 0 )
+        {
+            // A known value of an interned field needs no string.
+            if ( table->interned[pair->field] )
+            {
+                pair->valueString = [IFChargeInternLookup( pair->value, pair->valueLength ) retain];
+                if ( pair->valueString )
+                {
+                    continue;
+                }
+            }
+            valid = IFQueueString( pair->value, pair->valueLength, &pair->valueString,
+                                   arenaBytes, arenaLengths, arenaTargets, &arenaCount );
+        }
+    }
+
+    if ( valid )
+    {
+        IFChargeFieldArenaCreateStrings( arenaCount, arenaBytes, arenaLengths, arenaStrings );
+        for ( NSUInteger index = 0; index < arenaCount; index++ )
+        {
+            *arenaTargets[index] = arenaStrings[index];
+        }
+
+        for ( NSUInteger index = 0; index < pairCount; index++ )
+        {
+            IFQueryPair* pair = &pairs[index];
+            if ( IF_QUERY_PAIR_EXTRA == pair->field )
+            {
+                [extraParams setObject:pair->valueString forKey:pair->keyString];
+            }
+            else if ( pair->field >= 0 && pair->valueString )
+            {
+                values[pair->field] = [pair->valueString autorelease];
+                pair->valueString = nil;
+            }
+        }
+        for ( NSUInteger index = 0; index < table->count; index++ )
+        {
+            if ( fieldPairs[index] >= 0 && 0 == pairs[fieldPairs[index]].valueLength )
+            {
+                [extraParams setObject:@"" forKey:table->queryKeys[index]];
+            }
+        }
+    }
+
+    for ( NSUInteger index = 0; index < pairCount; index++ )
+    {
+        [pairs[index].keyString release];
+        [pairs[index].valueString release];
+    }
+
+    if ( pairs != stackPairs )
+    {
+        free( pairs );
+        free( arenaBytes );
+        free( arenaLengths );
+        free( arenaTargets );
+        free( arenaStrings );
+    }
+    if ( buffer != stackBuffer )
+    {
+        free( buffer );
+    }
+
+    IF_CHARGE_STATS_STOP( kIFChargeStageQueryParse, parseStart );
+    return valid;
+}
+
+#pragma -
+#pragma Percent Encoding
+
+// 1 for the RFC 3986 unreserved characters, which are the only ones
+// left alone; every other byte, including all of the non-ASCII UTF-8
+// bytes, is encoded.
+static const unsigned char _unreserved[256] = {
+//  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, // 0x20  - .
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 0x30  0-9
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40  A-O
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, // 0x50  P-Z _
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60  a-o
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, // 0x70  p-z ~
+};
+
+static const char _hexDigits[16] = "0123456789ABCDEF";
+
+// Returns the number of unreserved bytes at the start of s[0..len).
+// Field values are mostly letters and digits, so the runs are long
+// and are checked 16 bytes at a time where the CPU allows.
+static size_t IFUnreservedRunLength( const unsigned char* s, size_t len )
+{
+    size_t i = 0;
+
+#if defined( __SSE2__ )
+    // Signed compares are fine here: every unreserved character is
+    // ASCII, and bytes from 0x80 up compare as negative.
+    const __m128i caseBit = _mm_set1_epi8( 0x20 );
+    for ( ; i + 16 <= len; i += 16 )
+    {
+        __m128i v     = _mm_loadu_si128( (const __m128i*)( s + i ) );
+        __m128i lower = _mm_or_si128( v, caseBit );
+        __m128i alpha = _mm_and_si128( _mm_cmpgt_epi8( lower, _mm_set1_epi8( 'a' - 1 ) ),
+                                       _mm_cmplt_epi8( lower, _mm_set1_epi8( 'z' + 1 ) ) );
+        __m128i digit = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( '0' - 1 ) ),
+                                       _mm_cmplt_epi8( v, _mm_set1_epi8( '9' + 1 ) ) );
+        __m128i punct = _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '-' ) ),
+                                                    _mm_cmpeq_epi8( v, _mm_set1_epi8( '.' ) ) ),
+                                      _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '_' ) ),
+                                                    _mm_cmpeq_epi8( v, _mm_set1_epi8( '~' ) ) ) );
+        int mask = _mm_movemask_epi8( _mm_or_si128( _mm_or_si128( alpha, digit ), punct ) );
+        if ( 0xffff != mask )
+        {
+            return i + __builtin_ctz( ~mask );
+        }
+    }
+#elif defined( __ARM_NEON__ ) || defined( __ARM_NEON )
+    for ( ; i + 16 <= len; i += 16 )
+    {
+        uint8x16_t v     = vld1q_u8( s + i );
+        uint8x16_t lower = vorrq_u8( v, vdupq_n_u8( 0x20 ) );
+        uint8x16_t ok    = vandq_u8( vcgeq_u8( lower, vdupq_n_u8( 'a' ) ), vcleq_u8( lower, vdupq_n_u8( 'z' ) ) );
+        ok = vorrq_u8( ok, vandq_u8( vcgeq_u8( v, vdupq_n_u8( '0' ) ), vcleq_u8( v, vdupq_n_u8( '9' ) ) ) );
+        ok = vorrq_u8( ok, vorrq_u8( vceqq_u8( v, vdupq_n_u8( '-' ) ), vceqq_u8( v, vdupq_n_u8( '.' ) ) ) );
+        ok = vorrq_u8( ok, vorrq_u8( vceqq_u8( v, vdupq_n_u8( '_' ) ), vceqq_u8( v, vdupq_n_u8( '~' ) ) ) );
+        uint64x2_t halves = vreinterpretq_u64_u8( ok );
+        if ( ~0ULL != ( vgetq_lane_u64( halves, 0 ) & vgetq_lane_u64( halves, 1 ) ) )
+        {
+            // The scalar loop below finds the byte.
+            break;
+        }
+    }
+#endif
+
+    while ( i < len && _unreserved[s[i]] )
+    {
+        i++;
+    }
+    return i;
+}
+
+size_t IFChargeEncodedLength( const char* s, size_t len )
+{
+    const unsigned char* bytes = (const unsigned char*)s;
+    size_t encodedLength = len;
+    size_t i = 0;
+    while ( i < len )
+    {
+        i += IFUnreservedRunLength( bytes + i, len - i );
+        if ( i < len )
+        {
+            encodedLength += 2; // one byte becomes %XX
+            i++;
+        }
+    }
+    return encodedLength;
+}
+
+char* IFChargeEncode( char* out, const char* s, size_t len )
+{
+    const unsigned char* bytes = (const unsigned char*)s;
+    size_t i = 0;
+    while ( i < len )
+    {
+        size_t run = IFUnreservedRunLength( bytes + i, len - i );
+        memcpy( out, bytes + i, run );
+        out += run;
+        i   += run;
+        if ( i < len )
+        {
+            *out++ = '%';
+            *out++ = _hexDigits[bytes[i] >> 4];
+            *out++ = _hexDigits[bytes[i] & 0xf];
+            i++;
+        }
+    }
+    return out;
+}
+
+#pragma -
+#pragma URL Building
+
+static size_t IFGetUTF8Bytes( NSString* s, char* buffer, NSUInteger capacity )
+{
+    NSUInteger length = 0;
+    [s getBytes:buffer
+      maxLength:capacity
+     usedLength:&length
+       encoding:NSUTF8StringEncoding
+        options:0
+          range:NSMakeRange( 0, [s length] )
+ remainingRange:NULL];
+    return length;
+}
+
+NSString* IFChargeQueryCreateURLString( NSString* base, BOOL hasQuery, NSUInteger count, NSString* const* keys, NSString* const* values )
+{
+    IF_CHARGE_STATS_START( encodeStart );
+
+    // First pass: gather the UTF-8 bytes of the base and of each pair
+    // into one scratch buffer, and add up the length of the result.
+    NSUInteger capacity = [base maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        if ( [values[index] length] )
+        {
+            capacity += [keys[index] maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding]
+                      + [values[index] maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        }
+    }
+
+    char stackScratch[1024];
+    char* scratch = ( capacity <= sizeof( stackScratch ) ) ? stackScratch : malloc( capacity );
+
+    // lengths[0] is the base; then key and value for each pair. An
+    // empty value marks a skipped pair.
+    size_t stackLengths[1 + 2 * IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t* lengths = ( count <= IF_CHARGE_QUERY_MAX_FIELDS )
+        ? stackLengths
+        : malloc( ( 1 + 2 * count ) * sizeof( size_t ) );
+
+    char* scratchEnd = scratch;
+    lengths[0] = IFGetUTF8Bytes( base, scratchEnd, capacity );
+    scratchEnd += lengths[0];
+    size_t urlLength = lengths[0];
+
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        size_t* keyLength   = &lengths[1 + 2 * index];
+        size_t* valueLength = &lengths[2 + 2 * index];
+        *keyLength = *valueLength = 0;
+        if ( 0 == [values[index] length] )
+        {
+            continue;
+        }
+
+        *keyLength = IFGetUTF8Bytes( keys[index], scratchEnd, capacity - ( scratchEnd - scratch ) );
+        scratchEnd += *keyLength;
+        *valueLength = IFGetUTF8Bytes( values[index], scratchEnd, capacity - ( scratchEnd - scratch ) );
+
+        // separator, key, '=' and the encoded value
+        urlLength  += 2 + *keyLength + IFChargeEncodedLength( scratchEnd, *valueLength );
+        scratchEnd += *valueLength;
+    }
+
+    // Second pass: write the URL into a buffer of exactly that length,
+    // which the string then takes ownership of.
+    char* url = malloc( urlLength ? urlLength : 1 );
+    char* w = url;
+    const char* r = scratch;
+
+    memcpy( w, r, lengths[0] );
+    w += lengths[0];
+    r += lengths[0];
+
+    BOOL first = !hasQuery;
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        size_t keyLength   = lengths[1 + 2 * index];
+        size_t valueLength = lengths[2 + 2 * index];
+        if ( 0 == valueLength )
+        {
+            continue;
+        }
+
+        *w++ = first ? '?' : '&';
+        first = NO;
+        memcpy( w, r, keyLength );
+        w += keyLength;
+        *w++ = '=';
+        w = IFChargeEncode( w, r + keyLength, valueLength );
+        r += keyLength + valueLength;
+    }
+
+    if ( scratch != stackScratch )
+    {
+        free( scratch );
+    }
+    if ( lengths != stackLengths )
+    {
+        free( lengths );
+    }
+
+    IF_CHARGE_STATS_STOP( kIFChargeStageEncode, encodeStart );
+    return [[NSString alloc] initWithBytesNoCopy:url
+                                          length:urlLength
+                                        encoding:NSUTF8StringEncoding
+                                    freeWhenDone:YES];
+}
+
+#pragma -
+#pragma Incremental URL Building
+
+struct IFChargeQueryBuilder
+{
+    NSUInteger count;
+
+    // What the URL was last built from, retained. A fragment is clean
+    // while its key and value are these very strings.
+    NSString*  base;
+    BOOL       hasQuery;
+    NSString*  keys[IF_CHARGE_QUERY_MAX_FIELDS];
+    NSString*  values[IF_CHARGE_QUERY_MAX_FIELDS];
+
+    // The URL: the base is bytes [0, bounds[0]) and fragment i is
+    // bytes [bounds[i], bounds[i + 1]), empty if its pair is skipped.
+    // Every fragment starts with '&' here; the first is given its real
+    // separator only once the URL is complete.
+    char*      url;
+    size_t     length;
+    size_t     capacity;
+    size_t     bounds[IF_CHARGE_QUERY_MAX_FIELDS + 1];
+
+    // The string last returned, until something changes.
+    NSString*  string;
+};
+
+IFChargeQueryBuilder* IFChargeQueryBuilderCreate( NSUInteger count )
+{
+    NSCParameterAssert( count <= IF_CHARGE_QUERY_MAX_FIELDS );
+    IFChargeQueryBuilder* builder = calloc( 1, sizeof( IFChargeQueryBuilder ) );
+    builder->count    = count;
+    builder->capacity = 256;
+    builder->url      = malloc( builder->capacity );
+    return builder;
+}
+
+void IFChargeQueryBuilderFree( IFChargeQueryBuilder* builder )
+{
+    if ( NULL == builder )
+    {
+        return;
+    }
+    for ( NSUInteger index = 0; index < builder->count; index++ )
+    {
+        [builder->keys[index] release];
+        [builder->values[index] release];
+    }
+    [builder->base release];
+    [builder->string release];
+    free( builder->url );
+    free( builder );
+}
+
+// Makes the bytes of fragment (or of the base, for -1) length long,
+// moving everything after them, and returns where to write them.
+static char* IFBuilderResize( IFChargeQueryBuilder* builder, NSInteger fragment, size_t length )
+{
+    size_t start = ( fragment < 0 ) ? 0 : builder->bounds[fragment];
+    size_t end   = builder->bounds[fragment + 1];
+    size_t urlLength = builder->length - ( end - start ) + length;
+    if ( urlLength > builder->capacity )
+    {
+        builder->capacity = MAX( urlLength, 2 * builder->capacity );
+        builder->url = realloc( builder->url, builder->capacity );
+    }
+
+    memmove( builder->url + start + length, builder->url + end, builder->length - end );
+    for ( NSUInteger bound = fragment + 1; bound <= builder->count; bound++ )
+    {
+        builder->bounds[bound] = builder->bounds[bound] - ( end - start ) + length;
+    }
+    builder->length = urlLength;
+    return builder->url + start;
+}
+
+static void IFBuilderSetBase( IFChargeQueryBuilder* builder, NSString* base )
+{
+    NSUInteger capacity = [base maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    char stackScratch[1024];
+    char* scratch = ( capacity <= sizeof( stackScratch ) ) ? stackScratch : malloc( capacity );
+
+    size_t length = IFGetUTF8Bytes( base, scratch, capacity );
+    memcpy( IFBuilderResize( builder, -1, length ), scratch, length );
+
+    if ( scratch != stackScratch )
+    {
+        free( scratch );
+    }
+}
+
+// Encodes the pair for fragment index as IFChargeQueryCreateURLString
+// does, skipping it if the value is empty.
+static void IFBuilderSetFragment( IFChargeQueryBuilder* builder, NSUInteger index, NSString* key, NSString* value )
+{
+    if ( 0 == [value length] )
+    {
+        IFBuilderResize( builder, index, 0 );
+        return;
+    }
+
+    NSUInteger capacity = [key maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding]
+                        + [value maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    char stackScratch[1024];
+    char* scratch = ( capacity <= sizeof( stackScratch ) ) ? stackScratch : malloc( capacity );
+
+    size_t keyLength   = IFGetUTF8Bytes( key, scratch, capacity );
+    size_t valueLength = IFGetUTF8Bytes( value, scratch + keyLength, capacity - keyLength );
+    if ( 0 == valueLength )
+    {
+        IFBuilderResize( builder, index, 0 );
+    }
+    else
+    {
+        size_t encodedLength = IFChargeEncodedLength( scratch + keyLength, valueLength );
+        char* w = IFBuilderResize( builder, index, 2 + keyLength + encodedLength );
+        *w++ = '&';
+        memcpy( w, scratch, keyLength );
+        w += keyLength;
+        *w++ = '=';
+        IFChargeEncode( w, scratch + keyLength, valueLength );
+    }
+
+    if ( scratch != stackScratch )
+    {
+        free( scratch );
+    }
+}
+
+NSString* IFChargeQueryBuilderCreateURLString( IFChargeQueryBuilder* builder, NSString* base, BOOL hasQuery, NSString* const* keys, NSString* const* values )
+{
+    IF_CHARGE_STATS_START( encodeStart );
+
+    // Put the first fragment's '&' back, in case it stops being first.
+    BOOL changed = ( hasQuery != builder->hasQuery );
+    if ( builder->length > builder->bounds[0] )
+    {
+        builder->url[builder->bounds[0]] = '&';
+    }
+
+    if ( base != builder->base )
+    {
+        IFBuilderSetBase( builder, base );
+        [builder->base release];
+        builder->base = [base retain];
+        changed = YES;
+    }
+    for ( NSUInteger index = 0; index < builder->count; index++ )
+    {
+        if ( keys[index] == builder->keys[index] && values[index] == builder->values[index] )
+        {
+            continue;
+        }
+
+        IFBuilderSetFragment( builder, index, keys[index], values[index] );
+        [builder->keys[index] release];
+        [builder->values[index] release];
+        builder->keys[index]   = [keys[index] retain];
+        builder->values[index] = [values[index] retain];
+        changed = YES;
+    }
+
+    builder->hasQuery = hasQuery;
+    if ( builder->length > builder->bounds[0] )
+    {
+        builder->url[builder->bounds[0]] = hasQuery ? '&' : '?';
+    }
+    if ( changed || nil == builder->string )
+    {
+        [builder->string release];
+        builder->string = [[NSString alloc] initWithBytes:builder->url
+                                                   length:builder->length
+                                                 encoding:NSUTF8StringEncoding];
+    }
+
+    IF_CHARGE_STATS_STOP( kIFChargeStageEncode, encodeStart );
+    return [builder->string retain];
+}
@@ -56,7 +56,7 @@ extern const int Zip_MAX_LENGTH;
     NSString* _returnAppName;
     NSString* _returnURL;
     NSString* _requestBaseURI;
-    
+    NSDictionary* _storedExtraParams;
 
     NSString* _address;
     NSString* _city;
@@ -123,6 +123,26 @@ extern const int Zip_MAX_LENGTH;
 // and values.
 - (void)setReturnURL:(NSString*)url withExtraParams:(NSDictionary*)extraParams;
 
+// setReturnURL:withStoredExtraParams: - Like the above, but the
+// parameters stay on the device, kept with the request's nonce (see
+// IFChargeNonceStore), instead of riding on the returnURL. The URL
+// stays short and the parameters can't be tampered with. They are
+// merged into the response's extraParams when its nonce is checked.
+- (void)setReturnURL:(NSString*)url withStoredExtraParams:(NSDictionary*)extraParams;
+
+// storedExtraParams - The parameters given to
+// setReturnURL:withStoredExtraParams:, or nil.
+@property (readonly,copy) NSDictionary* storedExtraParams;
+
+// submitURL - The URL submit would open, for sending the request some
+// other way (a link, a QR code, a test harness). As submit does, it
+// issues a nonce and adds it to the returnURL, so each call leaves
+// one more nonce on the returnURL: call it on a fresh copy per
+// request. If no nonce can be issued (the nonce store's log couldn't
+// grow), it raises NSInternalInconsistencyException rather than send
+// a request whose response would be rejected; so does submit.
+- (NSURL*)submitURL;
+
 // requestBaseURI - If not nil, credit card terminal will derive its
 // requestURL by appending query params to this, otherwise
 // IF_CHARGE_API_BASE_URI will be used.
@@ -183,6 +203,26 @@ extern const int Zip_MAX_LENGTH;
 // Up to 20 characters (no symbols).
 @property (copy) NSString* zip;
 
+// Setters that report bad values instead of raising; see
+// IFChargeError. The plain setters call these and raise on failure.
+- (BOOL)trySetReturnAppName:(NSString*)returnAppName error:(IFChargeError*)error;
+- (BOOL)trySetReturnURL:(NSString*)returnURL error:(IFChargeError*)error;
+- (BOOL)trySetReturnURL:(NSString*)url withExtraParams:(NSDictionary*)extraParams error:(IFChargeError*)error;
+- (BOOL)trySetReturnURL:(NSString*)url withStoredExtraParams:(NSDictionary*)extraParams error:(IFChargeError*)error;
+- (BOOL)trySetRequestBaseURI:(NSString*)requestBaseURI error:(IFChargeError*)error;
+- (BOOL)trySetAddress:(NSString*)address error:(IFChargeError*)error;
+- (BOOL)trySetCity:(NSString*)city error:(IFChargeError*)error;
+- (BOOL)trySetCompany:(NSString*)company error:(IFChargeError*)error;
+- (BOOL)trySetCountry:(NSString*)country error:(IFChargeError*)error;
+- (BOOL)trySetDescription:(NSString*)description error:(IFChargeError*)error;
+- (BOOL)trySetEmail:(NSString*)email error:(IFChargeError*)error;
+- (BOOL)trySetFirstName:(NSString*)firstName error:(IFChargeError*)error;
+- (BOOL)trySetInvoiceNumber:(NSString*)invoiceNumber error:(IFChargeError*)error;
+- (BOOL)trySetLastName:(NSString*)lastName error:(IFChargeError*)error;
+- (BOOL)trySetPhone:(NSString*)phone error:(IFChargeError*)error;
+- (BOOL)trySetState:(NSString*)state error:(IFChargeError*)error;
+- (BOOL)trySetZip:(NSString*)zip error:(IFChargeError*)error;
+
 // init - designated initializer
 - init;
 
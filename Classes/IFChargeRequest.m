@@ -30,70 +30,82 @@
 // OTHER DEALINGS IN THE SOFTWARE.
 //
 #import "IFChargeRequest.h"
+#import "IFChargeNonce.h"
 
 #include <stdlib.h>
 
-#ifdef TARGET_OS_IPHONE
+#if TARGET_OS_IPHONE
 #import <UIKit/UIKit.h>
 #endif
 
-#define IF_CHARGE_REQUEST_FIELD_LIST \
-    @"returnAppName", \
-    @"returnURL", \
-    @"address", \
-    @"amount", \
-    @"subtotal", \
-    @"tip", \
-    @"tax", \
-    @"shipping", \
-    @"discount", \
-    @"city", \
-    @"company", \
-    @"country", \
-    @"currency", \
-    @"description", \
-    @"email", \
-    @"firstName", \
-    @"invoiceNumber", \
-    @"lastName", \
-    @"phone", \
-    @"state", \
-    @"zip", \
-    nil
+// IF_CHARGE_REQUEST_FIELDS - The request's fields, in knownFields
+// order, and the one place to add a field. TEXT rows give the length
+// limit (0 for none) and forbidden characters; TEXT, EMAIL and URL
+// rows also define the Name_MAX_LENGTH constant. The last column is
+// the field's wire tag; a new field takes the next unused one.
+#define IF_CHARGE_REQUEST_FIELDS( TEXT, EMAIL, URL, AMOUNT, CURRENCY ) \
+    TEXT(     returnAppName, ReturnAppName, 0,   None,    8  ) \
+    URL(      returnURL,     ReturnURL,                   9  ) \
+    TEXT(     address,       Address,       60,  Symbols, 10 ) \
+    AMOUNT(   amount,                                     1  ) \
+    AMOUNT(   subtotal,                                   2  ) \
+    AMOUNT(   tip,                                        3  ) \
+    AMOUNT(   tax,                                        4  ) \
+    AMOUNT(   shipping,                                   5  ) \
+    AMOUNT(   discount,                                   6  ) \
+    TEXT(     city,          City,          40,  Symbols, 11 ) \
+    TEXT(     company,       Company,       50,  Symbols, 12 ) \
+    TEXT(     country,       Country,       60,  Symbols, 13 ) \
+    CURRENCY( currency,                                   7  ) \
+    TEXT(     description,   Description,   255, Symbols, 14 ) \
+    EMAIL(    email,         Email,         255,          15 ) \
+    TEXT(     firstName,     FirstName,     50,  Symbols, 16 ) \
+    TEXT(     invoiceNumber, InvoiceNumber, 20,  Symbols, 17 ) \
+    TEXT(     lastName,      LastName,      50,  Symbols, 18 ) \
+    TEXT(     phone,         Phone,         25,  Phone,   19 ) \
+    TEXT(     state,         State,         40,  Symbols, 20 ) \
+    TEXT(     zip,           Zip,           20,  Symbols, 21 )
+
+// The length limits.
+#define IF_TEXT_MAX_LENGTH( name, Name, maxLength, forbidden, tag ) const int Name##_MAX_LENGTH = maxLength;
+#define IF_EMAIL_MAX_LENGTH( name, Name, maxLength, tag )           const int Name##_MAX_LENGTH = maxLength;
+#define IF_URL_MAX_LENGTH( name, Name, tag )                        const int Name##_MAX_LENGTH = 0; // 0 -> no max.
+#define IF_NO_MAX_LENGTH( name, tag )
+IF_CHARGE_REQUEST_FIELDS( IF_TEXT_MAX_LENGTH, IF_EMAIL_MAX_LENGTH, IF_URL_MAX_LENGTH, IF_NO_MAX_LENGTH, IF_NO_MAX_LENGTH )
+const int RequestBaseURI_MAX_LENGTH = 0; // 0 -> no max.
 
+// The field indexes, for the setters.
+#define IF_TEXT_INDEX( name, Name, maxLength, forbidden, tag ) kIFChargeRequest_##name,
+#define IF_EMAIL_INDEX( name, Name, maxLength, tag )           kIFChargeRequest_##name,
+#define IF_URL_INDEX( name, Name, tag )                        kIFChargeRequest_##name,
+#define IF_INDEX( name, tag )                                  kIFChargeRequest_##name,
+enum {
+    IF_CHARGE_REQUEST_FIELDS( IF_TEXT_INDEX, IF_EMAIL_INDEX, IF_URL_INDEX, IF_INDEX, IF_INDEX )
+    kIFChargeRequestFieldCount
+};
+
+// The schema.
+#define IF_TEXT_ROW( name, Name, maxLength, forbidden, tag ) IF_CHARGE_FIELD( name, Text,     maxLength, forbidden, NULL, tag )
+#define IF_EMAIL_ROW( name, Name, maxLength, tag )           IF_CHARGE_FIELD( name, Email,    maxLength, None,      NULL, tag )
+#define IF_URL_ROW( name, Name, tag )                        IF_CHARGE_FIELD( name, URL,      0,         None,      NULL, tag )
+#define IF_AMOUNT_ROW( name, tag )                           IF_CHARGE_FIELD( name, Amount,   0,         None,      NULL, tag )
+#define IF_CURRENCY_ROW( name, tag )                         IF_CHARGE_FIELD( name, Currency, 0,         None,      NULL, tag )
+static const IFChargeFieldSchema _schema[] = {
+    IF_CHARGE_REQUEST_FIELDS( IF_TEXT_ROW, IF_EMAIL_ROW, IF_URL_ROW, IF_AMOUNT_ROW, IF_CURRENCY_ROW )
+};
 
 static NSArray* _fieldList;
-
-const int ReturnAppName_MAX_LENGTH  = 0; // 0 -> no max.
-const int ReturnURL_MAX_LENGTH      = 0; // 0 -> no max.
-const int RequestBaseURI_MAX_LENGTH = 0; // 0 -> no max.
-const int Address_MAX_LENGTH        = 60;
-const int City_MAX_LENGTH           = 40;
-const int Company_MAX_LENGTH        = 50;
-const int Country_MAX_LENGTH        = 60;
-const int Description_MAX_LENGTH    = 255;
-const int Email_MAX_LENGTH          = 255;
-const int FirstName_MAX_LENGTH      = 50;
-const int InvoiceNumber_MAX_LENGTH  = 20;
-const int LastName_MAX_LENGTH       = 50;
-const int Phone_MAX_LENGTH          = 25;
-const int State_MAX_LENGTH          = 40;
-const int Zip_MAX_LENGTH            = 20;
-
-// Base64 isn't provided in Cocoa Touch, and I don't want to depend on
-// an external Base64 library, so instead of base64 encoding a random
-// value, I'll instead choose (web safe) base64-characters at random.
-static const NSUInteger kNonceLength = 27; // same size as base64-encoded SHA1 seems good
-static const long kNonceAlphabetMask = 0x3f;
-static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static IFChargeFieldTable* _queryFieldTable;
 
 @interface IFChargeRequest ()
 
 - (NSString*)createAndStoreNonce;
+- (void)addNonceToReturnURL;
 
 @property (readwrite,retain) NSDictionary* extraParams;
 @property (readwrite,retain) NSString* nonce;
 @property (readwrite,retain) NSString* baseURL;
+@property (readwrite,copy) NSDictionary* storedExtraParams;
 @end
 
 @implementation IFChargeRequest
@@ -111,6 +123,7 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
 @synthesize returnAppName  = _returnAppName;
 @synthesize returnURL      = _returnURL;
 @synthesize requestBaseURI = _requestBaseURI;
+@synthesize storedExtraParams = _storedExtraParams;
 @synthesize address        = _address;
 @synthesize city           = _city;
 @synthesize company        = _company;
@@ -126,7 +139,8 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
 
 + (void)initialize
 {
-    _fieldList = [[NSArray alloc] initWithObjects:IF_CHARGE_REQUEST_FIELD_LIST];
+    _queryFieldTable = IFChargeFieldTableCreate( self, _schema, kIFChargeRequestFieldCount );
+    _fieldList = [[NSArray alloc] initWithObjects:_queryFieldTable->names count:_queryFieldTable->count];
 }
 
 + (NSArray*)knownFields
@@ -134,6 +148,11 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
     return _fieldList;
 }
 
++ (const IFChargeFieldTable*)queryFieldTable
+{
+    return _queryFieldTable;
+}
+
 // Designated constructor
 - init
 {
@@ -156,15 +175,7 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
 
 - (NSString*)createAndStoreNonce
 {
-    NSMutableString* nonceString = [[[NSMutableString alloc] initWithCapacity:kNonceLength] autorelease];
-    for ( NSUInteger i = 0; i < kNonceLength; i++ )
-    {
-        [nonceString appendFormat:@"%c", _nonceAlphabet[ ( arc4random() & kNonceAlphabetMask ) ]];
-    }
-
-    [[NSUserDefaults standardUserDefaults] setObject:nonceString forKey:IF_CHARGE_NONCE_KEY];
-
-    return nonceString;
+    return [IFChargeNonceCreate( IFChargeNonceStoreShared(), self.storedExtraParams ) autorelease];
 }
 
 // If there's a delegate, invoke -creditCardTerminalNotInstalled on it;
@@ -193,65 +204,149 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
 // values. 
 - (NSURL*)requestURL
 {
-    self.baseURL = (_requestBaseURI) ? _requestBaseURI : IF_CHARGE_API_BASE_URI;
+    // A snapshot's baseURL was settled when it was frozen.
+    if ( !_frozen )
+    {
+        self.baseURL = (_requestBaseURI) ? _requestBaseURI : IF_CHARGE_API_BASE_URI;
+    }
     return [super requestURL];
 }
 
 - (void)setReturnURL:(NSString*)url withExtraParams:(NSDictionary*)extraParams
 {
-    BOOL hasQuery = 0 != [[[NSURL URLWithString:url] query] length];
+    IFChargeError error;
+    if ( ![self trySetReturnURL:url withExtraParams:extraParams error:&error] )
+    {
+        IFChargeRaiseError( &error, [self class], url );
+    }
+}
 
-    NSMutableString* urlString = [[NSMutableString alloc] initWithString:url];
-    BOOL first = YES;
+- (BOOL)trySetReturnURL:(NSString*)url withExtraParams:(NSDictionary*)extraParams error:(IFChargeError*)error
+{
+    if ( nil == url )
+    {
+        return IFChargeSetError( error, kIFChargeErrorNilURL, [self class], "returnURL", 0 );
+    }
 
-    // TODO - actually, to prevent tampering, etc, we should probably
-    // just shove this dictionary into NSUserDefaults instead of
-    // including it on the URL.
+    BOOL hasQuery = 0 != [[[NSURL URLWithString:url] query] length];
 
-    for ( NSObject* keyObject in [extraParams allKeys] )
+    NSUInteger count = [extraParams count];
+    id stackFields[IF_CHARGE_QUERY_MAX_FIELDS];
+    id stackValues[IF_CHARGE_QUERY_MAX_FIELDS];
+    id* fields = stackFields;
+    id* values = stackValues;
+    if ( count > IF_CHARGE_QUERY_MAX_FIELDS )
     {
-        NSObject* valueObject = [extraParams objectForKey:keyObject];
+        fields = malloc( count * sizeof( id ) );
+        values = malloc( count * sizeof( id ) );
+    }
+    [extraParams getObjects:values andKeys:fields];
 
-        if ( ![keyObject isKindOfClass:[NSString class]] ||
-             ![valueObject isKindOfClass:[NSString class]] )
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        if ( ![fields[index] isKindOfClass:[NSString class]] ||
+             ![values[index] isKindOfClass:[NSString class]] )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"extraParams dictionary keys and values must all be strings"];
+            if ( fields != stackFields )
+            {
+                free( fields );
+                free( values );
+            }
+            return IFChargeSetError( error, kIFChargeErrorNonStringExtraParam, [self class], "returnURL", 0 );
         }
+    }
 
-        NSString* field = (NSString*)keyObject;
-        NSString* value = (NSString*)valueObject;
-        if ( [value length] )
-        {
-            [urlString appendFormat:@"%@%@=%@",
-                       ( first && !hasQuery ) ? @"?" : @"&",
-                       field,
-                       IFEncodeURIComponent( value )];
-            first = NO;
-        }
+    NSString* urlString = IFChargeQueryCreateURLString(
+        url,
+        hasQuery,
+        count,
+        (NSString* const*)fields,
+        (NSString* const*)values
+    );
+
+    if ( fields != stackFields )
+    {
+        free( fields );
+        free( values );
     }
 
-    self.returnURL = urlString;
+    BOOL success = [self trySetReturnURL:urlString error:error];
     [urlString release];
+    if ( success )
+    {
+        self.storedExtraParams = nil;
+    }
+    return success;
 }
 
-#if TARGET_OS_IPHONE
+- (void)setReturnURL:(NSString*)url withStoredExtraParams:(NSDictionary*)extraParams
+{
+    IFChargeError error;
+    if ( ![self trySetReturnURL:url withStoredExtraParams:extraParams error:&error] )
+    {
+        IFChargeRaiseError( &error, [self class], url );
+    }
+}
 
-// Submit the charge request. The current application will terminate
-// and Credit Card Terminal will launch with the specified fields
-// pre-filled.
-- (void)submit
+- (BOOL)trySetReturnURL:(NSString*)url withStoredExtraParams:(NSDictionary*)extraParams error:(IFChargeError*)error
+{
+    if ( nil == url )
+    {
+        return IFChargeSetError( error, kIFChargeErrorNilURL, [self class], "returnURL", 0 );
+    }
+    for ( id field in extraParams )
+    {
+        if ( ![field isKindOfClass:[NSString class]] ||
+             ![[extraParams objectForKey:field] isKindOfClass:[NSString class]] )
+        {
+            return IFChargeSetError( error, kIFChargeErrorNonStringExtraParam, [self class], "returnURL", 0 );
+        }
+    }
+
+    if ( ![self trySetReturnURL:url error:error] )
+    {
+        return NO;
+    }
+    self.storedExtraParams = [extraParams count] ? extraParams : nil;
+    return YES;
+}
+
+// Issues a nonce for the response to be checked against and adds it
+// to the returnURL, if there is one. A request sent without its nonce
+// would have its response rejected, so if none can be issued this
+// raises, leaving the returnURL as it was.
+- (void)addNonceToReturnURL
 {
-    // Create a nonce
     if ( [_returnURL length] )
     {
+        NSString* nonce = [self createAndStoreNonce];
+        if ( nil == nonce )
+        {
+            [NSException raise:NSInternalInconsistencyException
+                        format:@"No nonce could be issued for the request, so its response could not be accepted"];
+        }
         self.returnURL = [_returnURL stringByAppendingFormat:@"%@%@=%@",
             [[[NSURL URLWithString:_returnURL] query] length] ? @"&" : @"?",
             IF_CHARGE_NONCE_KEY,
-            IFEncodeURIComponent( [self createAndStoreNonce] )
+            IFEncodeURIComponent( nonce )
         ];
     }
+}
 
+- (NSURL*)submitURL
+{
+    [self addNonceToReturnURL];
+    return [self requestURL];
+}
+
+#if TARGET_OS_IPHONE
+
+// Submit the charge request. The current application will terminate
+// and Credit Card Terminal will launch with the specified fields
+// pre-filled.
+- (void)submit
+{
+    [self addNonceToReturnURL];
     [super submit];
 }
 
@@ -265,138 +360,233 @@ static char _nonceAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuv
 #pragma -
 #pragma Atomic Getters/Setters
 
+- (BOOL)trySetReturnAppName:(NSString *)returnAppName error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_returnAppName value:returnAppName error:error];
+}
 - (void)setReturnAppName:(NSString *)returnAppName {
-    [self validateTextArgument:returnAppName withMaxLength:ReturnAppName_MAX_LENGTH forbiddenCharacterSets: nil];
-    setObject_AtomicCopy(_returnAppName, returnAppName);
+    IFChargeError error;
+    if (![self trySetReturnAppName:returnAppName error:&error]) IFChargeRaiseError(&error, [self class], returnAppName);
 }
 - (NSString*)returnAppName {
     getObject_Atomic(_returnAppName);
 }
 
+- (BOOL)trySetReturnURL:(NSString *)returnURL error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_returnURL value:returnURL error:error];
+}
 - (void)setReturnURL:(NSString *)returnURL {
-    [self validateURLString:returnURL];
-    setObject_AtomicCopy(_returnURL, returnURL);
+    IFChargeError error;
+    if (![self trySetReturnURL:returnURL error:&error]) IFChargeRaiseError(&error, [self class], returnURL);
 }
 - (NSString*)returnURL {
     getObject_Atomic(_returnURL);
 }
 
-- (void)setRequestBaseURI:(NSString *)requestBaseURI {
-    [self validateURLString:requestBaseURI];
+- (BOOL)trySetRequestBaseURI:(NSString *)requestBaseURI error:(IFChargeError *)error {
+    if (![self checkURLString:requestBaseURI field:NULL error:error]) return NO;
     if ([requestBaseURI rangeOfString:@"?"].location != NSNotFound) {
-        [NSException raise:NSInvalidArgumentException
-                    format:@"requestBaseURI may not include the character '?'"];
+        return IFChargeSetError(error, kIFChargeErrorQueryInBaseURI, [self class], NULL, 0);
     }
     setObject_AtomicCopy(_requestBaseURI, requestBaseURI);
+    return YES;
+}
+- (void)setRequestBaseURI:(NSString *)requestBaseURI {
+    IFChargeError error;
+    if (![self trySetRequestBaseURI:requestBaseURI error:&error]) IFChargeRaiseError(&error, [self class], requestBaseURI);
 }
 - (NSString*)requestBaseURI {
     getObject_Atomic(_requestBaseURI);
 }
 
+- (BOOL)trySetAddress:(NSString *)address error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_address value:address error:error];
+}
 - (void)setAddress:(NSString *)address {
-    [self validateTextArgument:address withMaxLength:Address_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_address, address);
+    IFChargeError error;
+    if (![self trySetAddress:address error:&error]) IFChargeRaiseError(&error, [self class], address);
 }
 - (NSString*)address {
     getObject_Atomic(_address);
 }
 
+- (BOOL)trySetCity:(NSString *)city error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_city value:city error:error];
+}
 - (void)setCity:(NSString *)city {
-    [self validateTextArgument:city withMaxLength:City_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_city, city);
+    IFChargeError error;
+    if (![self trySetCity:city error:&error]) IFChargeRaiseError(&error, [self class], city);
 }
 - (NSString*)city {
     getObject_Atomic(_city);
 }
 
+- (BOOL)trySetCompany:(NSString *)company error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_company value:company error:error];
+}
 - (void)setCompany:(NSString *)company {
-    [self validateTextArgument:company withMaxLength:Company_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_company, company);
+    IFChargeError error;
+    if (![self trySetCompany:company error:&error]) IFChargeRaiseError(&error, [self class], company);
 }
 - (NSString*)company {
     getObject_Atomic(_company);
 }
 
+- (BOOL)trySetCountry:(NSString *)country error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_country value:country error:error];
+}
 - (void)setCountry:(NSString *)country {
-    [self validateTextArgument:country withMaxLength:Country_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_country, country);
+    IFChargeError error;
+    if (![self trySetCountry:country error:&error]) IFChargeRaiseError(&error, [self class], country);
 }
 - (NSString*)country {
     getObject_Atomic(_country);
 }
 
+- (BOOL)trySetDescription:(NSString *)description error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_description value:description error:error];
+}
 - (void)setDescription:(NSString *)description {
-    [self validateTextArgument:description withMaxLength:Description_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_description, description);
+    IFChargeError error;
+    if (![self trySetDescription:description error:&error]) IFChargeRaiseError(&error, [self class], description);
 }
 - (NSString*)description {
     getObject_Atomic(_description);
 }
 
+- (BOOL)trySetEmail:(NSString *)email error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_email value:email error:error];
+}
 - (void)setEmail:(NSString *)email {
-    [self validateTextArgument:email withMaxLength:Email_MAX_LENGTH forbiddenCharacterSets:nil];
-    [self validateEmailString:email];
-    setObject_AtomicCopy(_email, email);
+    IFChargeError error;
+    if (![self trySetEmail:email error:&error]) IFChargeRaiseError(&error, [self class], email);
 }
 - (NSString*)email {
     getObject_Atomic(_email);
 }
 
+- (BOOL)trySetFirstName:(NSString *)firstName error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_firstName value:firstName error:error];
+}
 - (void)setFirstName:(NSString *)firstName {
-    [self validateTextArgument:firstName withMaxLength:FirstName_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_firstName, firstName);
+    IFChargeError error;
+    if (![self trySetFirstName:firstName error:&error]) IFChargeRaiseError(&error, [self class], firstName);
 }
 - (NSString*)firstName {
     getObject_Atomic(_firstName);
 }
 
+- (BOOL)trySetInvoiceNumber:(NSString *)invoiceNumber error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_invoiceNumber value:invoiceNumber error:error];
+}
 - (void)setInvoiceNumber:(NSString *)invoiceNumber {
-    [self validateTextArgument:invoiceNumber withMaxLength:InvoiceNumber_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_invoiceNumber, invoiceNumber);
+    IFChargeError error;
+    if (![self trySetInvoiceNumber:invoiceNumber error:&error]) IFChargeRaiseError(&error, [self class], invoiceNumber);
 }
 - (NSString*)invoiceNumber {
     getObject_Atomic(_invoiceNumber);
 }
 
+- (BOOL)trySetLastName:(NSString *)lastName error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_lastName value:lastName error:error];
+}
 - (void)setLastName:(NSString *)lastName {
-    [self validateTextArgument:lastName withMaxLength:LastName_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_lastName, lastName);
+    IFChargeError error;
+    if (![self trySetLastName:lastName error:&error]) IFChargeRaiseError(&error, [self class], lastName);
 }
 - (NSString*)lastName {
     getObject_Atomic(_lastName);
 }
 
-static NSString *validPhoneCharacters = @"0123456789- ";
-static NSCharacterSet *phoneForbiddenCharacterSet;
+- (BOOL)trySetPhone:(NSString *)phone error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_phone value:phone error:error];
+}
 - (void)setPhone:(NSString *)phone {
-    if (!phoneForbiddenCharacterSet) {
-        phoneForbiddenCharacterSet = [[[NSCharacterSet characterSetWithCharactersInString:validPhoneCharacters] invertedSet] retain];
-    }
-
-    [self validateTextArgument:phone withMaxLength:Phone_MAX_LENGTH forbiddenCharacterSets:phoneForbiddenCharacterSet, nil];
-    setObject_AtomicCopy(_phone, phone);
+    IFChargeError error;
+    if (![self trySetPhone:phone error:&error]) IFChargeRaiseError(&error, [self class], phone);
 }
 - (NSString*)phone {
     getObject_Atomic(_phone);
 }
 
+- (BOOL)trySetState:(NSString *)state error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_state value:state error:error];
+}
 - (void)setState:(NSString *)state {
-    [self validateTextArgument:state withMaxLength:State_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_state, state);
+    IFChargeError error;
+    if (![self trySetState:state error:&error]) IFChargeRaiseError(&error, [self class], state);
 }
 - (NSString*)state {
     getObject_Atomic(_state);
 }
 
+- (BOOL)trySetZip:(NSString *)zip error:(IFChargeError *)error {
+    return [self trySetField:kIFChargeRequest_zip value:zip error:error];
+}
 - (void)setZip:(NSString *)zip {
-    [self validateTextArgument:zip withMaxLength:Zip_MAX_LENGTH forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil];
-    setObject_AtomicCopy(_zip, zip);
+    IFChargeError error;
+    if (![self trySetZip:zip error:&error]) IFChargeRaiseError(&error, [self class], zip);
 }
 - (NSString*)zip {
     getObject_Atomic(_zip);
 }
 
 
+#pragma -
+#pragma Snapshots
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    if ( _frozen )
+    {
+        return [self retain];
+    }
+
+    IFChargeRequest* copy;
+    @synchronized(self)
+    {
+        copy = [super copyWithZone:zone];
+        copy->_delegate = _delegate;
+
+        [copy->_returnAppName release];  copy->_returnAppName  = [_returnAppName copy];
+        [copy->_returnURL release];      copy->_returnURL      = [_returnURL copy];
+        [copy->_requestBaseURI release]; copy->_requestBaseURI = [_requestBaseURI copy];
+
+        // Kept with each nonce the copy issues, as with this request's.
+        [copy->_storedExtraParams release];
+        copy->_storedExtraParams = [_storedExtraParams copy];
+
+        [copy->_address release];        copy->_address        = [_address copy];
+        [copy->_city release];           copy->_city           = [_city copy];
+        [copy->_company release];        copy->_company        = [_company copy];
+        [copy->_country release];        copy->_country        = [_country copy];
+        [copy->_description release];    copy->_description    = [_description copy];
+        [copy->_email release];          copy->_email          = [_email copy];
+        [copy->_firstName release];      copy->_firstName      = [_firstName copy];
+        [copy->_invoiceNumber release];  copy->_invoiceNumber  = [_invoiceNumber copy];
+        [copy->_lastName release];       copy->_lastName       = [_lastName copy];
+        [copy->_phone release];          copy->_phone          = [_phone copy];
+        [copy->_state release];          copy->_state          = [_state copy];
+        [copy->_zip release];            copy->_zip            = [_zip copy];
+
+        // Settle the base URL now, since a snapshot can't set it
+        // from -requestURL.
+        [copy->_baseURL release];
+        copy->_baseURL = [( _requestBaseURI ? _requestBaseURI : IF_CHARGE_API_BASE_URI ) copy];
+    }
+    return copy;
+}
+
+#pragma -
+#pragma Reuse
+
+// The delegate stays; everything sent or stored goes.
+- (void)reset
+{
+    [super reset];
+    setObject_AtomicCopy(_requestBaseURI, nil);
+    self.storedExtraParams = nil;
+}
+
 #pragma -
 #pragma Memory Management
 
@@ -407,6 +597,7 @@ static NSCharacterSet *phoneForbiddenCharacterSet;
     [_returnAppName release];
     [_returnURL release];
     [_requestBaseURI release];
+    [_storedExtraParams release];
 
     [_address release];
     [_city release];
@@ -30,7 +30,10 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 // OTHER DEALINGS IN THE SOFTWARE.
 //
+#import <Foundation/Foundation.h>
+#if TARGET_OS_IPHONE
 #import <UIKit/UIKit.h>
+#endif
 #import "IFChargeMessage.h"
 #import "IFChargeRequest.h"
 
@@ -56,6 +59,29 @@ typedef enum {
     kIFChargeResponseCodeError
 } IFChargeResponseCode;
 
+@class IFChargeResponse;
+
+// IFChargeVerifyResult - The outcome of verifying one response URL.
+typedef struct IFChargeVerifyResult
+{
+    // What was wrong with the URL, or kIFChargeErrorNone. These are
+    // the checks initWithURL: makes, other than the nonce.
+    IFChargeError error;
+
+    // The parsed response, frozen (see -[IFChargeMessage freeze]) and
+    // retained. Set whenever the URL parsed and every field was
+    // valid, so rejected responses can still be inspected.
+    IFChargeResponse* response;
+} IFChargeVerifyResult;
+
+// IFChargeVerifyResultReason - The message initWithURL: would have
+// raised for a rejected result, or nil for an accepted one.
+extern NSString* IFChargeVerifyResultReason( const IFChargeVerifyResult* result );
+
+// IFChargeVerifyResultsRelease - Releases the responses held by count
+// results.
+extern void IFChargeVerifyResultsRelease( IFChargeVerifyResult* results, NSUInteger count );
+
 @interface IFChargeResponse : IFChargeMessage
 {
 @private
@@ -84,10 +110,35 @@ typedef enum {
 // initWithChargeRequest - Copies values from the request to a new
 // response and redacts the provided card number. If the response code
 // is kIFChargeResponseCodeApproved, then the card number must be set.
+// If cardType is nil, it's worked out from the card number's BIN (see
+// IFChargeCard.h), and left nil if the number isn't one it knows. The
+// number isn't Luhn-checked here; see IFChargeCardNumberIsValid.
 - (id)initWithChargeRequest:(IFChargeRequest*)request responseCode:(IFChargeResponseCode)responseCode cardNumber:(NSString*)cardNumber cardType:(NSString*)cardType;
 
 + (NSDictionary*)responseCodeMapping;
 
+// verifyURL:result: - Checks one response URL as verifyURLs:results:
+// does, for callers that schedule their own work. A nil URL is
+// reported as kIFChargeErrorNilURL. Release the result with
+// IFChargeVerifyResultsRelease.
++ (void)verifyURL:(NSURL*)url result:(IFChargeVerifyResult*)result;
+
+// verifyURLs:count:results:threadCount: - Checks many response URLs at
+// once, for reconciliation, filling in one result per URL. The field
+// patterns and approved/failure rules are those of initWithURL:, but
+// nothing is raised: each URL's problem, if any, is reported in its
+// result. The nonce is left alone, since these are past responses;
+// it's available as response.nonce.
+//
+// The URLs are handed out in small batches to threadCount threads, or
+// one per core if threadCount is 0. Release the results with
+// IFChargeVerifyResultsRelease.
++ (void)verifyURLs:(NSURL* const*)urls count:(NSUInteger)count results:(IFChargeVerifyResult*)results threadCount:(NSUInteger)threadCount;
+
+// verifyURLs:results: - As above, for an array of NSURLs, on every core.
+// results must have room for [urls count] entries.
++ (void)verifyURLs:(NSArray*)urls results:(IFChargeVerifyResult*)results;
+
 @end
 
 
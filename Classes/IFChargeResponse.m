@@ -31,19 +31,30 @@
 //
 #import "IFChargeResponse.h"
 #import "IFChargeRequest.h"
-
-#define IF_CHARGE_RESPONSE_FIELD_PATTERNS                     \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"amount",             \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"subtotal",             \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"tip",             \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"tax",             \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"shipping",             \
-    @"^(0|[1-9][0-9]*)[.][0-9][0-9]$", @"discount",             \
-    @"^[A-Z]{3}$",                     @"currency",           \
-    @"^X*[0-9]{4}$",                   @"redactedCardNumber", \
-    @"^[A-Za-z ]{0,20}$",              @"cardType",           \
-    @"^[a-z]*$",                       @"responseType",       \
-    nil
+#import "IFChargeCard.h"
+#import "IFChargeIntern.h"
+#import "IFChargeNonce.h"
+#import "IFChargePattern.h"
+#import "IFChargeStats.h"
+
+#include <dispatch/dispatch.h>
+#include <string.h>
+
+// The response's fields, in knownFields order. The setters don't
+// check anything but amount ranges; every value must match its
+// pattern, which checkFields: tests all at once.
+static const IFChargeFieldSchema _schema[] = {
+    IF_CHARGE_FIELD( amount,             Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  1 )
+    IF_CHARGE_FIELD( cardType,           Token,    0, None, IF_CHARGE_CARD_TYPE_PATTERN, 22 )
+    IF_CHARGE_FIELD( currency,           Currency, 0, None, IF_CHARGE_CURRENCY_PATTERN,  7 )
+    IF_CHARGE_FIELD( discount,           Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  6 )
+    IF_CHARGE_FIELD( redactedCardNumber, Plain,    0, None, IF_CHARGE_REDACTED_CARD_NUMBER_PATTERN, 23 )
+    IF_CHARGE_FIELD( responseType,       Token,    0, None, IF_CHARGE_RESPONSE_TYPE_PATTERN, 24 )
+    IF_CHARGE_FIELD( shipping,           Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  5 )
+    IF_CHARGE_FIELD( subtotal,           Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  2 )
+    IF_CHARGE_FIELD( tax,                Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  4 )
+    IF_CHARGE_FIELD( tip,                Amount,   0, None, IF_CHARGE_AMOUNT_PATTERN,  3 )
+};
 
 #define IF_NSINT( n )  ( [NSNumber numberWithInteger:(n)] )
 
@@ -55,9 +66,15 @@
     nil
 
 static NSArray*      _fieldList;
-static NSDictionary* _fieldPatterns;
 static NSDictionary* _responseCodes;
 
+// The shared (interned) responseType string for each code.
+static NSString*     _responseTypes[kIFChargeResponseCodeError + 1];
+static IFChargeFieldTable* _queryFieldTable;
+
+// Number of URLs a verification thread claims at a time.
+#define IF_CHARGE_VERIFY_BATCH 64
+
 @interface IFChargeResponse ()
 
 @property (readwrite,copy)   NSString*     amount;
@@ -75,7 +92,8 @@ static NSDictionary* _responseCodes;
 @property (readwrite,assign) IFChargeResponseCode responseCode;
 
 - (void) validateFields;
-+(NSNumberFormatter*)chargeAmountFormatter;
+- (BOOL)checkFields:(IFChargeError*)error;
+- (BOOL)checkFieldsUntimed:(IFChargeError*)error;
 
 @end
 
@@ -97,11 +115,14 @@ static NSDictionary* _responseCodes;
 
 + (void)initialize
 {
-    _fieldPatterns = [[NSDictionary alloc]
-                         initWithObjectsAndKeys:IF_CHARGE_RESPONSE_FIELD_PATTERNS];
-    _fieldList     = [[[_fieldPatterns allKeys] sortedArrayUsingSelector:@selector(compare:)] retain];
-    _responseCodes = [[NSDictionary alloc]
-                         initWithObjectsAndKeys:IF_CHARGE_RESPONSE_CODE_MAPPING];
+    _queryFieldTable = IFChargeFieldTableCreate( self, _schema, sizeof( _schema ) / sizeof( _schema[0] ) );
+    _fieldList       = [[NSArray alloc] initWithObjects:_queryFieldTable->names count:_queryFieldTable->count];
+    _responseCodes   = [[NSDictionary alloc]
+                           initWithObjectsAndKeys:IF_CHARGE_RESPONSE_CODE_MAPPING];
+    for ( NSString* responseType in _responseCodes )
+    {
+        _responseTypes[[[_responseCodes objectForKey:responseType] intValue]] = IFChargeInternAdd( responseType );
+    }
 }
 
 + (NSArray*)knownFields
@@ -109,38 +130,54 @@ static NSDictionary* _responseCodes;
     return _fieldList;
 }
 
++ (const IFChargeFieldTable*)queryFieldTable
+{
+    return _queryFieldTable;
+}
+
 + (NSDictionary*)responseCodeMapping
 {
     return _responseCodes;
 }
 
-- (id)initWithURL:(NSURL*)url
+// initWithURL: (in IFChargeMessage) raises whatever this reports.
+- (id)tryInitWithURL:(NSURL*)url error:(IFChargeError*)error
 {
-    if ( ( self = [super initWithURL:url] ) )
+    IFChargeError localError;
+    if ( NULL == error )
     {
-        NSString* expectedNonce = [[NSUserDefaults standardUserDefaults]
-                                      objectForKey:IF_CHARGE_NONCE_KEY];
-        if ( 0 == [expectedNonce length] )
-        {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: No outstanding charge responses"];
-        }
+        error = &localError;
+    }
 
-        if ( 0 == [_nonce length] )
+    if ( ( self = [super tryInitWithURL:url error:error] ) )
+    {
+        NSDictionary* storedParams = nil;
+        IF_CHARGE_STATS_START( nonceStart );
+        IFChargeErrorCode code = IFChargeNonceConsume( IFChargeNonceStoreShared(), _nonce, &storedParams );
+        IF_CHARGE_STATS_STOP( kIFChargeStageNonceCheck, nonceStart );
+        if ( kIFChargeErrorNone != code )
         {
-            [NSException raise:NSInvalidArgumentException
-                        format:@"Bad URL Request: Nonce missing."];
+            IFChargeSetError( error, code, [self class], NULL, 0 );
         }
-
-        if ( ![expectedNonce isEqualToString:self.nonce] )
+        else
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: Incorrect nonce received"];
-        }
+            // Parameters kept on the device win over any on the URL.
+            if ( storedParams )
+            {
+                NSMutableDictionary* extraParams = [NSMutableDictionary dictionaryWithDictionary:_extraParams];
+                [extraParams addEntriesFromDictionary:storedParams];
+                self.extraParams = extraParams;
+            }
 
-        [[NSUserDefaults standardUserDefaults] removeObjectForKey:IF_CHARGE_NONCE_KEY];
+            if ( [self checkFields:error] )
+            {
+                return self;
+            }
+        }
 
-        [self validateFields];
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        [self release];
+        self = nil;
     }
 
     return self;
@@ -148,6 +185,7 @@ static NSDictionary* _responseCodes;
 
 // Display a dialog
 - (void)unableToOpenURL {
+#if TARGET_OS_IPHONE
     [[[[UIAlertView alloc]
        initWithTitle:IF_RESPONSE_CAN_NOT_OPEN_URL_TITLE
        message:IF_RESPONSE_CAN_NOT_OPEN_URL_MESSAGE
@@ -155,6 +193,7 @@ static NSDictionary* _responseCodes;
        cancelButtonTitle:IF_RESPONSE_CAN_NOT_OPEN_URL_BUTTON
        otherButtonTitles:nil
        ] autorelease] show];
+#endif
     [super unableToOpenURL]; // releases self.
 }
 
@@ -189,15 +228,12 @@ static NSDictionary* _responseCodes;
             }
 
             // redact the card number
-            NSMutableString *cNumber = [[NSMutableString alloc] initWithString:cardNumber];
-            int ccNumberLength = [cNumber length];
-            for (int index = 0; index < ccNumberLength - 4; index++) {
-                [cNumber replaceCharactersInRange:( NSRange ){ index, 1 } withString:IF_CHARGE_CARD_NUMBER_MASK];
-            }
-            self.redactedCardNumber = cNumber;
-            [cNumber release];
-            
-            if (cardType) self.cardType = cardType;
+            NSString *redacted = IFChargeCardCreateRedacted(cardNumber, [IF_CHARGE_CARD_NUMBER_MASK characterAtIndex:0]);
+            self.redactedCardNumber = redacted;
+            [redacted release];
+
+            // work out the card type from the number if it wasn't given
+            self.cardType = cardType ? cardType : IFChargeCardTypeForNumber(cardNumber);
         }
         self.responseCode = responseCode;
         switch (responseCode) {
@@ -229,70 +265,334 @@ static NSDictionary* _responseCodes;
             0 != [_discount length]);
 }
 
-static NSNumberFormatter *chargeAmountFormatter_;
-+(NSNumberFormatter*)chargeAmountFormatter {
-    if (!chargeAmountFormatter_) {
-        chargeAmountFormatter_ = [[NSNumberFormatter alloc] init];
-        [chargeAmountFormatter_ setNumberStyle:NSNumberFormatterCurrencyStyle];
-        [chargeAmountFormatter_ setGeneratesDecimalNumbers:YES];
-        [chargeAmountFormatter_ setCurrencySymbol:@""];
-        [chargeAmountFormatter_ setPerMillSymbol:@""];
+// Matches each non-nil value, in _fieldList order, against its field
+// pattern.
+static BOOL IFCheckFieldPatterns( NSString* const* values, IFChargeError* error )
+{
+    for ( NSUInteger fieldIndex = 0; fieldIndex < _queryFieldTable->count; fieldIndex++ )
+    {
+        if ( nil != values[fieldIndex] && !IFChargePatternMatches( _queryFieldTable->patterns[fieldIndex], values[fieldIndex] ) )
+        {
+            if ( error )
+            {
+                error->code   = kIFChargeErrorInvalidField;
+                error->field  = fieldIndex;
+                error->detail = 0;
+            }
+            return NO;
+        }
     }
-    return chargeAmountFormatter_;
+    return YES;
 }
 
-- (void)validateFields
+// The code for the length bytes of a responseType, straight from the
+// bytes: what responseCodeMapping gives, without the boxed numbers.
+static BOOL IFResponseCodeForBytes( const char* bytes, size_t length, IFChargeResponseCode* code )
 {
-    for ( NSString* field in _fieldList )
+    switch ( length )
     {
-        NSString* pattern = [_fieldPatterns objectForKey:field];
-        NSAssert1( nil != pattern, @"No regex for field %@", field );
+        case 5:
+            *code = kIFChargeResponseCodeError;
+            return 0 == memcmp( bytes, "error", 5 );
+        case 8:
+            *code = ( 'a' == bytes[0] ) ? kIFChargeResponseCodeApproved : kIFChargeResponseCodeDeclined;
+            return 0 == memcmp( bytes, ( 'a' == bytes[0] ) ? "approved" : "declined", 8 );
+        case 9:
+            *code = kIFChargeResponseCodeCancelled;
+            return 0 == memcmp( bytes, "cancelled", 9 );
+        default:
+            return NO;
+    }
+}
 
-        NSString* value = [self valueForKey:field];
+static BOOL IFResponseCodeForType( NSString* responseType, IFChargeResponseCode* code )
+{
+    // A parsed or set responseType is the shared string when it's
+    // known, so this nearly always ends here.
+    for ( int index = 0; index <= kIFChargeResponseCodeError; index++ )
+    {
+        if ( responseType == _responseTypes[index] )
+        {
+            *code = (IFChargeResponseCode)index;
+            return YES;
+        }
+    }
+
+    char buffer[16];
+    NSUInteger length = [responseType length];
+    return length < sizeof( buffer )
+        && [responseType getCString:buffer maxLength:sizeof( buffer ) encoding:NSASCIIStringEncoding]
+        && strlen( buffer ) == length
+        && IFResponseCodeForBytes( buffer, length, code );
+}
+
+// The checks behind validateFields, without the exception. Sets
+// responseCode as a side effect.
+- (BOOL)checkFields:(IFChargeError*)error
+{
+    IF_CHARGE_STATS_START( start );
+    BOOL valid = [self checkFieldsUntimed:error];
+    IF_CHARGE_STATS_STOP( kIFChargeStageValidateFields, start );
+    return valid;
+}
 
-        if ( nil != value && !IFMatchesPattern( value, pattern ) )
+- (BOOL)checkFieldsUntimed:(IFChargeError*)error
+{
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+    BOOL valid;
+    @synchronized(self)
+    {
+        for ( NSUInteger fieldIndex = 0; fieldIndex < _queryFieldTable->count; fieldIndex++ )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: field '%@' is not valid",
-                         field];
+            values[fieldIndex] = *IFChargeFieldSlot( _queryFieldTable, self, fieldIndex );
         }
+        valid = IFCheckFieldPatterns( values, error );
+    }
+    if ( !valid )
+    {
+        return NO;
     }
 
-    NSNumber* responseCode = [_responseCodes valueForKey:_responseType];
-    if ( nil == responseCode )
+    IFChargeResponseCode responseCode;
+    if ( !IFResponseCodeForType( _responseType, &responseCode ) )
     {
-        [NSException raise:NSInvalidArgumentException
-                     format:@"Bad URL Request: Unknown response type"];
+        return IFChargeSetError( error, kIFChargeErrorUnknownResponseType, [self class], "responseType", 0 );
     }
-    _responseCode = [responseCode intValue];
+    _responseCode = responseCode;
 
     if ( kIFChargeResponseCodeApproved == _responseCode )
     {
         if ( nil == _amount && ![self amountSubfieldsAreSet] )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: missing amount"];
+            return IFChargeSetError( error, kIFChargeErrorMissingAmount, [self class], "amount", 0 );
         }
         if ( nil == _redactedCardNumber )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: missing redactedCardNumber"];
+            return IFChargeSetError( error, kIFChargeErrorMissingRedactedCardNumber, [self class], "redactedCardNumber", 0 );
         }
     }
     else
     {
         if ( nil != _amount || [self amountSubfieldsAreSet] || nil != _cardType || nil != _redactedCardNumber )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"Bad URL Request: failure should not contain transaction info"];
+            return IFChargeSetError( error, kIFChargeErrorUnexpectedTransactionInfo, [self class], NULL, 0 );
         }
     }
+
+    return YES;
+}
+
+- (void)validateFields
+{
+    IFChargeError error;
+    if ( ![self checkFields:&error] )
+    {
+        IFChargeRaiseError( &error, [self class], nil );
+    }
+}
+
+#pragma -
+#pragma Batch Verification
+
+NSString* IFChargeVerifyResultReason( const IFChargeVerifyResult* result )
+{
+    return IFChargeErrorReason( &result->error, [IFChargeResponse class], nil );
+}
+
+void IFChargeVerifyResultsRelease( IFChargeVerifyResult* results, NSUInteger count )
+{
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        [results[index].response release];
+        results[index].response = nil;
+    }
+}
+
+static void IFCheckResponseURL( NSURL* url, IFChargeVerifyResult* result )
+{
+    IFChargeError* error = &result->error;
+    error->code      = kIFChargeErrorNone;
+    error->field     = -1;
+    error->detail    = 0;
+    result->response = nil;
+
+    if ( nil == url )
+    {
+        error->code = kIFChargeErrorNilURL;
+        return;
+    }
+
+    NSMutableDictionary* queryFields = [NSMutableDictionary dictionary];
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+    if ( !IFChargeQueryParse( url, _queryFieldTable, values, queryFields ) )
+    {
+        error->code = kIFChargeErrorMalformedQuery;
+        return;
+    }
+
+    // Reject bad fields before building anything.
+    if ( !IFCheckFieldPatterns( values, error ) )
+    {
+        return;
+    }
+
+    IFChargeResponse* response = [[IFChargeResponse alloc] init];
+    if ( ![response trySetQueryValues:values extraParams:queryFields error:error] )
+    {
+        [response release];
+        return;
+    }
+
+    // A response that breaks the approved/failure rules is still
+    // handed back for inspection.
+    [response checkFields:error];
+    [response freezeInPlace];
+    result->response = response;
+}
+
+static void IFVerifyURL( NSURL* url, IFChargeVerifyResult* result )
+{
+    IFCheckResponseURL( url, result );
+    if ( kIFChargeErrorNone != result->error.code )
+    {
+        IF_CHARGE_STATS_REJECT( [IFChargeResponse class], &result->error );
+    }
+}
+
++ (void)verifyURL:(NSURL*)url result:(IFChargeVerifyResult*)result
+{
+    IFVerifyURL( url, result );
+}
+
++ (void)verifyURLs:(NSURL* const*)urls count:(NSUInteger)count results:(IFChargeVerifyResult*)results threadCount:(NSUInteger)threadCount
+{
+    if ( 0 == threadCount )
+    {
+        threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+
+    // Rather than splitting the URLs evenly up front, each thread
+    // claims the next batch as it finishes one, so a thread that's
+    // held up doesn't hold up the rest.
+    volatile NSUInteger next = 0;
+    volatile NSUInteger* nextBatch = &next;
+    dispatch_apply( threadCount, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t thread )
+    {
+        for ( ;; )
+        {
+            NSUInteger start = __sync_fetch_and_add( nextBatch, IF_CHARGE_VERIFY_BATCH );
+            if ( start >= count )
+            {
+                break;
+            }
+
+            NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+            NSUInteger end = MIN( start + IF_CHARGE_VERIFY_BATCH, count );
+            for ( NSUInteger index = start; index < end; index++ )
+            {
+                IFVerifyURL( urls[index], &results[index] );
+            }
+            [pool drain];
+        }
+    });
+}
+
++ (void)verifyURLs:(NSArray*)urls results:(IFChargeVerifyResult*)results
+{
+    NSUInteger count = [urls count];
+    id* urlArray = malloc( count * sizeof( id ) );
+    [urls getObjects:urlArray];
+    [self verifyURLs:(NSURL* const*)urlArray count:count results:results threadCount:0];
+    free( urlArray );
 }
 
 - (NSString*)description {
     return [NSString stringWithFormat:@"IFChargeResponse (%p)", self];
 }
 
+#pragma -
+#pragma Snapshots
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    if ( _frozen )
+    {
+        return [self retain];
+    }
+
+    IFChargeResponse* copy;
+    @synchronized(self)
+    {
+        copy = [super copyWithZone:zone];
+        copy->_cardType           = [_cardType copy];
+        copy->_redactedCardNumber = [_redactedCardNumber copy];
+        copy->_responseCode       = _responseCode;
+        copy->_responseType       = [_responseType copy];
+    }
+    return copy;
+}
+
+#pragma -
+#pragma Reuse
+
+- (void)reset
+{
+    [super reset];
+    _responseCode = kIFChargeResponseCodeApproved;
+}
+
+// As with verifyURL:result:, the nonce is left alone: a response read
+// this way is one being checked, not one being handled.
+- (BOOL)tryReadURL:(NSURL*)url error:(IFChargeError*)error
+{
+    IFChargeError localError;
+    if ( NULL == error )
+    {
+        error = &localError;
+    }
+
+    if ( ![super tryReadURL:url error:error] )
+    {
+        return NO;
+    }
+    if ( ![self checkFields:error] )
+    {
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        return NO;
+    }
+    return YES;
+}
+
+#pragma -
+#pragma Atomic Getters/Setters
+
+- (void)setCardType:(NSString*)cardType
+{
+    setObject_AtomicIntern(_cardType, cardType);
+}
+- (NSString*)cardType
+{
+    getObject_Atomic(_cardType);
+}
+
+- (void)setRedactedCardNumber:(NSString*)redactedCardNumber
+{
+    setObject_AtomicCopy(_redactedCardNumber, redactedCardNumber);
+}
+- (NSString*)redactedCardNumber
+{
+    getObject_Atomic(_redactedCardNumber);
+}
+
+- (void)setResponseType:(NSString*)responseType
+{
+    setObject_AtomicIntern(_responseType, responseType);
+}
+- (NSString*)responseType
+{
+    getObject_Atomic(_responseType);
+}
+
 - (void)dealloc
 {
     [_baseURL release];
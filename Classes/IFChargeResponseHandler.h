@@ -0,0 +1,90 @@
+// -*- objc -*-
+//
+// IFChargeResponseHandler.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeJournal.h"
+#import "IFChargeResponse.h"
+
+#include <dispatch/dispatch.h>
+
+// IFChargeResponseHandler - Handles charge response URLs off the
+// thread they arrive on. -application:handleOpenURL: runs on the main
+// thread while the app is resuming, and everything it does before
+// returning holds up the app's first frame. Handing the URL to a
+// handler costs one small allocation; the parsing, the field and
+// nonce checks, the app's own check and the journal's fsync all happen
+// on the handler's queue, and the outcome is delivered to a queue of
+// the app's choosing, usually the main one.
+//
+// URLs are handled one at a time, in the order they were submitted,
+// and outcomes are delivered in that order. Nothing here touches UIKit,
+// so a handler can be driven headless with a private delivery queue.
+// A handler may be used from any thread.
+typedef struct IFChargeResponseHandler IFChargeResponseHandler;
+
+// IFChargeResponseOutcome - What became of a submitted URL.
+typedef enum {
+    // Accepted - The response was valid, its nonce was outstanding and
+    // the handler's check passed.
+    kIFChargeResponseAccepted,
+
+    // Invalid - The URL wasn't a valid response to an outstanding
+    // request: the reasons initWithURL: raises for. See error.
+    kIFChargeResponseInvalid,
+
+    // Rejected - The response was valid, but the handler's check
+    // returned NO. Its nonce has been consumed.
+    kIFChargeResponseRejected
+} IFChargeResponseOutcome;
+
+// IFChargeHandledResponse - The outcome of one URL, as delivered.
+typedef struct IFChargeHandledResponse
+{
+    IFChargeResponseOutcome outcome;
+
+    // Why the URL was invalid, or kIFChargeErrorNone.
+    IFChargeError error;
+
+    // The response, frozen (see -[IFChargeMessage freeze]), or nil if
+    // the URL was invalid. Retain it to keep it past the delivery.
+    IFChargeResponse* response;
+
+    // The sequence number of the journal entry for an accepted
+    // response, once synced; 0 if there's no journal, the response
+    // wasn't accepted, or it couldn't be recorded.
+    uint64_t journalSequence;
+} IFChargeHandledResponse;
+
+// IFChargeResponseCheck - The app's own check of a valid response,
+// such as validating the extra params it sent with the request. Runs
+// on the handler's queue; returns NO to reject the response.
+typedef BOOL (^IFChargeResponseCheck)( IFChargeResponse* response );
+
+// IFChargeResponseDelivery - Called on the delivery queue with the
+// outcome of a submitted URL, which is only valid during the call.
+typedef void (^IFChargeResponseDelivery)( const IFChargeHandledResponse* handled );
+
+// IFChargeResponseHandlerCreate - A handler that records each accepted
+// response in journal, if it isn't NULL, and checks each valid one
+// with check, if it isn't nil. Outcomes are delivered on
+// deliveryQueue, or the main queue if it's NULL. Free the handler with
+// IFChargeResponseHandlerFree.
+extern IFChargeResponseHandler* IFChargeResponseHandlerCreate( IFChargeJournal* journal, IFChargeResponseCheck check,
+                                                               dispatch_queue_t deliveryQueue );
+
+// IFChargeResponseHandlerFree - Waits for the URLs already submitted
+// to be handled (though not necessarily delivered), then frees the
+// handler. Don't call it from a check.
+extern void IFChargeResponseHandlerFree( IFChargeResponseHandler* handler );
+
+// IFChargeResponseHandlerSubmit - Queues url to be handled and returns
+// at once. deliver is called on the delivery queue with the outcome; a
+// nil url is delivered as invalid, with kIFChargeErrorNilURL.
+extern void IFChargeResponseHandlerSubmit( IFChargeResponseHandler* handler, NSURL* url, IFChargeResponseDelivery deliver );
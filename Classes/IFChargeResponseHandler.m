@@ -0,0 +1,145 @@
+//
+// IFChargeResponseHandler.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeResponseHandler.h"
+
+#include <stdlib.h>
+
+struct IFChargeResponseHandler
+{
+    dispatch_queue_t      queue; // serial, so URLs are handled in order
+    dispatch_queue_t      deliveryQueue;
+    IFChargeJournal*      journal;
+    IFChargeResponseCheck check;
+};
+
+// One submitted URL, from submission until its outcome is delivered.
+// It's the only thing allocated on the submitting thread.
+typedef struct IFHandlerJob
+{
+    IFChargeResponseHandler* handler;
+    NSURL*                   url;
+    IFChargeResponseDelivery deliver;
+    IFChargeHandledResponse  handled;
+} IFHandlerJob;
+
+#pragma -
+#pragma Handling
+
+static void IFHandlerDeliver( void* context )
+{
+    IFHandlerJob* job = context;
+
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    job->deliver( &job->handled );
+    [pool drain];
+
+    [job->handled.response release];
+    [job->deliver release];
+    free( job );
+}
+
+// Runs on the handler's queue.
+static void IFHandlerProcess( void* context )
+{
+    IFHandlerJob* job = context;
+    IFChargeResponseHandler* handler = job->handler;
+    IFChargeHandledResponse* handled = &job->handled;
+
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    // Nothing else has seen the response yet, so it's frozen in place
+    // rather than copied.
+    IFChargeResponse* response = [[IFChargeResponse alloc] tryInitWithURL:job->url error:&handled->error];
+    if ( nil == response )
+    {
+        handled->outcome = kIFChargeResponseInvalid;
+    }
+    else
+    {
+        [response freezeInPlace];
+        handled->response = response;
+
+        if ( handler->check && !handler->check( response ) )
+        {
+            handled->outcome = kIFChargeResponseRejected;
+        }
+        else
+        {
+            handled->outcome = kIFChargeResponseAccepted;
+
+            // Record the outcome before the app acts on it. Syncing
+            // makes sure it survives even if the device loses power
+            // right after.
+            if ( handler->journal )
+            {
+                uint64_t sequence = IFChargeJournalAppendResponse( handler->journal, response );
+                if ( 0 != sequence && IFChargeJournalSync( handler->journal, sequence ) )
+                {
+                    handled->journalSequence = sequence;
+                }
+            }
+        }
+    }
+
+    [pool drain];
+
+    [job->url release];
+    job->url = nil;
+    dispatch_async_f( handler->deliveryQueue, job, IFHandlerDeliver );
+}
+
+static void IFHandlerNothing( void* context )
+{
+}
+
+#pragma -
+#pragma Handlers
+
+IFChargeResponseHandler* IFChargeResponseHandlerCreate( IFChargeJournal* journal, IFChargeResponseCheck check,
+                                                        dispatch_queue_t deliveryQueue )
+{
+    IFChargeResponseHandler* handler = calloc( 1, sizeof( IFChargeResponseHandler ) );
+
+    // The user is waiting on the outcome, so the work goes ahead of
+    // the app's other background work.
+    handler->queue = dispatch_queue_create( "com.innerfence.IFChargeResponseHandler", NULL );
+    dispatch_set_target_queue( handler->queue, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_HIGH, 0 ) );
+
+    handler->deliveryQueue = deliveryQueue ? deliveryQueue : dispatch_get_main_queue();
+    dispatch_retain( handler->deliveryQueue );
+    handler->journal = journal;
+    handler->check   = [check copy];
+    return handler;
+}
+
+void IFChargeResponseHandlerFree( IFChargeResponseHandler* handler )
+{
+    // A job only uses the handler until it's queued for delivery, and
+    // the queue is serial, so once this runs none of them need it.
+    dispatch_sync_f( handler->queue, NULL, IFHandlerNothing );
+
+    dispatch_release( handler->queue );
+    dispatch_release( handler->deliveryQueue );
+    [handler->check release];
+    free( handler );
+}
+
+void IFChargeResponseHandlerSubmit( IFChargeResponseHandler* handler, NSURL* url, IFChargeResponseDelivery deliver )
+{
+    IFHandlerJob* job = calloc( 1, sizeof( IFHandlerJob ) );
+    job->handler = handler;
+    job->url     = [url retain];
+    job->handled.error.field = -1;
+
+    // A block that captures nothing is a global, so this copy is free.
+    job->deliver = [deliver copy];
+
+    dispatch_async_f( handler->queue, job, IFHandlerProcess );
+}
@@ -0,0 +1,91 @@
+// -*- objc -*-
+//
+// IFChargeSimulator.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeRequest.h"
+#import "IFChargeResponse.h"
+#import "IFChargeStats.h"
+
+// IFChargeSimulator - A stand-in for Credit Card Terminal, for testing
+// the whole request, terminal and response loop without a device. It
+// reads a request URL as the terminal would, decides how the charge
+// went from a weighted draw, and makes the response URL with
+// initWithChargeRequest:responseCode:cardNumber:cardType: and
+// requestURL. Nothing is charged and no app is opened. A simulator may
+// be used from any thread.
+typedef struct IFChargeSimulator IFChargeSimulator;
+
+// The extra param each round trip of IFChargeSimulatorRun stores with
+// its nonce, holding the round trip's index.
+#define IF_CHARGE_SIMULATOR_ROUND_TRIP_KEY @"ifsim_roundTrip"
+
+typedef struct IFChargeSimulatorConfig
+{
+    // How often each response code is drawn, relative to the others,
+    // indexed by IFChargeResponseCode. If they're all 0, every charge
+    // is approved.
+    NSUInteger weights[kIFChargeResponseCodeError + 1];
+
+    // The card approved charges are made on, or nil for a test Visa.
+    NSString* cardNumber;
+
+    // Where the draws start. The same seed draws the same codes in
+    // the same order.
+    uint64_t seed;
+} IFChargeSimulatorConfig;
+
+// IFChargeSimulatorReport - What IFChargeSimulatorRun saw.
+typedef struct IFChargeSimulatorReport
+{
+    uint64_t roundTrips;
+
+    // Responses that were read back, by the code they carried.
+    uint64_t responseCodes[kIFChargeResponseCodeError + 1];
+
+    // Round trips that failed, by the error that stopped them: the
+    // request rejected by the terminal, or the response rejected by
+    // IFChargeResponse (its nonce included).
+    uint64_t rejections[IF_CHARGE_ERROR_CODE_COUNT];
+
+    // Responses that were read back but didn't match the round trip:
+    // a different code or amount than the terminal sent, or another
+    // round trip's stored extra params.
+    uint64_t mismatches;
+
+    // Each round trip's time, from copying the prototype to reading
+    // the response.
+    IFChargeStatsHistogram latency;
+    NSTimeInterval         seconds;
+} IFChargeSimulatorReport;
+
+// IFChargeSimulatorCreate - A simulator drawing codes as config says.
+// Free it with IFChargeSimulatorFree.
+extern IFChargeSimulator* IFChargeSimulatorCreate( const IFChargeSimulatorConfig* config );
+
+extern void IFChargeSimulatorFree( IFChargeSimulator* simulator );
+
+// IFChargeSimulatorHandleRequestURL - Does what Credit Card Terminal
+// does with requestURL, returning the autoreleased response URL and
+// setting *responseCode (if responseCode isn't NULL) to the code drawn.
+// Returns nil, filling in *error, if the terminal would refuse the
+// request: it isn't a valid IFChargeRequest, or has no returnURL.
+extern NSURL* IFChargeSimulatorHandleRequestURL( IFChargeSimulator* simulator, NSURL* requestURL,
+                                                 IFChargeResponseCode* responseCode, IFChargeError* error );
+
+// IFChargeSimulatorRun - Makes count round trips, each with a copy of
+// prototype: its returnURL is set again with the round trip's index as
+// a stored extra param (replacing any others), it's sent with
+// submitURL, the simulator handles it, and the response URL is read
+// with -[IFChargeResponse tryInitWithURL:error:], consuming its nonce
+// from the shared store. The round trips are handed out in small
+// batches to threadCount threads, or one per core if threadCount is 0.
+// The outcome is filled into *report.
+extern void IFChargeSimulatorRun( IFChargeSimulator* simulator, IFChargeRequest* prototype, NSUInteger count,
+                                  NSUInteger threadCount, IFChargeSimulatorReport* report );
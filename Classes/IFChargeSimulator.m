@@ -0,0 +1,224 @@
+//
+// IFChargeSimulator.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeSimulator.h"
+
+#include <dispatch/dispatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Round trips handed to a thread at a time.
+#define IF_CHARGE_SIMULATOR_ROUND_TRIPS 16
+
+// A test Visa number, which passes the Luhn check.
+#define IF_CHARGE_SIMULATOR_CARD_NUMBER @"4111111111111111"
+
+struct IFChargeSimulator
+{
+    // thresholds[code] is the sum of the weights up to and including
+    // code's, so a draw below it and at or above the one before picks
+    // code.
+    uint64_t          thresholds[kIFChargeResponseCodeError + 1];
+    uint64_t          totalWeight;
+    NSString*         cardNumber;
+    uint64_t          seed;
+    volatile uint64_t draws;
+};
+
+#pragma -
+#pragma Terminal
+
+IFChargeSimulator* IFChargeSimulatorCreate( const IFChargeSimulatorConfig* config )
+{
+    IFChargeSimulator* simulator = calloc( 1, sizeof( IFChargeSimulator ) );
+    for ( int code = 0; code <= kIFChargeResponseCodeError; code++ )
+    {
+        simulator->totalWeight += config->weights[code];
+        simulator->thresholds[code] = simulator->totalWeight;
+    }
+    simulator->cardNumber = [( config->cardNumber ? config->cardNumber : IF_CHARGE_SIMULATOR_CARD_NUMBER ) copy];
+    simulator->seed = config->seed;
+    return simulator;
+}
+
+void IFChargeSimulatorFree( IFChargeSimulator* simulator )
+{
+    if ( simulator )
+    {
+        [simulator->cardNumber release];
+        free( simulator );
+    }
+}
+
+// SplitMix64's finalizer: spreads consecutive draws over all 64 bits.
+static uint64_t IFSimulatorMix( uint64_t x )
+{
+    x = ( x ^ ( x >> 30 ) ) * 0xBF58476D1CE4E5B9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94D049BB133111EBULL;
+    return x ^ ( x >> 31 );
+}
+
+// Draws the next code. The draws are numbered, so threads share the
+// sequence without a lock.
+static IFChargeResponseCode IFSimulatorDrawCode( IFChargeSimulator* simulator )
+{
+    if ( 0 == simulator->totalWeight )
+    {
+        return kIFChargeResponseCodeApproved;
+    }
+
+    uint64_t draw = __sync_fetch_and_add( &simulator->draws, 1 );
+    draw = IFSimulatorMix( simulator->seed + draw * 0x9E3779B97F4A7C15ULL ) % simulator->totalWeight;
+    IFChargeResponseCode code = kIFChargeResponseCodeApproved;
+    while ( draw >= simulator->thresholds[code] )
+    {
+        code++;
+    }
+    return code;
+}
+
+NSURL* IFChargeSimulatorHandleRequestURL( IFChargeSimulator* simulator, NSURL* requestURL,
+                                          IFChargeResponseCode* responseCode, IFChargeError* error )
+{
+    IFChargeRequest* request = [[IFChargeRequest alloc] tryInitWithURL:requestURL error:error];
+    if ( nil == request )
+    {
+        return nil;
+    }
+
+    // Without a returnURL the terminal has nowhere to send the
+    // response.
+    if ( 0 == [request.returnURL length] )
+    {
+        [request release];
+        IFChargeSetError( error, kIFChargeErrorNilURL, [IFChargeRequest class], "returnURL", 0 );
+        return nil;
+    }
+
+    IFChargeResponseCode code = IFSimulatorDrawCode( simulator );
+    IFChargeResponse* response = [[IFChargeResponse alloc] initWithChargeRequest:request
+                                                                    responseCode:code
+                                                                      cardNumber:simulator->cardNumber
+                                                                        cardType:nil];
+    NSURL* url = [[[response requestURL] retain] autorelease];
+    [response release];
+    [request release];
+
+    if ( responseCode )
+    {
+        *responseCode = code;
+    }
+    return url;
+}
+
+#pragma -
+#pragma Load
+
+static BOOL IFSimulatorSameString( NSString* a, NSString* b )
+{
+    return a == b || [a isEqualToString:b];
+}
+
+static void IFSimulatorRoundTrip( IFChargeSimulator* simulator, IFChargeRequest* prototype, NSUInteger index,
+                                  IFChargeSimulatorReport* report )
+{
+    uint64_t start = IFChargeStatsNow();
+    NSString* roundTrip = [NSString stringWithFormat:@"%lu", (unsigned long)index];
+    IFChargeError error = { kIFChargeErrorNone, -1, 0 };
+    IFChargeResponseCode code = kIFChargeResponseCodeError;
+    IFChargeResponse* response = nil;
+
+    IFChargeRequest* request = [prototype copy];
+    NSDictionary* storedParams = [NSDictionary dictionaryWithObject:roundTrip forKey:IF_CHARGE_SIMULATOR_ROUND_TRIP_KEY];
+    if ( [request trySetReturnURL:request.returnURL withStoredExtraParams:storedParams error:&error] )
+    {
+        NSURL* responseURL = IFChargeSimulatorHandleRequestURL( simulator, [request submitURL], &code, &error );
+        if ( responseURL )
+        {
+            response = [[IFChargeResponse alloc] tryInitWithURL:responseURL error:&error];
+        }
+    }
+    IFChargeStatsHistogramRecord( &report->latency, start );
+
+    report->roundTrips++;
+    if ( nil == response )
+    {
+        report->rejections[MIN( (unsigned)error.code, IF_CHARGE_ERROR_CODE_COUNT - 1 )]++;
+    }
+    else
+    {
+        report->responseCodes[response.responseCode]++;
+        if ( response.responseCode != code ||
+             !IFSimulatorSameString( roundTrip, [response.extraParams objectForKey:IF_CHARGE_SIMULATOR_ROUND_TRIP_KEY] ) ||
+             ( kIFChargeResponseCodeApproved == code && !IFSimulatorSameString( request.amount, response.amount ) ) )
+        {
+            report->mismatches++;
+        }
+        [response release];
+    }
+    [request release];
+}
+
+void IFChargeSimulatorRun( IFChargeSimulator* simulator, IFChargeRequest* prototype, NSUInteger count,
+                           NSUInteger threadCount, IFChargeSimulatorReport* report )
+{
+    memset( report, 0, sizeof( *report ) );
+    if ( 0 == threadCount )
+    {
+        threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    }
+
+    // A private copy, so the caller's prototype can change while the
+    // threads copy from this one.
+    IFChargeRequest* master = [prototype copy];
+    IFChargeSimulatorReport* reports = calloc( threadCount, sizeof( IFChargeSimulatorReport ) );
+    volatile NSUInteger next = 0;
+    volatile NSUInteger* nextRoundTrip = &next;
+
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    dispatch_apply( threadCount, dispatch_get_global_queue( DISPATCH_QUEUE_PRIORITY_DEFAULT, 0 ), ^( size_t thread )
+    {
+        for ( ;; )
+        {
+            NSUInteger first = __sync_fetch_and_add( nextRoundTrip, IF_CHARGE_SIMULATOR_ROUND_TRIPS );
+            if ( first >= count )
+            {
+                break;
+            }
+
+            NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+            NSUInteger end = MIN( first + IF_CHARGE_SIMULATOR_ROUND_TRIPS, count );
+            for ( NSUInteger index = first; index < end; index++ )
+            {
+                IFSimulatorRoundTrip( simulator, master, index, &reports[thread] );
+            }
+            [pool drain];
+        }
+    });
+    report->seconds = [NSDate timeIntervalSinceReferenceDate] - start;
+
+    for ( NSUInteger thread = 0; thread < threadCount; thread++ )
+    {
+        const IFChargeSimulatorReport* from = &reports[thread];
+        report->roundTrips += from->roundTrips;
+        report->mismatches += from->mismatches;
+        for ( int code = 0; code <= kIFChargeResponseCodeError; code++ )
+        {
+            report->responseCodes[code] += from->responseCodes[code];
+        }
+        for ( unsigned code = 0; code < IF_CHARGE_ERROR_CODE_COUNT; code++ )
+        {
+            report->rejections[code] += from->rejections[code];
+        }
+        IFChargeStatsHistogramMerge( &report->latency, &from->latency );
+    }
+
+    free( reports );
+    [master release];
+}
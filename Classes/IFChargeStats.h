@@ -0,0 +1,113 @@
+// -*- objc -*-
+//
+// IFChargeStats.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeMessage.h"
+
+// IFChargeStats - Counters and latency histograms for each stage of
+// handling a charge URL, and counts of what's rejected and why. Each
+// thread records into its own block of counters, so recording takes
+// no lock and no atomic operation: a stage costs two clock reads and a
+// few increments. Blocks are merged only when a snapshot is taken.
+//
+// Build with IF_CHARGE_STATS defined to 0 to compile the recording out
+// altogether; snapshots are then all zeros.
+#ifndef IF_CHARGE_STATS
+#define IF_CHARGE_STATS 1
+#endif
+
+// IFChargeStatsStage - The stages that are timed.
+typedef enum {
+    kIFChargeStageQueryParse,     // IFChargeQueryParse, all of it
+    kIFChargeStagePercentDecode,  // its pass splitting and decoding pairs
+    kIFChargeStageFieldAssign,    // trySetQueryValues:extraParams:error:
+    kIFChargeStageNonceCheck,     // consuming a response's nonce
+    kIFChargeStageValidateFields, // a response's field and approval checks
+    kIFChargeStageRequestURL,     // -requestURL, all of it
+    kIFChargeStageEncode,         // IFChargeQueryCreateURLString
+    kIFChargeStageCount
+} IFChargeStatsStage;
+
+// Histogram bucket i counts times under 2^i nanoseconds (and at least
+// 2^(i-1)); the last also counts everything longer.
+#define IF_CHARGE_STATS_BUCKETS 32
+
+typedef struct IFChargeStatsHistogram
+{
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+    uint64_t buckets[IF_CHARGE_STATS_BUCKETS];
+} IFChargeStatsHistogram;
+
+// IFChargeStatsSnapshot - Every thread's counters, merged.
+typedef struct IFChargeStatsSnapshot
+{
+    IFChargeStatsHistogram stages[kIFChargeStageCount];
+
+    // Rejected URLs, wire data and field values, by error code, and
+    // by the field blamed, if one was.
+    uint64_t rejections[IF_CHARGE_ERROR_CODE_COUNT];
+    uint64_t requestFieldRejections[IF_CHARGE_QUERY_MAX_FIELDS];
+    uint64_t responseFieldRejections[IF_CHARGE_QUERY_MAX_FIELDS];
+} IFChargeStatsSnapshot;
+
+// IFChargeStatsNow - The clock stages are timed by, in its own units.
+extern uint64_t IFChargeStatsNow( void );
+
+// IFChargeStatsRecord - Counts one run of stage, begun at start (an
+// IFChargeStatsNow time), on the calling thread.
+extern void IFChargeStatsRecord( IFChargeStatsStage stage, uint64_t start );
+
+// IFChargeStatsHistogramRecord - Counts one span, begun at start, in
+// a histogram of the caller's own, such as a per-thread latency
+// histogram. The histogram isn't locked.
+extern void IFChargeStatsHistogramRecord( IFChargeStatsHistogram* histogram, uint64_t start );
+
+// IFChargeStatsReject - Counts the rejection error describes, of a
+// message of messageClass.
+extern void IFChargeStatsReject( Class messageClass, const IFChargeError* error );
+
+// IFChargeStatsTakeSnapshot - Merges every thread's counters, including
+// those of threads that have exited, into *snapshot. Counts being
+// recorded while it runs may or may not be included.
+extern void IFChargeStatsTakeSnapshot( IFChargeStatsSnapshot* snapshot );
+
+// IFChargeStatsHistogramMerge - Adds the counts of from to to.
+extern void IFChargeStatsHistogramMerge( IFChargeStatsHistogram* to, const IFChargeStatsHistogram* from );
+
+// IFChargeStatsHistogramPercentile - An upper bound, in nanoseconds, on
+// the given percentile (0 to 100) of histogram; 0 if it's empty.
+extern uint64_t IFChargeStatsHistogramPercentile( const IFChargeStatsHistogram* histogram, double percentile );
+
+// IFChargeStatsSnapshotJSON - snapshot as a JSON object:
+//
+//   { "stages": { "queryParse": { "count": 10, "totalNanos": 52310,
+//                                 "maxNanos": 9120, "p50Nanos": 4096,
+//                                 "p99Nanos": 16384,
+//                                 "buckets": [0, 0, ...] }, ... },
+//     "rejections": { "invalidField": 2, ... },
+//     "fieldRejections": { "request": { "email": 1 },
+//                          "response": { "amount": 2 } } }
+//
+// Rejections and fields with no count are left out.
+extern NSString* IFChargeStatsSnapshotJSON( const IFChargeStatsSnapshot* snapshot );
+
+// Recording, as the library does it. Each compiles to nothing if
+// IF_CHARGE_STATS is 0.
+#if IF_CHARGE_STATS
+#define IF_CHARGE_STATS_START( start )        uint64_t start = IFChargeStatsNow()
+#define IF_CHARGE_STATS_STOP( stage, start )  IFChargeStatsRecord( stage, start )
+#define IF_CHARGE_STATS_REJECT( cls, error )  IFChargeStatsReject( cls, error )
+#else
+#define IF_CHARGE_STATS_START( start )
+#define IF_CHARGE_STATS_STOP( stage, start )
+#define IF_CHARGE_STATS_REJECT( cls, error )
+#endif
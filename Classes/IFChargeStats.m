@@ -0,0 +1,307 @@
+//
+// IFChargeStats.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeStats.h"
+#import "IFChargeRequest.h"
+#import "IFChargeResponse.h"
+
+#include <math.h>
+#include <pthread.h>
+#if defined( __APPLE__ )
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
+
+// IFStatsBlock - One thread's counters. Only the owning thread writes
+// them, so they're plain increments; a snapshot reads them as they
+// are. Blocks are never freed: one whose thread has exited keeps its
+// counts, and is handed to the next new thread.
+typedef struct IFStatsBlock
+{
+    struct IFStatsBlock*   next;
+    volatile int           owned;
+    IFChargeStatsHistogram stages[kIFChargeStageCount];
+    uint64_t               rejections[IF_CHARGE_ERROR_CODE_COUNT];
+    uint64_t               requestFieldRejections[IF_CHARGE_QUERY_MAX_FIELDS];
+    uint64_t               responseFieldRejections[IF_CHARGE_QUERY_MAX_FIELDS];
+} IFStatsBlock;
+
+static IFStatsBlock* volatile _blocks;
+static pthread_key_t          _blockKey;
+static pthread_once_t         _blockKeyOnce = PTHREAD_ONCE_INIT;
+
+#if defined( __APPLE__ )
+static mach_timebase_info_data_t _timebase;
+#endif
+
+static const char* const _stageNames[kIFChargeStageCount] = {
+    [kIFChargeStageQueryParse]     = "queryParse",
+    [kIFChargeStagePercentDecode]  = "percentDecode",
+    [kIFChargeStageFieldAssign]    = "fieldAssign",
+    [kIFChargeStageNonceCheck]     = "nonceCheck",
+    [kIFChargeStageValidateFields] = "validateFields",
+    [kIFChargeStageRequestURL]     = "requestURL",
+    [kIFChargeStageEncode]         = "encode"
+};
+
+static const char* const _errorNames[IF_CHARGE_ERROR_CODE_COUNT] = {
+    [kIFChargeErrorNone]                      = "none",
+    [kIFChargeErrorArgumentTooLong]           = "argumentTooLong",
+    [kIFChargeErrorDisallowedCharacter]       = "disallowedCharacter",
+    [kIFChargeErrorInvalidURL]                = "invalidURL",
+    [kIFChargeErrorInvalidEmail]              = "invalidEmail",
+    [kIFChargeErrorAmountTooHigh]             = "amountTooHigh",
+    [kIFChargeErrorAmountTooLow]              = "amountTooLow",
+    [kIFChargeErrorInvalidAmount]             = "invalidAmount",
+    [kIFChargeErrorQueryInBaseURI]            = "queryInBaseURI",
+    [kIFChargeErrorNilURL]                    = "nilURL",
+    [kIFChargeErrorNonStringExtraParam]       = "nonStringExtraParam",
+    [kIFChargeErrorNonceUnavailable]          = "nonceUnavailable",
+    [kIFChargeErrorMalformedQuery]            = "malformedQuery",
+    [kIFChargeErrorInvalidField]              = "invalidField",
+    [kIFChargeErrorUnknownResponseType]       = "unknownResponseType",
+    [kIFChargeErrorMissingAmount]             = "missingAmount",
+    [kIFChargeErrorMissingRedactedCardNumber] = "missingRedactedCardNumber",
+    [kIFChargeErrorUnexpectedTransactionInfo] = "unexpectedTransactionInfo",
+    [kIFChargeErrorNoOutstandingRequest]      = "noOutstandingRequest",
+    [kIFChargeErrorMissingNonce]              = "missingNonce",
+    [kIFChargeErrorIncorrectNonce]            = "incorrectNonce",
+    [kIFChargeErrorExpiredNonce]              = "expiredNonce",
+    [kIFChargeErrorMalformedWireData]         = "malformedWireData",
+    [kIFChargeErrorInvalidColumnName]         = "invalidColumnName"
+};
+
+#pragma -
+#pragma Thread Blocks
+
+// Hands the exiting thread's block on.
+static void IFStatsReleaseBlock( void* block )
+{
+    __sync_synchronize();
+    ( (IFStatsBlock*)block )->owned = 0;
+}
+
+static void IFStatsCreateKey( void )
+{
+    pthread_key_create( &_blockKey, IFStatsReleaseBlock );
+#if defined( __APPLE__ )
+    mach_timebase_info( &_timebase );
+#endif
+}
+
+// The calling thread's block: one left by an exited thread if there
+// is one, or a new one pushed onto the list.
+static IFStatsBlock* IFStatsThreadBlock( void )
+{
+    pthread_once( &_blockKeyOnce, IFStatsCreateKey );
+    IFStatsBlock* block = pthread_getspecific( _blockKey );
+    if ( block )
+    {
+        return block;
+    }
+
+    for ( block = _blocks; block; block = block->next )
+    {
+        if ( __sync_bool_compare_and_swap( &block->owned, 0, 1 ) )
+        {
+            break;
+        }
+    }
+    if ( NULL == block )
+    {
+        block = calloc( 1, sizeof( IFStatsBlock ) );
+        block->owned = 1;
+        do
+        {
+            block->next = _blocks;
+        }
+        while ( !__sync_bool_compare_and_swap( &_blocks, block->next, block ) );
+    }
+    pthread_setspecific( _blockKey, block );
+    return block;
+}
+
+#pragma -
+#pragma Recording
+
+uint64_t IFChargeStatsNow( void )
+{
+#if defined( __APPLE__ )
+    return mach_absolute_time();
+#else
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+void IFChargeStatsHistogramRecord( IFChargeStatsHistogram* histogram, uint64_t start )
+{
+    uint64_t nanos = IFChargeStatsNow() - start;
+#if defined( __APPLE__ )
+    pthread_once( &_blockKeyOnce, IFStatsCreateKey );
+    if ( _timebase.numer != _timebase.denom )
+    {
+        nanos = nanos * _timebase.numer / _timebase.denom;
+    }
+#endif
+
+    unsigned bucket = nanos ? 64 - __builtin_clzll( nanos ) : 0;
+    histogram->count++;
+    histogram->totalNanos += nanos;
+    histogram->maxNanos = MAX( histogram->maxNanos, nanos );
+    histogram->buckets[MIN( bucket, IF_CHARGE_STATS_BUCKETS - 1 )]++;
+}
+
+void IFChargeStatsRecord( IFChargeStatsStage stage, uint64_t start )
+{
+    IFChargeStatsHistogramRecord( &IFStatsThreadBlock()->stages[stage], start );
+}
+
+void IFChargeStatsReject( Class messageClass, const IFChargeError* error )
+{
+    IFStatsBlock* block = IFStatsThreadBlock();
+    if ( (unsigned)error->code < IF_CHARGE_ERROR_CODE_COUNT )
+    {
+        block->rejections[error->code]++;
+    }
+    if ( error->field >= 0 && error->field < IF_CHARGE_QUERY_MAX_FIELDS )
+    {
+        if ( [messageClass isSubclassOfClass:[IFChargeResponse class]] )
+        {
+            block->responseFieldRejections[error->field]++;
+        }
+        else if ( [messageClass isSubclassOfClass:[IFChargeRequest class]] )
+        {
+            block->requestFieldRejections[error->field]++;
+        }
+    }
+}
+
+#pragma -
+#pragma Snapshots
+
+void IFChargeStatsTakeSnapshot( IFChargeStatsSnapshot* snapshot )
+{
+    memset( snapshot, 0, sizeof( *snapshot ) );
+    __sync_synchronize();
+    for ( IFStatsBlock* block = _blocks; block; block = block->next )
+    {
+        for ( unsigned stage = 0; stage < kIFChargeStageCount; stage++ )
+        {
+            IFChargeStatsHistogramMerge( &snapshot->stages[stage], &block->stages[stage] );
+        }
+        for ( unsigned code = 0; code < IF_CHARGE_ERROR_CODE_COUNT; code++ )
+        {
+            snapshot->rejections[code] += block->rejections[code];
+        }
+        for ( unsigned field = 0; field < IF_CHARGE_QUERY_MAX_FIELDS; field++ )
+        {
+            snapshot->requestFieldRejections[field]  += block->requestFieldRejections[field];
+            snapshot->responseFieldRejections[field] += block->responseFieldRejections[field];
+        }
+    }
+}
+
+void IFChargeStatsHistogramMerge( IFChargeStatsHistogram* to, const IFChargeStatsHistogram* from )
+{
+    to->count      += from->count;
+    to->totalNanos += from->totalNanos;
+    to->maxNanos    = MAX( to->maxNanos, from->maxNanos );
+    for ( unsigned bucket = 0; bucket < IF_CHARGE_STATS_BUCKETS; bucket++ )
+    {
+        to->buckets[bucket] += from->buckets[bucket];
+    }
+}
+
+uint64_t IFChargeStatsHistogramPercentile( const IFChargeStatsHistogram* histogram, double percentile )
+{
+    uint64_t total = 0;
+    for ( unsigned bucket = 0; bucket < IF_CHARGE_STATS_BUCKETS; bucket++ )
+    {
+        total += histogram->buckets[bucket];
+    }
+    if ( 0 == total )
+    {
+        return 0;
+    }
+
+    // The bucket holding the rank'th time, counting from 1.
+    uint64_t rank = (uint64_t)ceil( total * percentile / 100 );
+    uint64_t seen = 0;
+    for ( unsigned bucket = 0; bucket < IF_CHARGE_STATS_BUCKETS - 1; bucket++ )
+    {
+        seen += histogram->buckets[bucket];
+        if ( seen >= MAX( rank, 1 ) )
+        {
+            return MIN( 1ULL << bucket, MAX( histogram->maxNanos, 1 ) );
+        }
+    }
+    return histogram->maxNanos;
+}
+
+// Appends the nonzero counts of fields, named from knownFields.
+static void IFAppendFieldCounts( NSMutableString* json, const uint64_t* counts, NSArray* knownFields )
+{
+    [json appendString:@"{"];
+    BOOL first = YES;
+    for ( NSUInteger field = 0; field < [knownFields count]; field++ )
+    {
+        if ( counts[field] )
+        {
+            [json appendFormat:@"%@\"%@\": %llu", first ? @"" : @", ", [knownFields objectAtIndex:field],
+                (unsigned long long)counts[field]];
+            first = NO;
+        }
+    }
+    [json appendString:@"}"];
+}
+
+NSString* IFChargeStatsSnapshotJSON( const IFChargeStatsSnapshot* snapshot )
+{
+    NSMutableString* json = [NSMutableString stringWithString:@"{\n  \"stages\": {"];
+    for ( unsigned stage = 0; stage < kIFChargeStageCount; stage++ )
+    {
+        const IFChargeStatsHistogram* histogram = &snapshot->stages[stage];
+        [json appendFormat:@"%@\n    \"%s\": { \"count\": %llu, \"totalNanos\": %llu, \"maxNanos\": %llu, "
+                           @"\"p50Nanos\": %llu, \"p99Nanos\": %llu, \"buckets\": [",
+            stage ? @"," : @"",
+            _stageNames[stage],
+            (unsigned long long)histogram->count,
+            (unsigned long long)histogram->totalNanos,
+            (unsigned long long)histogram->maxNanos,
+            (unsigned long long)IFChargeStatsHistogramPercentile( histogram, 50 ),
+            (unsigned long long)IFChargeStatsHistogramPercentile( histogram, 99 )];
+        for ( unsigned bucket = 0; bucket < IF_CHARGE_STATS_BUCKETS; bucket++ )
+        {
+            [json appendFormat:@"%@%llu", bucket ? @", " : @"", (unsigned long long)histogram->buckets[bucket]];
+        }
+        [json appendString:@"] }"];
+    }
+
+    [json appendString:@"\n  },\n  \"rejections\": {"];
+    BOOL first = YES;
+    for ( unsigned code = 0; code < IF_CHARGE_ERROR_CODE_COUNT; code++ )
+    {
+        if ( snapshot->rejections[code] )
+        {
+            [json appendFormat:@"%@\"%s\": %llu", first ? @"" : @", ", _errorNames[code],
+                (unsigned long long)snapshot->rejections[code]];
+            first = NO;
+        }
+    }
+
+    [json appendString:@"},\n  \"fieldRejections\": { \"request\": "];
+    IFAppendFieldCounts( json, snapshot->requestFieldRejections, [IFChargeRequest knownFields] );
+    [json appendString:@", \"response\": "];
+    IFAppendFieldCounts( json, snapshot->responseFieldRejections, [IFChargeResponse knownFields] );
+    [json appendString:@" }\n}\n"];
+    return json;
+}
@@ -0,0 +1,137 @@
+// -*- objc -*-
+//
+// IFChargeWire.h
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeMessage.h"
+#import "IFChargeMoney.h"
+#import "IFChargeResponse.h"
+
+// IFChargeWire - A compact binary form of a request or response, for
+// queueing, caching and handing messages between processes without
+// building and parsing URLs. A message is
+//
+//     'I' 'F' 'W'  version  kind  varint(body length)  body
+//
+// and the body is a run of fields, each
+//
+//     tag  varint(payload length)  payload
+//
+// Varints are unsigned LEB128. A field's tag is the wireTag of its
+// schema row (see IF_CHARGE_FIELD), or one of the message tags below;
+// a reader skips tags it doesn't know, so fields can be added without
+// a new version. Empty fields aren't written.
+//
+// Most payloads are the field's UTF-8 string. Two kinds of field have
+// a compact payload instead, marked by IF_CHARGE_WIRE_COMPACT in the
+// tag: an amount in the two-decimal form Credit Card Terminal sends is
+// a zigzag varint of hundredths, and a known responseType is its
+// IFChargeResponseCode as a (one byte) varint. Anything else (an amount set as
+// "5", say) is sent as its string, so every message round-trips
+// exactly.
+#define IF_CHARGE_WIRE_VERSION 1
+
+typedef enum {
+    kIFChargeWireRequest  = 1,
+    kIFChargeWireResponse = 2
+} IFChargeWireKind;
+
+// Set in the tag of a field with a compact payload.
+#define IF_CHARGE_WIRE_COMPACT 0x80
+
+// The wireTag of IFChargeResponse's responseType. A compact payload is
+// a response code under this tag, and an amount under any other.
+#define IF_CHARGE_WIRE_TAG_RESPONSE_TYPE 24
+
+// Tags for message state outside the schema.
+#define IF_CHARGE_WIRE_TAG_NONCE       60 // the nonce, if not in an extra param
+#define IF_CHARGE_WIRE_TAG_BASE_URL    61
+#define IF_CHARGE_WIRE_TAG_EXTRA_PARAM 62 // varint(key length) key value
+
+// The longest header a message can have.
+#define IF_CHARGE_WIRE_HEADER_MAX 15
+
+// IFChargeWireField - One field, as a view of the buffer it was read
+// from. bytes stays valid only as long as the buffer does.
+typedef struct IFChargeWireField
+{
+    unsigned       tag;     // without IF_CHARGE_WIRE_COMPACT
+    BOOL           compact;
+    const uint8_t* bytes;   // the payload
+    size_t         length;
+} IFChargeWireField;
+
+// IFChargeWireReader - Walks the fields of an encoded message in
+// place, copying nothing. Keep one on the stack.
+typedef struct IFChargeWireReader
+{
+    unsigned         version;
+    IFChargeWireKind kind;
+    const uint8_t*   next;
+    const uint8_t*   end;
+    BOOL             malformed;
+} IFChargeWireReader;
+
+// IFChargeWireReaderInit - Checks the header of the length bytes at
+// bytes and sets reader up to read the body. Returns NO if there's no
+// complete message of a known version; bytes after the message are
+// ignored, so messages can be read back to back (see
+// IFChargeWireMessageLength).
+extern BOOL IFChargeWireReaderInit( IFChargeWireReader* reader, const void* bytes, size_t length );
+
+// IFChargeWireReaderNext - Reads the next field into *field. Returns
+// NO at the end of the body, or if a field runs past it, in which case
+// reader->malformed is set.
+extern BOOL IFChargeWireReaderNext( IFChargeWireReader* reader, IFChargeWireField* field );
+
+// IFChargeWireMessageLength - The length of the whole message at the
+// start of the length bytes at bytes, or 0 if they don't hold a
+// complete message.
+extern size_t IFChargeWireMessageLength( const void* bytes, size_t length );
+
+// IFChargeWireFieldAmount - Decodes an amount field, compact or not,
+// into *money. Returns NO if it isn't a number.
+extern BOOL IFChargeWireFieldAmount( const IFChargeWireField* field, IFChargeMoney* money );
+
+// IFChargeWireFieldResponseCode - Decodes a compact responseType into
+// *code. Returns NO for a string responseType, or a bad code.
+extern BOOL IFChargeWireFieldResponseCode( const IFChargeWireField* field, IFChargeResponseCode* code );
+
+// IFChargeWireFieldExtraParam - Splits an extra param field into views
+// of its key and value. Returns NO if it's malformed.
+extern BOOL IFChargeWireFieldExtraParam( const IFChargeWireField* field,
+                                         const uint8_t** key, size_t* keyLength,
+                                         const uint8_t** value, size_t* valueLength );
+
+// IFChargeWireFieldCreateString - The field's value as a string, in
+// the form the message's property has (a compact amount as "12.50", a
+// compact responseType as "approved"), which the caller must release.
+// Returns nil if the payload isn't UTF-8. Use
+// IFChargeWireFieldExtraParam for an extra param.
+extern NSString* IFChargeWireFieldCreateString( const IFChargeWireField* field );
+
+@interface IFChargeMessage (Wire)
+
+// wireData - The message in the wire format: every field, the nonce,
+// the baseURL and the extraParams. An IFChargeRequest's stored extra
+// params stay on the device, as they do with its URL.
+- (NSData*)wireData;
+
+// tryInitWithWireData:error: - Decodes a message made by wireData,
+// checking each field as initWithURL: does. A response's nonce is
+// left alone, as with +[IFChargeResponse verifyURL:result:], since a
+// decoded response is one that's already been handled. If data isn't
+// a valid message of the receiver's class, releases the receiver,
+// fills in *error and returns nil.
+- (id)tryInitWithWireData:(NSData*)data error:(IFChargeError*)error;
+
+// initWithWireData: - As above, but raises.
+- (id)initWithWireData:(NSData*)data;
+
+@end
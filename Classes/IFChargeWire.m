@@ -0,0 +1,592 @@
+//
+// IFChargeWire.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+#import "IFChargeWire.h"
+#import "IFChargeIntern.h"
+#import "IFChargeQuery.h"
+#import "IFChargeStats.h"
+
+// A compact amount is in hundredths; IFChargeMoney is in
+// ten-thousandths.
+#define IF_WIRE_AMOUNT_UNIT ( IF_CHARGE_MONEY_ONE / 100 )
+
+// The most a field adds besides its strings' bytes: the tag and two
+// varints (the payload length, and an extra param's key length).
+#define IF_WIRE_FIELD_OVERHEAD 21
+
+// Indexed by IFChargeResponseCode.
+static NSString* const kIFWireResponseTypes[] = { @"approved", @"cancelled", @"declined", @"error" };
+#define IF_WIRE_RESPONSE_TYPE_COUNT ( sizeof( kIFWireResponseTypes ) / sizeof( kIFWireResponseTypes[0] ) )
+
+// checkFields: is private to IFChargeResponse.
+@interface IFChargeResponse (IFChargeWireChecks)
+- (BOOL)checkFields:(IFChargeError*)error;
+@end
+
+#pragma -
+#pragma Varints
+
+static size_t IFWireVarintLength( uint64_t value )
+{
+    size_t length = 1;
+    while ( value >= 0x80 )
+    {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+static uint8_t* IFWirePutVarint( uint8_t* out, uint64_t value )
+{
+    while ( value >= 0x80 )
+    {
+        *out++ = (uint8_t)( value | 0x80 );
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Reads a varint at *p, no further than end, and advances *p past it.
+static BOOL IFWireGetVarint( const uint8_t** p, const uint8_t* end, uint64_t* value )
+{
+    const uint8_t* in = *p;
+    uint64_t result = 0;
+    unsigned shift;
+    for ( shift = 0; shift < 64 && in < end; shift += 7 )
+    {
+        uint8_t byte = *in++;
+        result |= (uint64_t)( byte & 0x7f ) << shift;
+        if ( !( byte & 0x80 ) )
+        {
+            *p     = in;
+            *value = result;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static uint64_t IFWireZigzag( int64_t value )
+{
+    return ( (uint64_t)value << 1 ) ^ (uint64_t)( value >> 63 );
+}
+
+static int64_t IFWireUnzigzag( uint64_t value )
+{
+    return (int64_t)( value >> 1 ) ^ -(int64_t)( value & 1 );
+}
+
+#pragma -
+#pragma Reading
+
+BOOL IFChargeWireReaderInit( IFChargeWireReader* reader, const void* bytes, size_t length )
+{
+    const uint8_t* p   = bytes;
+    const uint8_t* end = p + length;
+    uint64_t bodyLength;
+
+    reader->next      = NULL;
+    reader->end       = NULL;
+    reader->malformed = YES;
+
+    if ( length < 5 || 'I' != p[0] || 'F' != p[1] || 'W' != p[2] )
+    {
+        return NO;
+    }
+    if ( 0 == p[3] || p[3] > IF_CHARGE_WIRE_VERSION )
+    {
+        return NO;
+    }
+    if ( kIFChargeWireRequest != p[4] && kIFChargeWireResponse != p[4] )
+    {
+        return NO;
+    }
+    reader->version = p[3];
+    reader->kind    = p[4];
+
+    p += 5;
+    if ( !IFWireGetVarint( &p, end, &bodyLength ) || bodyLength > (uint64_t)( end - p ) )
+    {
+        return NO;
+    }
+
+    reader->next      = p;
+    reader->end       = p + bodyLength;
+    reader->malformed = NO;
+    return YES;
+}
+
+BOOL IFChargeWireReaderNext( IFChargeWireReader* reader, IFChargeWireField* field )
+{
+    if ( reader->next >= reader->end )
+    {
+        return NO;
+    }
+
+    const uint8_t* p = reader->next;
+    uint8_t tag = *p++;
+    uint64_t length;
+    if ( !IFWireGetVarint( &p, reader->end, &length ) || length > (uint64_t)( reader->end - p ) )
+    {
+        reader->malformed = YES;
+        reader->next      = reader->end;
+        return NO;
+    }
+
+    field->tag     = tag & ~IF_CHARGE_WIRE_COMPACT;
+    field->compact = 0 != ( tag & IF_CHARGE_WIRE_COMPACT );
+    field->bytes   = p;
+    field->length  = (size_t)length;
+    reader->next   = p + length;
+    return YES;
+}
+
+size_t IFChargeWireMessageLength( const void* bytes, size_t length )
+{
+    IFChargeWireReader reader;
+    if ( !IFChargeWireReaderInit( &reader, bytes, length ) )
+    {
+        return 0;
+    }
+    return reader.end - (const uint8_t*)bytes;
+}
+
+BOOL IFChargeWireFieldAmount( const IFChargeWireField* field, IFChargeMoney* money )
+{
+    if ( !field->compact )
+    {
+        return IFChargeMoneyParse( (const char*)field->bytes, field->length, money );
+    }
+
+    uint64_t value;
+    const uint8_t* p = field->bytes;
+    if ( !IFWireGetVarint( &p, field->bytes + field->length, &value ) || p != field->bytes + field->length )
+    {
+        return NO;
+    }
+
+    // No amount field holds more than IF_CHARGE_MONEY_MAX, so anything
+    // larger is corrupt (and might overflow).
+    int64_t hundredths = IFWireUnzigzag( value );
+    if ( hundredths > IF_CHARGE_MONEY_MAX / IF_WIRE_AMOUNT_UNIT || hundredths < -IF_CHARGE_MONEY_MAX / IF_WIRE_AMOUNT_UNIT )
+    {
+        return NO;
+    }
+    *money = hundredths * IF_WIRE_AMOUNT_UNIT;
+    return YES;
+}
+
+BOOL IFChargeWireFieldResponseCode( const IFChargeWireField* field, IFChargeResponseCode* code )
+{
+    uint64_t value;
+    const uint8_t* p = field->bytes;
+    if ( !field->compact || IF_CHARGE_WIRE_TAG_RESPONSE_TYPE != field->tag ||
+         !IFWireGetVarint( &p, field->bytes + field->length, &value ) || p != field->bytes + field->length ||
+         value >= IF_WIRE_RESPONSE_TYPE_COUNT )
+    {
+        return NO;
+    }
+    *code = (IFChargeResponseCode)value;
+    return YES;
+}
+
+BOOL IFChargeWireFieldExtraParam( const IFChargeWireField* field,
+                                  const uint8_t** key, size_t* keyLength,
+                                  const uint8_t** value, size_t* valueLength )
+{
+    const uint8_t* p   = field->bytes;
+    const uint8_t* end = p + field->length;
+    uint64_t length;
+    if ( IF_CHARGE_WIRE_TAG_EXTRA_PARAM != field->tag ||
+         !IFWireGetVarint( &p, end, &length ) || length > (uint64_t)( end - p ) )
+    {
+        return NO;
+    }
+    *key         = p;
+    *keyLength   = (size_t)length;
+    *value       = p + length;
+    *valueLength = end - *value;
+    return YES;
+}
+
+NSString* IFChargeWireFieldCreateString( const IFChargeWireField* field )
+{
+    if ( !field->compact )
+    {
+        return [[NSString alloc] initWithBytes:field->bytes length:field->length encoding:NSUTF8StringEncoding];
+    }
+
+    if ( IF_CHARGE_WIRE_TAG_RESPONSE_TYPE == field->tag )
+    {
+        IFChargeResponseCode code;
+        return IFChargeWireFieldResponseCode( field, &code ) ? [kIFWireResponseTypes[code] retain] : nil;
+    }
+
+    IFChargeMoney money;
+    if ( !IFChargeWireFieldAmount( field, &money ) )
+    {
+        return nil;
+    }
+    char buffer[IF_CHARGE_MONEY_FORMAT_MAX];
+    size_t length = IFChargeMoneyFormat( money, IF_CHARGE_AMOUNT_DECIMALS, buffer );
+    return [[NSString alloc] initWithBytes:buffer length:length encoding:NSASCIIStringEncoding];
+}
+
+#pragma -
+#pragma Writing
+
+// Writes s as UTF-8 at out, which has room for maxLength bytes, and
+// returns the number of bytes written.
+static size_t IFWireGetUTF8( NSString* s, uint8_t* out, NSUInteger maxLength )
+{
+    NSUInteger used = 0;
+    [s getBytes:out
+      maxLength:maxLength
+     usedLength:&used
+       encoding:NSUTF8StringEncoding
+        options:0
+          range:NSMakeRange( 0, [s length] )
+ remainingRange:NULL];
+    return used;
+}
+
+// Writes a field whose payload is key's length (if there's a key),
+// key, and then s. The payload's length isn't known until the strings
+// are converted, so they're written after room for the longest
+// varints they could need, and moved back over any room left over.
+static uint8_t* IFWirePutStrings( uint8_t* out, unsigned tag, NSString* key, NSString* s )
+{
+    NSUInteger maxKey   = [key maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    NSUInteger maxValue = [s maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    size_t keyRoom = key ? IFWireVarintLength( maxKey ) : 0;
+
+    *out++ = (uint8_t)tag;
+    uint8_t* bytes = out + IFWireVarintLength( keyRoom + maxKey + maxValue ) + keyRoom;
+    size_t keyLength = key ? IFWireGetUTF8( key, bytes, maxKey ) : 0;
+    size_t length    = keyLength + IFWireGetUTF8( s, bytes + keyLength, maxValue );
+
+    size_t payloadLength = length + ( key ? IFWireVarintLength( keyLength ) : 0 );
+    uint8_t* payload = IFWirePutVarint( out, payloadLength );
+    if ( key )
+    {
+        payload = IFWirePutVarint( payload, keyLength );
+    }
+    if ( payload != bytes )
+    {
+        memmove( payload, bytes, length );
+    }
+    return payload + length;
+}
+
+// Writes an amount in compact form if it's in the two-decimal form
+// that decodes back to the same string.
+static uint8_t* IFWirePutAmount( uint8_t* out, unsigned tag, NSString* amount )
+{
+    char text[IF_CHARGE_MONEY_FORMAT_MAX];
+    char canonical[IF_CHARGE_MONEY_FORMAT_MAX];
+    NSUInteger length = [amount length];
+    NSUInteger used;
+    NSRange remaining;
+    IFChargeMoney money;
+
+    if ( length < sizeof( text ) &&
+         [amount getBytes:text maxLength:sizeof( text ) usedLength:&used encoding:NSASCIIStringEncoding
+                  options:0 range:NSMakeRange( 0, length ) remainingRange:&remaining] &&
+         0 == remaining.length &&
+         IFChargeMoneyParse( text, used, &money ) &&
+         used == IFChargeMoneyFormat( money, IF_CHARGE_AMOUNT_DECIMALS, canonical ) &&
+         0 == memcmp( text, canonical, used ) )
+    {
+        uint64_t value = IFWireZigzag( money / IF_WIRE_AMOUNT_UNIT );
+        *out++ = (uint8_t)( tag | IF_CHARGE_WIRE_COMPACT );
+        out = IFWirePutVarint( out, IFWireVarintLength( value ) );
+        return IFWirePutVarint( out, value );
+    }
+
+    return IFWirePutStrings( out, tag, nil, amount );
+}
+
+static uint8_t* IFWirePutResponseType( uint8_t* out, unsigned tag, NSString* responseType )
+{
+    for ( NSUInteger code = 0; code < IF_WIRE_RESPONSE_TYPE_COUNT; code++ )
+    {
+        if ( [responseType isEqualToString:kIFWireResponseTypes[code]] )
+        {
+            *out++ = (uint8_t)( tag | IF_CHARGE_WIRE_COMPACT );
+            *out++ = 1;
+            *out++ = (uint8_t)code;
+            return out;
+        }
+    }
+    return IFWirePutStrings( out, tag, nil, responseType );
+}
+
+static size_t IFWireCapacity( NSString* s )
+{
+    return IF_WIRE_FIELD_OVERHEAD + [s maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+}
+
+@implementation IFChargeMessage (Wire)
+
+- (IFChargeWireKind)wireKind
+{
+    return [self isKindOfClass:[IFChargeResponse class]] ? kIFChargeWireResponse : kIFChargeWireRequest;
+}
+
+// Reads each field straight from its ivar; the caller holds the lock.
+- (NSData*)createWireData
+{
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+    size_t capacity = IF_CHARGE_WIRE_HEADER_MAX;
+
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        values[index] = *IFChargeFieldSlot( fieldTable, self, index );
+        capacity += IFWireCapacity( values[index] );
+    }
+
+    // A response's nonce is already in its extra params.
+    NSString* nonce = _nonce;
+    if ( [nonce isEqualToString:[_extraParams objectForKey:IF_CHARGE_NONCE_KEY]] )
+    {
+        nonce = nil;
+    }
+    capacity += IFWireCapacity( nonce ) + IFWireCapacity( _baseURL );
+
+    NSUInteger count = [_extraParams count];
+    id stackKeys[IF_CHARGE_QUERY_MAX_FIELDS];
+    id stackObjects[IF_CHARGE_QUERY_MAX_FIELDS];
+    id* keys    = stackKeys;
+    id* objects = stackObjects;
+    if ( count > IF_CHARGE_QUERY_MAX_FIELDS )
+    {
+        keys    = malloc( count * sizeof( id ) );
+        objects = malloc( count * sizeof( id ) );
+    }
+    [_extraParams getObjects:objects andKeys:keys];
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        capacity += IFWireCapacity( keys[index] ) + IFWireCapacity( objects[index] );
+    }
+
+    // The body goes after room for the longest header, which is
+    // written once the body's length is known.
+    uint8_t* buffer = malloc( capacity );
+    uint8_t* body   = buffer + IF_CHARGE_WIRE_HEADER_MAX;
+    uint8_t* out    = body;
+
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        if ( 0 == [values[index] length] )
+        {
+            continue;
+        }
+        unsigned tag = fieldTable->schema[index].wireTag;
+        if ( kIFChargeFieldAmount == fieldTable->schema[index].kind )
+        {
+            out = IFWirePutAmount( out, tag, values[index] );
+        }
+        else if ( IF_CHARGE_WIRE_TAG_RESPONSE_TYPE == tag )
+        {
+            out = IFWirePutResponseType( out, tag, values[index] );
+        }
+        else
+        {
+            out = IFWirePutStrings( out, tag, nil, values[index] );
+        }
+    }
+    if ( [nonce length] )
+    {
+        out = IFWirePutStrings( out, IF_CHARGE_WIRE_TAG_NONCE, nil, nonce );
+    }
+    if ( [_baseURL length] )
+    {
+        out = IFWirePutStrings( out, IF_CHARGE_WIRE_TAG_BASE_URL, nil, _baseURL );
+    }
+    for ( NSUInteger index = 0; index < count; index++ )
+    {
+        out = IFWirePutStrings( out, IF_CHARGE_WIRE_TAG_EXTRA_PARAM, keys[index], objects[index] );
+    }
+
+    if ( keys != stackKeys )
+    {
+        free( keys );
+        free( objects );
+    }
+
+    uint8_t header[IF_CHARGE_WIRE_HEADER_MAX] = { 'I', 'F', 'W', IF_CHARGE_WIRE_VERSION, [self wireKind] };
+    size_t bodyLength   = out - body;
+    size_t headerLength = IFWirePutVarint( header + 5, bodyLength ) - header;
+    memmove( buffer + headerLength, body, bodyLength );
+    memcpy( buffer, header, headerLength );
+
+    size_t length = headerLength + bodyLength;
+    buffer = realloc( buffer, length );
+    return [[NSData alloc] initWithBytesNoCopy:buffer length:length freeWhenDone:YES];
+}
+
+- (NSData*)wireData
+{
+    // A snapshot can be read without the lock.
+    NSData* data;
+    if ( _frozen )
+    {
+        data = [self createWireData];
+    }
+    else
+    {
+        @synchronized(self)
+        {
+            data = [self createWireData];
+        }
+    }
+    return [data autorelease];
+}
+
+// Decodes data into the fields of a new message. If data is
+// malformed, sets *malformed and returns NO; any other failure fills
+// in *error.
+- (BOOL)trySetWireData:(NSData*)data malformed:(BOOL*)malformed error:(IFChargeError*)error
+{
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+    NSMutableDictionary* queryFields = [NSMutableDictionary dictionary];
+    NSString* nonce   = nil;
+    NSString* baseURL = nil;
+
+    IFChargeWireReader reader;
+    IFChargeWireField field;
+    BOOL valid = IFChargeWireReaderInit( &reader, [data bytes], [data length] ) && reader.kind == [self wireKind];
+    while ( valid && IFChargeWireReaderNext( &reader, &field ) )
+    {
+        if ( IF_CHARGE_WIRE_TAG_EXTRA_PARAM == field.tag )
+        {
+            const uint8_t* keyBytes;
+            const uint8_t* valueBytes;
+            size_t keyLength;
+            size_t valueLength;
+            valid = IFChargeWireFieldExtraParam( &field, &keyBytes, &keyLength, &valueBytes, &valueLength );
+            if ( valid )
+            {
+                NSString* key   = [[NSString alloc] initWithBytes:keyBytes length:keyLength encoding:NSUTF8StringEncoding];
+                NSString* value = [[NSString alloc] initWithBytes:valueBytes length:valueLength encoding:NSUTF8StringEncoding];
+                valid = nil != key && nil != value;
+                if ( valid )
+                {
+                    [queryFields setObject:value forKey:key];
+                }
+                [key release];
+                [value release];
+            }
+            continue;
+        }
+
+        NSString** target = NULL;
+        NSString* shared = nil;
+        if ( IF_CHARGE_WIRE_TAG_NONCE == field.tag )
+        {
+            target = &nonce;
+        }
+        else if ( IF_CHARGE_WIRE_TAG_BASE_URL == field.tag )
+        {
+            target = &baseURL;
+        }
+        else if ( field.tag < IF_CHARGE_WIRE_TAG_LIMIT && fieldTable->wireIndexes[field.tag] >= 0 )
+        {
+            NSInteger index = fieldTable->wireIndexes[field.tag];
+            target = &values[index];
+
+            // A known value of an interned field needs no string.
+            if ( fieldTable->interned[index] && !field.compact )
+            {
+                shared = IFChargeInternLookup( (const char*)field.bytes, field.length );
+            }
+        }
+
+        // Tags from a later version are skipped.
+        if ( target )
+        {
+            [*target release];
+            *target = shared ? [shared retain] : IFChargeWireFieldCreateString( &field );
+            valid = nil != *target;
+        }
+    }
+    valid = valid && !reader.malformed;
+    *malformed = !valid;
+
+    BOOL success = valid && [self trySetQueryValues:values extraParams:queryFields error:error];
+    if ( success )
+    {
+        @synchronized(self)
+        {
+            if ( nonce )
+            {
+                [_nonce release];
+                _nonce = [nonce retain];
+            }
+            [_baseURL release];
+            _baseURL = [baseURL retain];
+        }
+        if ( kIFChargeWireResponse == reader.kind )
+        {
+            success = [(IFChargeResponse*)self checkFields:error];
+        }
+    }
+
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        [values[index] release];
+    }
+    [nonce release];
+    [baseURL release];
+    return success;
+}
+
+- (id)tryInitWithWireData:(NSData*)data error:(IFChargeError*)error
+{
+    IFChargeError localError;
+    if ( NULL == error )
+    {
+        error = &localError;
+    }
+
+    if ( ( self = [super init] ) )
+    {
+        BOOL malformed = NO;
+        if ( [self trySetWireData:data malformed:&malformed error:error] )
+        {
+            return self;
+        }
+        if ( malformed )
+        {
+            IFChargeSetError( error, kIFChargeErrorMalformedWireData, [self class], NULL, 0 );
+        }
+
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        [self release];
+        self = nil;
+    }
+    return self;
+}
+
+- (id)initWithWireData:(NSData*)data
+{
+    Class messageClass = [self class];
+    IFChargeError error;
+    if ( !( self = [self tryInitWithWireData:data error:&error] ) )
+    {
+        IFChargeRaiseError( &error, messageClass, nil );
+    }
+    return self;
+}
+
+@end
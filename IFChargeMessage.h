@@ -5,8 +5,11 @@
 //  Created by Ben Acland on 1/23/11.
 //  Copyright 2011 ProxyObjects. All rights reserved.
 //
-#import <UIKit/UIKit.h>
 #import <Foundation/Foundation.h>
+#if TARGET_OS_IPHONE
+#import <UIKit/UIKit.h>
+#endif
+#import "IFChargeQuery.h"
 
 extern BOOL IFMatchesPattern( NSString* s, NSString* p );
 extern NSString* IFEncodeURIComponent( NSString* s );
@@ -17,6 +20,96 @@ extern NSString *const IFInvalidArgumentLengthException;
 // Indicates that an argument contained a disallowed character
 extern NSString *const IFDisallowedCharacterException;
 
+// IFChargeErrorCode - Why a field, message or URL was rejected. The
+// try... methods report these instead of raising; the raising methods
+// raise with the reason IFChargeErrorReason gives.
+typedef enum {
+    kIFChargeErrorNone,
+
+    // Setting a field
+    kIFChargeErrorArgumentTooLong,          // see detail
+    kIFChargeErrorDisallowedCharacter,      // see detail
+    kIFChargeErrorInvalidURL,
+    kIFChargeErrorInvalidEmail,
+    kIFChargeErrorAmountTooHigh,
+    kIFChargeErrorAmountTooLow,
+    kIFChargeErrorInvalidAmount,            // not a decimal number
+    kIFChargeErrorQueryInBaseURI,           // requestBaseURI has a '?'
+    kIFChargeErrorNilURL,
+    kIFChargeErrorNonStringExtraParam,
+    kIFChargeErrorNonceUnavailable,         // the nonce store couldn't issue or consume one
+
+    // Reading a URL
+    kIFChargeErrorMalformedQuery,           // bad percent escape or not UTF-8
+    kIFChargeErrorInvalidField,             // didn't match its pattern
+    kIFChargeErrorUnknownResponseType,
+    kIFChargeErrorMissingAmount,            // approved without an amount
+    kIFChargeErrorMissingRedactedCardNumber,
+    kIFChargeErrorUnexpectedTransactionInfo, // failure with an amount or card
+    kIFChargeErrorNoOutstandingRequest,
+    kIFChargeErrorMissingNonce,
+    kIFChargeErrorIncorrectNonce,
+    kIFChargeErrorExpiredNonce,             // outstanding past its TTL
+
+    // Reading wire data (see IFChargeWire.h)
+    kIFChargeErrorMalformedWireData,        // truncated, not UTF-8, or another kind
+
+    // Creating a batch (see IFChargeBatch.h)
+    kIFChargeErrorInvalidColumnName         // not a string; see detail
+} IFChargeErrorCode;
+
+// The number of error codes; keep it after the last one.
+#define IF_CHARGE_ERROR_CODE_COUNT ( kIFChargeErrorInvalidColumnName + 1 )
+
+// IFChargeError - Filled in by the try... methods when they fail.
+// Keep one on the stack and pass it to each call; reporting a failure
+// allocates nothing.
+typedef struct IFChargeError
+{
+    IFChargeErrorCode code;
+
+    // The index in knownFields of the field at fault, or -1 if the
+    // failure isn't down to one field.
+    NSInteger field;
+
+    // For kIFChargeErrorArgumentTooLong, the number of characters
+    // over the limit; for kIFChargeErrorDisallowedCharacter, the index
+    // of the first disallowed character; for
+    // kIFChargeErrorInvalidAmount, the decimal places of an amount
+    // with more than its currency allows; for
+    // kIFChargeErrorInvalidColumnName, the index of the column.
+    // Otherwise 0.
+    NSInteger detail;
+} IFChargeError;
+
+// IFChargeErrorReason - The exception reason for error, or nil for
+// kIFChargeErrorNone. Field names are looked up in messageClass's
+// knownFields; value is the rejected argument, if there was one.
+extern NSString* IFChargeErrorReason( const IFChargeError* error, Class messageClass, NSString* value );
+
+// IFChargeRaiseError - Raises what the raising API has always raised
+// for error: IFInvalidArgumentLengthException,
+// IFDisallowedCharacterException or NSInvalidArgumentException.
+extern void IFChargeRaiseError( const IFChargeError* error, Class messageClass, NSString* value );
+
+// IFChargeSetError - Fills in *error, unless error is NULL, and
+// returns NO. field is the name of the field at fault, or NULL.
+extern BOOL IFChargeSetError( IFChargeError* error, IFChargeErrorCode code, Class messageClass, const char* field, NSInteger detail );
+
+// IFChargeCheckField - Checks value as trySetField:value:error: checks
+// field index of table, without a message to store it in. Returns NO,
+// filling in *error, if it would be rejected. Safe to call from any
+// thread.
+extern BOOL IFChargeCheckField( const IFChargeFieldTable* table, NSUInteger index, NSString* value, IFChargeError* error );
+
+// IFChargeCheckAmountDecimals - Checks that none of the amount fields
+// in values, a value (or nil) for each field of table, has more
+// decimal places than the currency in values allows: its ISO 4217
+// minor unit, but no more than IF_CHARGE_AMOUNT_DECIMALS. Trailing
+// zeros don't count, so "1500.00" is whole yen. Returns NO, filling in
+// *error, if one has too many. Safe to call from any thread.
+extern BOOL IFChargeCheckAmountDecimals( const IFChargeFieldTable* table, NSString* const* values, IFChargeError* error );
+
 // To make atomic getters and setters a little less redundant
 extern id getObject_Atomic(id obj, id var);
 
@@ -24,7 +117,15 @@ extern id getObject_Atomic(id obj, id var);
 #define IF_CHARGE_NONCE_KEY @"ifcc_request_nonce"
 #define IF_CHARGE_DEFAULT_CURRENCY @"USD"
 
+// Setters raise on a frozen message (see -freeze).
+#define IF_CHARGE_ASSERT_NOT_FROZEN \
+if (_frozen) { \
+    [NSException raise:NSInternalInconsistencyException \
+                format:@"%@ is frozen and cannot be modified", NSStringFromClass([self class])]; \
+}
+
 #define setObject_AtomicCopy(iVar,newObj) \
+IF_CHARGE_ASSERT_NOT_FROZEN \
 @synchronized(self) \
 { \
     if (iVar != newObj) { \
@@ -33,14 +134,30 @@ extern id getObject_Atomic(id obj, id var);
     } \
 }
 
+// As setObject_AtomicCopy, for a field with a small vocabulary: a
+// value in the intern table is shared rather than copied (see
+// IFChargeIntern.h).
+#define setObject_AtomicIntern(iVar,newObj) \
+IF_CHARGE_ASSERT_NOT_FROZEN \
+@synchronized(self) \
+{ \
+    if (iVar != newObj) { \
+        [iVar release]; \
+        iVar = IFChargeInternCopy(newObj); \
+    } \
+}
+
+// A frozen message never changes, so its fields are read without the
+// lock or the retain/autorelease.
 #define getObject_Atomic(iVar) \
+if (_frozen) return iVar; \
 id result; \
 @synchronized(self) { \
     result = [iVar retain]; \
 } \
 return [result autorelease];
 
-@interface IFChargeMessage : NSObject {
+@interface IFChargeMessage : NSObject <NSCopying> {
     NSString* _amount;
     NSString* _subtotal;
     NSString* _tip;
@@ -49,17 +166,26 @@ return [result autorelease];
     NSString* _discount;
     NSString* _currency;
 
+    // The computed amount; see -amount.
+    NSString* _cachedAmount;
+
     NSDictionary* _extraParams;
     NSString* _nonce;
 
     NSString* _baseURL;
+
+    // The last requestURL, encoded field by field; see -requestURL.
+    IFChargeQueryBuilder* _urlBuilder;
+
+    BOOL _frozen;
 }
 
 // amount - The amount of the transaction.
-// Up to 15 digits with a decimal point. Can be set directly, or by
-// setting the amount subfields below. If set directly, all subfield
-// values will be ignored, otherwise the getter method will calculate
-// the amount using the subfields.
+// Up to 15 digits with a decimal point, and no more decimal places
+// than the currency's minor unit (none for JPY, for example). Can be
+// set directly, or by setting the amount subfields below. If set
+// directly, all subfield values will be ignored, otherwise the getter
+// method will calculate the amount by summing the subfields exactly.
 @property (readonly,copy) NSString* amount;
 
 // amountIsSet - Indicates that the amount property has been set
@@ -102,6 +228,18 @@ return [result autorelease];
 // then this value will be copied into the Response's baseURL.
 @property (readonly,retain) NSString* baseURL;
 
+// frozen - YES for a snapshot returned by freeze.
+@property (readonly,assign,getter=isFrozen) BOOL frozen;
+
+// freeze - Returns an immutable snapshot of the message. Use the
+// message itself as a builder: set and validate its fields, then
+// freeze it and hand the snapshot to other threads. Reading a
+// snapshot takes no locks, copying one just retains it, and any
+// attempt to set one of its fields raises
+// NSInternalInconsistencyException (so a snapshot can't be
+// submitted). Freezing a snapshot returns it unchanged.
+- (id)freeze;
+
 // initWithURL - Pass the URL that you receive in
 // application:handleOpenURL: and the resulting object will have the
 // properties set. Any fields that aren't part of the usual message
@@ -110,9 +248,18 @@ return [result autorelease];
 // Throws an exception if the input is not a valid charge response URL.
 - (id)initWithURL:(NSURL*)url;
 
+// tryInitWithURL:error: - As initWithURL:, but never raises. If the
+// input is not a valid charge response URL, releases the receiver,
+// fills in *error and returns nil. Use this where bad URLs are
+// expected, since a rejected URL costs no exception.
+- (id)tryInitWithURL:(NSURL*)url error:(IFChargeError*)error;
+
 // requestURL - Retrieves the URL for the message. If you have special
 // requirements around invoking the URL, you can use this instead of
-// submit.
+// submit. Each field's encoded pair is kept between calls, so after
+// setting one field only that field is encoded again (see
+// IFChargeQueryBuilder); the URL is the same as if it were built from
+// scratch.
 - (NSURL*)requestURL;
 
 #if TARGET_OS_IPHONE
@@ -137,7 +284,9 @@ return [result autorelease];
 - (void)unableToOpenURL;
 
 // validateTextArgumentWithMaxLength:forbiddenCharacterSets: - Checks a string
-// field setter against length and character set requirements
+// field setter against length and character set requirements. The union
+// of immutable sets is compiled on first use and cached (see
+// IFChargeCharSet.h).
 - (void)validateTextArgument:(NSString*)arg withMaxLength:(int)maxLength forbiddenCharacterSets:firstSet, ... NS_REQUIRES_NIL_TERMINATION;
 
 // validateURLString - Raises exception if urlWithString:testString returns nil.
@@ -146,6 +295,70 @@ return [result autorelease];
 // validateEmailString - Checks that testString conforms to RFC 2822.
 - (void)validateEmailString:(NSString*)testString;
 
+// The checks behind the validate... methods, without the exception.
+// Each returns NO and fills in *error (error may be NULL) on failure,
+// blaming the named field (which may be NULL).
+- (BOOL)checkTextArgument:(NSString*)arg withMaxLength:(int)maxLength forbiddenCharacterSet:(NSCharacterSet*)forbidden field:(const char*)field error:(IFChargeError*)error;
+- (BOOL)checkURLString:(NSString*)testString field:(const char*)field error:(IFChargeError*)error;
+- (BOOL)checkEmailString:(NSString*)testString field:(const char*)field error:(IFChargeError*)error;
+
+// Amount setters that report bad values instead of raising. The plain
+// setters call these and raise on failure. Setting a field of a frozen
+// message is a programming error and still raises.
+//
+// A value that isn't a decimal number, such as @"abc" or @" ", fails
+// with kIFChargeErrorInvalidAmount. This is a deliberate change: up to
+// API 1.0.0 such values were accepted and counted as 0. So does an
+// amount with more decimal places than the currency allows, and a
+// currency that the amounts already set have too many decimal places
+// for; see IFChargeCheckAmountDecimals.
+- (BOOL)trySetAmount:(NSString*)amount error:(IFChargeError*)error;
+- (BOOL)trySetSubtotal:(NSString*)subtotal error:(IFChargeError*)error;
+- (BOOL)trySetTip:(NSString*)tip error:(IFChargeError*)error;
+- (BOOL)trySetTax:(NSString*)tax error:(IFChargeError*)error;
+- (BOOL)trySetShipping:(NSString*)shipping error:(IFChargeError*)error;
+- (BOOL)trySetDiscount:(NSString*)discount error:(IFChargeError*)error;
+- (BOOL)trySetCurrency:(NSString*)currency error:(IFChargeError*)error;
+
 + (NSArray*)knownFields;
 
+// trySetQueryValues:extraParams:error: - Sets the fields parsed from a
+// URL by IFChargeQueryParse, as initWithURL: does. Returns NO, filling
+// in *error, if a value is out of range for its field.
+- (BOOL)trySetQueryValues:(NSString* const*)values extraParams:(NSMutableDictionary*)queryFields error:(IFChargeError*)error;
+
+// reset - Clears every field, the extraParams, the nonce and the
+// baseURL, leaving the message as tryInitWithURL: starts with it.
+// Raises on a frozen message.
+- (void)reset;
+
+// tryReadURL:error: - Resets the message and reads url into it, as
+// tryInitWithURL:error: does, so one message can be used for URL after
+// URL without allocating a new one each time. Returns NO, filling in
+// *error, if url isn't valid, in which case the message is left reset
+// or partly read and shouldn't be used until the next read succeeds.
+- (BOOL)tryReadURL:(NSURL*)url error:(IFChargeError*)error;
+
+// compactFields - Moves the message's ASCII fields into a single
+// allocation (see IFChargeFieldArena.h), as a URL's fields are when
+// it's read. Worth doing to a message built up field by field that
+// will be kept around, before queueing it or freezing it. The values
+// don't change. Raises on a frozen message.
+- (void)compactFields;
+
+// freezeInPlace - Makes a message that hasn't been shared with any
+// other thread yet into a snapshot, without the copy that freeze
+// makes.
+- (void)freezeInPlace;
+
+// queryFieldTable - The class's field schema, with each field's ivar
+// resolved and its name hashed for initWithURL:. Built once by each
+// subclass in +initialize.
++ (const IFChargeFieldTable*)queryFieldTable;
+
+// trySetField:value:error: - Checks value as the schema says field
+// index (of queryFieldTable) should be checked and, if it passes,
+// stores it. The per-field try setters all come here.
+- (BOOL)trySetField:(NSUInteger)index value:(NSString*)value error:(IFChargeError*)error;
+
 @end
@@ -7,12 +7,19 @@
 //
 
 #import "IFChargeMessage.h"
+#import "IFChargeEmail.h"
+#import "IFChargeFieldArena.h"
+#import "IFChargeIntern.h"
+#import "IFChargeMoney.h"
+#import "IFChargeQuery.h"
+#import "IFChargeStats.h"
 NSString *const IFInvalidArgumentLengthException = @"IFInvalidArgumentLengthException";
 NSString *const IFDisallowedCharacterException = @"IFDisallowedCharacterException";
 
 // This regular expression, from http://cocoawithlove.com/2009/06/verifying-that-string-is-email-address.html
 // is adapted from a version at http://www.regular-expressions.info/email.html, and
 // is a complete verification of RFC 2822. I have modified it to allow capital letters.
+// IFChargeEmailScan accepts exactly this language without building a predicate.
 NSString *const emailRegEx =
 @"(?:[a-zA-Z0-9!#$%\\&'*+/=?\\^_`{|}~-]+(?:\\.[a-zA-Z0-9!#$%\\&'*+/=?\\^_`{|}"
 @"~-]+)*|\"(?:[\\x01-\\x08\\x0b\\x0c\\x0e-\\x1f\\x21\\x23-\\x5b\\x5d-\\"
@@ -34,139 +41,283 @@ __inline__ BOOL IFMatchesPattern( NSString* s, NSString* p )
 
 #else
 
-#import <regex.h>
+#import "IFChargePattern.h"
 
+// IFMatchesPattern - Patterns are compiled on first use and cached
+// for the life of the process, see IFChargePattern.h.
 BOOL IFMatchesPattern( NSString* nsString, NSString* nsPattern )
 {
-    const char* string  = [nsString  cStringUsingEncoding:NSUTF8StringEncoding];
-    const char* pattern = [nsPattern cStringUsingEncoding:NSUTF8StringEncoding];
-
-    BOOL matches = NO;
-    BOOL compiled = NO;
-    int re_error;
-    regex_t re;
-
-    re_error = regcomp(
-        &re,
-        pattern,
-        REG_EXTENDED
-        | REG_NOSUB    // match only, no captures
+    IFChargePattern* pattern = IFChargePatternGet(
+        [nsPattern cStringUsingEncoding:NSUTF8StringEncoding]
     );
-    if ( re_error )
-    {
-        NSLog( @"regcomp error %d", re_error );
-        goto Cleanup;
-    }
-    compiled = YES;
+    return IFChargePatternMatches( pattern, nsString );
+}
 
-    re_error = regexec(
-        &re,
-        string,
-        0, NULL, // no captures
-        0        // no flags
-    );
-    if ( re_error )
+// Encode everything but the RFC 3986 unreserved characters. This is
+// what CFURLCreateStringByAddingPercentEscapes produces when told that
+// all the reserved chars (the 'reserved' BNF production from RFC 3986,
+// ":/?#[]@!$&'()*+,;=") *should* be encoded, byte for byte; see
+// IFChargeEncode.
+//
+// The whole string is encoded, embedded NULs included, as CF did.
+NSString* IFEncodeURIComponent( NSString* s )
+{
+    NSUInteger length = [s lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    if ( nil == s || ( 0 == length && 0 != [s length] ) )
     {
-        if ( REG_NOMATCH == re_error )
-        {
-            NSLog( @"string '%s' does not match pattern '%s'", string, pattern );
-        }
-        else
-        {
-            NSLog( @"regexec error %d", re_error );
-        }
-        goto Cleanup;
+        return nil;
     }
 
-    // No error, regex matched, input is valid
-    matches = YES;
-
-Cleanup:
-    if ( compiled )
+    char stackBuffer[256];
+    char* utf8 = ( length <= sizeof( stackBuffer ) ) ? stackBuffer : malloc( length );
+    [s getBytes:utf8
+      maxLength:length
+     usedLength:&length
+       encoding:NSUTF8StringEncoding
+        options:0
+          range:NSMakeRange( 0, [s length] )
+ remainingRange:NULL];
+
+    size_t encodedLength = IFChargeEncodedLength( utf8, length );
+    char* encoded = malloc( encodedLength ? encodedLength : 1 );
+    IFChargeEncode( encoded, utf8, length );
+    if ( utf8 != stackBuffer )
     {
-        regfree( &re );
+        free( utf8 );
     }
 
-    return matches;
+    return [[[NSString alloc] initWithBytesNoCopy:encoded
+                                           length:encodedLength
+                                         encoding:NSUTF8StringEncoding
+                                     freeWhenDone:YES] autorelease];
 }
 
-static NSMutableDictionary* IFParseQueryParameters( NSURL* url )
-{
-    NSMutableDictionary* dict = [[[NSMutableDictionary alloc] init] autorelease];
-    NSString*     queryString = [url query];
 
-    if ( [queryString length] )
-    {
-        NSArray* queryPairs = [queryString componentsSeparatedByString:@"&"];
+#endif
 
-        for ( NSString* queryPair in queryPairs )
-        {
-            NSArray* queryComps = [queryPair componentsSeparatedByString:@"="];
-            if ( 2 != [queryComps count] )
-            {
-                // Only interested in field=value pairs
-                continue;
-            }
+@interface IFChargeMessage ()
+@property (readwrite,copy) NSString* amount;
+@property (readwrite,copy) NSString* subtotal;
+@property (readwrite,copy) NSString* tip;
+@property (readwrite,copy) NSString* tax;
+@property (readwrite,copy) NSString* shipping;
+@property (readwrite,copy) NSString* discount;
+@property (readwrite,copy) NSString* currency;
+@property (readwrite,retain) NSDictionary* extraParams;
+@property (readwrite,retain) NSString* nonce;
+@property (readwrite,retain) NSString* baseURL;
+- (NSString*)createRequestURLString;
+@end
 
-            NSString* decodedField = [[queryComps objectAtIndex:0]
-                stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
-            NSString* decodedValue = [[queryComps objectAtIndex:1]
-                stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+// The index of the named field in this class's table.
+#define IF_FIELD_INDEX( name ) \
+    IFChargeFieldTableLookup( [[self class] queryFieldTable], name, sizeof( name ) - 1 )
 
-            [dict setObject:decodedValue forKey:decodedField];
-        }
+// The character sets validateTextArgument: passes on as they are; any
+// more are merged into the last.
+#define IF_MESSAGE_MAX_CHARACTER_SETS 4
+
+#pragma -
+#pragma Errors
+
+BOOL IFChargeSetError(IFChargeError* error, IFChargeErrorCode code, Class messageClass, const char* field, NSInteger detail) {
+    if (error) {
+        error->code   = code;
+        error->field  = field ? IFChargeFieldTableLookup([messageClass queryFieldTable], field, strlen(field)) : -1;
+        error->detail = detail;
+    }
+    return NO;
+}
+
+NSString* IFChargeErrorReason(const IFChargeError* error, Class messageClass, NSString* value) {
+    switch (error->code) {
+        case kIFChargeErrorNone:
+            return nil;
+        case kIFChargeErrorArgumentTooLong:
+            return [NSString stringWithFormat:@"Argument '%@' is %d characters too long", value, (int)error->detail];
+        case kIFChargeErrorDisallowedCharacter:
+            return [NSString stringWithFormat:@"The text argument contained the disallowed character '%@'",
+                    [value substringWithRange:[value rangeOfComposedCharacterSequenceAtIndex:error->detail]]];
+        case kIFChargeErrorInvalidURL:
+            return [NSString stringWithFormat:@"Could not build url out of string: '%@'", value];
+        case kIFChargeErrorInvalidEmail:
+            return [NSString stringWithFormat:@"'%@' doesn't look like an email", value];
+        case kIFChargeErrorAmountTooHigh:
+            return @"You cannot set amount fields to values higher than 9999999999999.99";
+        case kIFChargeErrorAmountTooLow:
+            return @"You cannot set amount fields to values lower than -9999999999999.99";
+        case kIFChargeErrorInvalidAmount:
+            if (error->detail) {
+                return [NSString stringWithFormat:@"Field '%@' has %d decimal places, more than the currency allows",
+                        [[messageClass knownFields] objectAtIndex:error->field], (int)error->detail];
+            }
+            return [NSString stringWithFormat:@"'%@' is not a decimal amount", value];
+        case kIFChargeErrorQueryInBaseURI:
+            return @"requestBaseURI may not include the character '?'";
+        case kIFChargeErrorNilURL:
+            return @"URL must not be nil";
+        case kIFChargeErrorNonStringExtraParam:
+            return @"extraParams dictionary keys and values must all be strings";
+        case kIFChargeErrorNonceUnavailable:
+            return @"The nonce log could not be grown to record the nonce, so the response could not be accepted";
+        case kIFChargeErrorMalformedQuery:
+            return @"Bad URL Request: malformed query string";
+        case kIFChargeErrorInvalidField:
+            return [NSString stringWithFormat:@"Bad URL Request: field '%@' is not valid",
+                    [[messageClass knownFields] objectAtIndex:error->field]];
+        case kIFChargeErrorUnknownResponseType:
+            return @"Bad URL Request: Unknown response type";
+        case kIFChargeErrorMissingAmount:
+            return @"Bad URL Request: missing amount";
+        case kIFChargeErrorMissingRedactedCardNumber:
+            return @"Bad URL Request: missing redactedCardNumber";
+        case kIFChargeErrorUnexpectedTransactionInfo:
+            return @"Bad URL Request: failure should not contain transaction info";
+        case kIFChargeErrorNoOutstandingRequest:
+            return @"Bad URL Request: No outstanding charge responses";
+        case kIFChargeErrorMissingNonce:
+            return @"Bad URL Request: Nonce missing.";
+        case kIFChargeErrorExpiredNonce:
+            return @"Bad URL Request: Nonce expired";
+        case kIFChargeErrorMalformedWireData:
+            return @"Bad wire data: malformed message";
+        case kIFChargeErrorInvalidColumnName:
+            return [NSString stringWithFormat:@"The name of batch column %d is not a string", (int)error->detail];
+        case kIFChargeErrorIncorrectNonce:
+        default:
+            return @"Bad URL Request: Incorrect nonce received";
     }
+}
 
-    return dict;
+// Fills in *error for field index of a table (or -1) and returns NO.
+static BOOL IFChargeFail(IFChargeError* error, IFChargeErrorCode code, NSInteger field, NSInteger detail) {
+    if (error) {
+        error->code   = code;
+        error->field  = field;
+        error->detail = detail;
+    }
+    return NO;
 }
 
-static float floatCheck(float theFloat) {
-    // make sure the float value doesn't indicate an overflow.
-    if (theFloat == HUGE_VAL || theFloat == -HUGE_VAL)
-        [NSException raise:NSInvalidArgumentException
-                    format:@"String could not be converted to a float value."];
-    return theFloat;
+void IFChargeRaiseError(const IFChargeError* error, Class messageClass, NSString* value) {
+    NSString *name = NSInvalidArgumentException;
+    if (kIFChargeErrorArgumentTooLong == error->code) {
+        name = IFInvalidArgumentLengthException;
+    } else if (kIFChargeErrorDisallowedCharacter == error->code) {
+        name = IFDisallowedCharacterException;
+    }
+    [NSException raise:name format:@"%@", IFChargeErrorReason(error, messageClass, value)];
 }
 
 
-// CFURLCreateStringByAddingPercentEscapes by default leaves legal
-// URL characters alone, which is not what we want. So we'll specify
-// that all the reserved chars *should* be encoded. This is the same
-// as the 'reserved' BNF production from RFC 3986.
-#define URI_RESERVED_CHARS @":/?#[]@!$&'()*+,;="
+#pragma -
+#pragma Checks
 
-NSString* IFEncodeURIComponent( NSString* s )
-{
-    CFStringRef encodedValue =
-    CFURLCreateStringByAddingPercentEscapes(
-                                            kCFAllocatorDefault,
-                                            (CFStringRef)s,
-                                            NULL,
-                                            (CFStringRef)URI_RESERVED_CHARS,
-                                            kCFStringEncodingUTF8
-                                            );
-    
-    return [NSMakeCollectable( encodedValue ) autorelease];
+// The checks behind the check... methods and the field schema. Each
+// returns kIFChargeErrorNone or why value was rejected, setting
+// *detail as IFChargeError describes.
+
+static IFChargeErrorCode IFCheckLength(NSString* value, int maxLength, NSInteger* detail) {
+    // Passing 0 as maxLength prevents length limit testing.
+    NSUInteger length = [value length];
+    if (maxLength != 0 && length > maxLength) {
+        *detail = length - maxLength;
+        return kIFChargeErrorArgumentTooLong;
+    }
+    return kIFChargeErrorNone;
 }
 
+static IFChargeErrorCode IFCheckText(NSString* value, int maxLength, const IFChargeCharSet* forbidden, NSInteger* detail) {
+    // Passing NULL as forbidden prevents forbidden character testing
+    IFChargeErrorCode code = IFCheckLength(value, maxLength, detail);
+    if (kIFChargeErrorNone == code && forbidden != NULL) {
+        NSUInteger location = IFChargeCharSetFind(forbidden, value);
+        if (location != NSNotFound) {
+            *detail = location;
+            return kIFChargeErrorDisallowedCharacter;
+        }
+    }
+    return code;
+}
 
-#endif
+// As IFCheckText, but forbidding the union of count sets.
+static IFChargeErrorCode IFCheckTextInSets(NSString* value, int maxLength, NSCharacterSet* const* forbidden, NSUInteger count, NSInteger* detail) {
+    IFChargeErrorCode code = IFCheckLength(value, maxLength, detail);
+    if (kIFChargeErrorNone == code) {
+        NSUInteger location = IFChargeCharSetFindInSets(value, forbidden, count);
+        if (location != NSNotFound) {
+            *detail = location;
+            return kIFChargeErrorDisallowedCharacter;
+        }
+    }
+    return code;
+}
 
-@interface IFChargeMessage ()
-@property (readwrite,copy) NSString* amount;
-@property (readwrite,copy) NSString* subtotal;
-@property (readwrite,copy) NSString* tip;
-@property (readwrite,copy) NSString* tax;
-@property (readwrite,copy) NSString* shipping;
-@property (readwrite,copy) NSString* discount;
-@property (readwrite,copy) NSString* currency;
-@property (readwrite,retain) NSDictionary* extraParams;
-@property (readwrite,retain) NSString* nonce;
-@property (readwrite,retain) NSString* baseURL;
+static IFChargeErrorCode IFCheckURL(NSString* value) {
+    // Takes a string, sees if it can be turned into an nsurl.
+    return [NSURL URLWithString:value] ? kIFChargeErrorNone : kIFChargeErrorInvalidURL;
+}
 
-- (void)checkFloatStringSize:(NSString*)floatString;
-@end
+static IFChargeErrorCode IFCheckEmail(NSString* value) {
+    return IFChargeEmailIsValid(value) ? kIFChargeErrorNone : kIFChargeErrorInvalidEmail; // x@xxx.xx
+}
 
+// Fails unless value parses to an amount within +/- IF_CHARGE_MONEY_MAX.
+// nil and the empty string unset the field, so they pass.
+static IFChargeErrorCode IFCheckAmount(NSString* value) {
+    IFChargeMoney money;
+    if (![value length]) return kIFChargeErrorNone;
+    if (!IFChargeMoneyParseString(value, &money)) return kIFChargeErrorInvalidAmount;
+    if (money > IF_CHARGE_MONEY_MAX) return kIFChargeErrorAmountTooHigh;
+    if (money < -IF_CHARGE_MONEY_MAX) return kIFChargeErrorAmountTooLow;
+    return kIFChargeErrorNone;
+}
+
+// Checks value as the schema says field index's setter should; see
+// IFChargeMessage.h.
+BOOL IFChargeCheckField(const IFChargeFieldTable* table, NSUInteger index, NSString* value, IFChargeError* error) {
+    const IFChargeFieldSchema* field = &table->schema[index];
+    IFChargeErrorCode code = kIFChargeErrorNone;
+    NSInteger detail = 0;
+    switch (field->kind) {
+        case kIFChargeFieldText:
+            code = IFCheckText(value, field->maxLength, table->forbidden[index], &detail);
+            break;
+        case kIFChargeFieldEmail:
+            code = IFCheckText(value, field->maxLength, NULL, &detail);
+            if (kIFChargeErrorNone == code) code = IFCheckEmail(value);
+            break;
+        case kIFChargeFieldURL:
+            code = IFCheckURL(value);
+            break;
+        case kIFChargeFieldAmount:
+            code = IFCheckAmount(value);
+            break;
+        case kIFChargeFieldPlain:
+        case kIFChargeFieldToken:
+        case kIFChargeFieldCurrency:
+        default:
+            break;
+    }
+    return (kIFChargeErrorNone == code) || IFChargeFail(error, code, index, detail);
+}
+
+// Checks the amount fields among values against the currency among
+// them; see IFChargeMessage.h.
+BOOL IFChargeCheckAmountDecimals(const IFChargeFieldTable* table, NSString* const* values, IFChargeError* error) {
+    NSString *currency = nil;
+    for (NSUInteger index = 0; index < table->count; index++) {
+        if (kIFChargeFieldCurrency == table->schema[index].kind) currency = values[index];
+    }
+
+    unsigned allowed = MIN(IFChargeCurrencyExponent(currency), IF_CHARGE_AMOUNT_DECIMALS);
+    for (NSUInteger index = 0; index < table->count; index++) {
+        if (kIFChargeFieldAmount != table->schema[index].kind) continue;
+        unsigned places = IFChargeMoneyDecimalPlaces(values[index]);
+        if (places > allowed) return IFChargeFail(error, kIFChargeErrorInvalidAmount, index, places);
+    }
+    return YES;
+}
 
 @implementation IFChargeMessage
 @synthesize subtotal           = _subtotal;
@@ -178,48 +329,261 @@ NSString* IFEncodeURIComponent( NSString* s )
 @synthesize nonce              = _nonce;
 @synthesize baseURL            = _baseURL;
 @synthesize extraParams        = _extraParams;
+@synthesize frozen             = _frozen;
 @synthesize amountIsSet;
 
-static NSNumberFormatter *chargeAmountFormatter_;
-+ (void)initialize
-{
-    chargeAmountFormatter_ = [[NSNumberFormatter alloc] init];
-    [chargeAmountFormatter_ setNumberStyle:NSNumberFormatterCurrencyStyle];
-    [chargeAmountFormatter_ setGeneratesDecimalNumbers:YES];
-    [chargeAmountFormatter_ setCurrencySymbol:@""];
-    [chargeAmountFormatter_ setPerMillSymbol:@""];
+// The raising initializer is a thin wrapper, so that subclasses only
+// override tryInitWithURL:error:.
+- (id)initWithURL:(NSURL*)url {
+    Class messageClass = [self class];
+    IFChargeError error;
+    if (!(self = [self tryInitWithURL:url error:&error])) {
+        IFChargeRaiseError(&error, messageClass, nil);
+    }
+    return self;
 }
 
-- (id)initWithURL:(NSURL*)url {
+- (id)tryInitWithURL:(NSURL*)url error:(IFChargeError*)error {
+    // Rejections are counted, so the reason is needed either way.
+    IFChargeError localError;
+    if ( NULL == error )
+    {
+        error = &localError;
+    }
+
     if ((self = [super init]))
     {
+        NSMutableDictionary* queryFields = [NSMutableDictionary dictionary];
+        const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+        NSString* values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+
         if ( nil == url )
         {
-            [NSException raise:NSInvalidArgumentException
-                         format:@"URL must not be nil"];
+            IFChargeSetError( error, kIFChargeErrorNilURL, [self class], NULL, 0 );
+        }
+        else if ( !IFChargeQueryParse( url, fieldTable, values, queryFields ) )
+        {
+            IFChargeSetError( error, kIFChargeErrorMalformedQuery, [self class], NULL, 0 );
+        }
+        else if ( [self trySetQueryValues:values extraParams:queryFields error:error] )
+        {
+            return self;
+        }
+
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        [self release];
+        self = nil;
+    }
+    return self;
+}
+
+- (BOOL)trySetQueryValues:(NSString* const*)values extraParams:(NSMutableDictionary*)queryFields error:(IFChargeError*)error {
+    IF_CHARGE_STATS_START( assignStart );
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        if ( values[index] && !IFChargeCheckField( fieldTable, index, values[index], error ) )
+        {
+            IF_CHARGE_STATS_STOP( kIFChargeStageFieldAssign, assignStart );
+            return NO;
         }
+    }
 
-        NSMutableDictionary* queryFields = IFParseQueryParameters( url );
+    // Every value is good on its own, so check the amounts against the
+    // currency they end up with and store them all under one lock.
+    IF_CHARGE_ASSERT_NOT_FROZEN
+    BOOL fits;
+    @synchronized(self)
+    {
+        NSString* merged[IF_CHARGE_QUERY_MAX_FIELDS];
+        for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+        {
+            merged[index] = values[index] ? values[index] : *IFChargeFieldSlot( fieldTable, self, index );
+        }
+        fits = IFChargeCheckAmountDecimals( fieldTable, merged, error );
 
-        for ( NSString* field in [[self class] knownFields] )
+        for ( NSUInteger index = 0; fits && index < fieldTable->count; index++ )
         {
-            NSString* queryName = [IF_CHARGE_MESSAGE_FIELD_PREFIX
-                                      stringByAppendingString:field];
-            NSString* value = [queryFields valueForKey:queryName];
-            if ( [value length] )
+            if ( values[index] )
             {
-                [self setValue:value forKey:field];
+                NSString** slot = IFChargeFieldSlot( fieldTable, self, index );
+                [*slot release];
+                *slot = [values[index] copy];
+            }
+        }
+        [_cachedAmount autorelease];
+        _cachedAmount = nil;
+    }
+    if ( !fits )
+    {
+        IF_CHARGE_STATS_STOP( kIFChargeStageFieldAssign, assignStart );
+        return NO;
+    }
 
-                [queryFields removeObjectForKey:queryName];
+    // extract the nonce here, since you've already unpacked queryFields
+    self.nonce = [queryFields objectForKey:IF_CHARGE_NONCE_KEY];
+
+    self.extraParams = queryFields;
+    IF_CHARGE_STATS_STOP( kIFChargeStageFieldAssign, assignStart );
+    return YES;
+}
+
+- (BOOL)trySetField:(NSUInteger)index value:(NSString*)value error:(IFChargeError*)error {
+    IFChargeError localError;
+    if ( NULL == error )
+    {
+        error = &localError;
+    }
+
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    if ( !IFChargeCheckField( fieldTable, index, value, error ) )
+    {
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        return NO;
+    }
+
+    IF_CHARGE_ASSERT_NOT_FROZEN
+    NSString** slot = IFChargeFieldSlot( fieldTable, self, index );
+    IFChargeFieldKind kind = fieldTable->schema[index].kind;
+    BOOL fits = YES;
+    @synchronized(self)
+    {
+        // Every amount field (and the currency) feeds into the cached
+        // amount, and has to agree with the others on decimal places,
+        // whichever is set last. The cache is autoreleased rather than
+        // released so that a string already handed out by -amount on
+        // this thread stays valid.
+        if ( kIFChargeFieldAmount == kind || kIFChargeFieldCurrency == kind )
+        {
+            NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+            for ( NSUInteger other = 0; other < fieldTable->count; other++ )
+            {
+                values[other] = *IFChargeFieldSlot( fieldTable, self, other );
+            }
+            values[index] = value;
+            fits = IFChargeCheckAmountDecimals( fieldTable, values, error );
+            if ( fits )
+            {
+                [_cachedAmount autorelease];
+                _cachedAmount = nil;
             }
         }
 
-        // extract the nonce here, since you've already unpacked queryFields
-        self.nonce = [queryFields objectForKey:IF_CHARGE_NONCE_KEY];
+        if ( fits && *slot != value )
+        {
+            [*slot release];
+            *slot = fieldTable->interned[index] ? IFChargeInternCopy( value ) : [value copy];
+        }
+    }
 
-        self.extraParams = queryFields;
+    if ( !fits )
+    {
+        IF_CHARGE_STATS_REJECT( [self class], error );
+        return NO;
+    }
+    return YES;
+}
+
+#pragma -
+#pragma Reuse
+
+- (void)reset {
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    IF_CHARGE_ASSERT_NOT_FROZEN
+    @synchronized(self) {
+        for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+        {
+            NSString** slot = IFChargeFieldSlot( fieldTable, self, index );
+            [*slot release];
+            *slot = nil;
+        }
+        [_cachedAmount autorelease];
+        _cachedAmount = nil;
+    }
+    self.nonce = nil;
+    self.baseURL = nil;
+    self.extraParams = nil;
+}
+
+- (BOOL)tryReadURL:(NSURL*)url error:(IFChargeError*)error {
+    IFChargeError localError;
+    if ( NULL == error )
+    {
+        error = &localError;
+    }
+
+    [self reset];
+    NSMutableDictionary* queryFields = [NSMutableDictionary dictionary];
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+    if ( nil == url )
+    {
+        IFChargeSetError( error, kIFChargeErrorNilURL, [self class], NULL, 0 );
+    }
+    else if ( !IFChargeQueryParse( url, fieldTable, values, queryFields ) )
+    {
+        IFChargeSetError( error, kIFChargeErrorMalformedQuery, [self class], NULL, 0 );
+    }
+    else if ( [self trySetQueryValues:values extraParams:queryFields error:error] )
+    {
+        return YES;
+    }
+
+    IF_CHARGE_STATS_REJECT( [self class], error );
+    return NO;
+}
+
+- (void)compactFields {
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    IF_CHARGE_ASSERT_NOT_FROZEN
+    @synchronized(self) {
+        NSUInteger fields[IF_CHARGE_QUERY_MAX_FIELDS];
+        const char* bytes[IF_CHARGE_QUERY_MAX_FIELDS];
+        size_t lengths[IF_CHARGE_QUERY_MAX_FIELDS];
+        NSUInteger count = 0;
+        for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+        {
+            NSString* value = *IFChargeFieldSlot( fieldTable, self, index );
+            if ( nil == value || IFChargeFieldArenaContains( value ) )
+            {
+                continue;
+            }
+
+            // A shared string costs nothing already.
+            if ( fieldTable->interned[index] && value == IFChargeInternString( value ) )
+            {
+                continue;
+            }
+
+            // Only a string that's ASCII, with no NULs, is its own
+            // UTF-8 byte for character; if its first length bytes are,
+            // they're the whole string.
+            const char* utf8 = [value UTF8String];
+            size_t length = [value length];
+            if ( utf8 && IFChargeFieldFitsArena( utf8, length ) )
+            {
+                fields[count]  = index;
+                bytes[count]   = utf8;
+                lengths[count] = length;
+                count++;
+            }
+        }
+
+        // A lone string gains nothing from an arena.
+        if ( count < 2 )
+        {
+            return;
+        }
+
+        NSString* strings[IF_CHARGE_QUERY_MAX_FIELDS];
+        IFChargeFieldArenaCreateStrings( count, bytes, lengths, strings );
+        for ( NSUInteger index = 0; index < count; index++ )
+        {
+            NSString** slot = IFChargeFieldSlot( fieldTable, self, fields[index] );
+            [*slot release];
+            *slot = strings[index];
+        }
     }
-    return self;
 }
 
 #if TARGET_OS_IPHONE
@@ -273,150 +637,238 @@ static NSNumberFormatter *chargeAmountFormatter_;
 // values.
 - (NSURL*)requestURL
 {
+    IF_CHARGE_STATS_START(start);
     if (!_baseURL) {
         [NSException raise:NSInternalInconsistencyException
                     format:@"Could not generate request URL: base URL not defined"];
     }
-    NSMutableString* urlString = [[NSMutableString alloc] initWithString:_baseURL];
-    BOOL first = ([urlString rangeOfString:@"?"].location == NSNotFound);
-    
-    // First build up the query params
-    for ( NSString* field in [[self class] knownFields] )
-    {
-        if ([field isEqualToString:@"amount"] && !_amount) continue; // don't send amount if it's not set explicitly.
-
-        NSString* value = [self valueForKey:field];
-        if ( [value length] )
-        {
-            [urlString appendFormat:@"%@%@%@=%@",
-             first ? @"?" : @"&",
-             IF_CHARGE_MESSAGE_FIELD_PREFIX,
-             field,
-             IFEncodeURIComponent( value )];
-            first = NO;
+    // A snapshot can be read without the lock.
+    NSString* urlString;
+    if (_frozen) {
+        urlString = [self createRequestURLString];
+    } else {
+        @synchronized(self) {
+            urlString = [self createRequestURLString];
         }
     }
-    
+
     // Convert to NSURL
     NSURL* url = [NSURL URLWithString:urlString];
     [urlString release];
+    IF_CHARGE_STATS_STOP(kIFChargeStageRequestURL, start);
     return url;
 }
 
+// Reads each field straight from its ivar; the caller holds the lock,
+// unless the message is frozen. A snapshot's URL is built from scratch,
+// since its readers don't take the lock the builder needs.
+- (NSString*)createRequestURLString
+{
+    const IFChargeFieldTable* fieldTable = [[self class] queryFieldTable];
+    NSString* values[IF_CHARGE_QUERY_MAX_FIELDS];
+
+    // The amount is only sent if it was set explicitly; it's nil here
+    // otherwise, so it's skipped.
+    for ( NSUInteger index = 0; index < fieldTable->count; index++ )
+    {
+        values[index] = *IFChargeFieldSlot( fieldTable, self, index );
+        if ( kIFChargeFieldCurrency == fieldTable->schema[index].kind && 0 == [values[index] length] )
+        {
+            values[index] = IF_CHARGE_DEFAULT_CURRENCY;
+        }
+    }
+
+    BOOL hasQuery = NSNotFound != [_baseURL rangeOfString:@"?"].location;
+    if (_frozen) {
+        return IFChargeQueryCreateURLString(_baseURL, hasQuery, fieldTable->count, fieldTable->queryKeys, values);
+    }
+    if (!_urlBuilder) {
+        _urlBuilder = IFChargeQueryBuilderCreate(fieldTable->count);
+    }
+    return IFChargeQueryBuilderCreateURLString(_urlBuilder, _baseURL, hasQuery, fieldTable->queryKeys, values);
+}
+
+#pragma -
+#pragma Snapshots
+
+- (id)copyWithZone:(NSZone*)zone {
+    // Snapshots are immutable, so they can share themselves.
+    if (_frozen) return [self retain];
+
+    IFChargeMessage *copy = [[[self class] allocWithZone:zone] init];
+    @synchronized(self) {
+        [copy->_amount release];      copy->_amount      = [_amount copy];
+        [copy->_subtotal release];    copy->_subtotal    = [_subtotal copy];
+        [copy->_tip release];         copy->_tip         = [_tip copy];
+        [copy->_tax release];         copy->_tax         = [_tax copy];
+        [copy->_shipping release];    copy->_shipping    = [_shipping copy];
+        [copy->_discount release];    copy->_discount    = [_discount copy];
+        [copy->_currency release];    copy->_currency    = [_currency copy];
+        [copy->_extraParams release]; copy->_extraParams = [_extraParams copy];
+        [copy->_nonce release];       copy->_nonce       = [_nonce copy];
+        [copy->_baseURL release];     copy->_baseURL     = [_baseURL copy];
+    }
+    return copy;
+}
+
+- (id)freeze {
+    if (_frozen) return self;
+
+    IFChargeMessage *snapshot = [self copy];
+    [snapshot freezeInPlace];
+    return [snapshot autorelease];
+}
+
+- (void)freezeInPlace {
+    // Work out the amount before freezing so that reads of the
+    // snapshot always find it cached.
+    [self amount];
+    __sync_synchronize();
+    _frozen = YES;
+}
+
+- (NSDictionary*)extraParams {
+    getObject_Atomic(_extraParams);
+}
+
+- (NSString*)nonce {
+    getObject_Atomic(_nonce);
+}
+
+- (NSString*)baseURL {
+    getObject_Atomic(_baseURL);
+}
+
 + (NSArray*)knownFields {
     // Implement in subclasses
     [self doesNotRecognizeSelector:_cmd];
     return nil;
 }
 
++ (const IFChargeFieldTable*)queryFieldTable {
+    // Implement in subclasses
+    [self doesNotRecognizeSelector:_cmd];
+    return NULL;
+}
+
 #pragma -
 #pragma Amount Fields
 
-double const AMOUNT_FIELD_MAX = 9999999999999.99;
-double const AMOUNT_FIELD_MIN = -9999999999999.99;
-
-- (void)checkFloatStringSize:(NSString*)floatString {
-    double testVal = [floatString doubleValue];
-    
-    // make sure the number could be initted
-    floatCheck(testVal);
-    
-    // make sure the nubmer isn't too high or too low
-    if (testVal > AMOUNT_FIELD_MAX) {
-        [NSException raise:NSInvalidArgumentException format:@"You cannot set amount fields to values higher than %f", AMOUNT_FIELD_MAX];
-    } else if (testVal < AMOUNT_FIELD_MIN) {
-        [NSException raise:NSInvalidArgumentException format:@"You cannot set amount fields to values lower than %f", AMOUNT_FIELD_MIN];
-    }
-}
-
 - (BOOL)amountIsSet {
     return (_amount) ? YES : NO;
 }
 
+- (BOOL)trySetAmount:(NSString *)amount error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("amount") value:amount error:error];
+}
 - (void)setAmount:(NSString *)amount {
-    [self checkFloatStringSize:amount];
-    @synchronized(self) // (readonly,copy)
-    {
-        if (_amount != amount) {
-            [_amount release];
-            _amount = [amount copy];
-        }
-    }
+    IFChargeError error;
+    if (![self trySetAmount:amount error:&error]) IFChargeRaiseError(&error, [self class], amount);
 }
 
+// The amount is worked out once and cached until one of the fields it
+// depends on is set. The subfields are summed exactly in IFChargeMoney;
+// none has more decimal places than the currency allows, so neither
+// does the sum, and nothing is rounded away. A setter on another thread
+// may drop the cache at any time, so it's only read without the lock
+// on a frozen message, whose cache is filled before it's frozen and
+// never cleared.
 - (NSString*)amount {
-    NSString *dollarString;
+    if (_frozen) return _cachedAmount;
 
+    NSString *cached;
     @synchronized(self) {
-        // return the amount if set explicitly
-        if (_amount) {
-            dollarString = [_amount retain];
-        } else {
-            // calculate the amount using the subfields
-            float sum = 0.f;
-            float subtotal__ = floatCheck([self.subtotal floatValue]);
-            float tax__      = floatCheck([self.tax      floatValue]);
-            float tip__      = floatCheck([self.tip      floatValue]);
-            float shipping__ = floatCheck([self.shipping floatValue]);
-            float discount__ = floatCheck([self.discount floatValue]);
-            sum = subtotal__ + tax__ + tip__ + shipping__ - discount__;
-            
-            NSNumber *dollarNumber = [[NSNumber alloc] initWithFloat:sum];
-            dollarString = [[chargeAmountFormatter_ stringFromNumber:dollarNumber] retain];
-            [dollarNumber release];
+        if (!_cachedAmount) {
+            if (_amount) {
+                // return the amount if set explicitly
+                _cachedAmount = [_amount retain];
+            } else {
+                // calculate the amount using the subfields
+                IFChargeMoney sum = IFChargeMoneyFromString(_subtotal)
+                                  + IFChargeMoneyFromString(_tax)
+                                  + IFChargeMoneyFromString(_tip)
+                                  + IFChargeMoneyFromString(_shipping)
+                                  - IFChargeMoneyFromString(_discount);
+
+                char buffer[IF_CHARGE_MONEY_FORMAT_MAX];
+                size_t length = IFChargeMoneyFormat(sum, IF_CHARGE_AMOUNT_DECIMALS, buffer);
+                NSString *amount = [[NSString alloc] initWithBytes:buffer length:length encoding:NSASCIIStringEncoding];
+
+                _cachedAmount = amount;
+            }
         }
+        cached = [[_cachedAmount retain] autorelease];
     }
 
-    return [dollarString autorelease];
+    return cached;
 }
 
+- (BOOL)trySetSubtotal:(NSString *)subtotal error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("subtotal") value:subtotal error:error];
+}
 - (void)setSubtotal:(NSString *)subtotal {
-    [self checkFloatStringSize:subtotal];
-    setObject_AtomicCopy(_subtotal, subtotal);
+    IFChargeError error;
+    if (![self trySetSubtotal:subtotal error:&error]) IFChargeRaiseError(&error, [self class], subtotal);
 }
 - (NSString*)subtotal {
     getObject_Atomic(_subtotal);
 }
 
+- (BOOL)trySetTip:(NSString *)tip error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("tip") value:tip error:error];
+}
 - (void)setTip:(NSString *)tip {
-    [self checkFloatStringSize:tip];
-    setObject_AtomicCopy(_tip, tip);
+    IFChargeError error;
+    if (![self trySetTip:tip error:&error]) IFChargeRaiseError(&error, [self class], tip);
 }
 - (NSString*)tip {
     getObject_Atomic(_tip);
 }
 
+- (BOOL)trySetTax:(NSString *)tax error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("tax") value:tax error:error];
+}
 - (void)setTax:(NSString *)tax {
-    [self checkFloatStringSize:tax];
-    setObject_AtomicCopy(_tax, tax);
+    IFChargeError error;
+    if (![self trySetTax:tax error:&error]) IFChargeRaiseError(&error, [self class], tax);
 }
 - (NSString*)tax {
     getObject_Atomic(_tax);
 }
 
+- (BOOL)trySetShipping:(NSString *)shipping error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("shipping") value:shipping error:error];
+}
 - (void)setShipping:(NSString *)shipping {
-    [self checkFloatStringSize:shipping];
-    setObject_AtomicCopy(_shipping, shipping);
+    IFChargeError error;
+    if (![self trySetShipping:shipping error:&error]) IFChargeRaiseError(&error, [self class], shipping);
 }
 - (NSString*)shipping {
     getObject_Atomic(_shipping);
 }
 
+- (BOOL)trySetDiscount:(NSString *)discount error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("discount") value:discount error:error];
+}
 - (void)setDiscount:(NSString *)discount {
-    [self checkFloatStringSize:discount];
-    setObject_AtomicCopy(_discount, discount);
+    IFChargeError error;
+    if (![self trySetDiscount:discount error:&error]) IFChargeRaiseError(&error, [self class], discount);
 }
 - (NSString*)discount {
     getObject_Atomic(_discount);
 }
 
 
+- (BOOL)trySetCurrency:(NSString *)currency error:(IFChargeError *)error {
+    return [self trySetField:IF_FIELD_INDEX("currency") value:currency error:error];
+}
 - (void)setCurrency:(NSString *)currency {
-    [self checkFloatStringSize:currency];
-    setObject_AtomicCopy(_currency, currency);
+    [self trySetCurrency:currency error:NULL];
 }
 
 - (NSString*)currency {
+    if (_frozen) return [_currency length] ? _currency : IF_CHARGE_DEFAULT_CURRENCY;
+
     id result;
     @synchronized(self) {
         result = (_currency && [_currency length] > 0) ? [_currency retain] : IF_CHARGE_DEFAULT_CURRENCY;
@@ -424,60 +876,69 @@ double const AMOUNT_FIELD_MIN = -9999999999999.99;
     return [result autorelease];
 }
 
-- (void)validateTextArgument:(NSString*)arg withMaxLength:(int)maxLength forbiddenCharacterSets:firstSet, ... {
-    // Passing 0 as maxLength prevents length limit testing.
-    // Passing nil as firstSet prevents forbidden character testing
-    if (maxLength != 0 && [arg length] > maxLength) {
-        [NSException raise:IFInvalidArgumentLengthException
-                    format:@"Argument '%@' is %d characters too long", arg, [arg length] - maxLength];
-    }
+- (BOOL)checkTextArgument:(NSString*)arg withMaxLength:(int)maxLength forbiddenCharacterSet:(NSCharacterSet*)forbidden field:(const char*)field error:(IFChargeError*)error {
+    NSInteger detail = 0;
+    IFChargeErrorCode code = IFCheckTextInSets(arg, maxLength, &forbidden, forbidden ? 1 : 0, &detail);
+    return (kIFChargeErrorNone == code) || IFChargeSetError(error, code, [self class], field, detail);
+}
+
+- (BOOL)checkURLString:(NSString*)testString field:(const char*)field error:(IFChargeError*)error {
+    IFChargeErrorCode code = IFCheckURL(testString);
+    return (kIFChargeErrorNone == code) || IFChargeSetError(error, code, [self class], field, 0);
+}
 
+- (BOOL)checkEmailString:(NSString*)testString field:(const char*)field error:(IFChargeError*)error {
+    IFChargeErrorCode code = IFCheckEmail(testString);
+    return (kIFChargeErrorNone == code) || IFChargeSetError(error, code, [self class], field, 0);
+}
+
+- (void)validateTextArgument:(NSString*)arg withMaxLength:(int)maxLength forbiddenCharacterSets:firstSet, ... {
+    // Gather the sets; their union is compiled once and cached (see
+    // IFChargeCharSetFindInSets). Past the first few, they're merged
+    // here.
+    NSCharacterSet *sets[IF_MESSAGE_MAX_CHARACTER_SETS];
+    NSUInteger count = 0;
     if (firstSet != nil) {
-        // merge the character sets
-        NSMutableCharacterSet *disallowedCharacterSet = [[firstSet mutableCopy] autorelease];
+        sets[count++] = firstSet;
         va_list argumentList;
         id nextSet;
 
         va_start(argumentList, firstSet);
-        while ((nextSet = va_arg(argumentList, id)))
-            [disallowedCharacterSet formUnionWithCharacterSet:nextSet];
-        va_end(argumentList);
-
-        // list all of the illegal characters
-        NSMutableArray *illegals = [[NSMutableArray alloc] init];
-        int argLength = [arg length];
-        NSRange searchRange = NSMakeRange(0, argLength);
-        NSRange resultRange = [arg rangeOfCharacterFromSet:disallowedCharacterSet options:0 range:searchRange];
-        while (resultRange.location != NSNotFound) {
-            NSString *illegalSubstring = [arg substringWithRange:resultRange];
-            if ([illegals indexOfObject:illegalSubstring] == NSNotFound)
-                [illegals addObject:[arg substringWithRange:resultRange]];
-            int newLoc = resultRange.location + resultRange.length;
-            searchRange = NSMakeRange(newLoc, argLength - newLoc);
-            resultRange = [arg rangeOfCharacterFromSet:disallowedCharacterSet options:0 range:searchRange];
-        }
-
-        // raise exception if necessary
-        if ([illegals count] > 0) {
-            [NSException raise:IFDisallowedCharacterException
-                        format:@"The text argument contained the following disallowed characters: %@", [illegals autorelease]];
+        NSMutableCharacterSet *merged = nil;
+        while ((nextSet = va_arg(argumentList, id))) {
+            if (count < IF_MESSAGE_MAX_CHARACTER_SETS) {
+                sets[count++] = nextSet;
+            } else {
+                if (nil == merged) {
+                    merged = [[sets[count - 1] mutableCopy] autorelease];
+                    sets[count - 1] = merged;
+                }
+                [merged formUnionWithCharacterSet:nextSet];
+            }
         }
+        va_end(argumentList);
+    }
 
-        [illegals release];
+    NSInteger detail = 0;
+    IFChargeErrorCode code = IFCheckTextInSets(arg, maxLength, sets, count, &detail);
+    if (kIFChargeErrorNone != code) {
+        IFChargeError error;
+        IFChargeSetError(&error, code, [self class], NULL, detail);
+        IFChargeRaiseError(&error, [self class], arg);
     }
 }
 
 - (void)validateURLString:(NSString*)testString {
-    // Takes a string, sees if it can be turned into an nsurl.
-    if (![NSURL URLWithString:testString]) {
-        [NSException raise:NSInvalidArgumentException format:@"Could not build url out of string: '%@'", testString];
+    IFChargeError error;
+    if (![self checkURLString:testString field:NULL error:&error]) {
+        IFChargeRaiseError(&error, [self class], testString);
     }
 }
 
 - (void)validateEmailString:(NSString*)testString {
-     NSPredicate *emailTestPredicate = [NSPredicate predicateWithFormat:@"SELF MATCHES %@", emailRegEx]; // x@xxx.xx
-    if (![emailTestPredicate evaluateWithObject:testString]) {
-        [NSException raise:NSInvalidArgumentException format:@"'%@' doesn't look like an email"];
+    IFChargeError error;
+    if (![self checkEmailString:testString field:NULL error:&error]) {
+        IFChargeRaiseError(&error, [self class], testString);
     }
 }
 
@@ -485,6 +946,7 @@ double const AMOUNT_FIELD_MIN = -9999999999999.99;
 #pragma Memory Management
 
 - (void) dealloc {
+    _frozen = NO; // so the setters below may clear the fields
     self.amount = nil;
     self.subtotal = nil;
     self.tip = nil;
@@ -495,6 +957,8 @@ double const AMOUNT_FIELD_MIN = -9999999999999.99;
     self.nonce = nil;
     self.baseURL = nil;
     self.extraParams = nil;
+    [_cachedAmount release];
+    IFChargeQueryBuilderFree(_urlBuilder);
     [super dealloc];
 }
 
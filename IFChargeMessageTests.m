@@ -7,6 +7,14 @@
 //
 
 #import "IFChargeMessageTests.h"
+#import "IFChargeCharSet.h"
+#import "IFChargeEmail.h"
+#import "IFChargeMoney.h"
+#import "IFChargePattern.h"
+#import "IFChargeQuery.h"
+#import "IFChargeTestData.h"
+
+#import <regex.h>
 
 
 @implementation IFChargeMessageTests
@@ -80,6 +88,58 @@
     [self testFloatStringSetter:@selector(setDiscount:) onObject:testRequest_ withMaxFigures:15];
 }
 
+- (void)testAmountArithmetic {
+    // Cents survive sums that a float would round.
+    testRequest_.subtotal = @"1234567.89";
+    testRequest_.tip = @"0.01";
+    STAssertEqualObjects(@"1234567.90", testRequest_.amount, @"Amount should be exact, but it was '%@'", testRequest_.amount);
+
+    // No grouping separators, and negative totals are plain.
+    testRequest_.discount = @"1234568.00";
+    STAssertEqualObjects(@"-0.10", testRequest_.amount, @"Amount should be '-0.10', but it was '%@'", testRequest_.amount);
+
+    // Amounts may not have more decimal places than the currency
+    // allows, whichever is set last; nothing is rounded away.
+    [self resetTestObjects];
+    IFChargeError error;
+    NSUInteger subtotalField = [[IFChargeRequest knownFields] indexOfObject:@"subtotal"];
+    STAssertFalse([testRequest_ trySetSubtotal:@"0.125" error:&error], @"A third decimal place should be rejected");
+    STAssertEquals(kIFChargeErrorInvalidAmount, error.code, @"Too many decimal places is an invalid amount");
+    STAssertEquals((NSInteger)subtotalField, error.field, @"The error should blame the subtotal");
+    STAssertEquals((NSInteger)3, error.detail, @"The error should give the decimal places");
+    STAssertTrue([testRequest_ trySetSubtotal:@"0.120" error:&error], @"Trailing zeros shouldn't count");
+    STAssertFalse([testRequest_ trySetSubtotal:@"1.00001" error:&error], @"Digits past the fourth decimal place should count");
+    STAssertEqualObjects(@"0.120", testRequest_.subtotal, @"A rejected subtotal shouldn't be stored");
+    STAssertTrue([testRequest_ trySetSubtotal:@"1500.50" error:&error], @"Cents should be allowed in USD");
+    STAssertFalse([testRequest_ trySetCurrency:@"JPY" error:&error], @"JPY should be rejected while the subtotal has cents");
+    STAssertEquals((NSInteger)subtotalField, error.field, @"The error should blame the subtotal");
+    STAssertEqualObjects(IF_CHARGE_DEFAULT_CURRENCY, testRequest_.currency, @"A rejected currency shouldn't be stored");
+    STAssertThrows(testRequest_.currency = @"JPY", @"The raising setter should raise");
+    testRequest_.subtotal = @"1500";
+    testRequest_.currency = @"JPY";
+    STAssertThrows(testRequest_.subtotal = @"1500.50", @"JPY amounts should be whole yen");
+    testRequest_.subtotal = @"1500.00";
+    STAssertEqualObjects(@"1500.00", testRequest_.amount, @"JPY amounts should be whole yen, but it was '%@'", testRequest_.amount);
+    STAssertNil([[[IFChargeRequest alloc] tryInitWithURL:[NSURL URLWithString:@"x://y?ifcc_currency=JPY&ifcc_tip=0.5"] error:&error] autorelease],
+                @"A URL's amounts should be checked against its currency");
+    STAssertEquals(kIFChargeErrorInvalidAmount, error.code, @"Too many decimal places is an invalid amount");
+
+    // The cached amount tracks every subfield setter.
+    NSString *before = testRequest_.amount;
+    STAssertTrue(before == testRequest_.amount, @"Reading the amount twice should return the cached string");
+    testRequest_.tax = @"1";
+    STAssertEqualObjects(@"1501.00", testRequest_.amount, @"Amount should be recomputed after a subfield changes, but it was '%@'", testRequest_.amount);
+
+    STAssertEquals(0u, IFChargeCurrencyExponent(@"JPY"), @"JPY has no minor unit");
+    STAssertEquals(3u, IFChargeCurrencyExponent(@"KWD"), @"KWD has three decimal places");
+    STAssertEquals(2u, IFChargeCurrencyExponent(@"USD"), @"USD has two decimal places");
+    STAssertEquals(2u, IFChargeCurrencyExponent(nil), @"Unknown currencies should have two decimal places");
+
+    STAssertEquals(12345LL, IFChargeMoneyFromString(@" 1.2345xyz"), @"Parsing should stop at the end of the number");
+    STAssertEquals(15000LL, IFChargeMoneyFromString(@"1.5e0"), @"Exponents should be honored");
+    STAssertEquals(0LL, IFChargeMoneyFromString(@"abc"), @"Non-numbers should be zero");
+}
+
 // Test that the currency defaults to IF_CHARGE_DEFAULT_CURRENCY
 - (void)testCurrencyDefault {
     STAssertEqualObjects(IF_CHARGE_DEFAULT_CURRENCY, self.testResponse.currency,
@@ -87,6 +147,227 @@
                          IF_CHARGE_DEFAULT_CURRENCY, testResponse_.currency);
 }
 
+// Test that the hand-written field matchers accept exactly what the
+// <regex.h> patterns they stand in for accept.
+- (void)testFieldPatternMatchers {
+    const char *patterns[] = {
+        IF_CHARGE_AMOUNT_PATTERN,
+        IF_CHARGE_CURRENCY_PATTERN,
+        IF_CHARGE_REDACTED_CARD_NUMBER_PATTERN,
+        IF_CHARGE_CARD_TYPE_PATTERN,
+        IF_CHARGE_RESPONSE_TYPE_PATTERN,
+    };
+    NSCharacterSet *alphabet = [NSCharacterSet characterSetWithCharactersInString:@"0123456789.XAZaz -"];
+
+    for (int p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+        regex_t re;
+        STAssertEquals(0, regcomp(&re, patterns[p], REG_EXTENDED | REG_NOSUB), @"Pattern '%s' should compile", patterns[p]);
+        IFChargePattern *pattern = IFChargePatternGet(patterns[p]);
+        STAssertTrue(pattern == IFChargePatternGet(patterns[p]), @"Pattern '%s' should only be compiled once", patterns[p]);
+
+        for (int i = 0; i < 2000; i++) {
+            NSString *candidate = randomStringFromCharacterSet(alphabet, IFTestRandomBelow(&IFTestSharedGenerator()->random, 24));
+            BOOL expected = (0 == regexec(&re, [candidate UTF8String], 0, NULL, 0));
+            STAssertEquals(expected, IFChargePatternMatches(pattern, candidate),
+                           @"'%@' should %@match '%s'", candidate, expected ? @"" : @"not ", patterns[p]);
+        }
+        regfree(&re);
+    }
+
+    STAssertTrue(IFMatchesPattern(@"123.45", @IF_CHARGE_AMOUNT_PATTERN), @"IFMatchesPattern should accept a valid amount");
+    STAssertFalse(IFMatchesPattern(@"0123.45", @IF_CHARGE_AMOUNT_PATTERN), @"IFMatchesPattern should reject a leading zero");
+    STAssertTrue(IFMatchesPattern(@"123", @"^[0-9]+$"), @"IFMatchesPattern should fall back to <regex.h> for other patterns");
+}
+
+// Test that IFChargeQueryParse splits known fields from extraParams the
+// way the NSDictionary-based parser did.
+- (void)testQueryParsing {
+    const IFChargeFieldTable *table = [IFChargeResponse queryFieldTable];
+    NSString *values[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+    NSMutableDictionary *extras = [NSMutableDictionary dictionary];
+    NSURL *url = [NSURL URLWithString:@"app://host?ifcc_amount=1.00&ifcc_amount=2.00&ifcc_tip=&record_id=a%20b"
+                  @"&a=b=c&bare&&ifcc_unknown=x&ifcc_cardType=American%20Express&=empty"];
+
+    STAssertTrue(IFChargeQueryParse(url, table, values, extras), @"'%@' should parse", url);
+
+    NSUInteger amount = [[IFChargeResponse knownFields] indexOfObject:@"amount"];
+    NSUInteger cardType = [[IFChargeResponse knownFields] indexOfObject:@"cardType"];
+    NSUInteger tip = [[IFChargeResponse knownFields] indexOfObject:@"tip"];
+    STAssertEqualObjects(@"2.00", values[amount], @"The last of repeated fields should win");
+    STAssertEqualObjects(@"American Express", values[cardType], @"Known field values should be percent-decoded");
+    STAssertNil(values[tip], @"Empty known fields should not be set");
+
+    NSDictionary *expected = [NSDictionary dictionaryWithObjectsAndKeys:
+                              @"", @"ifcc_tip",
+                              @"a b", @"record_id",
+                              @"x", @"ifcc_unknown",
+                              @"empty", @"",
+                              nil];
+    STAssertEqualObjects(expected, extras, @"Unknown and empty fields should be left in extraParams");
+
+    extras = [NSMutableDictionary dictionary];
+    url = [NSURL URLWithString:@"app://host?record_id=%C3%28"];
+    STAssertFalse(IFChargeQueryParse(url, table, values, extras), @"'%@' does not decode to UTF-8 and should not parse", url);
+
+    // NSURL refuses malformed escapes, so they go to the parser as they
+    // would arrive in a hand-built query.
+    NSString *malformed[] = { @"record_id=%zz", @"record_id=%", @"record_id=%4", @"record_id=a%4g",
+                              @"%zz=1", @"ifcc_amount=1.00&record_id=%" };
+    for (NSUInteger i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        NSString *parsed[IF_CHARGE_QUERY_MAX_FIELDS] = { nil };
+        extras = [NSMutableDictionary dictionary];
+        STAssertFalse(IFChargeQueryParseString(malformed[i], table, parsed, extras), @"'%@' has a malformed escape and should not parse", malformed[i]);
+        STAssertNil(parsed[amount], @"'%@' should leave the values untouched", malformed[i]);
+        STAssertEquals((NSUInteger)0, [extras count], @"'%@' should leave extraParams untouched", malformed[i]);
+    }
+    extras = [NSMutableDictionary dictionary];
+    STAssertTrue(IFChargeQueryParseString(@"record_id=%41%4a", table, values, extras), @"Well-formed escapes should parse");
+    STAssertEqualObjects(@"AJ", [extras objectForKey:@"record_id"], @"Escapes should decode in either case");
+}
+
+- (void)testPercentEncoding {
+    // IFEncodeURIComponent must produce exactly what
+    // CFURLCreateStringByAddingPercentEscapes did, reserved chars and all.
+    NSMutableArray *strings = [NSMutableArray arrayWithObjects:
+                               @"", @"plain", @"a b", @"100%", @"~-._", @":/?#[]@!$&'()*+,;=",
+                               @"\"<>\\^`{|}", @"caf\u00e9 \u20ac\U0001F4B3", @"an_unreserved-run.longer~than16 bytes", nil];
+    srandom(3);
+    for (int i = 0; i < 500; i++) {
+        unichar chars[40];
+        NSUInteger length = random() % 40;
+        for (NSUInteger j = 0; j < length; j++) {
+            switch (random() % 4) {
+                case 0:  chars[j] = 0x20 + random() % 0x5f; break;     // printable ASCII
+                case 1:  chars[j] = 0x80 + random() % 0x780; break;    // two-byte UTF-8
+                case 2:  chars[j] = random() % 0x20; break;            // control characters, NUL too
+                default: chars[j] = "abcXYZ0189-._~"[random() % 14];   // unreserved runs
+            }
+        }
+        [strings addObject:[NSString stringWithCharacters:chars length:length]];
+    }
+    unichar nul[] = { 'a', 0, 'b', 0 };
+    [strings addObject:[NSString stringWithCharacters:nul length:4]];
+
+    for (NSString *s in strings) {
+        NSString *expected = [(NSString *)CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, (CFStringRef)s, NULL,
+                                                                                  CFSTR(":/?#[]@!$&'()*+,;="),
+                                                                                  kCFStringEncodingUTF8) autorelease];
+        STAssertEqualObjects(expected, IFEncodeURIComponent(s), @"'%@' should encode as CF does", s);
+    }
+
+    // The builder skips empty values and only starts a query if there isn't one.
+    NSString *keys[] = { @"a", @"b", @"c" };
+    NSString *values[] = { @"1 2", @"", @"&" };
+    NSString *url = IFChargeQueryCreateURLString(@"app://host", NO, 3, keys, values);
+    STAssertEqualObjects(@"app://host?a=1%202&c=%26", url, @"Pairs should be appended to a URL without a query");
+    [url release];
+    url = IFChargeQueryCreateURLString(@"app://host?x=y", YES, 3, keys, values);
+    STAssertEqualObjects(@"app://host?x=y&a=1%202&c=%26", url, @"Pairs should be appended to an existing query");
+    [url release];
+}
+
+// IFChargeCharSetFind must find what rangeOfCharacterFromSet: finds.
+// The strings mix runs of plain ASCII (long enough for the vector
+// scan) with each set's members, non-ASCII letters and symbols, and
+// whole and broken surrogate pairs.
+- (void)testCharSetScanner {
+    NSMutableCharacterSet *symbolsOrPunctuation = [[[NSCharacterSet symbolCharacterSet] mutableCopy] autorelease];
+    [symbolsOrPunctuation formUnionWithCharacterSet:[NSCharacterSet punctuationCharacterSet]];
+    NSCharacterSet *sets[] = {
+        [NSCharacterSet symbolCharacterSet],
+        [[NSCharacterSet characterSetWithCharactersInString:@"0123456789- "] invertedSet],
+        [NSCharacterSet punctuationCharacterSet],
+        [NSCharacterSet whitespaceAndNewlineCharacterSet],
+        [NSCharacterSet characterSetWithCharactersInString:@"\u00e9\u20ac"],
+        symbolsOrPunctuation,
+    };
+    NSUInteger setCount = sizeof(sets) / sizeof(sets[0]);
+    unichar highSurrogate = 0xD83D, lowSurrogate = 0xDE00;
+    NSString *fragments[] = {
+        @"abcdefghij", @"0123456789", @"Ben Acland", @"-", @" ", @"$", @"+", @"<=>", @"^", @"`", @"|", @"~", @"!", @"#",
+        @"\x7f", @"\t", @"\u00e9", @"\u00a2", @"\u20ac", @"\u2211", @"\u65e5\u672c", @"\U0001F600", @"\U0001D400",
+        [NSString stringWithCharacters:&highSurrogate length:1], [NSString stringWithCharacters:&lowSurrogate length:1],
+    };
+    NSUInteger fragmentCount = sizeof(fragments) / sizeof(fragments[0]);
+
+    IFChargeCharSet *compiled[sizeof(sets) / sizeof(sets[0])];
+    for (NSUInteger i = 0; i < setCount; i++) compiled[i] = IFChargeCharSetCreate(sets[i]);
+
+    srandom(21);
+    for (int i = 0; i < 20000; i++) {
+        NSMutableString *string = [NSMutableString string];
+        NSUInteger count = random() % 40;
+        for (NSUInteger j = 0; j < count; j++) {
+            // Mostly plain text, so the vector scan gets long runs.
+            [string appendString:fragments[(random() % 3) ? random() % 3 : random() % fragmentCount]];
+        }
+        for (NSUInteger k = 0; k < setCount; k++) {
+            NSUInteger expected = [string rangeOfCharacterFromSet:sets[k]].location;
+            STAssertEquals(expected, IFChargeCharSetFind(compiled[k], string), @"'%@' against set %u", string, (unsigned)k);
+        }
+        NSUInteger expected = [string rangeOfCharacterFromSet:symbolsOrPunctuation].location;
+        NSCharacterSet *pair[] = { sets[0], sets[2] };
+        STAssertEquals(expected, IFChargeCharSetFindInSets(string, pair, 2), @"'%@' against a cached union", string);
+    }
+
+    for (NSUInteger i = 0; i < setCount; i++) IFChargeCharSetFree(compiled[i]);
+
+    // The raising API reports the same place.
+    STAssertThrowsSpecificNamed([testRequest_ validateTextArgument:@"ok but $" withMaxLength:0
+                                            forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], nil],
+                                NSException, IFDisallowedCharacterException, @"A symbol should be rejected");
+    STAssertNoThrow([testRequest_ validateTextArgument:@"no symbols here" withMaxLength:20
+                                forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], [NSCharacterSet controlCharacterSet],
+                                                       [NSCharacterSet illegalCharacterSet], [NSCharacterSet nonBaseCharacterSet],
+                                                       [NSCharacterSet decimalDigitCharacterSet], nil],
+                    @"Clean text should pass any number of sets");
+    STAssertThrowsSpecificNamed([testRequest_ validateTextArgument:@"abc1" withMaxLength:20
+                                              forbiddenCharacterSets:[NSCharacterSet symbolCharacterSet], [NSCharacterSet controlCharacterSet],
+                                                                     [NSCharacterSet illegalCharacterSet], [NSCharacterSet nonBaseCharacterSet],
+                                                                     [NSCharacterSet decimalDigitCharacterSet], nil],
+                                NSException, IFDisallowedCharacterException, @"Sets past the first few should still be checked");
+}
+
+// IFChargeEmailIsValid must accept exactly what the emailRegEx predicate
+// did. The corpus is built from fragments near each rule's edges.
+- (void)testEmailScanner {
+    NSPredicate *predicate = [NSPredicate predicateWithFormat:@"SELF MATCHES %@", emailRegEx];
+    NSMutableArray *emails = [NSMutableArray arrayWithObjects:
+                              @"", @"a@b.co", @"A.B+c@Example.COM", @"a@Example.com", @"a..b@x.com", @".a@x.com",
+                              @"a@x", @"a@-x.com", @"a@x-.com", @"a@x.c-m", @"\"\"@x.com", @"\"a\\\"b c\"@x.com",
+                              @"\"a\\\nb\"@x.com", @"a@[1.2.3.4]", @"a@[255.249.0.199]", @"a@[256.1.1.1]",
+                              @"a@[001.2.3.4]", @"a@[1.2.3]", @"a@[1.2.3.v6:a\\ b]", @"a@[1.2.3.v6:a b]",
+                              @"a@[1.2.3.v-:x]", @"a@[1.2.3.4]x", @"caf\u00e9@x.com", @"a@x.com\u00e9", nil];
+    NSString *fragments[] = {
+        @"a", @"Zz", @"0", @"-", @".", @"..", @"@", @"\"", @"\\", @"[", @"]", @":", @" ", @"\t", @"\n", @"\x7f",
+        @"!#$%&'*+/=?^_`{|}~", @"1", @"25", @"255", @"256", @"199", @"x.com", @"EX", @"v6:", @"\u00e9",
+    };
+    NSUInteger fragmentCount = sizeof(fragments) / sizeof(fragments[0]);
+    srandom(9);
+    for (int i = 0; i < 20000; i++) {
+        NSMutableString *email = [NSMutableString string];
+        NSUInteger count = 1 + random() % 10;
+        for (NSUInteger j = 0; j < count; j++) {
+            // Mostly well-formed skeletons with fragments spliced in.
+            switch (random() % 6) {
+                case 0:  [email appendString:@"a@"]; break;
+                case 1:  [email appendString:@"@[1.2.3."]; break;
+                default: [email appendString:fragments[random() % fragmentCount]];
+            }
+        }
+        [emails addObject:email];
+    }
+
+    for (NSString *email in emails) {
+        BOOL expected = [predicate evaluateWithObject:email];
+        STAssertEquals(expected, IFChargeEmailIsValid(email), @"'%@' should %@be a valid email", email, expected ? @"" : @"not ");
+    }
+
+    NSString *longLocal = [@"" stringByPaddingToLength:300 withString:@"a" startingAtIndex:0];
+    STAssertTrue(IFChargeEmailIsValid([longLocal stringByAppendingString:@"@x.com"]), @"Long addresses should be scanned off the stack");
+    STAssertFalse(IFChargeEmailIsValid(nil), @"nil should not be a valid email");
+}
+
 
 // BONUS: Test that the currency property enforces ISO 4217
 
@@ -7,6 +7,21 @@
 //
 
 #import "IFChargeRequestTests.h"
+#import "IFChargeBatch.h"
+#import "IFChargeNonce.h"
+#import "IFChargeSimulator.h"
+#import "IFChargeTestData.h"
+#import "IFChargeWire.h"
+
+// A request whose nonce store can't grow, as when the disk is full.
+@interface IFNoNonceRequest : IFChargeRequest
+@end
+
+@implementation IFNoNonceRequest
+- (NSString *)createAndStoreNonce {
+    return nil;
+}
+@end
 
 
 @implementation IFChargeRequestTests
@@ -125,4 +140,552 @@
     STAssertEqualObjects(newRequest.delegate, self, @"Initting an IFChargeRequest with delegate self should set the delegate to self. Instead, it was %@", newRequest.delegate);
 }
 
+- (void)testFreeze {
+    testRequest_.firstName = @"Ben";
+    testRequest_.subtotal = @"10.00";
+    testRequest_.tip = @"1.50";
+    IFChargeRequest *snapshot = [testRequest_ freeze];
+
+    // Test that the snapshot has the builder's values, and the builder stays mutable
+    STAssertTrue(snapshot.frozen, @"freeze should return a frozen snapshot");
+    STAssertFalse(testRequest_.frozen, @"Freezing should not freeze the builder");
+    STAssertEqualObjects(@"Ben", snapshot.firstName, @"The snapshot's firstName should be 'Ben', but it was '%@'", snapshot.firstName);
+    STAssertEqualObjects(@"11.50", snapshot.amount, @"The snapshot's amount should be '11.50', but it was '%@'", snapshot.amount);
+    STAssertEqualObjects([testRequest_ requestURL], [snapshot requestURL], @"The snapshot should produce the builder's requestURL");
+
+    testRequest_.firstName = @"Jerry";
+    STAssertEqualObjects(@"Ben", snapshot.firstName, @"Changing the builder should not change the snapshot");
+
+    // Test that setting a field on a snapshot raises NSInternalInconsistencyException
+    STAssertThrowsSpecificNamed(snapshot.firstName = @"Jerry", NSException, NSInternalInconsistencyException,
+                                @"Setting a field of a frozen request should raise %@", NSInternalInconsistencyException);
+    STAssertThrowsSpecificNamed(snapshot.tip = @"2.00", NSException, NSInternalInconsistencyException,
+                                @"Setting an amount field of a frozen request should raise %@", NSInternalInconsistencyException);
+
+    // Test that snapshots copy and re-freeze to themselves
+    STAssertTrue(snapshot == [[snapshot copy] autorelease], @"Copying a snapshot should return the snapshot");
+    STAssertTrue(snapshot == [snapshot freeze], @"Freezing a snapshot should return the snapshot");
+}
+
+- (void)testTrySetters {
+    IFChargeError error;
+
+    STAssertTrue([testRequest_ trySetFirstName:@"Ben" error:&error], @"A valid first name should be accepted");
+    STAssertEqualObjects(@"Ben", testRequest_.firstName, @"The accepted value should be set");
+
+    STAssertFalse([testRequest_ trySetFirstName:@"B$n" error:&error], @"A symbol in a name should be rejected");
+    STAssertEquals(kIFChargeErrorDisallowedCharacter, error.code, @"The disallowed character should be reported");
+    STAssertEquals((NSInteger)1, error.detail, @"The disallowed character's index should be reported");
+    STAssertEqualObjects(@"firstName", [[IFChargeRequest knownFields] objectAtIndex:error.field], @"The field should be reported");
+    STAssertEqualObjects(@"Ben", testRequest_.firstName, @"A rejected value should not be set");
+
+    NSString *tooLong = [@"" stringByPaddingToLength:Zip_MAX_LENGTH + 3 withString:@"1" startingAtIndex:0];
+    STAssertFalse([testRequest_ trySetZip:tooLong error:&error], @"A long zip should be rejected");
+    STAssertEquals(kIFChargeErrorArgumentTooLong, error.code, @"The length should be reported");
+    STAssertEquals((NSInteger)3, error.detail, @"The excess length should be reported");
+
+    STAssertFalse([testRequest_ trySetTip:@"10000000000000" error:&error], @"An amount out of range should be rejected");
+    STAssertEquals(kIFChargeErrorAmountTooHigh, error.code, @"The range should be reported");
+    for (NSString *notAnAmount in [NSArray arrayWithObjects:@"inf", @"-infinity", @"nan", @"0x1A", @"abc", @".", nil]) {
+        STAssertFalse([testRequest_ trySetTip:notAnAmount error:&error], @"'%@' should be rejected", notAnAmount);
+        STAssertEquals(kIFChargeErrorInvalidAmount, error.code, @"'%@' should be reported as not an amount", notAnAmount);
+    }
+    STAssertThrowsSpecificNamed(testRequest_.subtotal = @"inf", NSException, NSInvalidArgumentException,
+                                @"An infinite amount should raise, as it always has");
+    STAssertTrue([testRequest_ trySetTip:@"" error:&error], @"An empty amount should unset the field");
+
+    STAssertFalse([testRequest_ trySetRequestBaseURI:@"foo://bar?" error:&error], @"A base URI with a query should be rejected");
+    STAssertEquals(kIFChargeErrorQueryInBaseURI, error.code, @"The query should be reported");
+    STAssertEquals((NSInteger)-1, error.field, @"requestBaseURI isn't a query field");
+
+    STAssertFalse([testRequest_ trySetEmail:@"nobody" error:NULL], @"The error may be NULL");
+
+    STAssertThrowsSpecificNamed(testRequest_.zip = tooLong, NSException, IFInvalidArgumentLengthException,
+                                @"The plain setter should raise what the try setter reports");
+    STAssertThrowsSpecificNamed(testRequest_.firstName = @"B$n", NSException, IFDisallowedCharacterException,
+                                @"The plain setter should raise what the try setter reports");
+}
+
+// The characters each text field of the request forbids, and the rest
+// of the BMP, indexed by field; NULL for fields that aren't text.
+static void IFTextFieldCharacters(const IFChargeFieldTable *table, const IFTestCharacters **forbidden, const IFTestCharacters **allowed) {
+    NSCharacterSet *phone = [[NSCharacterSet characterSetWithCharactersInString:@"0123456789- "] invertedSet];
+    NSCharacterSet *none = [NSCharacterSet characterSetWithRange:NSMakeRange(0, 0)];
+    for (NSUInteger index = 0; index < table->count; index++) {
+        NSCharacterSet *set = nil;
+        switch (table->schema[index].forbidden) {
+            case kIFChargeForbidSymbols: set = [NSCharacterSet symbolCharacterSet]; break;
+            case kIFChargeForbidPhone:   set = phone; break;
+            case kIFChargeForbidNone:    set = none; break;
+        }
+        BOOL text = (kIFChargeFieldText == table->schema[index].kind);
+        forbidden[index] = text ? IFTestCharactersInSet(set) : NULL;
+        allowed[index] = text ? IFTestCharactersInSet([set invertedSet]) : NULL;
+    }
+}
+
+// Sets random BMP text on random text fields, a quarter of it too long
+// and half of it with forbidden characters scattered in, and checks the
+// outcome against the field's limits: the length first, then the first
+// forbidden character. A failure reports the seed and case to repeat.
+- (void)testTextSetterProperties {
+    const IFChargeFieldTable *table = [IFChargeRequest queryFieldTable];
+    const IFTestCharacters *forbidden[IF_CHARGE_QUERY_MAX_FIELDS];
+    const IFTestCharacters *allowed[IF_CHARGE_QUERY_MAX_FIELDS];
+    IFTextFieldCharacters(table, forbidden, allowed);
+    NSUInteger textFields[IF_CHARGE_QUERY_MAX_FIELDS];
+    uint32_t textFieldCount = 0;
+    for (NSUInteger index = 0; index < table->count; index++) {
+        if (forbidden[index]) textFields[textFieldCount++] = index;
+    }
+
+    uint64_t seed = IFTestSeed();
+    NSUInteger cases = IFTestCaseCount(IF_TEST_CASES);
+    IFTestGenerator generator;
+    IFTestGeneratorInit(&generator, seed);
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    for (NSUInteger i = 0; i < cases; i++) {
+        IFTestRandomSeed(&generator.random, IFTestCaseSeed(seed, i));
+        NSUInteger index = textFields[IFTestRandomBelow(&generator.random, textFieldCount)];
+        NSUInteger maxLength = table->schema[index].maxLength;
+        NSUInteger limit = maxLength ? maxLength : 256;
+        NSUInteger length = IFTestRandomBelow(&generator.random, 4) ? IFTestRandomBelow(&generator.random, limit + 1)
+                                                                   : limit + 1 + IFTestRandomBelow(&generator.random, 8);
+        const unichar *characters = IFTestGeneratorFill(&generator, allowed[index], length);
+        if (IFTestRandomBelow(&generator.random, 2)) {
+            IFTestGeneratorScatter(&generator, forbidden[index], length, 1 + IFTestRandomBelow(&generator.random, 3));
+        }
+
+        IFChargeErrorCode expectedCode = kIFChargeErrorNone;
+        NSInteger expectedDetail = 0;
+        if (maxLength && length > maxLength) {
+            expectedCode = kIFChargeErrorArgumentTooLong;
+            expectedDetail = length - maxLength;
+        } else {
+            for (NSUInteger j = 0; j < length; j++) {
+                if (IFTestCharactersContains(forbidden[index], characters[j])) {
+                    expectedCode = kIFChargeErrorDisallowedCharacter;
+                    expectedDetail = j;
+                    break;
+                }
+            }
+        }
+
+        NSString *value = [[NSString alloc] initWithCharacters:characters length:length];
+        IFChargeError error = { kIFChargeErrorNone, -1, 0 };
+        BOOL accepted = [testRequest_ trySetField:index value:value error:&error];
+        BOOL passed = accepted ? (kIFChargeErrorNone == expectedCode && [value isEqualToString:*IFChargeFieldSlot(table, testRequest_, index)])
+                               : (expectedCode == error.code && expectedDetail == error.detail && (NSInteger)index == error.field);
+        if (!passed) {
+            STFail(@"Case %lu of seed %llu: setting %@ to '%@' gave error %d at %ld, expected %d at %ld (set IFCHARGE_TEST_SEED=%llu to repeat)",
+                   (unsigned long)i, seed, [[IFChargeRequest knownFields] objectAtIndex:index], value,
+                   (int)error.code, (long)error.detail, (int)expectedCode, (long)expectedDetail, seed);
+            [value release];
+            break;
+        }
+        [value release];
+
+        if (0 == (i & 1023)) {
+            [pool drain];
+            pool = [[NSAutoreleasePool alloc] init];
+        }
+    }
+    [pool drain];
+    IFTestGeneratorDestroy(&generator);
+}
+
+// Fills random requests with values their setters accept (BMP text,
+// emails, amounts and currencies), and checks that each one reads back
+// from its requestURL field for field.
+- (void)testRequestURLProperties {
+    const IFChargeFieldTable *table = [IFChargeRequest queryFieldTable];
+    const IFTestCharacters *forbidden[IF_CHARGE_QUERY_MAX_FIELDS];
+    const IFTestCharacters *allowed[IF_CHARGE_QUERY_MAX_FIELDS];
+    IFTextFieldCharacters(table, forbidden, allowed);
+    const IFTestCharacters *letters = IFTestCharactersInSet([NSCharacterSet characterSetWithCharactersInString:@"abcdefghijklmnopqrstuvwxyz0123456789"]);
+    NSString *currencies[] = { nil, @"USD", @"EUR", @"JPY", @"XTS" };
+    NSArray *fields = [IFChargeRequest knownFields];
+
+    uint64_t seed = IFTestSeed();
+    NSUInteger cases = IFTestCaseCount(IF_TEST_CASES);
+    IFTestGenerator generator;
+    IFTestGeneratorInit(&generator, seed);
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    for (NSUInteger i = 0; i < cases; i++) {
+        IFTestRandomSeed(&generator.random, IFTestCaseSeed(seed, i));
+        IFChargeRequest *request = [[[IFChargeRequest alloc] init] autorelease];
+        request.returnURL = @"com-innerfence-ChargeDemo://chargeResponse";
+        for (NSUInteger index = 0; index < table->count; index++) {
+            if (IFTestRandomBelow(&generator.random, 2)) continue;
+            NSString *value = nil;
+            switch (table->schema[index].kind) {
+                case kIFChargeFieldText: {
+                    int maxLength = table->schema[index].maxLength;
+                    value = IFTestGeneratorString(&generator, allowed[index], IFTestRandomBelow(&generator.random, (maxLength ? maxLength : 256) + 1));
+                    break;
+                }
+                case kIFChargeFieldEmail:
+                    value = [NSString stringWithFormat:@"%@@%@.com",
+                             IFTestGeneratorString(&generator, letters, 1 + IFTestRandomBelow(&generator.random, 12)),
+                             IFTestGeneratorString(&generator, letters, 1 + IFTestRandomBelow(&generator.random, 12))];
+                    break;
+                case kIFChargeFieldAmount:
+                    value = [NSString stringWithFormat:@"%u.%02u", IFTestRandomBelow(&generator.random, 100000), IFTestRandomBelow(&generator.random, 100)];
+                    break;
+                case kIFChargeFieldCurrency:
+                    value = currencies[IFTestRandomBelow(&generator.random, sizeof(currencies) / sizeof(currencies[0]))];
+                    break;
+                default:
+                    break;
+            }
+            if (value) [request trySetField:index value:value error:NULL];
+        }
+
+        IFChargeError error;
+        NSURL *url = [request requestURL];
+        IFChargeRequest *read = [[[IFChargeRequest alloc] tryInitWithURL:url error:&error] autorelease];
+        NSString *mismatch = read ? nil : @"the URL";
+        for (NSString *field in fields) {
+            if (mismatch) break;
+            NSString *sent = [request valueForKey:field];
+            NSString *received = [read valueForKey:field];
+            if (!(sent == received || [sent isEqualToString:received] || (0 == [sent length] && 0 == [received length]))) mismatch = field;
+        }
+        if (mismatch) {
+            STFail(@"Case %lu of seed %llu: %@ didn't read back from %@ (set IFCHARGE_TEST_SEED=%llu to repeat)",
+                   (unsigned long)i, seed, mismatch, url, seed);
+            break;
+        }
+
+        if (0 == (i & 255)) {
+            [pool drain];
+            pool = [[NSAutoreleasePool alloc] init];
+        }
+    }
+    [pool drain];
+    IFTestGeneratorDestroy(&generator);
+}
+
+- (void)testFieldSchema {
+    const IFChargeFieldTable *table = [IFChargeRequest queryFieldTable];
+    NSArray *fields = [IFChargeRequest knownFields];
+    STAssertEquals([fields count], table->count, @"knownFields should list the schema");
+    STAssertEquals(20, Zip_MAX_LENGTH, @"The length limits should come from the schema");
+
+    testRequest_.firstName = @"Ben";
+    NSString *stored = *IFChargeFieldSlot(table, testRequest_, [fields indexOfObject:@"firstName"]);
+    STAssertEqualObjects(@"Ben", stored, @"The setter should store into the schema's slot");
+
+    NSString *query = [[testRequest_ requestURL] query];
+    STAssertTrue(NSNotFound != [query rangeOfString:@"ifcc_firstName=Ben"].location, @"Set fields should be sent");
+    STAssertTrue(NSNotFound != [query rangeOfString:@"ifcc_currency=USD"].location, @"An unset currency should be sent as USD");
+    STAssertTrue(NSNotFound == [query rangeOfString:@"ifcc_amount="].location, @"An unset amount should not be sent");
+}
+
+- (void)testIncrementalRequestURL {
+    // Values with reserved and non-ASCII characters, and empty ones,
+    // which aren't sent at all.
+    NSArray *keys = [NSArray arrayWithObjects:@"firstName", @"invoiceNumber", @"description", @"city",
+                     @"amount", @"subtotal", @"tip", @"currency", nil];
+    NSArray *values = [NSArray arrayWithObjects:@"", @"Ben", @"Zo\u00eb", @"A&B=C", @"100 % pure", @"x/y?z#w",
+                       @"12.50", @"0.99", @"EUR", nil];
+    srandom(18);
+    NSURL *url = [testRequest_ requestURL];
+    for (int step = 0; step < 500; step++) {
+        int action = (int)(random() % 20);
+        if (0 == action) {
+            testRequest_.requestBaseURI = (random() % 2) ? @"com-innerfence-ccterminal-test://charge/1.0.0/" : nil;
+        } else if (1 == action) {
+            [testRequest_ reset];
+        } else {
+            NSString *key = [keys objectAtIndex:random() % [keys count]];
+            NSString *value = (random() % 4) ? [values objectAtIndex:random() % [values count]] : nil;
+            IFChargeError error;
+            [testRequest_ trySetField:[[IFChargeRequest knownFields] indexOfObject:key] value:value error:&error];
+        }
+
+        // A snapshot builds its URL from scratch.
+        url = [testRequest_ requestURL];
+        STAssertEqualObjects([url absoluteString], [[[testRequest_ freeze] requestURL] absoluteString],
+                             @"Step %d: the URL should be the same as one built from scratch", step);
+    }
+    STAssertEqualObjects(url, [testRequest_ requestURL], @"Nothing changed, so the URL should be the same");
+
+    testRequest_.invoiceNumber = @"1001";
+    NSString *before = [url absoluteString];
+    NSString *after = [[testRequest_ requestURL] absoluteString];
+    STAssertTrue(NSNotFound != [after rangeOfString:@"ifcc_invoiceNumber=1001"].location, @"The changed field should be sent");
+    STAssertEqualObjects(after, [[[testRequest_ freeze] requestURL] absoluteString], @"The URL should be the same as one built from scratch");
+    STAssertFalse([before isEqualToString:after], @"A changed field should change the URL");
+}
+
+
+- (void)testBatch {
+    testRequest_.returnAppName = @"Invoices";
+    testRequest_.returnURL = @"com-innerfence-ChargeDemo://chargeResponse";
+    testRequest_.currency = @"EUR";
+    testRequest_.description = @"Invoice payment";
+    NSString *csv = @"invoiceNumber,amount,firstName,email,record_id\r\n"
+                    @"1001,12.50,Ben,ben@example.com,r-1\r\n"
+                    @"1002,\"1,000.00\",Zo\u00eb,zoe@example.com,\"a&b=c\"\r\n"
+                    @"\r\n"
+                    @"1003,7,,,\n"
+                    @"1004,5.00,Jerry,nobody,r-4\n"
+                    @"1005,0.125,Ann,ann@example.com,r-5\n";
+    NSArray *header = nil;
+    NSUInteger rows = 0;
+    NSString **cells = IFChargeBatchCreateCSVCells([csv dataUsingEncoding:NSUTF8StringEncoding], &header, &rows);
+    STAssertTrue(NULL != cells, @"The CSV should be read");
+    STAssertEquals((NSUInteger)5, rows, @"The blank line should be skipped");
+    STAssertEqualObjects(@"1,000.00", cells[1 * 5 + 1], @"A quoted cell should keep its comma");
+
+    // Blank lines are skipped before the header, and with one column.
+    NSArray *singleHeader = nil;
+    NSUInteger singleRows = 0;
+    NSString **single = IFChargeBatchCreateCSVCells([@"\r\n\ninvoiceNumber\n1001\n\n\"\"\n1002\n" dataUsingEncoding:NSUTF8StringEncoding],
+                                                    &singleHeader, &singleRows);
+    STAssertEqualObjects([NSArray arrayWithObject:@"invoiceNumber"], singleHeader, @"Blank lines before the header should be skipped");
+    STAssertEquals((NSUInteger)3, singleRows, @"A blank line in a one-column table should be skipped");
+    STAssertEqualObjects(@"", single[1], @"A quoted empty cell should be a row");
+    IFChargeBatchCellsRelease(single, singleRows);
+
+    IFChargeError error;
+    IFChargeBatch *batch = IFChargeBatchCreate(testRequest_, header, &error);
+    STAssertTrue(NULL != batch, @"The batch should be created");
+    IFChargeBatchResult results[5], oneThread[5];
+    IFChargeBatchCreateURLs(batch, cells, rows, results, 0);
+    IFChargeBatchCreateURLs(batch, cells, rows, oneThread, 1);
+
+    // Each URL is the one a request set up the slow way would submit,
+    // with a nonce of its own that keeps the row's extra params.
+    for (NSUInteger row = 0; row < rows; row++) {
+        IFChargeRequest *request = [[testRequest_ copy] autorelease];
+        NSMutableDictionary *extras = [NSMutableDictionary dictionary];
+        BOOL valid = YES;
+        for (NSUInteger column = 0; column < [header count]; column++) {
+            NSString *name = [header objectAtIndex:column];
+            NSString *value = cells[row * [header count] + column];
+            NSUInteger field = [[IFChargeRequest knownFields] indexOfObject:name];
+            if (![value length]) continue;
+            if (NSNotFound == field) [extras setObject:value forKey:name];
+            else valid = valid && [request trySetField:field value:value error:NULL];
+        }
+        [request setReturnURL:testRequest_.returnURL withExtraParams:extras];
+        if (!valid) {
+            STAssertNil(results[row].url, @"Row %u should be rejected", (unsigned)row);
+            STAssertNil(oneThread[row].url, @"Row %u should be rejected", (unsigned)row);
+            continue;
+        }
+
+        NSString *nonces[2];
+        NSString *urls[2] = { results[row].url, oneThread[row].url };
+        for (int run = 0; run < 2; run++) {
+            NSRange key = [urls[run] rangeOfString:@"ifcc_request_nonce%3D"];
+            STAssertTrue(NSNotFound != key.location, @"Row %u should have a nonce", (unsigned)row);
+            nonces[run] = [urls[run] substringWithRange:NSMakeRange(NSMaxRange(key), IF_CHARGE_NONCE_LENGTH)];
+
+            NSDictionary *stored = nil;
+            STAssertEquals(kIFChargeErrorNone, IFChargeNonceConsume(IFChargeNonceStoreShared(), nonces[run], &stored),
+                           @"Row %u's nonce should be outstanding", (unsigned)row);
+            STAssertEqualObjects(extras, stored ? stored : [NSDictionary dictionary],
+                                 @"Row %u's extra params should be kept with its nonce", (unsigned)row);
+        }
+        STAssertFalse([nonces[0] isEqualToString:nonces[1]], @"Row %u should get a new nonce each time", (unsigned)row);
+
+        NSString *returnURL = request.returnURL;
+        request.returnURL = [returnURL stringByAppendingFormat:@"%@ifcc_request_nonce=%@",
+                             (NSNotFound == [returnURL rangeOfString:@"?"].location) ? @"?" : @"&", nonces[0]];
+        STAssertEqualObjects([[request requestURL] absoluteString], results[row].url,
+                             @"Row %u should make the request's URL", (unsigned)row);
+    }
+    STAssertEquals(kIFChargeErrorInvalidEmail, results[3].error.code, @"A bad email should reject its row");
+    STAssertEqualObjects(@"email", [[IFChargeRequest knownFields] objectAtIndex:results[3].error.field], @"The field should be reported");
+    STAssertEquals(kIFChargeErrorInvalidAmount, results[4].error.code, @"An amount with too many decimal places should reject its row");
+    STAssertEquals(kIFChargeErrorNone, results[0].error.code, @"A good row should have no error");
+
+    IFChargeBatchResultsRelease(results, rows);
+    IFChargeBatchResultsRelease(oneThread, rows);
+    IFChargeBatchCellsRelease(cells, rows * [header count]);
+    IFChargeBatchFree(batch);
+
+    // Extra params need a returnURL to go on.
+    IFChargeRequest *bare = [[[IFChargeRequest alloc] init] autorelease];
+    STAssertTrue(NULL == IFChargeBatchCreate(bare, [NSArray arrayWithObjects:@"amount", @"record_id", nil], &error),
+                 @"Extra params without a returnURL should be rejected");
+    STAssertEquals(kIFChargeErrorNilURL, error.code, @"The missing returnURL should be reported");
+
+    // A column name that isn't a string is reported by its index.
+    NSArray *badColumns = [NSArray arrayWithObjects:@"amount", [NSNumber numberWithInt:7], @"record_id", nil];
+    STAssertTrue(NULL == IFChargeBatchCreate(testRequest_, badColumns, &error), @"A non-string column name should be rejected");
+    STAssertEquals(kIFChargeErrorInvalidColumnName, error.code, @"The bad column name should be reported");
+    STAssertEquals((NSInteger)-1, error.field, @"No field is at fault");
+    STAssertEquals((NSInteger)1, error.detail, @"The column should be reported");
+
+    STAssertTrue(NULL == IFChargeBatchCreateCSVCells([@"a,b\n\"1,2\n" dataUsingEncoding:NSUTF8StringEncoding], &header, &rows),
+                 @"An unclosed quote should be rejected");
+}
+
+- (void)testBatchSimulator {
+    testRequest_.returnURL = @"com-innerfence-ChargeDemo://chargeResponse";
+    testRequest_.currency = @"USD";
+    NSArray *header = [NSArray arrayWithObjects:@"amount", @"record_id", nil];
+    NSString *cells[] = { @"12.34", @"r-1", @"5.00", @"" };
+    IFChargeError error;
+    IFChargeBatch *batch = IFChargeBatchCreate(testRequest_, header, &error);
+    IFChargeBatchResult results[2];
+    IFChargeBatchCreateURLs(batch, cells, 2, results, 0);
+
+    // The terminal answers each row's link, and the response comes back
+    // through the same checks as one to a submitted request.
+    IFChargeSimulatorConfig config = { { 1, 0, 0, 0 }, nil, 20 };
+    IFChargeSimulator *simulator = IFChargeSimulatorCreate(&config);
+    for (int row = 0; row < 2; row++) {
+        IFChargeResponseCode code;
+        NSURL *responseURL = IFChargeSimulatorHandleRequestURL(simulator, [NSURL URLWithString:results[row].url], &code, &error);
+        STAssertNotNil(responseURL, @"The terminal should answer row %d", row);
+
+        IFChargeResponse *response = [[[IFChargeResponse alloc] tryInitWithURL:responseURL error:&error] autorelease];
+        STAssertNotNil(response, @"The response to row %d should be accepted", row);
+        STAssertEquals(code, response.responseCode, @"The drawn code should come back");
+        STAssertEqualObjects(cells[row * 2], response.amount, @"Row %d's amount should come back", row);
+        STAssertEqualObjects(row ? nil : @"r-1", [response.extraParams objectForKey:@"record_id"],
+                             @"Row %d's extra params should come back", row);
+
+        STAssertNil([[[IFChargeResponse alloc] tryInitWithURL:responseURL error:&error] autorelease],
+                    @"A replayed response to row %d should be refused", row);
+        STAssertEquals(kIFChargeErrorNoOutstandingRequest, error.code, @"The spent nonce should be reported");
+    }
+    IFChargeSimulatorFree(simulator);
+
+    IFChargeBatchResultsRelease(results, 2);
+    IFChargeBatchFree(batch);
+}
+
+- (void)testNonceStore {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeNonceTests.log"];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    IFChargeNonceStore *store = IFChargeNonceStoreOpen(path, 60);
+
+    STAssertEquals(kIFChargeErrorNoOutstandingRequest, IFChargeNonceConsume(store, @"x", NULL), @"An empty store has nothing outstanding");
+
+    // Thousands outstanding at once, some with params kept alongside.
+    NSMutableArray *nonces = [NSMutableArray array];
+    NSDictionary *params = [NSDictionary dictionaryWithObjectsAndKeys:@"42", @"record_id", @"caf\u00e9", @"note", nil];
+    for (int i = 0; i < 3000; i++) {
+        NSString *nonce = [IFChargeNonceCreate(store, (0 == i % 3) ? params : nil) autorelease];
+        STAssertEquals((NSUInteger)IF_CHARGE_NONCE_LENGTH, [nonce length], @"Nonces should be %d characters", IF_CHARGE_NONCE_LENGTH);
+        [nonces addObject:nonce];
+    }
+    STAssertEquals((NSUInteger)3000, [[NSSet setWithArray:nonces] count], @"Nonces should be unique");
+    STAssertEquals((NSUInteger)3000, IFChargeNonceStoreCount(store), @"Every nonce should be outstanding");
+
+    NSDictionary *consumed = nil;
+    for (int i = 0; i < 3000; i += 2) {
+        STAssertEquals(kIFChargeErrorNone, IFChargeNonceConsume(store, [nonces objectAtIndex:i], &consumed), @"Outstanding nonces should be accepted");
+        STAssertEqualObjects((0 == i % 3) ? params : nil, consumed, @"Stored params should come back with the nonce");
+    }
+    STAssertEquals(kIFChargeErrorIncorrectNonce, IFChargeNonceConsume(store, [nonces objectAtIndex:0], NULL), @"A nonce can only be used once");
+    STAssertEquals(kIFChargeErrorMissingNonce, IFChargeNonceConsume(store, nil, NULL), @"A missing nonce should be reported");
+    STAssertEquals(kIFChargeErrorIncorrectNonce, IFChargeNonceConsume(store, @"abc", NULL), @"A malformed nonce should be rejected");
+
+    // Reopening replays the log.
+    IFChargeNonceStoreClose(store);
+    store = IFChargeNonceStoreOpen(path, 60);
+    STAssertEquals((NSUInteger)1500, IFChargeNonceStoreCount(store), @"Outstanding nonces should persist");
+    STAssertEquals(kIFChargeErrorIncorrectNonce, IFChargeNonceConsume(store, [nonces objectAtIndex:2], NULL), @"Consumed nonces should persist");
+    STAssertEquals(kIFChargeErrorNone, IFChargeNonceConsume(store, [nonces objectAtIndex:3], &consumed), @"Outstanding nonces should persist");
+    STAssertEqualObjects(params, consumed, @"Stored params should persist");
+
+    // Churn compacts the log rather than growing it without bound.
+    unsigned long long size = [[[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL] fileSize];
+    for (int i = 0; i < 50000; i++) {
+        IFChargeNonceConsume(store, [IFChargeNonceCreate(store, params) autorelease], NULL);
+    }
+    unsigned long long churned = [[[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL] fileSize];
+    STAssertTrue(churned <= 2 * size, @"The log should be compacted, not grown from %llu to %llu bytes", size, churned);
+    STAssertEquals((NSUInteger)1499, IFChargeNonceStoreCount(store), @"Compaction should keep outstanding nonces");
+
+    IFChargeNonceStoreRemoveAll(store);
+    STAssertEquals((NSUInteger)0, IFChargeNonceStoreCount(store), @"RemoveAll should forget every nonce");
+    IFChargeNonceStoreClose(store);
+
+    // A TTL of 0 expires nonces as soon as they're issued.
+    store = IFChargeNonceStoreOpen(nil, 0);
+    STAssertEquals(kIFChargeErrorExpiredNonce, IFChargeNonceConsume(store, [IFChargeNonceCreate(store, nil) autorelease], NULL),
+                   @"An expired nonce should be reported");
+    STAssertEquals((NSUInteger)0, IFChargeNonceStoreCount(store), @"An expired nonce should be consumed");
+    IFChargeNonceStoreClose(store);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testStoredExtraParams {
+    NSDictionary *extras = [NSDictionary dictionaryWithObjectsAndKeys:@"42", @"record_id", nil];
+    IFChargeError error;
+
+    STAssertTrue([testRequest_ trySetReturnURL:@"com-innerfence-ChargeDemo://chargeResponse" withStoredExtraParams:extras error:&error],
+                 @"String params should be accepted");
+    STAssertEqualObjects(@"com-innerfence-ChargeDemo://chargeResponse", testRequest_.returnURL, @"Stored params should stay off the URL");
+
+    // A copy issues its nonces with the same params.
+    IFChargeRequest *copy = [[testRequest_ copy] autorelease];
+    [copy submitURL];
+    NSString *query = [[NSURL URLWithString:copy.returnURL] query];
+    NSString *prefix = [IF_CHARGE_NONCE_KEY stringByAppendingString:@"="];
+    STAssertTrue([query hasPrefix:prefix], @"The copy should add a nonce to its returnURL");
+    NSDictionary *stored = nil;
+    STAssertEquals(kIFChargeErrorNone, IFChargeNonceConsume(IFChargeNonceStoreShared(), [query substringFromIndex:[prefix length]], &stored),
+                   @"The copy's nonce should be outstanding");
+    STAssertEqualObjects(@"42", [stored objectForKey:@"record_id"], @"The copy's nonce should keep the stored params");
+
+    extras = [NSDictionary dictionaryWithObject:[NSNumber numberWithInt:1] forKey:@"a"];
+    STAssertFalse([testRequest_ trySetReturnURL:@"app://x" withStoredExtraParams:extras error:&error], @"Non-string params should be rejected");
+    STAssertEquals(kIFChargeErrorNonStringExtraParam, error.code, @"The bad param should be reported");
+}
+
+- (void)testSubmitWithoutNonce {
+    IFChargeRequest *request = [[[IFNoNonceRequest alloc] init] autorelease];
+    request.amount = @"5.00";
+    request.returnURL = @"com-innerfence-ChargeDemo://chargeResponse?record_id=7";
+    STAssertThrowsSpecificNamed([request submitURL], NSException, NSInternalInconsistencyException,
+                                @"A request should not be sent when no nonce can be issued");
+    STAssertEqualObjects(@"com-innerfence-ChargeDemo://chargeResponse?record_id=7", request.returnURL,
+                         @"The returnURL should be left as it was");
+
+    request.returnURL = nil;
+    STAssertNoThrow([request submitURL], @"A request with no returnURL needs no nonce");
+}
+
+- (void)testWireFormat {
+    testRequest_.firstName = @"Zo\u00eb";
+    testRequest_.description = @"Caf\u00e9 order";
+    testRequest_.email = @"zoe@example.com";
+    testRequest_.phone = @"555-1234";
+    testRequest_.subtotal = @"19.99";
+    testRequest_.tip = @"5";
+    testRequest_.discount = @"-2.50";
+    testRequest_.currency = @"EUR";
+    [testRequest_ setReturnURL:@"com-innerfence-ChargeDemo://chargeResponse" withExtraParams:
+     [NSDictionary dictionaryWithObject:@"42" forKey:@"record_id"]];
+    [testRequest_ requestURL];
+
+    NSData *data = [testRequest_ wireData];
+    STAssertEquals((NSUInteger)IFChargeWireMessageLength([data bytes], [data length]), [data length],
+                   @"The message should be as long as its header says");
+
+    IFChargeError error;
+    IFChargeRequest *request = [[[IFChargeRequest alloc] tryInitWithWireData:data error:&error] autorelease];
+    STAssertNotNil(request, @"A request should decode (%@)", IFChargeErrorReason(&error, [IFChargeRequest class], nil));
+    for (NSString *field in [IFChargeRequest knownFields]) {
+        STAssertEqualObjects([testRequest_ valueForKey:field], [request valueForKey:field], @"%@ should round-trip", field);
+    }
+    STAssertEqualObjects(@"5", request.tip, @"An amount that isn't in the two-decimal form should be kept as it was");
+    STAssertEqualObjects(testRequest_.amount, request.amount, @"The amount should be worked out the same way");
+    STAssertEqualObjects(testRequest_.baseURL, request.baseURL, @"The base URL should round-trip");
+    STAssertEqualObjects([testRequest_ requestURL], [request requestURL], @"The decoded request should send the same URL");
+
+    STAssertNil([[IFChargeResponse alloc] tryInitWithWireData:data error:&error], @"A request should not decode as a response");
+    STAssertEquals(kIFChargeErrorMalformedWireData, error.code, @"The wrong kind of message should be reported");
+}
+
 @end
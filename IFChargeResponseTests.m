@@ -7,8 +7,31 @@
 //
 
 #import "IFChargeResponseTests.h"
+#import "IFChargeCard.h"
+#import "IFChargeFieldArena.h"
+#import "IFChargeIntern.h"
+#import "IFChargeJournal.h"
+#import "IFChargeNonce.h"
+#import "IFChargePattern.h"
+#import "IFChargeResponseHandler.h"
+#import "IFChargeSimulator.h"
+#import "IFChargeStats.h"
+#import "IFChargeWire.h"
 
 
+// The textbook Luhn check, one digit at a time.
+static BOOL IFReferenceLuhn(const char *digits, size_t length) {
+    if (0 == length) return NO;
+    unsigned sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        int digit = digits[length - 1 - i] - '0';
+        if (digit < 0 || digit > 9) return NO;
+        if (i & 1) digit = (2 * digit > 9) ? 2 * digit - 9 : 2 * digit;
+        sum += digit;
+    }
+    return 0 == sum % 10;
+}
+
 @implementation IFChargeResponseTests
 
 - (void)testChargeRequestInit {
@@ -94,4 +117,560 @@
     // NOTE: We test currency property defaults in IFChargeMessageTests
 }
 
+- (void)testBatchVerification {
+    NSString *base = @"com.yourapp.someco://somePath?ifcc_request_nonce=abc&";
+    NSArray *queries = [NSArray arrayWithObjects:
+                        @"ifcc_responseType=approved&ifcc_amount=5.00&ifcc_redactedCardNumber=XXXX1111",
+                        @"ifcc_responseType=approved&ifcc_cardType=%C3%28",
+                        @"ifcc_responseType=approved&ifcc_amount=5&ifcc_redactedCardNumber=XXXX1111",
+                        @"ifcc_responseType=refunded",
+                        @"ifcc_responseType=approved&ifcc_redactedCardNumber=XXXX1111",
+                        @"ifcc_responseType=approved&ifcc_subtotal=5.00",
+                        @"ifcc_responseType=declined&ifcc_cardType=Visa",
+                        @"ifcc_responseType=cancelled",
+                        nil];
+    IFChargeErrorCode expected[] = {
+        kIFChargeErrorNone,
+        kIFChargeErrorMalformedQuery,
+        kIFChargeErrorInvalidField,
+        kIFChargeErrorUnknownResponseType,
+        kIFChargeErrorMissingAmount,
+        kIFChargeErrorMissingRedactedCardNumber,
+        kIFChargeErrorUnexpectedTransactionInfo,
+        kIFChargeErrorNone,
+    };
+
+    NSMutableArray *urls = [NSMutableArray array];
+    for (NSString *query in queries) {
+        [urls addObject:[NSURL URLWithString:[base stringByAppendingString:query]]];
+    }
+
+    IFChargeVerifyResult results[8];
+    [IFChargeResponse verifyURLs:urls results:results];
+
+    for (NSUInteger i = 0; i < [queries count]; i++) {
+        STAssertEquals(expected[i], results[i].error.code, @"'%@' should verify as %d but was %d (%@)",
+                       [queries objectAtIndex:i], expected[i], results[i].error.code, IFChargeVerifyResultReason(&results[i]));
+    }
+
+    STAssertEqualObjects(@"amount", [[IFChargeResponse knownFields] objectAtIndex:results[2].error.field],
+                         @"The invalid amount should be reported");
+    STAssertEquals(kIFChargeResponseCodeApproved, results[0].response.responseCode, @"The approved response should be parsed");
+    STAssertEqualObjects(@"abc", results[0].response.nonce, @"The nonce should be parsed but not checked");
+    STAssertTrue(results[0].response.frozen, @"Verified responses should be frozen");
+    STAssertEquals(kIFChargeResponseCodeCancelled, results[7].response.responseCode, @"The cancelled response should be parsed");
+
+    IFChargeVerifyResultsRelease(results, [queries count]);
+
+    IFChargeVerifyResult result;
+    for (NSUInteger i = 0; i < [queries count]; i++) {
+        [IFChargeResponse verifyURL:[urls objectAtIndex:i] result:&result];
+        STAssertEquals(expected[i], result.error.code, @"verifyURL:result: should agree with verifyURLs:results: on '%@'",
+                       [queries objectAtIndex:i]);
+        IFChargeVerifyResultsRelease(&result, 1);
+    }
+    [IFChargeResponse verifyURL:nil result:&result];
+    STAssertEquals(kIFChargeErrorNilURL, result.error.code, @"A nil URL should be reported");
+    STAssertNil(result.response, @"A nil URL should have no response");
+}
+
+- (void)testTryInitWithURL {
+    NSString *base = @"com.yourapp.someco://somePath?";
+    NSString *approved = @"ifcc_request_nonce=abc&ifcc_responseType=approved&ifcc_amount=5.00&ifcc_redactedCardNumber=XXXX1111";
+    IFChargeNonceStore *store = IFChargeNonceStoreShared();
+    IFChargeError error;
+
+    IFChargeNonceStoreRemoveAll(store);
+    NSURL *url = [NSURL URLWithString:[base stringByAppendingString:approved]];
+    STAssertNil([[IFChargeResponse alloc] tryInitWithURL:url error:&error], @"A response with no outstanding request should be rejected");
+    STAssertEquals(kIFChargeErrorNoOutstandingRequest, error.code, @"The missing request should be reported");
+    STAssertThrowsSpecificNamed([[IFChargeResponse alloc] initWithURL:url], NSException, NSInvalidArgumentException,
+                                @"initWithURL: should raise what tryInitWithURL:error: reports");
+
+    NSString *nonce = [IFChargeNonceCreate(store, nil) autorelease];
+    STAssertNil([[IFChargeResponse alloc] tryInitWithURL:url error:&error], @"A replayed response should be rejected");
+    STAssertEquals(kIFChargeErrorIncorrectNonce, error.code, @"The wrong nonce should be reported");
+    STAssertEquals((NSUInteger)1, IFChargeNonceStoreCount(store), @"A rejected nonce should stay outstanding");
+
+    url = [NSURL URLWithString:[base stringByAppendingFormat:@"ifcc_request_nonce=%@&ifcc_responseType=approved&ifcc_amount=5", nonce]];
+    STAssertNil([[IFChargeResponse alloc] tryInitWithURL:url error:&error], @"A malformed amount should be rejected");
+    STAssertEquals(kIFChargeErrorInvalidEmail, error.code, @"The bad field should be reported");
+    STAssertEqualObjects(@"amount", [[IFChargeResponse knownFields] objectAtIndex:error.field], @"The amount should be blamed");
+    STAssertEqualObjects(@"Bad URL Request: field 'amount' is not valid", IFChargeErrorReason(&error, [IFChargeResponse class], nil),
+                         @"The reason should be the one initWithURL: raises");
+
+    // The nonce was used up above; issue one with params kept on the device.
+    nonce = [IFChargeNonceCreate(store, [NSDictionary dictionaryWithObject:@"42" forKey:@"record_id"]) autorelease];
+    url = [NSURL URLWithString:[base stringByAppendingFormat:@"ifcc_request_nonce=%@&ifcc_responseType=approved&ifcc_amount=5.00"
+                                @"&ifcc_redactedCardNumber=XXXX1111&record_id=forged&page=2", nonce]];
+    IFChargeResponse *response = [[[IFChargeResponse alloc] tryInitWithURL:url error:&error] autorelease];
+    STAssertNotNil(response, @"A valid response should be accepted (%@)", IFChargeErrorReason(&error, [IFChargeResponse class], nil));
+    STAssertEqualObjects(@"5.00", response.amount, @"The amount should be parsed");
+    STAssertEqualObjects(@"42", [response.extraParams objectForKey:@"record_id"], @"Stored params should win over the URL's");
+    STAssertEqualObjects(@"2", [response.extraParams objectForKey:@"page"], @"The URL's other params should be kept");
+    STAssertEquals((NSUInteger)0, IFChargeNonceStoreCount(store), @"An accepted nonce should be used up");
+}
+
+- (void)testJournal {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeJournalTests.log"];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    IFChargeJournal *journal = IFChargeJournalOpen(path);
+
+    NSString *base = @"com.yourapp.someco://chargeResponse?";
+    NSArray *queries = [NSArray arrayWithObjects:
+                        @"ifcc_request_nonce=aaaaaaaaaaaaaaaaaaaaaaaaaaa&ifcc_responseType=declined&record_id=7",
+                        @"ifcc_request_nonce=bbbbbbbbbbbbbbbbbbbbbbbbbbb&ifcc_responseType=approved&ifcc_amount=12.34"
+                        @"&ifcc_currency=USD&ifcc_redactedCardNumber=XXXXXXXXXXXX1111&ifcc_cardType=Visa&record_id=7",
+                        @"ifcc_request_nonce=ccccccccccccccccccccccccccc&ifcc_responseType=approved&ifcc_amount=500.00"
+                        @"&ifcc_currency=JPY&ifcc_redactedCardNumber=XXXX4242&record_id=8",
+                        nil];
+    for (NSString *query in queries) {
+        IFChargeVerifyResult result;
+        [IFChargeResponse verifyURL:[NSURL URLWithString:[base stringByAppendingString:query]] result:&result];
+        STAssertTrue(0 != IFChargeJournalAppendResponse(journal, result.response), @"'%@' should be journaled", query);
+        IFChargeVerifyResultsRelease(&result, 1);
+    }
+    STAssertTrue(IFChargeJournalSync(journal, IFChargeJournalCount(journal)), @"The journal should sync");
+    IFChargeJournalClose(journal);
+
+    // Reopening replays the log and rebuilds the indexes.
+    journal = IFChargeJournalOpen(path);
+    STAssertEquals((uint64_t)3, IFChargeJournalCount(journal), @"Every entry should persist");
+
+    IFChargeJournalEntry entry;
+    STAssertTrue(IFChargeJournalFindRecordId(journal, @"7", &entry), @"Entries should be found by record id");
+    STAssertEquals((int32_t)kIFChargeResponseCodeApproved, entry.responseCode, @"The latest entry for a record id should win");
+    STAssertEquals((int64_t)1234, entry.amount, @"Amounts should be kept in minor units");
+    STAssertEquals(0, strcmp("XXXXXXXXXXXX1111", entry.redactedCardNumber), @"The card number should be kept");
+    STAssertEquals(0, strcmp("Visa", entry.cardType), @"The card type should be kept");
+
+    IFChargeJournalEntry history[4];
+    STAssertEquals((NSUInteger)2, IFChargeJournalHistory(journal, @"7", history, 4), @"Both tries should be in the history");
+    STAssertEquals((int32_t)kIFChargeResponseCodeDeclined, history[1].responseCode, @"The history should be newest first");
+
+    STAssertTrue(IFChargeJournalFindNonce(journal, @"ccccccccccccccccccccccccccc", &entry), @"Entries should be found by nonce");
+    STAssertEquals((int64_t)500, entry.amount, @"Yen have no minor unit");
+    STAssertEquals(0, strcmp("JPY", entry.currency), @"The currency should be kept");
+    STAssertFalse(IFChargeJournalFindNonce(journal, @"ddddddddddddddddddddddddddd", &entry), @"Unknown nonces should not be found");
+    STAssertFalse(IFChargeJournalFindRecordId(journal, @"9", &entry), @"Unknown record ids should not be found");
+    IFChargeJournalClose(journal);
+
+    // A record torn by a crash is dropped. Records are a 16-byte header
+    // and an entry, after a 16-byte file header; this overwrites the
+    // third one's timestamp.
+    NSFileHandle *file = [NSFileHandle fileHandleForUpdatingAtPath:path];
+    [file seekToFileOffset:16 + 2 * (16 + sizeof(IFChargeJournalEntry)) + 16 + 16];
+    [file writeData:[@"X" dataUsingEncoding:NSASCIIStringEncoding]];
+    [file closeFile];
+    journal = IFChargeJournalOpen(path);
+    STAssertEquals((uint64_t)2, IFChargeJournalCount(journal), @"The torn record should be dropped");
+    STAssertFalse(IFChargeJournalFindRecordId(journal, @"8", &entry), @"The torn record should not be indexed");
+    IFChargeJournalClose(journal);
+
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+- (void)testWireFormat {
+    NSURL *url = [NSURL URLWithString:@"com.yourapp.someco://chargeResponse?ifcc_request_nonce=abc&record_id=7"
+                  @"&ifcc_responseType=approved&ifcc_amount=73.00&ifcc_subtotal=70.00&ifcc_tax=3.00&ifcc_currency=USD"
+                  @"&ifcc_redactedCardNumber=XXXXXXXXXXXX1111&ifcc_cardType=American%20Express"];
+    IFChargeVerifyResult result;
+    [IFChargeResponse verifyURL:url result:&result];
+    IFChargeResponse *original = result.response;
+    NSData *data = [original wireData];
+    STAssertTrue([data length] < [[url absoluteString] length] / 2, @"The wire form should be much smaller than the URL");
+
+    // Fields can be read in place, without decoding the message.
+    IFChargeWireReader reader;
+    IFChargeWireField field;
+    IFChargeMoney amount = 0;
+    IFChargeResponseCode code = kIFChargeResponseCodeError;
+    STAssertTrue(IFChargeWireReaderInit(&reader, [data bytes], [data length]), @"The header should be valid");
+    STAssertEquals(kIFChargeWireResponse, reader.kind, @"The message should be a response");
+    while (IFChargeWireReaderNext(&reader, &field)) {
+        if (1 == field.tag) STAssertTrue(IFChargeWireFieldAmount(&field, &amount), @"The amount should decode");
+        if (IF_CHARGE_WIRE_TAG_RESPONSE_TYPE == field.tag) STAssertTrue(IFChargeWireFieldResponseCode(&field, &code), @"The code should decode");
+    }
+    STAssertFalse(reader.malformed, @"The body should be well formed");
+    STAssertEquals((IFChargeMoney)73 * IF_CHARGE_MONEY_ONE, amount, @"The amount should be read in place");
+    STAssertEquals(kIFChargeResponseCodeApproved, code, @"The response code should be read in place");
+
+    IFChargeError error;
+    IFChargeResponse *response = [[[IFChargeResponse alloc] tryInitWithWireData:data error:&error] autorelease];
+    STAssertNotNil(response, @"A response should decode (%@)", IFChargeErrorReason(&error, [IFChargeResponse class], nil));
+    for (NSString *name in [IFChargeResponse knownFields]) {
+        STAssertEqualObjects([original valueForKey:name], [response valueForKey:name], @"%@ should round-trip", name);
+    }
+    STAssertEquals(kIFChargeResponseCodeApproved, response.responseCode, @"The response code should be set");
+    STAssertEqualObjects(@"abc", response.nonce, @"The nonce should round-trip");
+    STAssertEqualObjects(@"7", [response.extraParams objectForKey:@"record_id"], @"Extra params should round-trip");
+    STAssertEqualObjects([original requestURL], [response requestURL], @"The decoded response should send the same URL");
+    IFChargeVerifyResultsRelease(&result, 1);
+
+    // Every truncation is rejected, and nothing is read past the end.
+    for (NSUInteger length = 0; length < [data length]; length++) {
+        NSData *truncated = [NSData dataWithBytes:[data bytes] length:length];
+        STAssertNil([[IFChargeResponse alloc] tryInitWithWireData:truncated error:&error], @"%u bytes should be rejected", (unsigned)length);
+        STAssertEquals(kIFChargeErrorMalformedWireData, error.code, @"The truncation should be reported");
+    }
+
+    // Fields from a later version are skipped; bad fields are rejected.
+    const uint8_t unknown[] = { 'I', 'F', 'W', 1, 2, 6, 50, 1, 'x', 0x80 | 24, 1, 1 };
+    response = [[[IFChargeResponse alloc] tryInitWithWireData:[NSData dataWithBytes:unknown length:sizeof(unknown)] error:&error] autorelease];
+    STAssertNotNil(response, @"Unknown tags should be skipped");
+    STAssertEquals(kIFChargeResponseCodeCancelled, response.responseCode, @"Known fields should still be read");
+
+    const uint8_t notUTF8[] = { 'I', 'F', 'W', 1, 2, 4, 22, 2, 0xc3, 0x28 };
+    STAssertNil([[IFChargeResponse alloc] tryInitWithWireData:[NSData dataWithBytes:notUTF8 length:sizeof(notUTF8)] error:&error],
+                @"A field that isn't UTF-8 should be rejected");
+    STAssertEquals(kIFChargeErrorMalformedWireData, error.code, @"The bad field should be reported");
+    STAssertThrows([[IFChargeResponse alloc] initWithWireData:[NSData dataWithBytes:notUTF8 length:sizeof(notUTF8)]],
+                   @"initWithWireData: should raise what tryInitWithWireData:error: reports");
+
+    const uint8_t declinedWithCard[] = { 'I', 'F', 'W', 1, 2, 9, 0x80 | 24, 1, 2, 22, 4, 'V', 'i', 's', 'a' };
+    STAssertNil([[IFChargeResponse alloc] tryInitWithWireData:[NSData dataWithBytes:declinedWithCard length:sizeof(declinedWithCard)] error:&error],
+                @"The approved/failure rules should be checked");
+    STAssertEquals(kIFChargeErrorUnexpectedTransactionInfo, error.code, @"The broken rule should be reported");
+}
+
+- (void)testFieldArena {
+    NSURL *url = [NSURL URLWithString:@"com.yourapp.someco://chargeResponse?ifcc_request_nonce=abc&record_id=7"
+                  @"&ifcc_responseType=approved&ifcc_amount=73.00&ifcc_currency=USD"
+                  @"&ifcc_redactedCardNumber=XXXXXXXXXXXX1111&ifcc_cardType=Caf%C3%A9%20Card"];
+    IFChargeResponse *response = [[[IFChargeResponse alloc] init] autorelease];
+    IFChargeError error;
+    STAssertTrue([response tryReadURL:url error:&error], @"The URL should be read (%@)", IFChargeErrorReason(&error, [IFChargeResponse class], nil));
+
+    // ASCII values share the arena; others are ordinary strings.
+    STAssertTrue(IFChargeFieldArenaContains(response.amount), @"An ASCII value should live in the arena");
+    STAssertFalse(IFChargeFieldArenaContains(response.cardType), @"A non-ASCII value should not");
+    STAssertEqualObjects(@"Caf\u00e9 Card", response.cardType, @"A non-ASCII value should still decode");
+    STAssertEqualObjects(@"7", [response.extraParams objectForKey:@"record_id"], @"Arena keys should look up like any other");
+    STAssertEqualObjects(@"73.00", [[response.amount mutableCopy] autorelease], @"An arena string should copy like any other");
+    STAssertEquals(kIFChargeResponseCodeApproved, response.responseCode, @"The response should be checked");
+
+    // A value decoded from %00 is an ordinary string: an arena string's
+    // -UTF8String is its bytes, which would end at the NUL.
+    NSURL *nulURL = [NSURL URLWithString:@"com.yourapp.someco://chargeResponse?ifcc_responseType=cancelled&record_id=a%00b&note=ok"];
+    IFChargeResponse *nulResponse = [[[IFChargeResponse alloc] init] autorelease];
+    STAssertTrue([nulResponse tryReadURL:nulURL error:&error], @"The URL should be read");
+    NSString *nul = [nulResponse.extraParams objectForKey:@"record_id"];
+    STAssertEquals((NSUInteger)3, [nul length], @"The NUL should be kept");
+    STAssertEquals((unichar)0, [nul characterAtIndex:1], @"The NUL should be kept");
+    STAssertFalse(IFChargeFieldArenaContains(nul), @"A value with a NUL should not live in the arena");
+    STAssertTrue(IFChargeFieldArenaContains([nulResponse.extraParams objectForKey:@"note"]), @"The other values should");
+
+    // A value outlives the message it came from.
+    NSString *amount = [response.amount retain];
+    NSString *copy = [amount copy];
+    STAssertTrue(copy == amount, @"Copying an arena string should share it");
+    STAssertTrue([response tryReadURL:[NSURL URLWithString:@"app://host?ifcc_responseType=cancelled"] error:&error], @"The message should be reusable");
+    STAssertEqualObjects(@"73.00", amount, @"A retained value should survive the next read");
+    [copy release];
+    [amount release];
+    STAssertNil(response.amount, @"The previous read's fields should be cleared");
+    STAssertNil(response.nonce, @"The previous read's nonce should be cleared");
+    STAssertEquals(kIFChargeResponseCodeCancelled, response.responseCode, @"The new response code should be set");
+
+    STAssertFalse([response tryReadURL:[NSURL URLWithString:@"app://host?ifcc_responseType=bogus"] error:&error], @"A bad URL should be rejected");
+    STAssertEquals(kIFChargeErrorUnknownResponseType, error.code, @"The reason should be reported");
+    STAssertFalse([response tryReadURL:nil error:&error], @"A nil URL should be rejected");
+    STAssertEquals(kIFChargeErrorNilURL, error.code, @"The nil URL should be reported");
+
+    // Fields set one by one can be packed the same way.
+    IFChargeRequest *request = [[[IFChargeRequest alloc] init] autorelease];
+    request.firstName = [NSMutableString stringWithString:@"Ada"];
+    request.lastName = @"Lovelace";
+    request.city = @"Z\u00fcrich";
+    request.amount = @"12.50";
+    NSURL *before = [request requestURL];
+    [request compactFields];
+    STAssertTrue(IFChargeFieldArenaContains(request.firstName), @"Set fields should be compacted");
+    STAssertTrue(IFChargeFieldArenaContains(request.amount), @"Amounts should be compacted");
+    STAssertFalse(IFChargeFieldArenaContains(request.city), @"Non-ASCII fields should be left alone");
+    STAssertEqualObjects(before, [request requestURL], @"Compacting should not change the message");
+    STAssertThrows([[request freeze] compactFields], @"A snapshot should not be compacted");
+}
+
+- (void)testInternedFields {
+    NSURL *url = [NSURL URLWithString:@"com.yourapp.someco://chargeResponse?ifcc_responseType=approved&ifcc_amount=73.00"
+                  @"&ifcc_currency=USD&ifcc_redactedCardNumber=XXXXXXXXXXXX1111&ifcc_cardType=American%20Express"];
+    IFChargeResponse *first = [[[IFChargeResponse alloc] init] autorelease];
+    IFChargeResponse *second = [[[IFChargeResponse alloc] init] autorelease];
+    IFChargeError error;
+    STAssertTrue([first tryReadURL:url error:&error], @"The URL should be read (%@)", IFChargeErrorReason(&error, [IFChargeResponse class], nil));
+    STAssertTrue([second tryReadURL:url error:&error], @"The URL should be read again");
+
+    // Known values are the shared strings, whichever message read them.
+    STAssertTrue(IFChargeInternLookup("USD", 3) == first.currency, @"A known currency should be shared");
+    STAssertTrue(first.currency == second.currency, @"Both reads should share the currency");
+    STAssertTrue(first.cardType == second.cardType, @"Both reads should share the card type");
+    STAssertTrue(first.responseType == second.responseType, @"Both reads should share the response type");
+    STAssertFalse(IFChargeFieldArenaContains(first.currency), @"A shared value should not take arena space");
+    STAssertTrue(IFChargeFieldArenaContains(first.redactedCardNumber), @"Other fields should still use the arena");
+    STAssertTrue(IFChargeInternLookup("Visa", 4) == IFChargeInternString([NSMutableString stringWithString:@"Visa"]), @"Card brands should be seeded");
+    STAssertNil(IFChargeInternLookup("usd", 3), @"Lookups should be exact");
+
+    // Wire data and setters share them too.
+    IFChargeResponse *decoded = [[[IFChargeResponse alloc] initWithWireData:[first wireData]] autorelease];
+    STAssertTrue(first.currency == decoded.currency, @"Decoded wire data should share the currency");
+    STAssertTrue(first.cardType == decoded.cardType, @"Decoded wire data should share the card type");
+    IFChargeRequest *request = [[[IFChargeRequest alloc] init] autorelease];
+    request.currency = [NSMutableString stringWithString:@"USD"];
+    STAssertTrue(first.currency == request.currency, @"A set currency should be shared");
+    request.currency = @"XTS";
+    STAssertNil(IFChargeInternString(request.currency), @"An unknown currency should not be added");
+    STAssertEqualObjects(@"XTS", request.currency, @"An unknown currency should be kept as it is");
+
+    // An unknown value is an ordinary string until it's added.
+    url = [NSURL URLWithString:@"app://host?ifcc_responseType=cancelled&ifcc_currency=XTS"];
+    STAssertTrue([first tryReadURL:url error:&error], @"An unknown currency should be read");
+    STAssertTrue(IFChargeFieldArenaContains(first.currency), @"An unknown currency should be in the arena");
+    NSString *shared = IFChargeInternAdd([NSMutableString stringWithString:@"XTS"]);
+    STAssertEqualObjects(@"XTS", shared, @"Adding should return an equal string");
+    STAssertTrue(shared == IFChargeInternAdd(@"XTS"), @"Adding again should return the same string");
+    STAssertTrue([first tryReadURL:url error:&error], @"The currency should be read again");
+    STAssertTrue(shared == first.currency, @"An added currency should be shared");
+    STAssertNil(IFChargeInternAdd(@"Caf\u00e9"), @"Only ASCII strings should be added");
+
+    // The response code is decoded from the type, shared or not.
+    NSDictionary *mapping = [IFChargeResponse responseCodeMapping];
+    for (NSString *type in mapping) {
+        NSString *query = [@"app://host?ifcc_responseType=" stringByAppendingString:type];
+        STAssertTrue([first tryReadURL:[NSURL URLWithString:query] error:&error], @"%@ should be read", type);
+        STAssertEquals([[mapping objectForKey:type] intValue], (int)first.responseCode, @"%@ should decode", type);
+        STAssertTrue(IFChargeInternString(type) == first.responseType, @"%@ should be shared", type);
+    }
+    NSString *unknown[] = { @"approve", @"approvedd", @"declinee", @"errors", @"Error", @"" };
+    for (NSUInteger i = 0; i < sizeof(unknown) / sizeof(unknown[0]); i++) {
+        NSString *query = [@"app://host?ifcc_responseType=" stringByAppendingString:unknown[i]];
+        STAssertFalse([first tryReadURL:[NSURL URLWithString:query] error:&error], @"%@ should be rejected", unknown[i]);
+        STAssertEquals(kIFChargeErrorUnknownResponseType, error.code, @"%@ should be unknown", unknown[i]);
+    }
+}
+
+- (void)testCardNumbers {
+    NSDictionary *types = [NSDictionary dictionaryWithObjectsAndKeys:
+                           @"Visa", @"4111 1111 1111 1111",
+                           @"MasterCard", @"5555555555554444",
+                           @"MasterCard", @"2223003122003222",
+                           @"American Express", @"3782-822463-10005",
+                           @"Discover", @"6011111111111117",
+                           @"Diners Club", @"30569309025904",
+                           @"JCB", @"3530111333300000",
+                           @"UnionPay", @"6200000000000005",
+                           nil];
+    for (NSString *number in types) {
+        STAssertTrue(IFChargeCardNumberIsValid(number), @"%@ should pass the Luhn check", number);
+        NSString *type = IFChargeCardTypeForNumber(number);
+        STAssertEqualObjects([types objectForKey:number], type, @"%@ should be recognized", number);
+        STAssertTrue(IFMatchesPattern(type, @IF_CHARGE_CARD_TYPE_PATTERN), @"%@ should be a valid cardType", type);
+    }
+    STAssertFalse(IFChargeCardNumberIsValid(@"4111111111111112"), @"A wrong check digit should fail");
+    STAssertFalse(IFChargeCardNumberIsValid(@"4111.1111.1111.1111"), @"Only spaces and dashes should be skipped");
+    STAssertFalse(IFChargeCardNumberIsValid(@"00000000000000000000"), @"Twenty digits is too long");
+    STAssertFalse(IFChargeCardNumberIsValid(@"0000000000"), @"Ten digits is too short");
+    STAssertNil(IFChargeCardTypeForNumber(@"9999999999999995"), @"An unknown BIN should have no type");
+    STAssertNil(IFChargeCardTypeForNumber(@"41111"), @"Too few digits should have no type");
+
+    // The word-at-a-time check agrees with the textbook one.
+    srandom(16);
+    char digits[32];
+    for (int i = 0; i < 100000; i++) {
+        size_t length = 1 + random() % sizeof(digits);
+        for (size_t j = 0; j < length; j++) digits[j] = '0' + random() % 10;
+        if (0 == random() % 20) digits[random() % length] = (char)random();
+        STAssertEquals(IFReferenceLuhn(digits, length), IFChargeCardLuhnValid(digits, length), @"%.*s", (int)length, digits);
+    }
+
+    // Numbers of every brand and length, with their check digits filled
+    // in, pass and are recognized.
+    const char *prefixes[] = { "4", "51", "2221", "34", "37", "6011", "3528", "62", "36" };
+    const size_t lengths[] = { 16, 16, 16, 15, 15, 16, 16, 19, 14 };
+    char pan[IF_CHARGE_CARD_DIGITS_MAX];
+    for (int i = 0; i < 900; i++) {
+        unsigned kind = i % 9;
+        size_t prefix = strlen(prefixes[kind]);
+        memcpy(pan, prefixes[kind], prefix);
+        for (size_t j = prefix; j < lengths[kind]; j++) pan[j] = '0' + random() % 10;
+        for (pan[lengths[kind] - 1] = '0'; pan[lengths[kind] - 1] < '9' && !IFChargeCardLuhnValid(pan, lengths[kind]); pan[lengths[kind] - 1]++);
+        STAssertTrue(IFChargeCardLuhnValid(pan, lengths[kind]), @"%.*s should pass", (int)lengths[kind], pan);
+        STAssertTrue(kIFChargeCardUnknown != IFChargeCardBrandForDigits(pan, lengths[kind]), @"%.*s should have a brand", (int)lengths[kind], pan);
+    }
+
+    NSString *redacted = [IFChargeCardCreateRedacted(@"4111 1111 1111 1234", 'X') autorelease];
+    STAssertEqualObjects(@"XXXXXXXXXXXXXXX1234", redacted, @"Every character but the last four should be masked");
+    redacted = [IFChargeCardCreateRedacted(@"123", 'X') autorelease];
+    STAssertEqualObjects(@"123", redacted, @"A short number should be left alone");
+
+    IFChargeResponse *response = [[[IFChargeResponse alloc] initWithChargeRequest:testRequest_
+                                                                     responseCode:kIFChargeResponseCodeApproved
+                                                                       cardNumber:@"378282246310005"
+                                                                         cardType:nil] autorelease];
+    STAssertEqualObjects(@"American Express", response.cardType, @"The card type should be worked out from the number");
+    STAssertEqualObjects(@"XXXXXXXXXXX0005", response.redactedCardNumber, @"The number should be redacted");
+}
+
+- (void)testSimulator {
+    IFChargeSimulatorConfig config = { { 4, 1, 2, 1 }, nil, 20 };
+    IFChargeSimulator *simulator = IFChargeSimulatorCreate(&config);
+
+    IFChargeError error;
+    STAssertNil(IFChargeSimulatorHandleRequestURL(simulator, [NSURL URLWithString:@"com-innerfence-ccterminal://charge/1.0.0/?ifcc_email=nobody"], NULL, &error),
+                @"The terminal should refuse a bad request");
+    STAssertEquals(kIFChargeErrorInvalidEmail, error.code, @"The bad field should be reported");
+    STAssertNil(IFChargeSimulatorHandleRequestURL(simulator, [NSURL URLWithString:@"com-innerfence-ccterminal://charge/1.0.0/?ifcc_amount=5.00"], NULL, &error),
+                @"The terminal should refuse a request with nowhere to return");
+
+    testRequest_.amount = @"12.34";
+    testRequest_.currency = @"USD";
+    testRequest_.returnURL = @"com-innerfence-ChargeDemo://chargeResponse";
+    IFChargeSimulatorReport reports[2];
+    for (int run = 0; run < 2; run++) {
+        IFChargeSimulatorFree(simulator);
+        simulator = IFChargeSimulatorCreate(&config);
+        IFChargeSimulatorRun(simulator, testRequest_, 800, run ? 4 : 1, &reports[run]);
+    }
+    IFChargeSimulatorFree(simulator);
+
+    STAssertEquals((uint64_t)800, reports[1].roundTrips, @"Every round trip should be made");
+    STAssertEquals((uint64_t)800, reports[1].latency.count, @"Every round trip should be timed");
+    STAssertEquals((uint64_t)0, reports[1].mismatches, @"Every response should match its request");
+    uint64_t received = 0;
+    for (int code = 0; code <= kIFChargeResponseCodeError; code++) {
+        STAssertTrue(reports[1].responseCodes[code] > 0, @"Every weighted code should be drawn");
+        STAssertEquals(reports[0].responseCodes[code], reports[1].responseCodes[code], @"The same seed should draw the same codes");
+        received += reports[1].responseCodes[code];
+    }
+    STAssertEquals((uint64_t)800, received, @"Every response should be read back, nonce and all");
+    STAssertTrue(reports[1].responseCodes[kIFChargeResponseCodeApproved] > reports[1].responseCodes[kIFChargeResponseCodeError],
+                 @"Codes should be drawn by weight");
+}
+
+- (void)testResponseHandler {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"IFChargeResponseHandlerTests.log"];
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    IFChargeJournal *journal = IFChargeJournalOpen(path);
+    IFChargeNonceStore *store = IFChargeNonceStoreShared();
+    IFChargeNonceStoreRemoveAll(store);
+
+    // Outcomes are delivered on a private queue, so nothing here needs
+    // a run loop.
+    dispatch_queue_t delivery = dispatch_queue_create("IFChargeResponseTests.delivery", NULL);
+    IFChargeResponseHandler *handler = IFChargeResponseHandlerCreate(journal, ^BOOL(IFChargeResponse *response) {
+        return ![[response.extraParams objectForKey:@"record_id"] isEqualToString:@"bad"];
+    }, delivery);
+
+    NSString *base = @"com-innerfence-ChargeDemo://chargeResponse?";
+    NSString *approved = @"ifcc_request_nonce=%@&ifcc_responseType=approved&ifcc_amount=5.00&ifcc_redactedCardNumber=XXXX1111";
+    NSString *good = [IFChargeNonceCreate(store, [NSDictionary dictionaryWithObject:@"7" forKey:@"record_id"]) autorelease];
+    NSString *bad = [IFChargeNonceCreate(store, [NSDictionary dictionaryWithObject:@"bad" forKey:@"record_id"]) autorelease];
+    NSURL *urls[] = {
+        [NSURL URLWithString:[base stringByAppendingFormat:approved, good]],
+        [NSURL URLWithString:[base stringByAppendingFormat:approved, bad]],
+        [NSURL URLWithString:[base stringByAppendingFormat:approved, good]], // replayed
+        nil,
+    };
+    IFChargeResponseOutcome expected[] = {
+        kIFChargeResponseAccepted, kIFChargeResponseRejected, kIFChargeResponseInvalid, kIFChargeResponseInvalid,
+    };
+
+    // Blocks can't capture arrays, so the outcomes are kept through a
+    // pointer. Deliveries are serial, so they're counted without a lock.
+    IFChargeHandledResponse handled[4];
+    IFChargeHandledResponse *outcomes = handled;
+    __block NSUInteger delivered = 0;
+    dispatch_semaphore_t done = dispatch_semaphore_create(0);
+    for (NSUInteger i = 0; i < 4; i++) {
+        IFChargeResponseHandlerSubmit(handler, urls[i], ^(const IFChargeHandledResponse *outcome) {
+            outcomes[delivered] = *outcome;
+            [outcomes[delivered].response retain];
+            delivered++;
+            dispatch_semaphore_signal(done);
+        });
+    }
+    for (NSUInteger i = 0; i < 4; i++) {
+        STAssertEquals(0L, dispatch_semaphore_wait(done, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)),
+                       @"Every URL should be delivered");
+    }
+    IFChargeResponseHandlerFree(handler);
+    dispatch_release(done);
+    dispatch_release(delivery);
+
+    for (NSUInteger i = 0; i < 4; i++) {
+        STAssertEquals(expected[i], handled[i].outcome, @"URL %u should be delivered in order, as %d", (unsigned)i, expected[i]);
+    }
+    STAssertTrue(handled[0].response.frozen, @"An accepted response should be frozen");
+    STAssertEqualObjects(@"7", [handled[0].response.extraParams objectForKey:@"record_id"], @"Stored params should be applied");
+    STAssertTrue(0 != handled[0].journalSequence, @"An accepted response should be journaled");
+    STAssertNotNil(handled[1].response, @"A rejected response should still be delivered for inspection");
+    STAssertEquals((uint64_t)0, handled[1].journalSequence, @"A rejected response should not be journaled");
+    STAssertEquals(kIFChargeErrorNoOutstandingRequest, handled[2].error.code, @"A replay should be reported");
+    STAssertNil(handled[2].response, @"An invalid URL should have no response");
+    STAssertEquals(kIFChargeErrorNilURL, handled[3].error.code, @"A nil URL should be reported");
+    STAssertEquals((NSUInteger)0, IFChargeNonceStoreCount(store), @"Both nonces should be used up");
+
+    IFChargeJournalEntry entry;
+    STAssertEquals((uint64_t)1, IFChargeJournalCount(journal), @"Only the accepted response should be journaled");
+    STAssertTrue(IFChargeJournalFindRecordId(journal, @"7", &entry), @"The entry should be found by record id");
+    for (NSUInteger i = 0; i < 4; i++) {
+        [handled[i].response release];
+    }
+    IFChargeJournalClose(journal);
+    [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+#if IF_CHARGE_STATS
+- (void)testStats {
+    IFChargeStatsSnapshot before, after;
+    IFChargeStatsTakeSnapshot(&before);
+
+    // Bad amounts, checked on several threads.
+    NSMutableArray *urls = [NSMutableArray array];
+    for (int i = 0; i < 100; i++) {
+        [urls addObject:[NSURL URLWithString:@"app://host?ifcc_responseType=approved&ifcc_amount=5&ifcc_redactedCardNumber=XXXX1111"]];
+    }
+    IFChargeVerifyResult results[100];
+    [IFChargeResponse verifyURLs:urls results:results];
+    IFChargeVerifyResultsRelease(results, 100);
+
+    IFChargeResponse *response = [[[IFChargeResponse alloc] init] autorelease];
+    NSURL *url = [NSURL URLWithString:@"com.yourapp.someco://chargeResponse?ifcc_responseType=approved&ifcc_amount=5.00"
+                  @"&ifcc_redactedCardNumber=XXXX1111"];
+    STAssertTrue([response tryReadURL:url error:NULL], @"A good URL should be read");
+    [response requestURL];
+    STAssertFalse([response tryReadURL:[NSURL URLWithString:@"app://host?ifcc_responseType=%zz"] error:NULL], @"A bad URL should be rejected");
+    STAssertThrows(testRequest_.email = @"not an email", @"A bad email should be rejected");
+
+    IFChargeStatsTakeSnapshot(&after);
+    NSUInteger amount = [[IFChargeResponse knownFields] indexOfObject:@"amount"];
+    NSUInteger email = [[IFChargeRequest knownFields] indexOfObject:@"email"];
+    STAssertEquals((uint64_t)100, after.rejections[kIFChargeErrorInvalidField] - before.rejections[kIFChargeErrorInvalidField],
+                   @"Every thread's rejections should be counted");
+    STAssertEquals((uint64_t)100, after.responseFieldRejections[amount] - before.responseFieldRejections[amount],
+                   @"The field blamed should be counted");
+    STAssertEquals((uint64_t)1, after.rejections[kIFChargeErrorMalformedQuery] - before.rejections[kIFChargeErrorMalformedQuery],
+                   @"A malformed query should be counted");
+    STAssertEquals((uint64_t)1, after.requestFieldRejections[email] - before.requestFieldRejections[email],
+                   @"A rejected setter should be counted");
+    STAssertTrue(after.stages[kIFChargeStageQueryParse].count - before.stages[kIFChargeStageQueryParse].count >= 102,
+                 @"Every parse should be timed");
+    STAssertTrue(after.stages[kIFChargeStageRequestURL].count > before.stages[kIFChargeStageRequestURL].count,
+                 @"requestURL should be timed");
+    STAssertTrue(after.stages[kIFChargeStageEncode].count > before.stages[kIFChargeStageEncode].count,
+                 @"Encoding should be timed");
+
+    const IFChargeStatsHistogram *parse = &after.stages[kIFChargeStageQueryParse];
+    STAssertTrue(IFChargeStatsHistogramPercentile(parse, 50) <= IFChargeStatsHistogramPercentile(parse, 99), @"p50 should not exceed p99");
+    STAssertTrue(IFChargeStatsHistogramPercentile(parse, 99) <= parse->maxNanos, @"p99 should not exceed the max");
+
+    NSData *json = [IFChargeStatsSnapshotJSON(&after) dataUsingEncoding:NSUTF8StringEncoding];
+    NSDictionary *stats = [NSJSONSerialization JSONObjectWithData:json options:0 error:NULL];
+    STAssertNotNil(stats, @"The snapshot should be valid JSON");
+    STAssertEqualObjects([NSNumber numberWithUnsignedLongLong:parse->count],
+                         [stats valueForKeyPath:@"stages.queryParse.count"], @"Stage counts should be in the JSON");
+    STAssertNotNil([stats valueForKeyPath:@"fieldRejections.response.amount"], @"Field rejections should be named");
+}
+#endif
+
 @end
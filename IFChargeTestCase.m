@@ -7,6 +7,7 @@
 //
 
 #import "IFChargeTestCase.h"
+#import "IFChargeTestData.h"
 
 @implementation IFChargeTestCase
 @synthesize testRequest=testRequest_;
@@ -27,55 +28,15 @@
 #pragma -
 #pragma Character Sets and String Generators
 
-static NSMutableDictionary *characterListCache_;
-NSMutableDictionary * characterListCache() {
-    if (!characterListCache_) {
-        characterListCache_ = [[NSMutableDictionary alloc] init];
-    }
-    return characterListCache_;
-}
-
-NSArray * charactersInSet(NSCharacterSet *characterSet) {
-    if (!characterSet) [NSException raise:NSInvalidArgumentException format:@"You must pass in a non-nil character set"];
-
-    // Check the character list set for an entry whose key is a mutual superset of the passed set.
-    NSMutableDictionary *cListCache = characterListCache();
-    __block NSArray *characterList = nil;
-    [cListCache enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-        NSCharacterSet *keySet = (NSCharacterSet*)key;
-        if ([keySet isSupersetOfSet:characterSet] && [characterSet isSupersetOfSet:keySet]) {
-            characterList = (NSArray*)obj;
-            *stop = YES;
-        }
-    }];
-    if (characterList) return characterList;
-
-    // If we didn't find a cached string, we'll have to build one - this time.
-    NSMutableArray *workingList = [[NSMutableArray alloc] init];
-    for (unichar testChar = 0; testChar < 256; testChar++) {
-        if ([characterSet characterIsMember:(testChar)]) [workingList addObject:[NSString stringWithCharacters:&testChar length:1]];
-    }
-
-    // Make a cache entry and return the string
-    [cListCache setObject:workingList forKey:characterSet];
-    return [workingList autorelease];
-}
-
 NSMutableString * randomStringFromCharacterSet(NSCharacterSet *characterSet, int stringLength) {
     if (!characterSet) [NSException raise:NSInvalidArgumentException format:@"You must pass in a non-nil character set"];
 
-    // Passing a nil set or length < 1 will return an empty string.
-    NSMutableString *workingString = [[[NSMutableString alloc] init] autorelease];
-    if (!characterSet || stringLength < 1) return workingString;
-
-    // Add random characters from the character set to the string until it's long enough.
-    NSArray *characterList = charactersInSet(characterSet);
-    if ([characterList count] == 0) [NSException raise:NSInvalidArgumentException format:@"You must pass in a character set containing at least one character"];
-    while ([workingString length] < stringLength) {
-        [workingString appendString:(NSString*)[characterList objectAtIndex:(arc4random() % [characterList count])]];
-    }
+    // Passing a length < 1 will return an empty string.
+    if (stringLength < 1) return [NSMutableString string];
 
-    return workingString;
+    // Draw the whole string into the shared generator's buffer at once.
+    const unichar *characters = IFTestGeneratorFill(IFTestSharedGenerator(), IFTestCharactersInSet(characterSet), stringLength);
+    return [NSMutableString stringWithCharacters:characters length:stringLength];
 }
 
 NSMutableString * randomEmailAddress(BOOL shouldBeValid, int stringLength) {
@@ -266,38 +227,43 @@ static NSCharacterSet *phoneForbiddenCharacterSet;
                        obj, IFInvalidArgumentLengthException, NSStringFromSelector(setter), lengthLimit);
     }
     
-    // Test that every allowable character may be set (ie does not raise an exception)
+    // Test that allowable characters from across the BMP may be set (ie do not raise an exception).
+    // The characters are a seeded sample, IF_TEST_CASES of each kind; once IFCHARGE_TEST_SCALE
+    // asks for as many as there are, every one is tried.
     if (testCharacters) {
-        NSMutableArray *unExceptedCharacters = [charactersInSet(allowedCharacterSet) mutableCopy];
-        __block NSMutableIndexSet *exceptedIndexes = [[NSMutableIndexSet alloc] init];
-        [unExceptedCharacters enumerateObjectsUsingBlock:^(id character, NSUInteger idx, BOOL *stop) {
+        NSMutableString *failures = [NSMutableString string];
+        NSUInteger samples = IFTestCaseCount(IF_TEST_CASES);
+        IFTestRandom random;
+        IFTestRandomSeed(&random, IFTestSeed());
+        const IFTestCharacters *allowed = IFTestCharactersInSet(allowedCharacterSet);
+        for (NSUInteger n = 0; n < MIN(samples, allowed->count); n++) {
+            NSUInteger i = (samples >= allowed->count) ? n : IFTestRandomBelow(&random, (uint32_t)allowed->count);
+            NSString *character = [[NSString alloc] initWithCharacters:&allowed->members[i] length:1];
             @try {
                 [obj performSelector:setter withObject:character];
             }
             @catch (NSException *exception) {
-                [exceptedIndexes addIndex:idx];
+                [failures appendFormat:@"U+%04X ", allowed->members[i]];
             }
-        }];
-        [unExceptedCharacters removeObjectsAtIndexes:exceptedIndexes];
-        STAssertTrue([exceptedIndexes count] == 0, @"'%@' should'n raise an exception for the following characters: '%@'", obj, unExceptedCharacters);
-        [unExceptedCharacters release]; unExceptedCharacters = nil;
-        [exceptedIndexes removeAllIndexes];
-        
-        // Test that every disallowed character may NOT be set, and raises IFDisallowedCharacterException
-        unExceptedCharacters = [charactersInSet(disallowedCharacterSet) mutableCopy];
-        [unExceptedCharacters enumerateObjectsUsingBlock:^(id character, NSUInteger idx, BOOL *stop) {
+            [character release];
+        }
+        STAssertTrue([failures length] == 0, @"'%@' shouldn't raise an exception for the following characters: %@", obj, failures);
+
+        // Test that disallowed characters from across the BMP may NOT be set, and raise IFDisallowedCharacterException
+        [failures setString:@""];
+        const IFTestCharacters *disallowed = IFTestCharactersInSet(disallowedCharacterSet);
+        for (NSUInteger n = 0; n < MIN(samples, disallowed->count); n++) {
+            NSUInteger i = (samples >= disallowed->count) ? n : IFTestRandomBelow(&random, (uint32_t)disallowed->count);
+            NSString *character = [[NSString alloc] initWithCharacters:&disallowed->members[i] length:1];
             @try {
                 [obj performSelector:setter withObject:character];
+                [failures appendFormat:@"U+%04X ", disallowed->members[i]];
             }
             @catch (NSException *exception) {
-                [exceptedIndexes addIndex:idx];
             }
-        }];
-        [unExceptedCharacters removeObjectsAtIndexes:exceptedIndexes];
-        STAssertTrue([unExceptedCharacters count] == 0, @"'%@' should raise %@ for the following characters: '%@'", obj, IFDisallowedCharacterException, unExceptedCharacters);
-
-        [exceptedIndexes release];
-        [unExceptedCharacters release];
+            [character release];
+        }
+        STAssertTrue([failures length] == 0, @"'%@' should raise %@ for the following characters: %@", obj, IFDisallowedCharacterException, failures);
     }
 
     [disallowedCharacterSet release];
@@ -0,0 +1,87 @@
+//
+//  IFChargeTestData.h
+//  ChargeDemo
+//
+//  Seeded, reproducible test data: a fast random number generator,
+//  the members of character sets across the whole Basic Multilingual
+//  Plane, and random strings made in a reusable buffer.
+//
+//  Every run starts from one seed, logged at the start, which is taken
+//  from the IFCHARGE_TEST_SEED environment variable when it's set. A
+//  property test that fails reports its seed and case, and running
+//  again with IFCHARGE_TEST_SEED set to it repeats the same cases.
+//  Each runs IF_TEST_CASES cases, so the unit tests stay quick;
+//  IFCHARGE_TEST_SCALE multiplies that, so IFCHARGE_TEST_SCALE=1000
+//  makes a million-case sweep.
+//
+
+#import <Foundation/Foundation.h>
+
+// IFTestRandom - xoshiro256**, seeded through SplitMix64.
+typedef struct IFTestRandom {
+    uint64_t state[4];
+} IFTestRandom;
+
+extern void IFTestRandomSeed(IFTestRandom *random, uint64_t seed);
+extern uint64_t IFTestRandomNext(IFTestRandom *random);
+
+// IFTestRandomBelow - A number from 0 to bound - 1, bound > 0.
+extern uint32_t IFTestRandomBelow(IFTestRandom *random, uint32_t bound);
+
+// IFTestSeed - The seed of this run.
+extern uint64_t IFTestSeed(void);
+
+// IFTestCaseSeed - The seed of case index of a property test, so any
+// one case can be made again without the ones before it.
+extern uint64_t IFTestCaseSeed(uint64_t seed, NSUInteger index);
+
+// The cases a property test runs, before IFCHARGE_TEST_SCALE.
+#define IF_TEST_CASES 1000
+
+// IFTestCaseCount - count, times IFCHARGE_TEST_SCALE if it's set.
+extern NSUInteger IFTestCaseCount(NSUInteger count);
+
+// IFTestCharacters - The members of a character set in the BMP, less
+// the surrogates (which can't stand alone), read from its
+// bitmapRepresentation rather than asked about one at a time.
+typedef struct IFTestCharacters {
+    NSUInteger count;
+    unichar   *members;      // in order
+    uint8_t    bitmap[8192]; // bit c & 7 of byte c >> 3 for member c
+} IFTestCharacters;
+
+// IFTestCharactersInSet - The members of set. Sets with the same
+// members share an entry, which lasts as long as the process.
+extern const IFTestCharacters *IFTestCharactersInSet(NSCharacterSet *set);
+
+static inline BOOL IFTestCharactersContains(const IFTestCharacters *characters, unichar c) {
+    return (characters->bitmap[c >> 3] >> (c & 7)) & 1;
+}
+
+// IFTestGenerator - Random strings, made in a buffer that's kept from
+// one to the next.
+typedef struct IFTestGenerator {
+    IFTestRandom random;
+    unichar     *buffer;
+    NSUInteger   capacity;
+} IFTestGenerator;
+
+extern void IFTestGeneratorInit(IFTestGenerator *generator, uint64_t seed);
+extern void IFTestGeneratorDestroy(IFTestGenerator *generator);
+
+// IFTestSharedGenerator - A generator seeded with IFTestSeed(), for
+// tests that don't need their own.
+extern IFTestGenerator *IFTestSharedGenerator(void);
+
+// IFTestGeneratorFill - Fills the generator's buffer with length
+// characters drawn from characters, which must have at least one, and
+// returns it. It's overwritten by the next fill.
+extern const unichar *IFTestGeneratorFill(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length);
+
+// IFTestGeneratorScatter - Replaces count characters at random places
+// in the first length of the buffer with ones drawn from characters.
+extern void IFTestGeneratorScatter(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length, NSUInteger count);
+
+// IFTestGeneratorString - IFTestGeneratorFill, as a new autoreleased
+// string.
+extern NSString *IFTestGeneratorString(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length);
@@ -0,0 +1,167 @@
+//
+//  IFChargeTestData.m
+//  ChargeDemo
+//
+
+#import "IFChargeTestData.h"
+
+#include <dispatch/dispatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma -
+#pragma Random Numbers
+
+static uint64_t IFSplitMix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t IFRotateLeft(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+void IFTestRandomSeed(IFTestRandom *random, uint64_t seed) {
+    for (int i = 0; i < 4; i++) random->state[i] = IFSplitMix64(&seed);
+}
+
+uint64_t IFTestRandomNext(IFTestRandom *random) {
+    uint64_t *s = random->state;
+    uint64_t result = IFRotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = IFRotateLeft(s[3], 45);
+    return result;
+}
+
+uint32_t IFTestRandomBelow(IFTestRandom *random, uint32_t bound) {
+    // Multiply and shift rather than divide; the bias is below 2^-32.
+    return (uint32_t)(((IFTestRandomNext(random) >> 32) * (uint64_t)bound) >> 32);
+}
+
+uint64_t IFTestSeed(void) {
+    static uint64_t seed;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        const char *given = getenv("IFCHARGE_TEST_SEED");
+        if (given) {
+            seed = strtoull(given, NULL, 10);
+        } else {
+            uint64_t x = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+            seed = IFSplitMix64(&x);
+        }
+        NSLog(@"Test data seed %llu (set IFCHARGE_TEST_SEED=%llu to repeat this run)", seed, seed);
+    });
+    return seed;
+}
+
+uint64_t IFTestCaseSeed(uint64_t seed, NSUInteger index) {
+    uint64_t x = seed ^ ((uint64_t)index * 0xD1B54A32D192ED03ULL);
+    return IFSplitMix64(&x);
+}
+
+NSUInteger IFTestCaseCount(NSUInteger count) {
+    const char *scale = getenv("IFCHARGE_TEST_SCALE");
+    double factor = scale ? strtod(scale, NULL) : 1;
+    return factor > 0 ? MAX((NSUInteger)1, (NSUInteger)(count * factor)) : count;
+}
+
+#pragma -
+#pragma Character Sets
+
+// Keyed by the BMP half of the bitmap, so sets are matched by their
+// members rather than compared one pair at a time.
+static NSMutableDictionary *characterCache_;
+
+static IFTestCharacters *IFTestCharactersCreate(NSData *bitmap) {
+    IFTestCharacters *characters = calloc(1, sizeof(IFTestCharacters));
+    memcpy(characters->bitmap, [bitmap bytes], sizeof(characters->bitmap));
+    memset(characters->bitmap + (0xD800 >> 3), 0, (0xE000 - 0xD800) >> 3);
+
+    characters->members = malloc(65536 * sizeof(unichar));
+    for (NSUInteger byte = 0; byte < sizeof(characters->bitmap); byte++) {
+        for (unsigned bits = characters->bitmap[byte]; bits; bits &= bits - 1) {
+            characters->members[characters->count++] = (unichar)(byte * 8 + __builtin_ctz(bits));
+        }
+    }
+    characters->members = realloc(characters->members, MAX(characters->count, (NSUInteger)1) * sizeof(unichar));
+    return characters;
+}
+
+const IFTestCharacters *IFTestCharactersInSet(NSCharacterSet *set) {
+    if (!set) [NSException raise:NSInvalidArgumentException format:@"You must pass in a non-nil character set"];
+    if (!characterCache_) characterCache_ = [[NSMutableDictionary alloc] init];
+
+    // bitmapRepresentation is plane 0 first, padded to at least 8192
+    // bytes.
+    NSData *full = [set bitmapRepresentation];
+    NSMutableData *bitmap = [NSMutableData dataWithLength:8192];
+    memcpy([bitmap mutableBytes], [full bytes], MIN([full length], (NSUInteger)8192));
+
+    NSValue *entry = [characterCache_ objectForKey:bitmap];
+    if (!entry) {
+        entry = [NSValue valueWithPointer:IFTestCharactersCreate(bitmap)];
+        [characterCache_ setObject:entry forKey:bitmap];
+    }
+    return [entry pointerValue];
+}
+
+#pragma -
+#pragma Strings
+
+void IFTestGeneratorInit(IFTestGenerator *generator, uint64_t seed) {
+    IFTestRandomSeed(&generator->random, seed);
+    generator->capacity = 256;
+    generator->buffer = malloc(generator->capacity * sizeof(unichar));
+}
+
+void IFTestGeneratorDestroy(IFTestGenerator *generator) {
+    free(generator->buffer);
+    generator->buffer = NULL;
+    generator->capacity = 0;
+}
+
+IFTestGenerator *IFTestSharedGenerator(void) {
+    static IFTestGenerator generator;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        IFTestGeneratorInit(&generator, IFTestSeed());
+    });
+    return &generator;
+}
+
+const unichar *IFTestGeneratorFill(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length) {
+    if (0 == characters->count) [NSException raise:NSInvalidArgumentException format:@"You must pass in a character set containing at least one character"];
+    if (length > generator->capacity) {
+        if (0 == generator->capacity) generator->capacity = 256;
+        while (generator->capacity < length) generator->capacity *= 2;
+        generator->buffer = realloc(generator->buffer, generator->capacity * sizeof(unichar));
+    }
+
+    uint32_t count = (uint32_t)characters->count;
+    for (NSUInteger i = 0; i < length; i++) {
+        generator->buffer[i] = characters->members[IFTestRandomBelow(&generator->random, count)];
+    }
+    return generator->buffer;
+}
+
+void IFTestGeneratorScatter(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length, NSUInteger count) {
+    if (0 == length || 0 == characters->count) return;
+    for (NSUInteger i = 0; i < count; i++) {
+        NSUInteger at = IFTestRandomBelow(&generator->random, (uint32_t)length);
+        generator->buffer[at] = characters->members[IFTestRandomBelow(&generator->random, (uint32_t)characters->count)];
+    }
+}
+
+NSString *IFTestGeneratorString(IFTestGenerator *generator, const IFTestCharacters *characters, NSUInteger length) {
+    const unichar *buffer = IFTestGeneratorFill(generator, characters, length);
+    return [[[NSString alloc] initWithCharacters:buffer length:length] autorelease];
+}
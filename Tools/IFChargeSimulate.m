@@ -0,0 +1,163 @@
+//
+// IFChargeSimulate.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+// Load-tests the whole request, terminal and response loop against
+// IFChargeSimulator, a local stand-in for Credit Card Terminal. It
+// builds against GNUstep on Linux as well as Foundation on OS X; see
+// GNUmakefile.
+//
+//   IFChargeSimulate [-n roundTrips] [-j threads] [-w weights] [-s seed]
+//                    [-a amount]
+//
+// -n sets the number of round trips (100000 by default), -j the number
+// of threads (one per core by default), -w the relative weights of
+// approved, cancelled, declined and error responses, separated by
+// commas (70,10,10,10 by default), -s the seed the codes are drawn
+// from, and -a the amount charged (12.34 by default). A summary goes
+// to standard output. Exits 0 if every round trip came back and
+// matched, 1 if any didn't.
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeSimulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int IFSimulateUsage( void )
+{
+    fprintf( stderr, "usage: IFChargeSimulate [-n roundTrips] [-j threads] [-w approved,cancelled,declined,error] [-s seed] [-a amount]\n" );
+    return 2;
+}
+
+// Reads -w's list of weights; NO if it isn't one per response code.
+static BOOL IFSimulateParseWeights( const char* list, NSUInteger* weights )
+{
+    for ( int code = 0; code <= kIFChargeResponseCodeError; code++ )
+    {
+        char* end;
+        weights[code] = (NSUInteger)strtoul( list, &end, 10 );
+        if ( end == list || *end != ( kIFChargeResponseCodeError == code ? '\0' : ',' ) )
+        {
+            return NO;
+        }
+        list = end + 1;
+    }
+    return YES;
+}
+
+// Prints the summary, returning the number of round trips rejected.
+static uint64_t IFSimulatePrintReport( const IFChargeSimulatorReport* report, const char* const* codeNames,
+                                       NSUInteger threadCount )
+{
+    uint64_t rejected = 0;
+    for ( unsigned code = 0; code < IF_CHARGE_ERROR_CODE_COUNT; code++ )
+    {
+        rejected += report->rejections[code];
+    }
+
+    printf( "round trips  %llu on %lu threads\n", (unsigned long long)report->roundTrips, (unsigned long)threadCount );
+    printf( "responses   " );
+    for ( int code = 0; code <= kIFChargeResponseCodeError; code++ )
+    {
+        printf( "%s %s %llu", code ? "," : "", codeNames[code], (unsigned long long)report->responseCodes[code] );
+    }
+    printf( "\nrejected     %llu\n", (unsigned long long)rejected );
+    for ( unsigned code = 0; code < IF_CHARGE_ERROR_CODE_COUNT; code++ )
+    {
+        if ( report->rejections[code] )
+        {
+            IFChargeError error = { (IFChargeErrorCode)code, -1, 0 };
+            printf( "%12llu  %s\n", (unsigned long long)report->rejections[code],
+                    [IFChargeErrorReason( &error, [IFChargeResponse class], nil ) UTF8String] );
+        }
+    }
+    printf( "mismatched   %llu\n", (unsigned long long)report->mismatches );
+
+    const IFChargeStatsHistogram* latency = &report->latency;
+    printf( "%.2f s, %.0f round trips/s, latency p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            report->seconds,
+            report->seconds > 0 ? report->roundTrips / report->seconds : 0,
+            IFChargeStatsHistogramPercentile( latency, 50 ) / 1e3,
+            IFChargeStatsHistogramPercentile( latency, 99 ) / 1e3,
+            latency->maxNanos / 1e3 );
+    return rejected;
+}
+
+int main( int argc, char* const argv[] )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    NSUInteger count = 100000;
+    NSUInteger threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    IFChargeSimulatorConfig config = { { 70, 10, 10, 10 }, nil, 0 };
+    NSString* amount = @"12.34";
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "n:j:w:s:a:" ) ) )
+    {
+        switch ( option )
+        {
+            case 'n':
+                count = (NSUInteger)strtoul( optarg, NULL, 10 );
+                break;
+            case 'j':
+                threadCount = MAX( 1, (NSUInteger)strtoul( optarg, NULL, 10 ) );
+                break;
+            case 'w':
+                if ( !IFSimulateParseWeights( optarg, config.weights ) )
+                {
+                    return IFSimulateUsage();
+                }
+                break;
+            case 's':
+                config.seed = strtoull( optarg, NULL, 10 );
+                break;
+            case 'a':
+                amount = [NSString stringWithUTF8String:optarg];
+                break;
+            default:
+                return IFSimulateUsage();
+        }
+    }
+    if ( optind != argc )
+    {
+        return IFSimulateUsage();
+    }
+
+    IFChargeRequest* prototype = [[[IFChargeRequest alloc] init] autorelease];
+    IFChargeError error;
+    if ( ![prototype trySetAmount:amount error:&error] )
+    {
+        fprintf( stderr, "%s\n", [IFChargeErrorReason( &error, [IFChargeRequest class], amount ) UTF8String] );
+        return 2;
+    }
+    prototype.currency      = @"USD";
+    prototype.returnAppName = @"IFChargeSimulate";
+    prototype.returnURL     = @"com-innerfence-simulate://chargeResponse";
+    prototype.description   = @"Simulated charge";
+
+    const char* codeNames[kIFChargeResponseCodeError + 1] = { "?", "?", "?", "?" };
+    NSDictionary* mapping = [IFChargeResponse responseCodeMapping];
+    for ( NSString* name in mapping )
+    {
+        codeNames[[[mapping objectForKey:name] intValue]] = [name UTF8String];
+    }
+
+    IFChargeSimulator* simulator = IFChargeSimulatorCreate( &config );
+    IFChargeSimulatorReport report;
+    IFChargeSimulatorRun( simulator, prototype, count, threadCount, &report );
+    IFChargeSimulatorFree( simulator );
+
+    uint64_t rejected = IFSimulatePrintReport( &report, codeNames, threadCount );
+
+    int status = ( rejected || report.mismatches ) ? 1 : 0;
+    [pool drain];
+    return status;
+}
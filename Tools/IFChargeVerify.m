@@ -0,0 +1,588 @@
+//
+// IFChargeVerify.m
+// Inner Fence Credit Card Terminal for iPhone
+// API 1.0.0
+//
+// You may license this source code under the MIT License. See COPYING.
+//
+// Copyright (c) 2009 Inner Fence, LLC
+//
+// Re-verifies a log of response URLs, one per line, with the rules
+// of +[IFChargeResponse verifyURL:result:]. It builds against GNUstep
+// on Linux as well as Foundation on OS X; see GNUmakefile.
+//
+//   IFChargeVerify [-q] [-j threads] [file]
+//
+// With no file, or "-", the URLs are read from standard input. A
+// verdict for each non-blank line goes to standard output:
+//
+//   <line>\tok\t<approved|cancelled|declined|error>
+//   <line>\trejected\t<reason>
+//
+// and a summary to standard error. -q prints only the summary; -j
+// sets the number of validating threads (one per core by default).
+// Exits 0 if every line verified, 1 if any was rejected and 2 if the
+// input couldn't be read.
+//
+// Reading, parsing, validating and printing run on their own threads,
+// handing batches of lines along queues. The batches come from a fixed
+// pool, so memory use doesn't grow with the input.
+//
+#import <Foundation/Foundation.h>
+#import "IFChargeResponse.h"
+#import "IFChargeQuery.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Lines and bytes per batch. A line longer than a batch is rejected.
+#define IF_VERIFY_BATCH_LINES 1024
+#define IF_VERIFY_BATCH_BYTES ( 256 * 1024 )
+
+// The most validating threads, and so the largest batch pool.
+#define IF_VERIFY_MAX_THREADS 64
+#define IF_VERIFY_MAX_BATCHES ( 2 * IF_VERIFY_MAX_THREADS + 4 )
+
+#pragma -
+#pragma Batches
+
+typedef enum {
+    kIFVerifyLineURL,
+    kIFVerifyLineBlank,
+    kIFVerifyLineTooLong,
+    kIFVerifyLineBadURL     // not UTF-8, or NSURL wouldn't take it
+} IFVerifyLineKind;
+
+typedef struct IFVerifyBatch
+{
+    NSUInteger           sequence;
+    unsigned long long   firstLine;  // the number of lines[0], from 1
+    NSUInteger           count;
+    size_t               length;     // of bytes
+
+    uint32_t             offsets[IF_VERIFY_BATCH_LINES];
+    uint32_t             lengths[IF_VERIFY_BATCH_LINES];
+    uint8_t              kinds[IF_VERIFY_BATCH_LINES];
+    NSURL*               urls[IF_VERIFY_BATCH_LINES];
+    IFChargeError        errors[IF_VERIFY_BATCH_LINES];
+    int8_t               responseCodes[IF_VERIFY_BATCH_LINES];
+
+    char                 bytes[IF_VERIFY_BATCH_BYTES];
+} IFVerifyBatch;
+
+// IFVerifyQueue - Batches waiting for the next stage. Every batch in
+// the pool fits, so pushing never waits; popping waits for a batch,
+// or returns NULL once every producer has finished and it's empty.
+typedef struct IFVerifyQueue
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    IFVerifyBatch*  items[IF_VERIFY_MAX_BATCHES];
+    NSUInteger      head;
+    NSUInteger      count;
+    NSUInteger      producers;
+} IFVerifyQueue;
+
+static void IFVerifyQueueInit( IFVerifyQueue* queue, NSUInteger producers )
+{
+    pthread_mutex_init( &queue->lock, NULL );
+    pthread_cond_init( &queue->ready, NULL );
+    queue->head      = 0;
+    queue->count     = 0;
+    queue->producers = producers;
+}
+
+static void IFVerifyQueuePush( IFVerifyQueue* queue, IFVerifyBatch* batch )
+{
+    pthread_mutex_lock( &queue->lock );
+    queue->items[( queue->head + queue->count++ ) % IF_VERIFY_MAX_BATCHES] = batch;
+    pthread_cond_signal( &queue->ready );
+    pthread_mutex_unlock( &queue->lock );
+}
+
+static IFVerifyBatch* IFVerifyQueuePop( IFVerifyQueue* queue )
+{
+    IFVerifyBatch* batch = NULL;
+    pthread_mutex_lock( &queue->lock );
+    while ( 0 == queue->count && queue->producers > 0 )
+    {
+        pthread_cond_wait( &queue->ready, &queue->lock );
+    }
+    if ( queue->count > 0 )
+    {
+        batch = queue->items[queue->head];
+        queue->head = ( queue->head + 1 ) % IF_VERIFY_MAX_BATCHES;
+        queue->count--;
+    }
+    pthread_mutex_unlock( &queue->lock );
+    return batch;
+}
+
+// Called by each producer when it's done.
+static void IFVerifyQueueFinish( IFVerifyQueue* queue )
+{
+    pthread_mutex_lock( &queue->lock );
+    queue->producers--;
+    pthread_cond_broadcast( &queue->ready );
+    pthread_mutex_unlock( &queue->lock );
+}
+
+#pragma -
+#pragma Pipeline
+
+typedef struct IFVerifyPipeline
+{
+    int                fd;
+    int                readError;    // errno, or 0
+    unsigned long long bytesRead;
+
+    IFVerifyQueue      free;
+    IFVerifyQueue      toParse;
+    IFVerifyQueue      toValidate;
+    IFVerifyQueue      toEmit;
+} IFVerifyPipeline;
+
+// Stage threads are plain pthreads, which GNUstep needs told about
+// before they send messages.
+static void IFVerifyThreadBegin( void )
+{
+#ifdef GNUSTEP
+    GSRegisterCurrentThread();
+#endif
+}
+
+static void IFVerifyThreadEnd( void )
+{
+#ifdef GNUSTEP
+    GSUnregisterCurrentThread();
+#endif
+}
+
+static void IFVerifyAddLine( IFVerifyBatch* batch, size_t start, size_t end, IFVerifyLineKind kind )
+{
+    // Logs written on Windows end their lines with CR LF.
+    if ( end > start && '\r' == batch->bytes[end - 1] )
+    {
+        end--;
+    }
+    NSUInteger index = batch->count++;
+    batch->offsets[index] = (uint32_t)start;
+    batch->lengths[index] = (uint32_t)( end - start );
+    batch->kinds[index]   = ( kIFVerifyLineURL == kind && end == start ) ? kIFVerifyLineBlank : kind;
+}
+
+// Read stage: fills batches from the input and splits them into lines.
+// A partial line at the end of a batch is carried to the next.
+static void* IFVerifyRead( void* context )
+{
+    IFVerifyPipeline* pipeline = context;
+    unsigned long long line = 1;
+    NSUInteger sequence = 0;
+    BOOL eof = NO;
+    BOOL skipping = NO; // the rest of a too-long line
+
+    IFVerifyBatch* batch = IFVerifyQueuePop( &pipeline->free );
+    batch->length = 0;
+    while ( batch )
+    {
+        while ( !eof && batch->length < IF_VERIFY_BATCH_BYTES )
+        {
+            ssize_t n = read( pipeline->fd, batch->bytes + batch->length, IF_VERIFY_BATCH_BYTES - batch->length );
+            if ( n > 0 )
+            {
+                batch->length += n;
+                pipeline->bytesRead += n;
+            }
+            else if ( 0 == n )
+            {
+                eof = YES;
+            }
+            else if ( EINTR != errno )
+            {
+                pipeline->readError = errno;
+                eof = YES;
+            }
+        }
+
+        batch->firstLine = line;
+        batch->count = 0;
+        size_t start = 0;
+        while ( start < batch->length && batch->count < IF_VERIFY_BATCH_LINES )
+        {
+            const char* newline = memchr( batch->bytes + start, '\n', batch->length - start );
+            size_t end = newline ? (size_t)( newline - batch->bytes ) : batch->length;
+            if ( !newline && !eof )
+            {
+                if ( start > 0 )
+                {
+                    break;
+                }
+
+                // The line fills the whole batch.
+                if ( !skipping )
+                {
+                    IFVerifyAddLine( batch, 0, 0, kIFVerifyLineTooLong );
+                    skipping = YES;
+                }
+                start = batch->length;
+                break;
+            }
+
+            if ( skipping )
+            {
+                skipping = NO;
+            }
+            else
+            {
+                IFVerifyAddLine( batch, start, end, kIFVerifyLineURL );
+            }
+            start = newline ? end + 1 : end;
+        }
+        line += batch->count;
+
+        IFVerifyBatch* next = NULL;
+        size_t carry = batch->length - start;
+        if ( carry > 0 || !eof )
+        {
+            next = IFVerifyQueuePop( &pipeline->free );
+            memcpy( next->bytes, batch->bytes + start, carry );
+            next->length = carry;
+        }
+
+        if ( batch->count > 0 )
+        {
+            batch->sequence = sequence++;
+            IFVerifyQueuePush( &pipeline->toParse, batch );
+        }
+        else
+        {
+            IFVerifyQueuePush( &pipeline->free, batch );
+        }
+        batch = next;
+    }
+
+    IFVerifyQueueFinish( &pipeline->toParse );
+    return NULL;
+}
+
+// Parse stage: builds an NSURL for each line.
+static void* IFVerifyParse( void* context )
+{
+    IFVerifyPipeline* pipeline = context;
+    IFVerifyThreadBegin();
+
+    IFVerifyBatch* batch;
+    while ( ( batch = IFVerifyQueuePop( &pipeline->toParse ) ) )
+    {
+        NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+        for ( NSUInteger index = 0; index < batch->count; index++ )
+        {
+            batch->urls[index] = nil;
+            if ( kIFVerifyLineURL != batch->kinds[index] )
+            {
+                continue;
+            }
+
+            NSString* string = [[NSString alloc] initWithBytes:batch->bytes + batch->offsets[index]
+                                                        length:batch->lengths[index]
+                                                      encoding:NSUTF8StringEncoding];
+            NSURL* url = string ? [[NSURL alloc] initWithString:string] : nil;
+            [string release];
+            if ( nil == url )
+            {
+                batch->kinds[index] = kIFVerifyLineBadURL;
+            }
+            batch->urls[index] = url;
+        }
+        [pool drain];
+        IFVerifyQueuePush( &pipeline->toValidate, batch );
+    }
+
+    IFVerifyQueueFinish( &pipeline->toValidate );
+    IFVerifyThreadEnd();
+    return NULL;
+}
+
+// Validate stage, on several threads: verifies each URL, keeping
+// just the error and response code.
+static void* IFVerifyValidate( void* context )
+{
+    IFVerifyPipeline* pipeline = context;
+    IFVerifyThreadBegin();
+
+    IFVerifyBatch* batch;
+    while ( ( batch = IFVerifyQueuePop( &pipeline->toValidate ) ) )
+    {
+        NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+        for ( NSUInteger index = 0; index < batch->count; index++ )
+        {
+            batch->responseCodes[index] = -1;
+            if ( kIFVerifyLineURL != batch->kinds[index] )
+            {
+                continue;
+            }
+
+            IFChargeVerifyResult result;
+            [IFChargeResponse verifyURL:batch->urls[index] result:&result];
+            batch->errors[index] = result.error;
+            if ( result.response )
+            {
+                batch->responseCodes[index] = (int8_t)result.response.responseCode;
+            }
+            IFChargeVerifyResultsRelease( &result, 1 );
+            [batch->urls[index] release];
+            batch->urls[index] = nil;
+        }
+        [pool drain];
+        IFVerifyQueuePush( &pipeline->toEmit, batch );
+    }
+
+    IFVerifyQueueFinish( &pipeline->toEmit );
+    IFVerifyThreadEnd();
+    return NULL;
+}
+
+#pragma -
+#pragma Output
+
+typedef struct IFVerifySummary
+{
+    unsigned long long lines;
+    unsigned long long blank;
+    unsigned long long verified;
+    unsigned long long rejected;
+    unsigned long long responseCodes[kIFChargeResponseCodeError + 1];
+    NSMutableDictionary* reasons;   // reason => count
+} IFVerifySummary;
+
+// Reasons are looked up once per error code and field, other than
+// for lines NSURL wouldn't take, which quote the line.
+static NSString* IFVerifyReason( IFVerifyBatch* batch, NSUInteger index, NSMutableDictionary* cache )
+{
+    if ( kIFVerifyLineTooLong == batch->kinds[index] )
+    {
+        return [NSString stringWithFormat:@"Line longer than %d bytes", IF_VERIFY_BATCH_BYTES];
+    }
+    if ( kIFVerifyLineBadURL == batch->kinds[index] )
+    {
+        NSString* line = [[[NSString alloc] initWithBytes:batch->bytes + batch->offsets[index]
+                                                   length:batch->lengths[index]
+                                                 encoding:NSUTF8StringEncoding] autorelease];
+        IFChargeError error = { kIFChargeErrorInvalidURL, -1, 0 };
+        return IFChargeErrorReason( &error, [IFChargeResponse class], line ? line : @"(not UTF-8)" );
+    }
+
+    const IFChargeError* error = &batch->errors[index];
+    NSNumber* key = [NSNumber numberWithLong:(long)error->code * ( IF_CHARGE_QUERY_MAX_FIELDS + 1 ) + error->field + 1];
+    NSString* reason = [cache objectForKey:key];
+    if ( nil == reason )
+    {
+        reason = IFChargeErrorReason( error, [IFChargeResponse class], nil );
+        [cache setObject:reason forKey:key];
+    }
+    return reason;
+}
+
+static void IFVerifyEmit( IFVerifyBatch* batch, IFVerifySummary* summary, const char* const* codeNames,
+                          NSMutableDictionary* cache, BOOL quiet )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+    for ( NSUInteger index = 0; index < batch->count; index++ )
+    {
+        unsigned long long line = batch->firstLine + index;
+        summary->lines++;
+        if ( kIFVerifyLineBlank == batch->kinds[index] )
+        {
+            summary->blank++;
+            continue;
+        }
+
+        if ( kIFVerifyLineURL == batch->kinds[index] && kIFChargeErrorNone == batch->errors[index].code )
+        {
+            int code = batch->responseCodes[index];
+            summary->verified++;
+            summary->responseCodes[code]++;
+            if ( !quiet )
+            {
+                printf( "%llu\tok\t%s\n", line, codeNames[code] );
+            }
+            continue;
+        }
+
+        NSString* reason = IFVerifyReason( batch, index, cache );
+        summary->rejected++;
+        NSNumber* count = [summary->reasons objectForKey:reason];
+        [summary->reasons setObject:[NSNumber numberWithUnsignedLongLong:[count unsignedLongLongValue] + 1] forKey:reason];
+        if ( !quiet )
+        {
+            printf( "%llu\trejected\t%s\n", line, [reason UTF8String] );
+        }
+    }
+    [pool drain];
+}
+
+static void IFVerifyPrintSummary( const IFVerifySummary* summary, const char* const* codeNames,
+                                  unsigned long long bytes, double seconds )
+{
+    fprintf( stderr, "lines     %llu (%llu blank)\n", summary->lines, summary->blank );
+    fprintf( stderr, "verified  %llu", summary->verified );
+    for ( int code = 0; code <= kIFChargeResponseCodeError; code++ )
+    {
+        fprintf( stderr, "%s %s %llu", code ? "," : " (", codeNames[code], summary->responseCodes[code] );
+    }
+    fprintf( stderr, ")\nrejected  %llu\n", summary->rejected );
+
+    NSArray* reasons = [[summary->reasons allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    for ( NSString* reason in reasons )
+    {
+        fprintf( stderr, "%12llu  %s\n", [[summary->reasons objectForKey:reason] unsignedLongLongValue], [reason UTF8String] );
+    }
+
+    fprintf( stderr, "%.2f s, %.0f lines/s, %.1f MB/s\n", seconds,
+             seconds > 0 ? summary->lines / seconds : 0, seconds > 0 ? bytes / seconds / ( 1024 * 1024 ) : 0 );
+}
+
+#pragma -
+#pragma Main
+
+static double IFVerifyNow( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int IFVerifyUsage( void )
+{
+    fprintf( stderr, "usage: IFChargeVerify [-q] [-j threads] [file]\n" );
+    return 2;
+}
+
+int main( int argc, char* const argv[] )
+{
+    NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
+
+    BOOL quiet = NO;
+    NSUInteger threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "qj:" ) ) )
+    {
+        switch ( option )
+        {
+            case 'q':
+                quiet = YES;
+                break;
+            case 'j':
+                threadCount = (NSUInteger)strtoul( optarg, NULL, 10 );
+                break;
+            default:
+                return IFVerifyUsage();
+        }
+    }
+    if ( argc - optind > 1 )
+    {
+        return IFVerifyUsage();
+    }
+    threadCount = MAX( 1, MIN( threadCount, IF_VERIFY_MAX_THREADS ) );
+
+    IFVerifyPipeline* pipeline = calloc( 1, sizeof( IFVerifyPipeline ) );
+    pipeline->fd = STDIN_FILENO;
+    if ( optind < argc && 0 != strcmp( argv[optind], "-" ) )
+    {
+        pipeline->fd = open( argv[optind], O_RDONLY );
+        if ( pipeline->fd < 0 )
+        {
+            fprintf( stderr, "can't open %s: %s\n", argv[optind], strerror( errno ) );
+            return 2;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise( pipeline->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+    }
+
+    // Enough batches for each validating thread to have one in hand
+    // and one waiting, plus one for each other stage.
+    NSUInteger batchCount = 2 * threadCount + 4;
+    IFVerifyBatch* batches = malloc( batchCount * sizeof( IFVerifyBatch ) );
+    IFVerifyQueueInit( &pipeline->free, 1 );
+    IFVerifyQueueInit( &pipeline->toParse, 1 );
+    IFVerifyQueueInit( &pipeline->toValidate, 1 );
+    IFVerifyQueueInit( &pipeline->toEmit, threadCount );
+    for ( NSUInteger index = 0; index < batchCount; index++ )
+    {
+        IFVerifyQueuePush( &pipeline->free, &batches[index] );
+    }
+
+    const char* codeNames[kIFChargeResponseCodeError + 1] = { "?", "?", "?", "?" };
+    NSDictionary* mapping = [IFChargeResponse responseCodeMapping];
+    for ( NSString* name in mapping )
+    {
+        codeNames[[[mapping objectForKey:name] intValue]] = [name UTF8String];
+    }
+
+    static char outputBuffer[1 << 20];
+    setvbuf( stdout, outputBuffer, _IOFBF, sizeof( outputBuffer ) );
+
+    double start = IFVerifyNow();
+    pthread_t reader, parser, validators[IF_VERIFY_MAX_THREADS];
+    pthread_create( &reader, NULL, IFVerifyRead, pipeline );
+    pthread_create( &parser, NULL, IFVerifyParse, pipeline );
+    for ( NSUInteger index = 0; index < threadCount; index++ )
+    {
+        pthread_create( &validators[index], NULL, IFVerifyValidate, pipeline );
+    }
+
+    // Emit stage: validated batches can arrive out of order, but never
+    // more than the pool apart, so they're put back in order here.
+    IFVerifySummary summary;
+    memset( &summary, 0, sizeof( summary ) );
+    summary.reasons = [NSMutableDictionary dictionary];
+    NSMutableDictionary* reasonCache = [NSMutableDictionary dictionary];
+    IFVerifyBatch* pending[IF_VERIFY_MAX_BATCHES] = { NULL };
+    NSUInteger nextSequence = 0;
+    IFVerifyBatch* batch;
+    while ( ( batch = IFVerifyQueuePop( &pipeline->toEmit ) ) )
+    {
+        pending[batch->sequence % batchCount] = batch;
+        while ( ( batch = pending[nextSequence % batchCount] ) && batch->sequence == nextSequence )
+        {
+            pending[nextSequence % batchCount] = NULL;
+            IFVerifyEmit( batch, &summary, codeNames, reasonCache, quiet );
+            IFVerifyQueuePush( &pipeline->free, batch );
+            nextSequence++;
+        }
+    }
+
+    pthread_join( reader, NULL );
+    pthread_join( parser, NULL );
+    for ( NSUInteger index = 0; index < threadCount; index++ )
+    {
+        pthread_join( validators[index], NULL );
+    }
+    fflush( stdout );
+
+    IFVerifyPrintSummary( &summary, codeNames, pipeline->bytesRead, IFVerifyNow() - start );
+
+    int status = summary.rejected ? 1 : 0;
+    if ( pipeline->readError )
+    {
+        fprintf( stderr, "read failed: %s\n", strerror( pipeline->readError ) );
+        status = 2;
+    }
+
+    if ( STDIN_FILENO != pipeline->fd )
+    {
+        close( pipeline->fd );
+    }
+    free( batches );
+    free( pipeline );
+    [pool drain];
+    return status;
+}